@@ -14,6 +14,7 @@ static void ngx_destroy_cycle_pools(ngx_conf_t *conf);
 static ngx_int_t ngx_init_zone_pool(ngx_cycle_t *cycle,
     ngx_shm_zone_t *shm_zone);
 static ngx_int_t ngx_test_lockfile(u_char *file, ngx_log_t *log);
+static ngx_msec_t ngx_cycle_msec(void);
 static void ngx_clean_old_cycles(ngx_event_t *ev);
 static void ngx_shutdown_timer_handler(ngx_event_t *ev);
 
@@ -52,6 +53,7 @@ ngx_init_cycle(ngx_cycle_t *old_cycle)
     ngx_listening_t     *ls, *nls;
     ngx_core_conf_t     *ccf, *old_ccf;
     ngx_core_module_t   *module;
+    ngx_msec_t           start, parsed, inited, opened, listened, loaded;
     char                 hostname[NGX_MAXHOSTNAMELEN];
 
     ngx_timezone_update();
@@ -63,6 +65,8 @@ ngx_init_cycle(ngx_cycle_t *old_cycle)
 
     ngx_time_update();
 
+    start = ngx_cycle_msec();
+
 
     log = old_cycle->log;
 
@@ -283,6 +287,8 @@ ngx_init_cycle(ngx_cycle_t *old_cycle)
                        cycle->conf_file.data);
     }
 
+    parsed = ngx_cycle_msec();
+
     for (i = 0; cycle->modules[i]; i++) {
         if (cycle->modules[i]->type != NGX_CORE_MODULE) {
             continue;
@@ -306,6 +312,8 @@ ngx_init_cycle(ngx_cycle_t *old_cycle)
         return cycle;
     }
 
+    inited = ngx_cycle_msec();
+
     ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
 
     if (ngx_test_config) {
@@ -606,10 +614,14 @@ ngx_init_cycle(ngx_cycle_t *old_cycle)
         }
     }
 
+    opened = ngx_cycle_msec();
+
     if (ngx_open_listening_sockets(cycle) != NGX_OK) {
         goto failed;
     }
 
+    listened = ngx_cycle_msec();
+
     if (!ngx_test_config) {
         ngx_configure_listening_sockets(cycle);
     }
@@ -628,6 +640,15 @@ ngx_init_cycle(ngx_cycle_t *old_cycle)
         exit(1);
     }
 
+    loaded = ngx_cycle_msec();
+
+    ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                  "configuration loaded in %M ms: parse %M ms, init %M ms, "
+                  "files and shared memory %M ms, listen %M ms, "
+                  "modules %M ms",
+                  loaded - start, parsed - start, inited - parsed,
+                  opened - inited, listened - opened, loaded - listened);
+
 
     /* close and delete stuff that lefts from an old cycle */
 
@@ -1121,6 +1142,17 @@ ngx_signal_process(ngx_cycle_t *cycle, char *sig)
 }
 
 
+static ngx_msec_t
+ngx_cycle_msec(void)
+{
+    struct timeval  tv;
+
+    ngx_gettimeofday(&tv);
+
+    return (ngx_msec_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+
 static ngx_int_t
 ngx_test_lockfile(u_char *file, ngx_log_t *log)
 {
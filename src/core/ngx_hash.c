@@ -9,6 +9,30 @@
 #include <ngx_core.h>
 
 
+#define NGX_HASH_PERFECT_LAMBDA   2
+#define NGX_HASH_PERFECT_SEEDS    8
+#define NGX_HASH_PERFECT_MAX_D0   64
+
+#define NGX_HASH_PERFECT_F1       0x9e3779b9
+#define NGX_HASH_PERFECT_F2       0x7f4a7c15
+
+
+typedef struct {
+    ngx_uint_t        index;
+    uint32_t          bucket;
+    uint32_t          f1;
+    uint32_t          f2;
+} ngx_hash_perfect_key_t;
+
+
+static ngx_inline uint32_t ngx_hash_perfect_mix(ngx_uint_t key,
+    uint32_t seed);
+static ngx_inline ngx_uint_t ngx_hash_perfect_slot(ngx_hash_t *hash,
+    ngx_uint_t key);
+static ngx_int_t ngx_hash_perfect_build(ngx_hash_init_t *hinit,
+    ngx_hash_key_t *names, ngx_uint_t nelts);
+
+
 void *
 ngx_hash_find(ngx_hash_t *hash, ngx_uint_t key, u_char *name, size_t len)
 {
@@ -19,6 +43,25 @@ ngx_hash_find(ngx_hash_t *hash, ngx_uint_t key, u_char *name, size_t len)
     ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0, "hf:\"%*s\"", len, name);
 #endif
 
+    if (hash->disp) {
+
+        /* perfect hash: every slot holds exactly one element */
+
+        elt = hash->buckets[ngx_hash_perfect_slot(hash, key)];
+
+        if (len != (size_t) elt->len) {
+            return NULL;
+        }
+
+        for (i = 0; i < len; i++) {
+            if (name[i] != elt->name[i]) {
+                return NULL;
+            }
+        }
+
+        return elt->value;
+    }
+
     elt = hash->buckets[key % hash->size];
 
     if (elt == NULL) {
@@ -447,6 +490,9 @@ found:
 
     hinit->hash->buckets = buckets;
     hinit->hash->size = size;
+    hinit->hash->disp = NULL;
+    hinit->hash->ndisp = 0;
+    hinit->hash->seed = 0;
 
 #if 0
 
@@ -482,6 +528,403 @@ found:
 }
 
 
+/*
+ * The perfect hash is built with the "hash, displace and compress"
+ * algorithm.  Keys are split into small buckets, and the buckets are
+ * placed starting from the largest one, each with a displacement pair
+ * (d0, d1) chosen so that all keys of the bucket land in free slots:
+ *
+ *     slot = (f1 + d0 * f2 + d1) % size
+ *
+ * The table has exactly one slot per key, so a lookup is a single probe
+ * followed by one key comparison.
+ */
+
+static ngx_inline uint32_t
+ngx_hash_perfect_mix(ngx_uint_t key, uint32_t seed)
+{
+#if (NGX_PTR_SIZE == 8)
+
+    uint64_t  h;
+
+    h = (uint64_t) key ^ seed;
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return (uint32_t) h;
+
+#else
+
+    uint32_t  h;
+
+    h = (uint32_t) key ^ seed;
+
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+
+    return h;
+
+#endif
+}
+
+
+static ngx_inline ngx_uint_t
+ngx_hash_perfect_slot(ngx_hash_t *hash, ngx_uint_t key)
+{
+    uint32_t  *d, f1, f2;
+
+    d = &hash->disp[2 * (ngx_hash_perfect_mix(key, hash->seed)
+                         % hash->ndisp)];
+
+    f1 = ngx_hash_perfect_mix(key, hash->seed ^ NGX_HASH_PERFECT_F1)
+         % hash->size;
+    f2 = ngx_hash_perfect_mix(key, hash->seed ^ NGX_HASH_PERFECT_F2)
+         % hash->size;
+
+    return (ngx_uint_t) (((uint64_t) d[0] * f2 + f1 + d[1]) % hash->size);
+}
+
+
+/*
+ * a separate entry point rather than a flag in ngx_hash_init_t, so that
+ * callers which do not know about it keep the bucket hash; falls back
+ * to ngx_hash_init() if keys cannot be separated
+ */
+
+ngx_int_t
+ngx_hash_perfect_init(ngx_hash_init_t *hinit, ngx_hash_key_t *names,
+    ngx_uint_t nelts)
+{
+    ngx_int_t  rc;
+
+    rc = ngx_hash_perfect_build(hinit, names, nelts);
+
+    if (rc != NGX_DECLINED) {
+        return rc;
+    }
+
+    return ngx_hash_init(hinit, names, nelts);
+}
+
+
+static ngx_int_t
+ngx_hash_perfect_build(ngx_hash_init_t *hinit, ngx_hash_key_t *names,
+    ngx_uint_t nelts)
+{
+    u_char                  *p, *elts, *taken;
+    size_t                   len;
+    uint32_t                 seed, *pos, *disp;
+    ngx_msec_t               start_msec, elapsed;
+    ngx_uint_t               i, j, k, n, b, s, size, nbuckets, attempt,
+                             probes, slot, next, d0, d1;
+    ngx_uint_t              *start, *count, *order, *slots;
+    struct timeval           tv;
+    ngx_hash_key_t          *name;
+    ngx_hash_elt_t          *elt, **buckets;
+    ngx_hash_perfect_key_t  *keys, *bkeys, *key;
+
+    n = 0;
+
+    for (i = 0; i < nelts; i++) {
+        if (names[i].key.data == NULL) {
+            continue;
+        }
+
+        if (names[i].key.len > 65535) {
+            return NGX_DECLINED;
+        }
+
+        n++;
+    }
+
+    if (n == 0) {
+        return NGX_DECLINED;
+    }
+
+    ngx_gettimeofday(&tv);
+    start_msec = (ngx_msec_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+
+    size = n;
+    nbuckets = n / NGX_HASH_PERFECT_LAMBDA + 1;
+
+    len = (nbuckets + 1 + n + 1 + nbuckets + size) * sizeof(ngx_uint_t)
+          + 2 * n * sizeof(ngx_hash_perfect_key_t)
+          + (n + 2 * nbuckets) * sizeof(uint32_t)
+          + size;
+
+    p = ngx_alloc(len, hinit->pool->log);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    start = (ngx_uint_t *) p;
+    count = start + nbuckets + 1;
+    order = count + n + 1;
+    slots = order + nbuckets;
+    keys = (ngx_hash_perfect_key_t *) (slots + size);
+    bkeys = keys + n;
+    pos = (uint32_t *) (bkeys + n);
+    disp = pos + n;
+    taken = (u_char *) (disp + 2 * nbuckets);
+
+    probes = 0;
+
+    for (attempt = 0; attempt < NGX_HASH_PERFECT_SEEDS; attempt++) {
+
+        seed = (uint32_t) (attempt * 0x61c88647);
+
+        /* distribute keys over buckets */
+
+        ngx_memzero(start, (nbuckets + 1) * sizeof(ngx_uint_t));
+
+        for (i = 0, k = 0; i < nelts; i++) {
+            if (names[i].key.data == NULL) {
+                continue;
+            }
+
+            key = &keys[k++];
+
+            key->index = i;
+            key->bucket = ngx_hash_perfect_mix(names[i].key_hash, seed)
+                          % nbuckets;
+            key->f1 = ngx_hash_perfect_mix(names[i].key_hash,
+                                           seed ^ NGX_HASH_PERFECT_F1)
+                      % size;
+            key->f2 = ngx_hash_perfect_mix(names[i].key_hash,
+                                           seed ^ NGX_HASH_PERFECT_F2)
+                      % size;
+
+            start[key->bucket + 1]++;
+        }
+
+        for (b = 0; b < nbuckets; b++) {
+            start[b + 1] += start[b];
+            order[b] = start[b];
+        }
+
+        for (k = 0; k < n; k++) {
+            bkeys[order[keys[k].bucket]++] = keys[k];
+        }
+
+        /* order buckets by size, the largest first */
+
+        ngx_memzero(count, (n + 1) * sizeof(ngx_uint_t));
+
+        for (b = 0; b < nbuckets; b++) {
+            count[start[b + 1] - start[b]]++;
+        }
+
+        k = 0;
+
+        for (s = n; /* void */; s--) {
+            i = count[s];
+            count[s] = k;
+            k += i;
+
+            if (s == 0) {
+                break;
+            }
+        }
+
+        for (b = 0; b < nbuckets; b++) {
+            order[count[start[b + 1] - start[b]]++] = b;
+        }
+
+        /* place buckets */
+
+        ngx_memzero(taken, size);
+        ngx_memzero(disp, 2 * nbuckets * sizeof(uint32_t));
+
+        next = 0;
+
+        for (i = 0; i < nbuckets; i++) {
+            b = order[i];
+            key = &bkeys[start[b]];
+            s = start[b + 1] - start[b];
+
+            if (s == 0) {
+                break;
+            }
+
+            for (j = 1; j < s; j++) {
+                for (k = 0; k < j; k++) {
+                    if (key[j].f1 != key[k].f1 || key[j].f2 != key[k].f2) {
+                        continue;
+                    }
+
+                    if (names[key[j].index].key_hash
+                        == names[key[k].index].key_hash)
+                    {
+                        /* keys with equal hash values cannot be separated */
+                        goto declined;
+                    }
+
+                    goto next;
+                }
+            }
+
+            if (s == 1) {
+
+                /* single keys take the remaining free slots in order */
+
+                while (taken[next]) {
+                    next++;
+                }
+
+                probes++;
+
+                pos[0] = (uint32_t) next;
+
+                d0 = 0;
+                d1 = (next + size - key[0].f1) % size;
+
+                goto placed;
+            }
+
+            for (d0 = 0; d0 < NGX_HASH_PERFECT_MAX_D0; d0++) {
+                for (d1 = 0; d1 < size; d1++) {
+
+                    probes++;
+
+                    for (j = 0; j < s; j++) {
+                        slot = (ngx_uint_t) (((uint64_t) d0 * key[j].f2
+                                              + key[j].f1 + d1) % size);
+
+                        if (taken[slot]) {
+                            goto collision;
+                        }
+
+                        for (k = 0; k < j; k++) {
+                            if (pos[k] == slot) {
+                                goto collision;
+                            }
+                        }
+
+                        pos[j] = (uint32_t) slot;
+                    }
+
+                    goto placed;
+
+                collision:
+
+                    continue;
+                }
+            }
+
+            goto next;
+
+        placed:
+
+            for (j = 0; j < s; j++) {
+                taken[pos[j]] = 1;
+                slots[pos[j]] = key[j].index;
+            }
+
+            disp[2 * b] = (uint32_t) d0;
+            disp[2 * b + 1] = (uint32_t) d1;
+        }
+
+        goto found;
+
+    next:
+
+        continue;
+    }
+
+declined:
+
+    ngx_free(p);
+
+    ngx_log_error(NGX_LOG_NOTICE, hinit->pool->log, 0,
+                  "could not build perfect %s of %ui keys, "
+                  "using bucket hash", hinit->name, n);
+
+    return NGX_DECLINED;
+
+found:
+
+    len = 0;
+
+    for (i = 0; i < size; i++) {
+        len += NGX_HASH_ELT_SIZE(&names[slots[i]]);
+    }
+
+    if (hinit->hash == NULL) {
+        hinit->hash = ngx_pcalloc(hinit->pool, sizeof(ngx_hash_wildcard_t)
+                                             + size * sizeof(ngx_hash_elt_t *));
+        if (hinit->hash == NULL) {
+            ngx_free(p);
+            return NGX_ERROR;
+        }
+
+        buckets = (ngx_hash_elt_t **)
+                      ((u_char *) hinit->hash + sizeof(ngx_hash_wildcard_t));
+
+    } else {
+        buckets = ngx_palloc(hinit->pool, size * sizeof(ngx_hash_elt_t *));
+        if (buckets == NULL) {
+            ngx_free(p);
+            return NGX_ERROR;
+        }
+    }
+
+    elts = ngx_palloc(hinit->pool, len + ngx_cacheline_size);
+    if (elts == NULL) {
+        ngx_free(p);
+        return NGX_ERROR;
+    }
+
+    elts = ngx_align_ptr(elts, ngx_cacheline_size);
+
+    for (i = 0; i < size; i++) {
+        name = &names[slots[i]];
+
+        elt = (ngx_hash_elt_t *) elts;
+
+        elt->value = name->value;
+        elt->len = (u_short) name->key.len;
+
+        ngx_strlow(elt->name, name->key.data, name->key.len);
+
+        buckets[i] = elt;
+        elts += NGX_HASH_ELT_SIZE(name);
+    }
+
+    hinit->hash->disp = ngx_palloc(hinit->pool,
+                                   2 * nbuckets * sizeof(uint32_t));
+    if (hinit->hash->disp == NULL) {
+        ngx_free(p);
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(hinit->hash->disp, disp, 2 * nbuckets * sizeof(uint32_t));
+
+    ngx_free(p);
+
+    hinit->hash->buckets = buckets;
+    hinit->hash->size = size;
+    hinit->hash->ndisp = nbuckets;
+    hinit->hash->seed = seed;
+
+    ngx_gettimeofday(&tv);
+    elapsed = (ngx_msec_t) tv.tv_sec * 1000 + tv.tv_usec / 1000 - start_msec;
+
+    ngx_log_error(NGX_LOG_NOTICE, hinit->pool->log, 0,
+                  "%s: perfect hash of %ui keys built in %M ms, "
+                  "%ui buckets, %ui probes, %ui attempts",
+                  hinit->name, n, elapsed, nbuckets, probes, attempt + 1);
+
+    return NGX_OK;
+}
+
+
 ngx_int_t
 ngx_hash_wildcard_init(ngx_hash_init_t *hinit, ngx_hash_key_t *names,
     ngx_uint_t nelts)
@@ -23,6 +23,11 @@ typedef struct {
 typedef struct {
     ngx_hash_elt_t  **buckets;
     ngx_uint_t        size;
+
+    /* perfect hash displacements, NULL for the bucket hash */
+    uint32_t         *disp;
+    ngx_uint_t        ndisp;
+    uint32_t          seed;
 } ngx_hash_t;
 
 
@@ -105,6 +110,8 @@ void *ngx_hash_find_combined(ngx_hash_combined_t *hash, ngx_uint_t key,
 
 ngx_int_t ngx_hash_init(ngx_hash_init_t *hinit, ngx_hash_key_t *names,
     ngx_uint_t nelts);
+ngx_int_t ngx_hash_perfect_init(ngx_hash_init_t *hinit, ngx_hash_key_t *names,
+    ngx_uint_t nelts);
 ngx_int_t ngx_hash_wildcard_init(ngx_hash_init_t *hinit, ngx_hash_key_t *names,
     ngx_uint_t nelts);
 
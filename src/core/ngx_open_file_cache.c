@@ -15,12 +15,79 @@
  *    open file handles with stat() info;
  *    directories stat() info;
  *    files and directories errors: not found, access denied, etc.
+ *
+ * with a shared zone stat() info and errors are also kept in shared
+ * memory, where they are trusted while the parent directory is watched
+ * by inotify in a live worker process, or for the "valid" time otherwise
  */
 
 
 #define NGX_MIN_READ_AHEAD  (128 * 1024)
 
 
+typedef struct {
+    ngx_str_node_t           sn;
+    ngx_queue_t              queue;
+
+    ngx_file_uniq_t          uniq;
+    time_t                   mtime;
+    off_t                    size;
+    off_t                    fs_size;
+    ngx_err_t                err;
+
+    time_t                   created;
+    time_t                   accessed;
+
+    ngx_uint_t               generation;
+    ngx_uint_t               seq;
+    ngx_uint_t               watch;
+
+    ngx_pid_t                pid;
+    ngx_uint_t               slot;
+
+    unsigned                 dir:1;
+    unsigned                 is_dir:1;
+    unsigned                 is_file:1;
+    unsigned                 is_link:1;
+    unsigned                 is_exec:1;
+
+    u_char                   name[1];
+} ngx_open_file_node_t;
+
+
+typedef struct {
+    ngx_rbtree_t             rbtree;
+    ngx_rbtree_node_t        sentinel;
+    ngx_rbtree_t             dirs;
+    ngx_rbtree_node_t        dirs_sentinel;
+    ngx_queue_t              queue;
+
+    ngx_uint_t               generation;
+    ngx_uint_t               seq;
+
+    ngx_pid_t                watchers[NGX_MAX_PROCESSES];
+} ngx_open_file_shctx_t;
+
+
+#if (NGX_HAVE_INOTIFY)
+
+typedef struct {
+    ngx_str_node_t           sn;
+    ngx_rbtree_node_t        wd;
+    ngx_queue_t              queue;
+} ngx_open_file_watch_t;
+
+
+#define NGX_OPEN_FILE_WATCH_MAX  1024
+
+
+#define NGX_OPEN_FILE_WATCH_MASK                                              \
+    (IN_ATTRIB|IN_MODIFY|IN_CLOSE_WRITE|IN_CREATE|IN_DELETE|IN_MOVED_FROM    \
+     |IN_MOVED_TO|IN_DELETE_SELF|IN_MOVE_SELF|IN_ONLYDIR)
+
+#endif
+
+
 static void ngx_open_file_cache_cleanup(void *data);
 #if (NGX_HAVE_OPENAT)
 static ngx_fd_t ngx_openat_file_owner(ngx_fd_t at_fd, const u_char *name,
@@ -51,6 +118,53 @@ static ngx_cached_open_file_t *
     ngx_open_file_lookup(ngx_open_file_cache_t *cache, ngx_str_t *name,
     uint32_t hash);
 static void ngx_open_file_cache_remove(ngx_event_t *ev);
+static ngx_int_t ngx_open_file_cache_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+static ngx_int_t ngx_open_file_shared_lookup(ngx_open_file_cache_t *cache,
+    ngx_str_t *name, uint32_t hash, ngx_open_file_info_t *of, ngx_log_t *log);
+static ngx_uint_t ngx_open_file_shared_test(ngx_open_file_cache_t *cache,
+    ngx_str_t *name, uint32_t hash, ngx_cached_open_file_t *file,
+    time_t valid);
+static ngx_int_t ngx_open_file_shared_stat(ngx_open_file_cache_t *cache,
+    ngx_str_t *name, uint32_t hash, ngx_open_file_info_t *of, ngx_log_t *log);
+static ngx_uint_t ngx_open_file_shared_valid(ngx_open_file_shctx_t *sh,
+    ngx_open_file_node_t *node, time_t valid);
+static void ngx_open_file_parent(ngx_str_t *name, ngx_str_t *dir);
+static ngx_open_file_node_t *ngx_open_file_shared_add(
+    ngx_open_file_shctx_t *sh, ngx_slab_pool_t *shpool, ngx_str_t *name,
+    uint32_t hash, ngx_uint_t dir);
+static void ngx_open_file_shared_expire(ngx_open_file_shctx_t *sh,
+    ngx_slab_pool_t *shpool, time_t inactive);
+static void ngx_open_file_shared_delete(ngx_open_file_shctx_t *sh,
+    ngx_slab_pool_t *shpool, ngx_open_file_node_t *node);
+#if (NGX_HAVE_INOTIFY)
+static ngx_int_t ngx_open_file_inotify_init(ngx_cycle_t *cycle);
+static void ngx_open_file_inotify_exit(void *data);
+static ngx_int_t ngx_open_file_watch(ngx_str_t *dir, ngx_log_t *log);
+static void ngx_open_file_unwatch(ngx_open_file_watch_t *w);
+static ngx_open_file_watch_t *ngx_open_file_watch_lookup(int wd);
+static void ngx_open_file_inotify_handler(ngx_event_t *ev);
+static void ngx_open_file_inotify_event(struct inotify_event *ie,
+    ngx_log_t *log);
+static void ngx_open_file_shared_invalidate(ngx_str_t *dir, u_char *name);
+static void ngx_open_file_shared_flush(ngx_str_t *dir, ngx_uint_t nested);
+
+
+static ngx_array_t           *ngx_open_file_zones;
+
+static ngx_connection_t       ngx_open_file_inotify;
+static ngx_event_t            ngx_open_file_inotify_read;
+static ngx_event_t            ngx_open_file_inotify_write;
+
+static ngx_rbtree_t           ngx_open_file_watches;
+static ngx_rbtree_node_t      ngx_open_file_watches_sentinel;
+static ngx_rbtree_t           ngx_open_file_watch_wds;
+static ngx_rbtree_node_t      ngx_open_file_watch_wds_sentinel;
+static ngx_queue_t            ngx_open_file_watch_queue;
+static ngx_uint_t             ngx_open_file_nwatches;
+
+static ngx_uint_t             ngx_open_file_watch_full;
+#endif
 
 
 ngx_open_file_cache_t *
@@ -72,6 +186,7 @@ ngx_open_file_cache_init(ngx_pool_t *pool, ngx_uint_t max, time_t inactive)
     cache->current = 0;
     cache->max = max;
     cache->inactive = inactive;
+    cache->shm_zone = NULL;
 
     cln = ngx_pool_cleanup_add(pool, 0);
     if (cln == NULL) {
@@ -147,6 +262,7 @@ ngx_open_cached_file(ngx_open_file_cache_t *cache, ngx_str_t *name,
     time_t                          now;
     uint32_t                        hash;
     ngx_int_t                       rc;
+    ngx_uint_t                      shared, valid;
     ngx_file_info_t                 fi;
     ngx_pool_cleanup_t             *cln;
     ngx_cached_open_file_t         *file;
@@ -206,6 +322,17 @@ ngx_open_cached_file(ngx_open_file_cache_t *cache, ngx_str_t *name,
 
     hash = ngx_crc32_long(name->data, name->len);
 
+    shared = 0;
+
+    if (cache->shm_zone && !of->log
+#if (NGX_HAVE_OPENAT)
+        && of->disable_symlinks == NGX_DISABLE_SYMLINKS_OFF
+#endif
+       )
+    {
+        shared = 1;
+    }
+
     file = ngx_open_file_lookup(cache, name, hash);
 
     if (file) {
@@ -218,7 +345,19 @@ ngx_open_cached_file(ngx_open_file_cache_t *cache, ngx_str_t *name,
 
             /* file was not used often enough to keep open */
 
-            rc = ngx_open_and_stat_file(name, of, pool->log);
+            if (shared) {
+                rc = ngx_open_file_shared_lookup(cache, name, hash, of,
+                                                 pool->log);
+                if (rc != NGX_DECLINED) {
+                    goto update;
+                }
+
+                rc = ngx_open_file_shared_stat(cache, name, hash, of,
+                                               pool->log);
+
+            } else {
+                rc = ngx_open_and_stat_file(name, of, pool->log);
+            }
 
             if (rc != NGX_OK && (of->err == 0 || !of->errors)) {
                 goto failed;
@@ -227,10 +366,23 @@ ngx_open_cached_file(ngx_open_file_cache_t *cache, ngx_str_t *name,
             goto add_event;
         }
 
+        /*
+         * in shared mode an entry is valid while the shared zone
+         * has a trusted entry with the same stat() info
+         */
+
+        if (shared) {
+            valid = ngx_open_file_shared_test(cache, name, hash, file,
+                                              of->valid);
+
+        } else {
+            valid = (now - file->created < of->valid);
+        }
+
         if (file->use_event
             || (file->event == NULL
                 && (of->uniq == 0 || of->uniq == file->uniq)
-                && now - file->created < of->valid
+                && valid
 #if (NGX_HAVE_OPENAT)
                 && of->disable_symlinks == file->disable_symlinks
                 && of->disable_symlinks_from == file->disable_symlinks_from
@@ -286,7 +438,12 @@ ngx_open_cached_file(ngx_open_file_cache_t *cache, ngx_str_t *name,
         of->fd = file->fd;
         of->uniq = file->uniq;
 
-        rc = ngx_open_and_stat_file(name, of, pool->log);
+        if (shared) {
+            rc = ngx_open_file_shared_stat(cache, name, hash, of, pool->log);
+
+        } else {
+            rc = ngx_open_and_stat_file(name, of, pool->log);
+        }
 
         if (rc != NGX_OK && (of->err == 0 || !of->errors)) {
             goto failed;
@@ -351,7 +508,18 @@ ngx_open_cached_file(ngx_open_file_cache_t *cache, ngx_str_t *name,
 
     /* not found */
 
-    rc = ngx_open_and_stat_file(name, of, pool->log);
+    if (shared) {
+        rc = ngx_open_file_shared_lookup(cache, name, hash, of, pool->log);
+
+        if (rc != NGX_DECLINED) {
+            goto create;
+        }
+
+        rc = ngx_open_file_shared_stat(cache, name, hash, of, pool->log);
+
+    } else {
+        rc = ngx_open_and_stat_file(name, of, pool->log);
+    }
 
     if (rc != NGX_OK && (of->err == 0 || !of->errors)) {
         goto failed;
@@ -1251,3 +1419,1061 @@ ngx_open_file_cache_remove(ngx_event_t *ev)
     ngx_free(ev->data);
     ngx_free(ev);
 }
+
+
+ngx_int_t
+ngx_open_file_cache_add_zone(ngx_conf_t *cf, ngx_open_file_cache_t *cache,
+    ngx_str_t *name, size_t size, void *tag)
+{
+    ngx_shm_zone_t  *shm_zone;
+
+    shm_zone = ngx_shared_memory_add(cf, name, size, tag);
+    if (shm_zone == NULL) {
+        return NGX_ERROR;
+    }
+
+    shm_zone->init = ngx_open_file_cache_init_zone;
+
+    cache->shm_zone = shm_zone;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_open_file_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_open_file_shctx_t  *osh = data;
+
+    size_t                  len;
+    ngx_slab_pool_t        *shpool;
+    ngx_open_file_shctx_t  *sh;
+
+    if (osh) {
+        shm_zone->data = osh;
+        return NGX_OK;
+    }
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        shm_zone->data = shpool->data;
+        return NGX_OK;
+    }
+
+    sh = ngx_slab_calloc(shpool, sizeof(ngx_open_file_shctx_t));
+    if (sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    shpool->data = sh;
+    shm_zone->data = sh;
+
+    ngx_rbtree_init(&sh->rbtree, &sh->sentinel, ngx_str_rbtree_insert_value);
+    ngx_rbtree_init(&sh->dirs, &sh->dirs_sentinel,
+                    ngx_str_rbtree_insert_value);
+
+    ngx_queue_init(&sh->queue);
+
+    len = sizeof(" in open file cache zone \"\"") + shm_zone->shm.name.len;
+
+    shpool->log_ctx = ngx_slab_alloc(shpool, len);
+    if (shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(shpool->log_ctx, " in open file cache zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    shpool->log_nomem = 0;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_open_file_cache_init_process(ngx_cycle_t *cycle)
+{
+#if (NGX_HAVE_INOTIFY)
+
+    ngx_uint_t        i;
+    ngx_shm_zone_t   *shm_zone, **zone;
+    ngx_list_part_t  *part;
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    part = &cycle->shared_memory.part;
+    shm_zone = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            shm_zone = part->elts;
+            i = 0;
+        }
+
+        if (shm_zone[i].init != ngx_open_file_cache_init_zone) {
+            continue;
+        }
+
+        if (ngx_open_file_zones == NULL) {
+            ngx_open_file_zones = ngx_array_create(cycle->pool, 4,
+                                                   sizeof(ngx_shm_zone_t *));
+            if (ngx_open_file_zones == NULL) {
+                return NGX_ERROR;
+            }
+        }
+
+        zone = ngx_array_push(ngx_open_file_zones);
+        if (zone == NULL) {
+            return NGX_ERROR;
+        }
+
+        *zone = &shm_zone[i];
+    }
+
+    if (ngx_open_file_zones == NULL) {
+        return NGX_OK;
+    }
+
+    return ngx_open_file_inotify_init(cycle);
+
+#else
+
+    return NGX_OK;
+
+#endif
+}
+
+
+static ngx_int_t
+ngx_open_file_shared_lookup(ngx_open_file_cache_t *cache, ngx_str_t *name,
+    uint32_t hash, ngx_open_file_info_t *of, ngx_log_t *log)
+{
+    ngx_int_t               rc;
+    ngx_slab_pool_t        *shpool;
+    ngx_open_file_node_t   *node;
+    ngx_open_file_shctx_t  *sh;
+
+    sh = cache->shm_zone->data;
+    shpool = (ngx_slab_pool_t *) cache->shm_zone->shm.addr;
+
+    rc = NGX_DECLINED;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    node = (ngx_open_file_node_t *) ngx_str_rbtree_lookup(&sh->rbtree, name,
+                                                          hash);
+
+    if (node == NULL || !ngx_open_file_shared_valid(sh, node, of->valid)) {
+        goto done;
+    }
+
+    if (node->err) {
+
+        if (!of->errors) {
+            goto done;
+        }
+
+        of->err = node->err;
+        of->failed = of->test_only ? ngx_file_info_n : ngx_open_file_n;
+
+        rc = NGX_ERROR;
+
+    } else if (node->is_dir || of->test_only) {
+
+        /* a descriptor is not needed */
+
+        of->uniq = node->uniq;
+        of->mtime = node->mtime;
+        of->size = node->size;
+        of->fs_size = node->fs_size;
+
+        of->is_dir = node->is_dir;
+        of->is_file = node->is_file;
+        of->is_link = node->is_link;
+        of->is_exec = node->is_exec;
+
+        rc = NGX_OK;
+
+    } else {
+        goto done;
+    }
+
+    node->accessed = ngx_time();
+
+    ngx_queue_remove(&node->queue);
+    ngx_queue_insert_head(&sh->queue, &node->queue);
+
+done:
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, log, 0,
+                   "shared open file: \"%V\" %i", name, rc);
+
+    return rc;
+}
+
+
+static ngx_uint_t
+ngx_open_file_shared_test(ngx_open_file_cache_t *cache, ngx_str_t *name,
+    uint32_t hash, ngx_cached_open_file_t *file, time_t valid)
+{
+    ngx_uint_t              rc;
+    ngx_slab_pool_t        *shpool;
+    ngx_open_file_node_t   *node;
+    ngx_open_file_shctx_t  *sh;
+
+    sh = cache->shm_zone->data;
+    shpool = (ngx_slab_pool_t *) cache->shm_zone->shm.addr;
+
+    rc = 0;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    node = (ngx_open_file_node_t *) ngx_str_rbtree_lookup(&sh->rbtree, name,
+                                                          hash);
+
+    if (node == NULL
+        || !ngx_open_file_shared_valid(sh, node, valid)
+        || node->err != file->err)
+    {
+        goto done;
+    }
+
+    if (file->err == 0
+        && (node->uniq != file->uniq
+            || node->mtime != file->mtime
+            || node->size != file->size
+            || node->is_dir != file->is_dir))
+    {
+        goto done;
+    }
+
+    node->accessed = ngx_time();
+
+    ngx_queue_remove(&node->queue);
+    ngx_queue_insert_head(&sh->queue, &node->queue);
+
+    rc = 1;
+
+done:
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    return rc;
+}
+
+
+/*
+ * the parent directory is watched before stat() and the result is
+ * trusted only if no event was seen for the directory in the meantime
+ */
+
+static ngx_int_t
+ngx_open_file_shared_stat(ngx_open_file_cache_t *cache, ngx_str_t *name,
+    uint32_t hash, ngx_open_file_info_t *of, ngx_log_t *log)
+{
+    time_t                  now;
+    uint32_t                dhash;
+    ngx_int_t               rc;
+    ngx_str_t               dir;
+    ngx_pid_t               pid;
+    ngx_uint_t              seq, slot, watch;
+    ngx_slab_pool_t        *shpool;
+    ngx_open_file_node_t   *node;
+    ngx_open_file_shctx_t  *sh;
+
+    sh = cache->shm_zone->data;
+    shpool = (ngx_slab_pool_t *) cache->shm_zone->shm.addr;
+
+    pid = 0;
+    slot = 0;
+    seq = 0;
+    watch = 0;
+    dhash = 0;
+
+    ngx_open_file_parent(name, &dir);
+
+    if (dir.len) {
+        dhash = ngx_crc32_long(dir.data, dir.len);
+
+        ngx_shmtx_lock(&shpool->mutex);
+
+        node = (ngx_open_file_node_t *) ngx_str_rbtree_lookup(&sh->dirs, &dir,
+                                                              dhash);
+
+        if (node && node->pid && sh->watchers[node->slot] == node->pid) {
+            pid = node->pid;
+            slot = node->slot;
+            seq = node->seq;
+        }
+
+        ngx_shmtx_unlock(&shpool->mutex);
+
+#if (NGX_HAVE_INOTIFY)
+
+        if (pid == 0 && ngx_open_file_watch(&dir, log) == NGX_OK) {
+
+            ngx_shmtx_lock(&shpool->mutex);
+
+            node = (ngx_open_file_node_t *)
+                       ngx_str_rbtree_lookup(&sh->dirs, &dir, dhash);
+
+            if (node == NULL) {
+                node = ngx_open_file_shared_add(sh, shpool, &dir, dhash, 1);
+            }
+
+            if (node) {
+                node->pid = ngx_pid;
+                node->slot = ngx_process_slot;
+                node->seq = ++sh->seq;
+                node->watch = node->seq;
+
+                pid = node->pid;
+                slot = node->slot;
+                seq = node->seq;
+            }
+
+            ngx_shmtx_unlock(&shpool->mutex);
+        }
+
+#endif
+    }
+
+    rc = ngx_open_and_stat_file(name, of, log);
+
+    if (rc != NGX_OK && of->err == 0) {
+        return rc;
+    }
+
+    now = ngx_time();
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    if (pid) {
+        node = (ngx_open_file_node_t *) ngx_str_rbtree_lookup(&sh->dirs, &dir,
+                                                              dhash);
+
+        if (node == NULL || node->pid != pid || node->seq != seq) {
+            pid = 0;
+
+        } else {
+            watch = node->watch;
+            node->accessed = now;
+
+            ngx_queue_remove(&node->queue);
+            ngx_queue_insert_head(&sh->queue, &node->queue);
+        }
+    }
+
+    ngx_open_file_shared_expire(sh, shpool, cache->inactive);
+
+    node = (ngx_open_file_node_t *) ngx_str_rbtree_lookup(&sh->rbtree, name,
+                                                          hash);
+
+    if (node == NULL) {
+        node = ngx_open_file_shared_add(sh, shpool, name, hash, 0);
+        if (node == NULL) {
+            goto done;
+        }
+    }
+
+    node->err = of->err;
+
+    if (of->err == 0) {
+        node->uniq = of->uniq;
+        node->mtime = of->mtime;
+        node->size = of->size;
+        node->fs_size = of->fs_size;
+
+        node->is_dir = of->is_dir;
+        node->is_file = of->is_file;
+        node->is_link = of->is_link;
+        node->is_exec = of->is_exec;
+    }
+
+    node->created = now;
+    node->accessed = now;
+    node->generation = sh->generation;
+
+    node->pid = pid;
+    node->slot = slot;
+    node->watch = watch;
+
+    ngx_queue_remove(&node->queue);
+    ngx_queue_insert_head(&sh->queue, &node->queue);
+
+done:
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_CORE, log, 0,
+                   "shared open file update: \"%V\" e:%d p:%P",
+                   name, of->err, pid);
+
+    return rc;
+}
+
+
+/*
+ * an entry stat()'ed under a watch is trusted as long as the parent
+ * directory node still refers to the same watch of a live process
+ */
+
+static ngx_uint_t
+ngx_open_file_shared_valid(ngx_open_file_shctx_t *sh,
+    ngx_open_file_node_t *node, time_t valid)
+{
+    ngx_str_t              dir;
+    ngx_open_file_node_t  *parent;
+
+    if (node->generation != sh->generation) {
+        return 0;
+    }
+
+    if (node->pid == 0) {
+        return ngx_time() - node->created < valid;
+    }
+
+    if (sh->watchers[node->slot] != node->pid) {
+        return 0;
+    }
+
+    ngx_open_file_parent(&node->sn.str, &dir);
+
+    if (dir.len == 0) {
+        return 0;
+    }
+
+    parent = (ngx_open_file_node_t *)
+                 ngx_str_rbtree_lookup(&sh->dirs, &dir,
+                                       ngx_crc32_long(dir.data, dir.len));
+
+    if (parent == NULL
+        || parent->pid != node->pid
+        || parent->watch != node->watch)
+    {
+        return 0;
+    }
+
+    parent->accessed = ngx_time();
+
+    ngx_queue_remove(&parent->queue);
+    ngx_queue_insert_head(&sh->queue, &parent->queue);
+
+    return 1;
+}
+
+
+static void
+ngx_open_file_parent(ngx_str_t *name, ngx_str_t *dir)
+{
+    dir->data = name->data;
+
+    for (dir->len = name->len; dir->len; dir->len--) {
+        if (name->data[dir->len - 1] == '/') {
+            break;
+        }
+    }
+
+    if (dir->len == name->len) {
+
+        /* a trailing slash */
+
+        dir->len = 0;
+
+    } else if (dir->len > 1) {
+        dir->len--;
+    }
+}
+
+
+static ngx_open_file_node_t *
+ngx_open_file_shared_add(ngx_open_file_shctx_t *sh, ngx_slab_pool_t *shpool,
+    ngx_str_t *name, uint32_t hash, ngx_uint_t dir)
+{
+    size_t                 size;
+    ngx_uint_t             n;
+    ngx_queue_t           *q;
+    ngx_open_file_node_t  *node;
+
+    size = offsetof(ngx_open_file_node_t, name) + name->len;
+
+    for (n = 0; n < 16; n++) {
+
+        node = ngx_slab_alloc_locked(shpool, size);
+
+        if (node) {
+            ngx_memzero(node, offsetof(ngx_open_file_node_t, name));
+
+            node->sn.node.key = hash;
+            node->sn.str.len = name->len;
+            node->sn.str.data = node->name;
+            ngx_memcpy(node->name, name->data, name->len);
+
+            node->dir = dir;
+
+            ngx_rbtree_insert(dir ? &sh->dirs : &sh->rbtree, &node->sn.node);
+            ngx_queue_insert_head(&sh->queue, &node->queue);
+
+            return node;
+        }
+
+        if (ngx_queue_empty(&sh->queue)) {
+            break;
+        }
+
+        /* evict the least recently used entry */
+
+        q = ngx_queue_last(&sh->queue);
+
+        node = ngx_queue_data(q, ngx_open_file_node_t, queue);
+
+        ngx_open_file_shared_delete(sh, shpool, node);
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_open_file_shared_expire(ngx_open_file_shctx_t *sh,
+    ngx_slab_pool_t *shpool, time_t inactive)
+{
+    time_t                 now;
+    ngx_uint_t             n;
+    ngx_queue_t           *q;
+    ngx_open_file_node_t  *node;
+
+    now = ngx_time();
+
+    /* drop one or two old entries */
+
+    for (n = 0; n < 2; n++) {
+
+        if (ngx_queue_empty(&sh->queue)) {
+            return;
+        }
+
+        q = ngx_queue_last(&sh->queue);
+
+        node = ngx_queue_data(q, ngx_open_file_node_t, queue);
+
+        if (now - node->accessed <= inactive) {
+            return;
+        }
+
+        ngx_open_file_shared_delete(sh, shpool, node);
+    }
+}
+
+
+static void
+ngx_open_file_shared_delete(ngx_open_file_shctx_t *sh,
+    ngx_slab_pool_t *shpool, ngx_open_file_node_t *node)
+{
+    ngx_rbtree_delete(node->dir ? &sh->dirs : &sh->rbtree, &node->sn.node);
+
+    ngx_queue_remove(&node->queue);
+
+    ngx_slab_free_locked(shpool, node);
+}
+
+
+#if (NGX_HAVE_INOTIFY)
+
+static ngx_int_t
+ngx_open_file_inotify_init(ngx_cycle_t *cycle)
+{
+    int                      fd;
+    ngx_uint_t               i;
+    ngx_event_t             *rev;
+    ngx_shm_zone_t         **zone;
+    ngx_slab_pool_t         *shpool;
+    ngx_connection_t        *c;
+    ngx_pool_cleanup_t      *cln;
+    ngx_open_file_shctx_t   *sh;
+
+    /* events are delivered to the notification descriptor via epoll */
+
+    if (!(ngx_event_flags & NGX_USE_EPOLL_EVENT)) {
+        return NGX_OK;
+    }
+
+    fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+
+    if (fd == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "inotify_init1() failed");
+        return NGX_OK;
+    }
+
+    c = &ngx_open_file_inotify;
+    rev = &ngx_open_file_inotify_read;
+
+    c->fd = fd;
+    c->read = rev;
+    c->write = &ngx_open_file_inotify_write;
+    c->log = cycle->log;
+
+    rev->data = c;
+    rev->handler = ngx_open_file_inotify_handler;
+    rev->log = cycle->log;
+
+    ngx_open_file_inotify_write.data = c;
+    ngx_open_file_inotify_write.log = cycle->log;
+
+    if (ngx_add_event(rev, NGX_READ_EVENT, NGX_CLEAR_EVENT) != NGX_OK) {
+
+        if (close(fd) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                          "inotify close() failed");
+        }
+
+        c->read = NULL;
+
+        return NGX_OK;
+    }
+
+    ngx_rbtree_init(&ngx_open_file_watches, &ngx_open_file_watches_sentinel,
+                    ngx_str_rbtree_insert_value);
+    ngx_rbtree_init(&ngx_open_file_watch_wds,
+                    &ngx_open_file_watch_wds_sentinel,
+                    ngx_rbtree_insert_value);
+    ngx_queue_init(&ngx_open_file_watch_queue);
+
+    cln = ngx_pool_cleanup_add(cycle->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_open_file_inotify_exit;
+
+    zone = ngx_open_file_zones->elts;
+
+    for (i = 0; i < ngx_open_file_zones->nelts; i++) {
+        sh = zone[i]->data;
+        shpool = (ngx_slab_pool_t *) zone[i]->shm.addr;
+
+        ngx_shmtx_lock(&shpool->mutex);
+        sh->watchers[ngx_process_slot] = ngx_pid;
+        ngx_shmtx_unlock(&shpool->mutex);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_open_file_inotify_exit(void *data)
+{
+    ngx_uint_t               i;
+    ngx_shm_zone_t         **zone;
+    ngx_slab_pool_t         *shpool;
+    ngx_open_file_shctx_t   *sh;
+
+    /* entries watched by this process are not trusted anymore */
+
+    zone = ngx_open_file_zones->elts;
+
+    for (i = 0; i < ngx_open_file_zones->nelts; i++) {
+        sh = zone[i]->data;
+        shpool = (ngx_slab_pool_t *) zone[i]->shm.addr;
+
+        ngx_shmtx_lock(&shpool->mutex);
+
+        if (sh->watchers[ngx_process_slot] == ngx_pid) {
+            sh->watchers[ngx_process_slot] = 0;
+        }
+
+        ngx_shmtx_unlock(&shpool->mutex);
+    }
+}
+
+
+static ngx_int_t
+ngx_open_file_watch(ngx_str_t *dir, ngx_log_t *log)
+{
+    int                     wd;
+    uint32_t                hash;
+    ngx_err_t               err;
+    ngx_uint_t              level;
+    ngx_queue_t            *q;
+    ngx_open_file_watch_t  *w;
+
+    if (ngx_open_file_inotify.read == NULL) {
+        return NGX_DECLINED;
+    }
+
+    hash = ngx_crc32_long(dir->data, dir->len);
+
+    w = (ngx_open_file_watch_t *)
+            ngx_str_rbtree_lookup(&ngx_open_file_watches, dir, hash);
+
+    if (w) {
+        ngx_queue_remove(&w->queue);
+        ngx_queue_insert_head(&ngx_open_file_watch_queue, &w->queue);
+
+        return NGX_OK;
+    }
+
+    if (ngx_open_file_nwatches >= NGX_OPEN_FILE_WATCH_MAX) {
+        q = ngx_queue_last(&ngx_open_file_watch_queue);
+        w = ngx_queue_data(q, ngx_open_file_watch_t, queue);
+
+        ngx_log_debug2(NGX_LOG_DEBUG_CORE, log, 0,
+                       "inotify unwatch: \"%V\" wd:%d",
+                       &w->sn.str, (int) w->wd.key);
+
+        (void) inotify_rm_watch(ngx_open_file_inotify.fd, (int) w->wd.key);
+
+        ngx_open_file_shared_flush(&w->sn.str, 0);
+        ngx_open_file_unwatch(w);
+    }
+
+    w = ngx_alloc(sizeof(ngx_open_file_watch_t) + dir->len + 1, log);
+    if (w == NULL) {
+        return NGX_DECLINED;
+    }
+
+    w->sn.node.key = hash;
+    w->sn.str.len = dir->len;
+    w->sn.str.data = (u_char *) (w + 1);
+    ngx_cpystrn(w->sn.str.data, dir->data, dir->len + 1);
+
+    wd = inotify_add_watch(ngx_open_file_inotify.fd,
+                           (const char *) w->sn.str.data,
+                           NGX_OPEN_FILE_WATCH_MASK);
+
+    if (wd == -1) {
+        err = ngx_errno;
+
+        if (err == NGX_ENOSPC) {
+            if (!ngx_open_file_watch_full) {
+                ngx_open_file_watch_full = 1;
+
+                ngx_log_error(NGX_LOG_WARN, log, err,
+                              "inotify_add_watch(\"%V\") failed, "
+                              "the limit of watches is reached", dir);
+            }
+
+        } else {
+            if (err == NGX_ENOENT || err == NGX_ENOTDIR
+                || err == NGX_ENAMETOOLONG || err == NGX_ELOOP
+                || err == NGX_EACCES)
+            {
+                level = NGX_LOG_DEBUG;
+
+            } else {
+                level = NGX_LOG_INFO;
+            }
+
+            ngx_log_error(level, log, err,
+                          "inotify_add_watch(\"%V\") failed", dir);
+        }
+
+        ngx_free(w);
+
+        return NGX_DECLINED;
+    }
+
+    if (ngx_open_file_watch_lookup(wd)) {
+
+        /* the directory is already watched under another name */
+
+        ngx_free(w);
+
+        return NGX_DECLINED;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, log, 0,
+                   "inotify watch: \"%V\" wd:%d", dir, wd);
+
+    w->wd.key = wd;
+
+    ngx_rbtree_insert(&ngx_open_file_watches, &w->sn.node);
+    ngx_rbtree_insert(&ngx_open_file_watch_wds, &w->wd);
+    ngx_queue_insert_head(&ngx_open_file_watch_queue, &w->queue);
+
+    ngx_open_file_nwatches++;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_open_file_unwatch(ngx_open_file_watch_t *w)
+{
+    ngx_rbtree_delete(&ngx_open_file_watches, &w->sn.node);
+    ngx_rbtree_delete(&ngx_open_file_watch_wds, &w->wd);
+    ngx_queue_remove(&w->queue);
+
+    ngx_open_file_nwatches--;
+
+    ngx_free(w);
+}
+
+
+static ngx_open_file_watch_t *
+ngx_open_file_watch_lookup(int wd)
+{
+    ngx_rbtree_key_t    key;
+    ngx_rbtree_node_t  *node, *sentinel;
+
+    key = wd;
+
+    node = ngx_open_file_watch_wds.root;
+    sentinel = ngx_open_file_watch_wds.sentinel;
+
+    while (node != sentinel) {
+
+        if (key < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (key > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        return (ngx_open_file_watch_t *)
+                   ((u_char *) node - offsetof(ngx_open_file_watch_t, wd));
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_open_file_inotify_handler(ngx_event_t *ev)
+{
+    u_char                *p, *last;
+    ssize_t                n;
+    ngx_err_t              err;
+    struct inotify_event  *ie;
+
+    /* uint32_t to keep struct inotify_event aligned */
+    uint32_t               buf[1024];
+
+    for ( ;; ) {
+
+        n = read(ngx_open_file_inotify.fd, buf, sizeof(buf));
+
+        if (n == -1) {
+            err = ngx_errno;
+
+            if (err == NGX_EINTR) {
+                continue;
+            }
+
+            if (err != NGX_EAGAIN) {
+                ngx_log_error(NGX_LOG_ALERT, ev->log, err,
+                              "inotify read() failed");
+            }
+
+            return;
+        }
+
+        if (n == 0) {
+            return;
+        }
+
+        p = (u_char *) buf;
+        last = p + n;
+
+        while (p < last) {
+            ie = (struct inotify_event *) p;
+
+            ngx_open_file_inotify_event(ie, ev->log);
+
+            p += sizeof(struct inotify_event) + ie->len;
+        }
+    }
+}
+
+
+static void
+ngx_open_file_inotify_event(struct inotify_event *ie, ngx_log_t *log)
+{
+    ngx_open_file_watch_t  *w;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_CORE, log, 0,
+                   "inotify event: wd:%d mask:%uxD \"%s\"",
+                   ie->wd, ie->mask, ie->len ? ie->name : "");
+
+    if (ie->mask & IN_Q_OVERFLOW) {
+        ngx_log_error(NGX_LOG_WARN, log, 0, "inotify event queue overflow");
+
+        ngx_open_file_shared_flush(NULL, 0);
+        return;
+    }
+
+    w = ngx_open_file_watch_lookup(ie->wd);
+    if (w == NULL) {
+        return;
+    }
+
+    if (ie->mask & (IN_DELETE_SELF|IN_MOVE_SELF|IN_UNMOUNT|IN_IGNORED)) {
+
+        /*
+         * entries of the directory are invalidated along with its node,
+         * on rename or unmount nested directories are invalidated as well
+         */
+
+        ngx_open_file_shared_flush(&w->sn.str,
+                                   ie->mask & (IN_MOVE_SELF|IN_UNMOUNT));
+
+        if (ie->mask & IN_MOVE_SELF) {
+            (void) inotify_rm_watch(ngx_open_file_inotify.fd, ie->wd);
+        }
+
+        if (ie->mask & IN_IGNORED) {
+            ngx_open_file_unwatch(w);
+        }
+
+        return;
+    }
+
+    if (ie->len) {
+        ngx_open_file_shared_invalidate(&w->sn.str, (u_char *) ie->name);
+    }
+}
+
+
+static void
+ngx_open_file_shared_invalidate(ngx_str_t *dir, u_char *name)
+{
+    u_char                 *p;
+    size_t                  len;
+    uint32_t                hash, dhash;
+    ngx_str_t               path;
+    ngx_uint_t              i;
+    ngx_shm_zone_t        **zone;
+    ngx_slab_pool_t        *shpool;
+    ngx_open_file_node_t   *node;
+    ngx_open_file_shctx_t  *sh;
+    u_char                  buf[NGX_MAX_PATH];
+
+    len = ngx_strlen(name);
+
+    if (dir->len + 1 + len > NGX_MAX_PATH) {
+        return;
+    }
+
+    p = ngx_cpymem(buf, dir->data, dir->len);
+
+    if (dir->len > 1) {
+        *p++ = '/';
+    }
+
+    p = ngx_cpymem(p, name, len);
+
+    path.len = p - buf;
+    path.data = buf;
+
+    hash = ngx_crc32_long(path.data, path.len);
+    dhash = ngx_crc32_long(dir->data, dir->len);
+
+    zone = ngx_open_file_zones->elts;
+
+    for (i = 0; i < ngx_open_file_zones->nelts; i++) {
+        sh = zone[i]->data;
+        shpool = (ngx_slab_pool_t *) zone[i]->shm.addr;
+
+        ngx_shmtx_lock(&shpool->mutex);
+
+        node = (ngx_open_file_node_t *) ngx_str_rbtree_lookup(&sh->dirs, dir,
+                                                              dhash);
+        if (node) {
+            node->seq = ++sh->seq;
+        }
+
+        node = (ngx_open_file_node_t *) ngx_str_rbtree_lookup(&sh->rbtree,
+                                                              &path, hash);
+        if (node) {
+            ngx_open_file_shared_delete(sh, shpool, node);
+        }
+
+        ngx_shmtx_unlock(&shpool->mutex);
+    }
+}
+
+
+/*
+ * a NULL dir invalidates all entries, otherwise the directory node
+ * is deleted, which invalidates entries stat()'ed under its watch
+ */
+
+static void
+ngx_open_file_shared_flush(ngx_str_t *dir, ngx_uint_t nested)
+{
+    uint32_t                hash;
+    ngx_uint_t              i;
+    ngx_shm_zone_t        **zone;
+    ngx_slab_pool_t        *shpool;
+    ngx_rbtree_node_t      *rn, *next;
+    ngx_open_file_node_t   *node;
+    ngx_open_file_shctx_t  *sh;
+
+    hash = dir ? ngx_crc32_long(dir->data, dir->len) : 0;
+
+    zone = ngx_open_file_zones->elts;
+
+    for (i = 0; i < ngx_open_file_zones->nelts; i++) {
+        sh = zone[i]->data;
+        shpool = (ngx_slab_pool_t *) zone[i]->shm.addr;
+
+        ngx_shmtx_lock(&shpool->mutex);
+
+        if (dir == NULL) {
+            sh->generation++;
+
+            ngx_shmtx_unlock(&shpool->mutex);
+            continue;
+        }
+
+        node = (ngx_open_file_node_t *)
+                   ngx_str_rbtree_lookup(&sh->dirs, dir, hash);
+
+        if (node && node->pid == ngx_pid) {
+            ngx_open_file_shared_delete(sh, shpool, node);
+        }
+
+        if (nested && sh->dirs.root != sh->dirs.sentinel) {
+
+            rn = ngx_rbtree_min(sh->dirs.root, sh->dirs.sentinel);
+
+            while (rn) {
+                next = ngx_rbtree_next(&sh->dirs, rn);
+
+                node = (ngx_open_file_node_t *) rn;
+
+                if (node->sn.str.len > dir->len
+                    && node->sn.str.data[dir->len] == '/'
+                    && ngx_strncmp(node->sn.str.data, dir->data, dir->len)
+                       == 0)
+                {
+                    ngx_open_file_shared_delete(sh, shpool, node);
+                }
+
+                rn = next;
+            }
+        }
+
+        ngx_shmtx_unlock(&shpool->mutex);
+    }
+}
+
+#endif
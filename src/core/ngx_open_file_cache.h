@@ -96,6 +96,8 @@ typedef struct {
     ngx_uint_t               current;
     ngx_uint_t               max;
     time_t                   inactive;
+
+    ngx_shm_zone_t          *shm_zone;
 } ngx_open_file_cache_t;
 
 
@@ -124,6 +126,9 @@ ngx_open_file_cache_t *ngx_open_file_cache_init(ngx_pool_t *pool,
     ngx_uint_t max, time_t inactive);
 ngx_int_t ngx_open_cached_file(ngx_open_file_cache_t *cache, ngx_str_t *name,
     ngx_open_file_info_t *of, ngx_pool_t *pool);
+ngx_int_t ngx_open_file_cache_add_zone(ngx_conf_t *cf,
+    ngx_open_file_cache_t *cache, ngx_str_t *name, size_t size, void *tag);
+ngx_int_t ngx_open_file_cache_init_process(ngx_cycle_t *cycle);
 
 
 #endif /* _NGX_OPEN_FILE_CACHE_H_INCLUDED_ */
@@ -8,20 +8,75 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 #include <ngx_event.h>
+#include <ngx_sha1.h>
 
 
 #define NGX_SSL_PASSWORD_BUFFER_SIZE  4096
 
+#define NGX_SSL_CACHE_CERT            0
+#define NGX_SSL_CACHE_KEY             1
+
 
 typedef struct {
     ngx_uint_t  engine;   /* unsigned  engine:1; */
 } ngx_openssl_conf_t;
 
 
+/*
+ * certificates and keys loaded by previous configurations, looked up
+ * by the digest of the file contents
+ */
+
+typedef struct {
+    ngx_rbtree_node_t           node;
+    ngx_queue_t                 queue;
+    ngx_uint_t                  type;
+    ngx_uint_t                  generation;
+    u_char                      digest[20];
+
+    /* the certificate itself is kept as DER, it carries per-context data */
+    u_char                     *der;
+    size_t                      len;
+    STACK_OF(X509)             *chain;
+
+    EVP_PKEY                   *pkey;
+} ngx_ssl_cache_node_t;
+
+
+typedef struct {
+    ngx_rbtree_t                rbtree;
+    ngx_rbtree_node_t           sentinel;
+    ngx_queue_t                 queue;
+    ngx_uint_t                  generation;
+    ngx_uint_t                  reused;
+    ngx_uint_t                  loaded;
+} ngx_ssl_cache_t;
+
+
 static X509 *ngx_ssl_load_certificate(ngx_pool_t *pool, char **err,
     ngx_str_t *cert, STACK_OF(X509) **chain);
+static X509 *ngx_ssl_parse_certificate(BIO *bio, char **err,
+    STACK_OF(X509) **chain);
 static EVP_PKEY *ngx_ssl_load_certificate_key(ngx_pool_t *pool, char **err,
     ngx_str_t *key, ngx_array_t *passwords);
+static EVP_PKEY *ngx_ssl_parse_certificate_key(BIO *bio, char **err,
+    ngx_array_t *passwords);
+static X509 *ngx_ssl_cache_certificate(ngx_conf_t *cf, char **err,
+    ngx_str_t *cert, STACK_OF(X509) **chain);
+static EVP_PKEY *ngx_ssl_cache_certificate_key(ngx_conf_t *cf, char **err,
+    ngx_str_t *key, ngx_array_t *passwords);
+#if OPENSSL_VERSION_NUMBER >= 0x10100001L
+static ngx_int_t ngx_ssl_cache_read(ngx_conf_t *cf, ngx_str_t *name,
+    ngx_str_t *data);
+static ngx_ssl_cache_node_t *ngx_ssl_cache_lookup(ngx_uint_t type,
+    ngx_str_t *data, u_char *digest);
+static void ngx_ssl_cache_insert(ngx_ssl_cache_node_t *node);
+#endif
+static ngx_int_t ngx_ssl_cache_cmp(ngx_uint_t type, u_char *digest,
+    ngx_ssl_cache_node_t *node);
+static void ngx_ssl_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static void ngx_ssl_cache_sweep(ngx_uint_t all);
 static int ngx_ssl_password_callback(char *buf, int size, int rwflag,
     void *userdata);
 static int ngx_ssl_verify_callback(int ok, X509_STORE_CTX *x509_store);
@@ -47,6 +102,10 @@ static void ngx_ssl_write_handler(ngx_event_t *wev);
 static ssize_t ngx_ssl_write_early(ngx_connection_t *c, u_char *data,
     size_t size);
 #endif
+#ifdef SSL_OP_ENABLE_KTLS
+static ssize_t ngx_ssl_sendfile(ngx_connection_t *c, ngx_buf_t *file,
+    size_t size);
+#endif
 static void ngx_ssl_read_handler(ngx_event_t *rev);
 static void ngx_ssl_shutdown_handler(ngx_event_t *ev);
 static void ngx_ssl_connection_error(ngx_connection_t *c, int sslerr,
@@ -86,6 +145,7 @@ static time_t ngx_ssl_parse_time(
     ASN1_TIME *asn1time);
 
 static void *ngx_openssl_create_conf(ngx_cycle_t *cycle);
+static char *ngx_openssl_init_conf(ngx_cycle_t *cycle, void *conf);
 static char *ngx_openssl_engine(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static void ngx_openssl_exit(ngx_cycle_t *cycle);
 
@@ -106,7 +166,7 @@ static ngx_command_t  ngx_openssl_commands[] = {
 static ngx_core_module_t  ngx_openssl_module_ctx = {
     ngx_string("openssl"),
     ngx_openssl_create_conf,
-    NULL
+    ngx_openssl_init_conf
 };
 
 
@@ -137,6 +197,9 @@ int  ngx_ssl_certificate_name_index;
 int  ngx_ssl_stapling_index;
 
 
+static ngx_ssl_cache_t  ngx_ssl_cache;
+
+
 ngx_int_t
 ngx_ssl_init(ngx_log_t *log)
 {
@@ -426,7 +489,7 @@ ngx_ssl_certificate(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_str_t *cert,
     EVP_PKEY        *pkey;
     STACK_OF(X509)  *chain;
 
-    x509 = ngx_ssl_load_certificate(cf->pool, &err, cert, &chain);
+    x509 = ngx_ssl_cache_certificate(cf, &err, cert, &chain);
     if (x509 == NULL) {
         if (err != NULL) {
             ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
@@ -514,7 +577,7 @@ ngx_ssl_certificate(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_str_t *cert,
     }
 #endif
 
-    pkey = ngx_ssl_load_certificate_key(cf->pool, &err, key, passwords);
+    pkey = ngx_ssl_cache_certificate_key(cf, &err, key, passwords);
     if (pkey == NULL) {
         if (err != NULL) {
             ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
@@ -613,9 +676,8 @@ static X509 *
 ngx_ssl_load_certificate(ngx_pool_t *pool, char **err, ngx_str_t *cert,
     STACK_OF(X509) **chain)
 {
-    BIO     *bio;
-    X509    *x509, *temp;
-    u_long   n;
+    BIO   *bio;
+    X509  *x509;
 
     if (ngx_strncmp(cert->data, "data:", sizeof("data:") - 1) == 0) {
 
@@ -642,12 +704,25 @@ ngx_ssl_load_certificate(ngx_pool_t *pool, char **err, ngx_str_t *cert,
         }
     }
 
+    x509 = ngx_ssl_parse_certificate(bio, err, chain);
+
+    BIO_free(bio);
+
+    return x509;
+}
+
+
+static X509 *
+ngx_ssl_parse_certificate(BIO *bio, char **err, STACK_OF(X509) **chain)
+{
+    X509    *x509, *temp;
+    u_long   n;
+
     /* certificate itself */
 
     x509 = PEM_read_bio_X509_AUX(bio, NULL, NULL, NULL);
     if (x509 == NULL) {
         *err = "PEM_read_bio_X509_AUX() failed";
-        BIO_free(bio);
         return NULL;
     }
 
@@ -656,7 +731,6 @@ ngx_ssl_load_certificate(ngx_pool_t *pool, char **err, ngx_str_t *cert,
     *chain = sk_X509_new_null();
     if (*chain == NULL) {
         *err = "sk_X509_new_null() failed";
-        BIO_free(bio);
         X509_free(x509);
         return NULL;
     }
@@ -678,7 +752,6 @@ ngx_ssl_load_certificate(ngx_pool_t *pool, char **err, ngx_str_t *cert,
             /* some real error */
 
             *err = "PEM_read_bio_X509() failed";
-            BIO_free(bio);
             X509_free(x509);
             sk_X509_pop_free(*chain, X509_free);
             return NULL;
@@ -686,15 +759,13 @@ ngx_ssl_load_certificate(ngx_pool_t *pool, char **err, ngx_str_t *cert,
 
         if (sk_X509_push(*chain, temp) == 0) {
             *err = "sk_X509_push() failed";
-            BIO_free(bio);
+            X509_free(temp);
             X509_free(x509);
             sk_X509_pop_free(*chain, X509_free);
             return NULL;
         }
     }
 
-    BIO_free(bio);
-
     return x509;
 }
 
@@ -703,11 +774,8 @@ static EVP_PKEY *
 ngx_ssl_load_certificate_key(ngx_pool_t *pool, char **err,
     ngx_str_t *key, ngx_array_t *passwords)
 {
-    BIO              *bio;
-    EVP_PKEY         *pkey;
-    ngx_str_t        *pwd;
-    ngx_uint_t        tries;
-    pem_password_cb  *cb;
+    BIO       *bio;
+    EVP_PKEY  *pkey;
 
     if (ngx_strncmp(key->data, "engine:", sizeof("engine:") - 1) == 0) {
 
@@ -780,39 +848,491 @@ ngx_ssl_load_certificate_key(ngx_pool_t *pool, char **err,
         }
     }
 
-    if (passwords) {
-        tries = passwords->nelts;
-        pwd = passwords->elts;
-        cb = ngx_ssl_password_callback;
+    pkey = ngx_ssl_parse_certificate_key(bio, err, passwords);
+
+    BIO_free(bio);
+
+    return pkey;
+}
+
+
+static EVP_PKEY *
+ngx_ssl_parse_certificate_key(BIO *bio, char **err, ngx_array_t *passwords)
+{
+    EVP_PKEY         *pkey;
+    ngx_str_t        *pwd;
+    ngx_uint_t        tries;
+    pem_password_cb  *cb;
+
+    if (passwords) {
+        tries = passwords->nelts;
+        pwd = passwords->elts;
+        cb = ngx_ssl_password_callback;
+
+    } else {
+        tries = 1;
+        pwd = NULL;
+        cb = NULL;
+    }
+
+    for ( ;; ) {
+
+        pkey = PEM_read_bio_PrivateKey(bio, NULL, cb, pwd);
+        if (pkey != NULL) {
+            break;
+        }
+
+        if (tries-- > 1) {
+            ERR_clear_error();
+            (void) BIO_reset(bio);
+            pwd++;
+            continue;
+        }
+
+        *err = "PEM_read_bio_PrivateKey() failed";
+        return NULL;
+    }
+
+    return pkey;
+}
+
+
+static X509 *
+ngx_ssl_cache_certificate(ngx_conf_t *cf, char **err, ngx_str_t *cert,
+    STACK_OF(X509) **chain)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10100001L
+
+    BIO                   *bio;
+    X509                  *x509;
+    u_char                *p, digest[20];
+    ngx_str_t              data;
+    const u_char          *cp;
+    ngx_ssl_cache_node_t  *node;
+
+    if (ngx_ssl_cache_read(cf, cert, &data) != NGX_OK) {
+        *err = NULL;
+        return NULL;
+    }
+
+    node = ngx_ssl_cache_lookup(NGX_SSL_CACHE_CERT, &data, digest);
+
+    if (node) {
+        cp = node->der;
+
+        x509 = d2i_X509_AUX(NULL, &cp, node->len);
+        if (x509 == NULL) {
+            *err = "d2i_X509_AUX() failed";
+            return NULL;
+        }
+
+        *chain = X509_chain_up_ref(node->chain);
+        if (*chain == NULL) {
+            *err = "X509_chain_up_ref() failed";
+            X509_free(x509);
+            return NULL;
+        }
+
+        node->generation = ngx_ssl_cache.generation;
+        ngx_ssl_cache.reused++;
+
+        return x509;
+    }
+
+    bio = BIO_new_mem_buf(data.data, data.len);
+    if (bio == NULL) {
+        *err = "BIO_new_mem_buf() failed";
+        return NULL;
+    }
+
+    x509 = ngx_ssl_parse_certificate(bio, err, chain);
+
+    BIO_free(bio);
+
+    if (x509 == NULL) {
+        return NULL;
+    }
+
+    ngx_ssl_cache.loaded++;
+
+    /* failure to cache is not fatal, the certificate is just loaded again */
+
+    node = ngx_alloc(sizeof(ngx_ssl_cache_node_t), cf->log);
+    if (node == NULL) {
+        return x509;
+    }
+
+    node->len = i2d_X509_AUX(x509, NULL);
+
+    node->der = ngx_alloc(node->len, cf->log);
+    if (node->der == NULL) {
+        ngx_free(node);
+        return x509;
+    }
+
+    p = node->der;
+
+    if (i2d_X509_AUX(x509, &p) <= 0) {
+        ngx_ssl_error(NGX_LOG_WARN, cf->log, 0, "i2d_X509_AUX() failed");
+        ngx_free(node->der);
+        ngx_free(node);
+        return x509;
+    }
+
+    node->chain = X509_chain_up_ref(*chain);
+    if (node->chain == NULL) {
+        ngx_ssl_error(NGX_LOG_WARN, cf->log, 0, "X509_chain_up_ref() failed");
+        ngx_free(node->der);
+        ngx_free(node);
+        return x509;
+    }
+
+    node->type = NGX_SSL_CACHE_CERT;
+    node->generation = ngx_ssl_cache.generation;
+    node->pkey = NULL;
+    ngx_memcpy(node->digest, digest, 20);
+
+    ngx_ssl_cache_insert(node);
+
+    return x509;
+
+#else
+
+    return ngx_ssl_load_certificate(cf->pool, err, cert, chain);
+
+#endif
+}
+
+
+static EVP_PKEY *
+ngx_ssl_cache_certificate_key(ngx_conf_t *cf, char **err, ngx_str_t *key,
+    ngx_array_t *passwords)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10100001L
+
+    BIO                   *bio;
+    u_char                 digest[20];
+    EVP_PKEY              *pkey;
+    ngx_str_t              data;
+    ngx_ssl_cache_node_t  *node;
+
+    /*
+     * keys protected with passwords are not cached, as the result
+     * depends on the passwords as well
+     */
+
+    if (passwords
+        || ngx_strncmp(key->data, "engine:", sizeof("engine:") - 1) == 0)
+    {
+        return ngx_ssl_load_certificate_key(cf->pool, err, key, passwords);
+    }
+
+    if (ngx_ssl_cache_read(cf, key, &data) != NGX_OK) {
+        *err = NULL;
+        return NULL;
+    }
+
+    node = ngx_ssl_cache_lookup(NGX_SSL_CACHE_KEY, &data, digest);
+
+    if (node) {
+        if (EVP_PKEY_up_ref(node->pkey) == 0) {
+            *err = "EVP_PKEY_up_ref() failed";
+            return NULL;
+        }
+
+        node->generation = ngx_ssl_cache.generation;
+        ngx_ssl_cache.reused++;
+
+        return node->pkey;
+    }
+
+    bio = BIO_new_mem_buf(data.data, data.len);
+    if (bio == NULL) {
+        *err = "BIO_new_mem_buf() failed";
+        return NULL;
+    }
+
+    pkey = ngx_ssl_parse_certificate_key(bio, err, NULL);
+
+    BIO_free(bio);
+
+    if (pkey == NULL) {
+        return NULL;
+    }
+
+    ngx_ssl_cache.loaded++;
+
+    node = ngx_alloc(sizeof(ngx_ssl_cache_node_t), cf->log);
+    if (node == NULL) {
+        return pkey;
+    }
+
+    if (EVP_PKEY_up_ref(pkey) == 0) {
+        ngx_ssl_error(NGX_LOG_WARN, cf->log, 0, "EVP_PKEY_up_ref() failed");
+        ngx_free(node);
+        return pkey;
+    }
+
+    node->type = NGX_SSL_CACHE_KEY;
+    node->generation = ngx_ssl_cache.generation;
+    node->der = NULL;
+    node->len = 0;
+    node->chain = NULL;
+    node->pkey = pkey;
+    ngx_memcpy(node->digest, digest, 20);
+
+    ngx_ssl_cache_insert(node);
+
+    return pkey;
+
+#else
+
+    return ngx_ssl_load_certificate_key(cf->pool, err, key, passwords);
+
+#endif
+}
+
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100001L
+
+static ngx_int_t
+ngx_ssl_cache_read(ngx_conf_t *cf, ngx_str_t *name, ngx_str_t *data)
+{
+    ssize_t     n;
+    ngx_int_t   rc;
+    ngx_file_t  file;
+
+    if (ngx_strncmp(name->data, "data:", sizeof("data:") - 1) == 0) {
+        data->len = name->len - (sizeof("data:") - 1);
+        data->data = name->data + sizeof("data:") - 1;
+        return NGX_OK;
+    }
+
+    if (ngx_get_full_name(cf->pool, (ngx_str_t *) &ngx_cycle->conf_prefix,
+                          name)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.name = *name;
+    file.log = cf->log;
+
+    file.fd = ngx_open_file(name->data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+    if (file.fd == NGX_INVALID_FILE) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                           ngx_open_file_n " \"%s\" failed", name->data);
+        return NGX_ERROR;
+    }
+
+    rc = NGX_ERROR;
+
+    if (ngx_fd_info(file.fd, &file.info) == NGX_FILE_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                           ngx_fd_info_n " \"%s\" failed", name->data);
+        goto done;
+    }
+
+    data->len = ngx_file_size(&file.info);
+
+    data->data = ngx_pnalloc(cf->temp_pool, data->len);
+    if (data->data == NULL) {
+        goto done;
+    }
+
+    n = ngx_read_file(&file, data->data, data->len, 0);
+
+    if (n == NGX_ERROR) {
+        goto done;
+    }
+
+    if ((size_t) n != data->len) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           ngx_read_file_n " \"%s\" returned only "
+                           "%z bytes instead of %uz",
+                           name->data, n, data->len);
+        goto done;
+    }
+
+    rc = NGX_OK;
+
+done:
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, cf->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", name->data);
+    }
+
+    return rc;
+}
+
+
+#define ngx_ssl_cache_key(digest)                                            \
+    ((ngx_rbtree_key_t) (digest)[0] << 24 | (digest)[1] << 16                 \
+     | (digest)[2] << 8 | (digest)[3])
+
+
+static ngx_ssl_cache_node_t *
+ngx_ssl_cache_lookup(ngx_uint_t type, ngx_str_t *data, u_char *digest)
+{
+    ngx_int_t              rc;
+    ngx_sha1_t             sha1;
+    ngx_rbtree_key_t       key;
+    ngx_rbtree_node_t     *node, *sentinel;
+    ngx_ssl_cache_node_t  *cn;
+
+    ngx_sha1_init(&sha1);
+    ngx_sha1_update(&sha1, data->data, data->len);
+    ngx_sha1_final(digest, &sha1);
+
+    key = ngx_ssl_cache_key(digest);
+
+    node = ngx_ssl_cache.rbtree.root;
+    sentinel = ngx_ssl_cache.rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (key < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (key > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* key == node->key */
+
+        cn = (ngx_ssl_cache_node_t *) node;
+
+        rc = ngx_ssl_cache_cmp(type, digest, cn);
+
+        if (rc == 0) {
+            return cn;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_ssl_cache_insert(ngx_ssl_cache_node_t *node)
+{
+    node->node.key = ngx_ssl_cache_key(node->digest);
+
+    ngx_rbtree_insert(&ngx_ssl_cache.rbtree, &node->node);
+    ngx_queue_insert_head(&ngx_ssl_cache.queue, &node->queue);
+}
+
+#endif
+
+
+static ngx_int_t
+ngx_ssl_cache_cmp(ngx_uint_t type, u_char *digest, ngx_ssl_cache_node_t *node)
+{
+    if (type != node->type) {
+        return (type < node->type) ? -1 : 1;
+    }
+
+    return ngx_memcmp(digest, node->digest, 20);
+}
+
+
+static void
+ngx_ssl_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t     **p;
+    ngx_ssl_cache_node_t   *cn;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            cn = (ngx_ssl_cache_node_t *) node;
+
+            p = (ngx_ssl_cache_cmp(cn->type, cn->digest,
+                                   (ngx_ssl_cache_node_t *) temp)
+                 < 0)
+                ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
 
-    } else {
-        tries = 1;
-        pwd = NULL;
-        cb = NULL;
+static void
+ngx_ssl_cache_sweep(ngx_uint_t all)
+{
+    ngx_queue_t           *q, *next;
+    ngx_ssl_cache_node_t  *node;
+
+    if (ngx_ssl_cache.queue.prev == NULL) {
+        ngx_rbtree_init(&ngx_ssl_cache.rbtree, &ngx_ssl_cache.sentinel,
+                        ngx_ssl_cache_rbtree_insert_value);
+        ngx_queue_init(&ngx_ssl_cache.queue);
     }
 
-    for ( ;; ) {
+    /*
+     * entries are kept while used by the current or the previous
+     * configuration, as the new one may fail to load
+     */
 
-        pkey = PEM_read_bio_PrivateKey(bio, NULL, cb, pwd);
-        if (pkey != NULL) {
-            break;
-        }
+    for (q = ngx_queue_head(&ngx_ssl_cache.queue);
+         q != ngx_queue_sentinel(&ngx_ssl_cache.queue);
+         q = next)
+    {
+        next = ngx_queue_next(q);
 
-        if (tries-- > 1) {
-            ERR_clear_error();
-            (void) BIO_reset(bio);
-            pwd++;
+        node = ngx_queue_data(q, ngx_ssl_cache_node_t, queue);
+
+        if (!all && node->generation + 1 >= ngx_ssl_cache.generation) {
             continue;
         }
 
-        *err = "PEM_read_bio_PrivateKey() failed";
-        BIO_free(bio);
-        return NULL;
-    }
+        ngx_queue_remove(q);
+        ngx_rbtree_delete(&ngx_ssl_cache.rbtree, &node->node);
 
-    BIO_free(bio);
+        if (node->chain) {
+            sk_X509_pop_free(node->chain, X509_free);
+        }
 
-    return pkey;
+        if (node->pkey) {
+            EVP_PKEY_free(node->pkey);
+        }
+
+        if (node->der) {
+            ngx_free(node->der);
+        }
+
+        ngx_free(node);
+    }
 }
 
 
@@ -1470,6 +1990,32 @@ ngx_ssl_early_data(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_uint_t enable)
 }
 
 
+ngx_int_t
+ngx_ssl_ktls(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_uint_t enable)
+{
+    if (!enable) {
+        return NGX_OK;
+    }
+
+#ifdef SSL_OP_ENABLE_KTLS
+
+    /*
+     * OpenSSL switches a connection to kernel TLS after the handshake
+     * if the kernel supports the negotiated cipher, and silently keeps
+     * encrypting in user space otherwise
+     */
+
+    SSL_CTX_set_options(ssl->ctx, SSL_OP_ENABLE_KTLS);
+
+#else
+    ngx_log_error(NGX_LOG_WARN, ssl->log, 0,
+                  "kernel TLS is not supported by OpenSSL library, ignored");
+#endif
+
+    return NGX_OK;
+}
+
+
 ngx_int_t
 ngx_ssl_client_session_cache(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_uint_t enable)
 {
@@ -1642,6 +2188,21 @@ ngx_ssl_handshake(ngx_connection_t *c)
         c->recv_chain = ngx_ssl_recv_chain;
         c->send_chain = ngx_ssl_send_chain;
 
+#ifdef SSL_OP_ENABLE_KTLS
+
+        if (BIO_get_ktls_send(SSL_get_wbio(c->ssl->connection))) {
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                           "SSL kernel TLS send enabled");
+            c->ssl->sendfile = 1;
+        }
+
+        if (BIO_get_ktls_recv(SSL_get_rbio(c->ssl->connection))) {
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                           "SSL kernel TLS receive enabled");
+        }
+
+#endif
+
 #ifndef SSL_OP_NO_RENEGOTIATION
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
 #ifdef SSL3_FLAGS_NO_RENEGOTIATE_CIPHERS
@@ -2379,10 +2940,20 @@ ngx_ssl_write_handler(ngx_event_t *wev)
 ngx_chain_t *
 ngx_ssl_send_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
 {
-    int          n;
-    ngx_uint_t   flush;
-    ssize_t      send, size;
-    ngx_buf_t   *buf;
+    int           n;
+    ngx_uint_t    flush;
+    ssize_t       send, size;
+    ngx_buf_t    *buf;
+#ifdef SSL_OP_ENABLE_KTLS
+    ssize_t       sent;
+    ngx_chain_t  *cl;
+#endif
+
+    /* the maximum limit size is the maximum int32_t value - the page size */
+
+    if (limit == 0 || limit > (off_t) (NGX_MAX_INT32_VALUE - ngx_pagesize)) {
+        limit = NGX_MAX_INT32_VALUE - ngx_pagesize;
+    }
 
     if (!c->ssl->buffer) {
 
@@ -2392,6 +2963,29 @@ ngx_ssl_send_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
                 continue;
             }
 
+#ifdef SSL_OP_ENABLE_KTLS
+
+            if (in->buf->in_file && c->ssl->sendfile) {
+                cl = in;
+                size = (ssize_t) ngx_chain_coalesce_file(&cl, limit);
+
+                sent = ngx_ssl_sendfile(c, in->buf, size);
+
+                if (sent == NGX_ERROR) {
+                    return NGX_CHAIN_ERROR;
+                }
+
+                if (sent == NGX_AGAIN) {
+                    return in;
+                }
+
+                in = ngx_chain_update_sent(in, sent);
+
+                continue;
+            }
+
+#endif
+
             n = ngx_ssl_write(c, in->buf->pos, in->buf->last - in->buf->pos);
 
             if (n == NGX_ERROR) {
@@ -2412,13 +3006,6 @@ ngx_ssl_send_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
         return in;
     }
 
-
-    /* the maximum limit size is the maximum int32_t value - the page size */
-
-    if (limit == 0 || limit > (off_t) (NGX_MAX_INT32_VALUE - ngx_pagesize)) {
-        limit = NGX_MAX_INT32_VALUE - ngx_pagesize;
-    }
-
     buf = c->ssl->buf;
 
     if (buf == NULL) {
@@ -2456,6 +3043,18 @@ ngx_ssl_send_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
                 continue;
             }
 
+#ifdef SSL_OP_ENABLE_KTLS
+
+            if (in->buf->in_file && c->ssl->sendfile) {
+
+                /* the buffered data go first, then the file is sent as is */
+
+                flush = 1;
+                break;
+            }
+
+#endif
+
             size = in->buf->last - in->buf->pos;
 
             if (size > buf->end - buf->last) {
@@ -2486,6 +3085,37 @@ ngx_ssl_send_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
 
         size = buf->last - buf->pos;
 
+#ifdef SSL_OP_ENABLE_KTLS
+
+        if (size == 0 && in && in->buf->in_file && c->ssl->sendfile
+            && send < limit)
+        {
+            cl = in;
+            size = (ssize_t) ngx_chain_coalesce_file(&cl, limit - send);
+
+            sent = ngx_ssl_sendfile(c, in->buf, size);
+
+            if (sent == NGX_ERROR) {
+                return NGX_CHAIN_ERROR;
+            }
+
+            if (sent == NGX_AGAIN) {
+                break;
+            }
+
+            in = ngx_chain_update_sent(in, sent);
+            send += sent;
+            flush = 0;
+
+            if (sent < size || in == NULL || send == limit) {
+                break;
+            }
+
+            continue;
+        }
+
+#endif
+
         if (size == 0) {
             buf->flush = 0;
             c->buffered &= ~NGX_SSL_BUFFERED;
@@ -2568,6 +3198,10 @@ ngx_ssl_write(ngx_connection_t *c, u_char *data, size_t size)
 
         c->sent += n;
 
+        if (c->ssl->sendfile) {
+            c->ssl->ktls_sent += n;
+        }
+
         return n;
     }
 
@@ -2630,6 +3264,128 @@ ngx_ssl_write(ngx_connection_t *c, u_char *data, size_t size)
 }
 
 
+#ifdef SSL_OP_ENABLE_KTLS
+
+static ssize_t
+ngx_ssl_sendfile(ngx_connection_t *c, ngx_buf_t *file, size_t size)
+{
+    int        sslerr;
+    ssize_t    n;
+    ngx_err_t  err;
+
+    ngx_ssl_clear_error(c->log);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "SSL to sendfile: @%O %uz", file->file_pos, size);
+
+    ngx_set_errno(0);
+
+    n = SSL_sendfile(c->ssl->connection, file->file->fd, file->file_pos,
+                     size, 0);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0, "SSL_sendfile: %z", n);
+
+    if (n > 0) {
+
+        if (c->ssl->saved_read_handler) {
+
+            c->read->handler = c->ssl->saved_read_handler;
+            c->ssl->saved_read_handler = NULL;
+            c->read->ready = 1;
+
+            if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            ngx_post_event(c->read, &ngx_posted_events);
+        }
+
+        if ((size_t) n < size) {
+            c->write->ready = 0;
+        }
+
+        c->sent += n;
+        c->ssl->ktls_sent += n;
+
+        return n;
+    }
+
+    if (n == 0) {
+
+        /*
+         * if sendfile returns zero, then someone has truncated the file,
+         * so the offset became beyond the end of the file
+         */
+
+        ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                      "SSL_sendfile() reported that \"%s\" was truncated at %O",
+                      file->file->name.data, file->file_pos);
+
+        return NGX_ERROR;
+    }
+
+    sslerr = SSL_get_error(c->ssl->connection, n);
+
+    if (sslerr == SSL_ERROR_SSL
+        && ERR_GET_REASON(ERR_peek_error()) == SSL_R_UNINITIALIZED
+        && ngx_errno != 0)
+    {
+        /*
+         * OpenSSL reports errors of the sendfile() call itself
+         * as SSL_ERROR_SSL with the SSL_R_UNINITIALIZED reason
+         */
+
+        sslerr = SSL_ERROR_SYSCALL;
+    }
+
+    err = (sslerr == SSL_ERROR_SYSCALL) ? ngx_errno : 0;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0, "SSL_get_error: %d", sslerr);
+
+    if (sslerr == SSL_ERROR_WANT_WRITE
+        || (sslerr == SSL_ERROR_SYSCALL
+            && (err == NGX_EAGAIN || err == NGX_EINTR)))
+    {
+        c->write->ready = 0;
+        return NGX_AGAIN;
+    }
+
+    if (sslerr == SSL_ERROR_WANT_READ) {
+
+        ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "SSL_sendfile: want read");
+
+        c->read->ready = 0;
+
+        if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        /*
+         * we do not set the timer because there is already
+         * the write event timer
+         */
+
+        if (c->ssl->saved_read_handler == NULL) {
+            c->ssl->saved_read_handler = c->read->handler;
+            c->read->handler = ngx_ssl_read_handler;
+        }
+
+        return NGX_AGAIN;
+    }
+
+    c->ssl->no_wait_shutdown = 1;
+    c->ssl->no_send_shutdown = 1;
+    c->write->error = 1;
+
+    ngx_ssl_connection_error(c, sslerr, err, "SSL_sendfile() failed");
+
+    return NGX_ERROR;
+}
+
+#endif
+
+
 #ifdef SSL_READ_EARLY_DATA_SUCCESS
 
 ssize_t
@@ -4502,6 +5258,49 @@ ngx_ssl_get_early_data(ngx_connection_t *c, ngx_pool_t *pool, ngx_str_t *s)
 }
 
 
+ngx_int_t
+ngx_ssl_get_ktls(ngx_connection_t *c, ngx_pool_t *pool, ngx_str_t *s)
+{
+    s->len = 0;
+
+#ifdef SSL_OP_ENABLE_KTLS
+
+    if (c->ssl->sendfile) {
+
+        if (BIO_get_ktls_recv(SSL_get_rbio(c->ssl->connection))) {
+            ngx_str_set(s, "send,recv");
+
+        } else {
+            ngx_str_set(s, "send");
+        }
+
+    } else if (BIO_get_ktls_recv(SSL_get_rbio(c->ssl->connection))) {
+        ngx_str_set(s, "recv");
+    }
+
+#endif
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_ssl_get_ktls_sent(ngx_connection_t *c, ngx_pool_t *pool, ngx_str_t *s)
+{
+    u_char  *p;
+
+    p = ngx_pnalloc(pool, NGX_OFF_T_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    s->len = ngx_sprintf(p, "%O", c->ssl->ktls_sent) - p;
+    s->data = p;
+
+    return NGX_OK;
+}
+
+
 ngx_int_t
 ngx_ssl_get_server_name(ngx_connection_t *c, ngx_pool_t *pool, ngx_str_t *s)
 {
@@ -5146,10 +5945,29 @@ ngx_openssl_create_conf(ngx_cycle_t *cycle)
      *     oscf->engine = 0;
      */
 
+    ngx_ssl_cache.generation++;
+    ngx_ssl_cache.reused = 0;
+    ngx_ssl_cache.loaded = 0;
+
+    ngx_ssl_cache_sweep(0);
+
     return oscf;
 }
 
 
+static char *
+ngx_openssl_init_conf(ngx_cycle_t *cycle, void *conf)
+{
+    if (ngx_ssl_cache.reused || ngx_ssl_cache.loaded) {
+        ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0,
+                      "ssl certificates and keys: %ui reused, %ui loaded",
+                      ngx_ssl_cache.reused, ngx_ssl_cache.loaded);
+    }
+
+    return NGX_CONF_OK;
+}
+
+
 static char *
 ngx_openssl_engine(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
@@ -5201,6 +6019,8 @@ ngx_openssl_engine(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 static void
 ngx_openssl_exit(ngx_cycle_t *cycle)
 {
+    ngx_ssl_cache_sweep(1);
+
 #if OPENSSL_VERSION_NUMBER < 0x10100003L
 
     EVP_cleanup();
@@ -13,6 +13,7 @@
 typedef struct {
     ngx_uint_t                  hash_max_size;
     ngx_uint_t                  hash_bucket_size;
+    ngx_flag_t                  hash_perfect;
 } ngx_http_map_conf_t;
 
 
@@ -69,6 +70,13 @@ static ngx_command_t  ngx_http_map_commands[] = {
       offsetof(ngx_http_map_conf_t, hash_bucket_size),
       NULL },
 
+    { ngx_string("map_hash_perfect"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_map_conf_t, hash_perfect),
+      NULL },
+
       ngx_null_command
 };
 
@@ -167,6 +175,7 @@ ngx_http_map_create_conf(ngx_conf_t *cf)
 
     mcf->hash_max_size = NGX_CONF_UNSET_UINT;
     mcf->hash_bucket_size = NGX_CONF_UNSET_UINT;
+    mcf->hash_perfect = NGX_CONF_UNSET;
 
     return mcf;
 }
@@ -178,6 +187,7 @@ ngx_http_map_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ngx_http_map_conf_t  *mcf = conf;
 
     char                              *rv;
+    ngx_int_t                          rc;
     ngx_str_t                         *value, name;
     ngx_conf_t                         save;
     ngx_pool_t                        *pool;
@@ -199,6 +209,10 @@ ngx_http_map_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
                                           ngx_cacheline_size);
     }
 
+    if (mcf->hash_perfect == NGX_CONF_UNSET) {
+        mcf->hash_perfect = 0;
+    }
+
     map = ngx_pcalloc(cf->pool, sizeof(ngx_http_map_ctx_t));
     if (map == NULL) {
         return NGX_CONF_ERROR;
@@ -302,9 +316,15 @@ ngx_http_map_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         hash.hash = &map->map.hash.hash;
         hash.temp_pool = NULL;
 
-        if (ngx_hash_init(&hash, ctx.keys.keys.elts, ctx.keys.keys.nelts)
-            != NGX_OK)
-        {
+        if (mcf->hash_perfect) {
+            rc = ngx_hash_perfect_init(&hash, ctx.keys.keys.elts,
+                                       ctx.keys.keys.nelts);
+
+        } else {
+            rc = ngx_hash_init(&hash, ctx.keys.keys.elts, ctx.keys.keys.nelts);
+        }
+
+        if (rc != NGX_OK) {
             ngx_destroy_pool(pool);
             return NGX_CONF_ERROR;
         }
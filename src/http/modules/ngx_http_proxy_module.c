@@ -100,6 +100,7 @@ typedef struct {
     ngx_str_t                      ssl_certificate;
     ngx_str_t                      ssl_certificate_key;
     ngx_array_t                   *ssl_passwords;
+    ngx_flag_t                     ssl_ktls;
 #endif
 } ngx_http_proxy_loc_conf_t;
 
@@ -123,6 +124,7 @@ static ngx_int_t ngx_http_proxy_eval(ngx_http_request_t *r,
     ngx_http_proxy_ctx_t *ctx, ngx_http_proxy_loc_conf_t *plcf);
 #if (NGX_HTTP_CACHE)
 static ngx_int_t ngx_http_proxy_create_key(ngx_http_request_t *r);
+static u_char *ngx_http_proxy_cache_range(ngx_http_request_t *r, u_char *p);
 #endif
 static ngx_int_t ngx_http_proxy_create_request(ngx_http_request_t *r);
 static ngx_int_t ngx_http_proxy_reinit_request(ngx_http_request_t *r);
@@ -310,6 +312,13 @@ static ngx_command_t  ngx_http_proxy_commands[] = {
       offsetof(ngx_http_proxy_loc_conf_t, upstream.request_buffering),
       NULL },
 
+    { ngx_string("proxy_splice"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_proxy_loc_conf_t, upstream.splice),
+      NULL },
+
     { ngx_string("proxy_ignore_client_abort"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
       ngx_conf_set_flag_slot,
@@ -487,6 +496,27 @@ static ngx_command_t  ngx_http_proxy_commands[] = {
       offsetof(ngx_http_proxy_loc_conf_t, upstream.no_cache),
       NULL },
 
+    { ngx_string("proxy_cache_purge"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+      ngx_http_set_predicate_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_proxy_loc_conf_t, upstream.cache_purge),
+      NULL },
+
+    { ngx_string("proxy_cache_purge_tags"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_set_complex_value_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_proxy_loc_conf_t, upstream.cache_purge_tags),
+      NULL },
+
+    { ngx_string("proxy_cache_tags"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_set_complex_value_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_proxy_loc_conf_t, upstream.cache_tags),
+      NULL },
+
     { ngx_string("proxy_cache_valid"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
       ngx_http_file_cache_valid_set_slot,
@@ -608,6 +638,13 @@ static ngx_command_t  ngx_http_proxy_commands[] = {
       offsetof(ngx_http_proxy_loc_conf_t, upstream.next_upstream_timeout),
       NULL },
 
+    { ngx_string("proxy_hedge"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+      ngx_http_upstream_hedge_set_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_proxy_loc_conf_t, upstream.hedge),
+      NULL },
+
     { ngx_string("proxy_pass_header"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_str_array_slot,
@@ -722,6 +759,13 @@ static ngx_command_t  ngx_http_proxy_commands[] = {
       0,
       NULL },
 
+    { ngx_string("proxy_ssl_ktls"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_proxy_loc_conf_t, ssl_ktls),
+      NULL },
+
 #endif
 
       ngx_null_command
@@ -893,6 +937,7 @@ ngx_http_proxy_handler(ngx_http_request_t *r)
 
     u->caches = &pmcf->caches;
     u->create_key = ngx_http_proxy_create_key;
+    u->cache_ranges = 1;
 #endif
 
     u->create_request = ngx_http_proxy_create_request;
@@ -1143,6 +1188,44 @@ ngx_http_proxy_create_key(ngx_http_request_t *r)
     return NGX_OK;
 }
 
+
+static u_char *
+ngx_http_proxy_cache_range(ngx_http_request_t *r, u_char *p)
+{
+    ngx_http_cache_t  *c;
+
+    c = r->cache;
+
+    p = ngx_sprintf(p, "Range: bytes=%O-", c->fill_start);
+
+    if (c->fill_end != -1) {
+        p = ngx_sprintf(p, "%O", c->fill_end - 1);
+    }
+
+    *p++ = CR; *p++ = LF;
+
+    if (!c->sparse) {
+        return p;
+    }
+
+    /* blocks being filled must be of the same response as those cached */
+
+    if (c->etag.len && ngx_strncmp(c->etag.data, "W/", 2) != 0) {
+        p = ngx_sprintf(p, "If-Range: %V" CRLF, &c->etag);
+
+    } else if (c->last_modified != -1) {
+        p = ngx_cpymem(p, "If-Range: ", sizeof("If-Range: ") - 1);
+        p = ngx_http_time(p, c->last_modified);
+        *p++ = CR; *p++ = LF;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http proxy cache range: %O-%O",
+                   c->fill_start, c->fill_end);
+
+    return p;
+}
+
 #endif
 
 
@@ -1308,6 +1391,16 @@ ngx_http_proxy_create_request(ngx_http_request_t *r)
         }
     }
 
+#if (NGX_HTTP_CACHE)
+
+    if (r->cache && r->cache->ranged) {
+        len += sizeof("Range: bytes=-" CRLF) - 1 + 2 * NGX_OFF_T_LEN
+               + sizeof("If-Range: " CRLF) - 1
+               + ngx_max(r->cache->etag.len,
+                         sizeof("Mon, 28 Sep 1970 06:00:00 GMT") - 1);
+    }
+
+#endif
 
     b = ngx_create_temp_buf(r->pool, len);
     if (b == NULL) {
@@ -1455,6 +1548,14 @@ ngx_http_proxy_create_request(ngx_http_request_t *r)
     }
 
 
+#if (NGX_HTTP_CACHE)
+
+    if (r->cache && r->cache->ranged) {
+        b->last = ngx_http_proxy_cache_range(r, b->last);
+    }
+
+#endif
+
     /* add "\r\n" at the header end */
     *b->last++ = CR; *b->last++ = LF;
 
@@ -1770,14 +1871,22 @@ ngx_http_proxy_process_status_line(ngx_http_request_t *r)
     u->headers_in.status_n = ctx->status.code;
 
     len = ctx->status.end - ctx->status.start;
-    u->headers_in.status_line.len = len;
 
-    u->headers_in.status_line.data = ngx_pnalloc(r->pool, len);
-    if (u->headers_in.status_line.data == NULL) {
-        return NGX_ERROR;
-    }
+    /*
+     * a status line without a reason phrase, as translated from HTTP/2,
+     * is left empty to send the standard one
+     */
 
-    ngx_memcpy(u->headers_in.status_line.data, ctx->status.start, len);
+    if (len > sizeof("000 ") - 1) {
+        u->headers_in.status_line.len = len;
+
+        u->headers_in.status_line.data = ngx_pnalloc(r->pool, len);
+        if (u->headers_in.status_line.data == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(u->headers_in.status_line.data, ctx->status.start, len);
+    }
 
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http proxy status %ui \"%V\"",
@@ -2000,6 +2109,10 @@ ngx_http_proxy_input_filter_init(void *data)
 
         u->pipe->length = u->headers_in.content_length_n;
         u->length = u->headers_in.content_length_n;
+
+        /* the body is copied as is, and may be spliced if unbuffered */
+
+        u->splice = u->conf->splice;
     }
 
     return NGX_OK;
@@ -2867,6 +2980,8 @@ ngx_http_proxy_create_loc_conf(ngx_conf_t *cf)
      *     conf->upstream.cache_zone = NULL;
      *     conf->upstream.cache_use_stale = 0;
      *     conf->upstream.cache_methods = 0;
+     *     conf->upstream.cache_tags = NULL;
+     *     conf->upstream.cache_purge_tags = NULL;
      *     conf->upstream.temp_path = NULL;
      *     conf->upstream.hide_headers_hash = { NULL, 0 };
      *     conf->upstream.store_lengths = NULL;
@@ -2901,10 +3016,12 @@ ngx_http_proxy_create_loc_conf(ngx_conf_t *cf)
     conf->upstream.next_upstream_tries = NGX_CONF_UNSET_UINT;
     conf->upstream.buffering = NGX_CONF_UNSET;
     conf->upstream.request_buffering = NGX_CONF_UNSET;
+    conf->upstream.splice = NGX_CONF_UNSET;
     conf->upstream.ignore_client_abort = NGX_CONF_UNSET;
     conf->upstream.force_ranges = NGX_CONF_UNSET;
 
     conf->upstream.local = NGX_CONF_UNSET_PTR;
+    conf->upstream.hedge = NGX_CONF_UNSET_PTR;
     conf->upstream.socket_keepalive = NGX_CONF_UNSET;
 
     conf->upstream.connect_timeout = NGX_CONF_UNSET_MSEC;
@@ -2929,6 +3046,7 @@ ngx_http_proxy_create_loc_conf(ngx_conf_t *cf)
     conf->upstream.cache_max_range_offset = NGX_CONF_UNSET;
     conf->upstream.cache_bypass = NGX_CONF_UNSET_PTR;
     conf->upstream.no_cache = NGX_CONF_UNSET_PTR;
+    conf->upstream.cache_purge = NGX_CONF_UNSET_PTR;
     conf->upstream.cache_valid = NGX_CONF_UNSET_PTR;
     conf->upstream.cache_lock = NGX_CONF_UNSET;
     conf->upstream.cache_lock_timeout = NGX_CONF_UNSET_MSEC;
@@ -2949,6 +3067,7 @@ ngx_http_proxy_create_loc_conf(ngx_conf_t *cf)
     conf->upstream.ssl_verify = NGX_CONF_UNSET;
     conf->ssl_verify_depth = NGX_CONF_UNSET_UINT;
     conf->ssl_passwords = NGX_CONF_UNSET_PTR;
+    conf->ssl_ktls = NGX_CONF_UNSET;
 #endif
 
     /* "proxy_cyclic_temp_file" is disabled */
@@ -3017,6 +3136,9 @@ ngx_http_proxy_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_value(conf->upstream.request_buffering,
                               prev->upstream.request_buffering, 1);
 
+    ngx_conf_merge_value(conf->upstream.splice,
+                              prev->upstream.splice, 0);
+
     ngx_conf_merge_value(conf->upstream.ignore_client_abort,
                               prev->upstream.ignore_client_abort, 0);
 
@@ -3026,6 +3148,12 @@ ngx_http_proxy_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_ptr_value(conf->upstream.local,
                               prev->upstream.local, NULL);
 
+    if (ngx_http_upstream_merge_hedge(cf, &conf->upstream, &prev->upstream)
+        != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
     ngx_conf_merge_value(conf->upstream.socket_keepalive,
                               prev->upstream.socket_keepalive, 0);
 
@@ -3222,6 +3350,17 @@ ngx_http_proxy_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_ptr_value(conf->upstream.no_cache,
                              prev->upstream.no_cache, NULL);
 
+    ngx_conf_merge_ptr_value(conf->upstream.cache_purge,
+                             prev->upstream.cache_purge, NULL);
+
+    if (conf->upstream.cache_tags == NULL) {
+        conf->upstream.cache_tags = prev->upstream.cache_tags;
+    }
+
+    if (conf->upstream.cache_purge_tags == NULL) {
+        conf->upstream.cache_purge_tags = prev->upstream.cache_purge_tags;
+    }
+
     ngx_conf_merge_ptr_value(conf->upstream.cache_valid,
                              prev->upstream.cache_valid, NULL);
 
@@ -3292,6 +3431,7 @@ ngx_http_proxy_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_str_value(conf->ssl_certificate_key,
                               prev->ssl_certificate_key, "");
     ngx_conf_merge_ptr_value(conf->ssl_passwords, prev->ssl_passwords, NULL);
+    ngx_conf_merge_value(conf->ssl_ktls, prev->ssl_ktls, 0);
 
     if (conf->ssl && ngx_http_proxy_set_ssl(cf, conf) != NGX_OK) {
         return NGX_CONF_ERROR;
@@ -4385,6 +4525,10 @@ ngx_http_proxy_set_ssl(ngx_conf_t *cf, ngx_http_proxy_loc_conf_t *plcf)
         }
     }
 
+    if (ngx_ssl_ktls(cf, plcf->upstream.ssl, plcf->ssl_ktls) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
     if (ngx_ssl_client_session_cache(cf, plcf->upstream.ssl,
                                      plcf->upstream.ssl_session_reuse)
         != NGX_OK)
@@ -25,6 +25,7 @@ typedef struct {
 typedef struct {
     ngx_http_complex_value_t            key;
     ngx_http_upstream_chash_points_t   *points;
+    ngx_uint_t                          bound;
 } ngx_http_upstream_hash_srv_conf_t;
 
 
@@ -58,6 +59,11 @@ static ngx_int_t ngx_http_upstream_init_chash_peer(ngx_http_request_t *r,
 static ngx_int_t ngx_http_upstream_get_chash_peer(ngx_peer_connection_t *pc,
     void *data);
 
+static ngx_int_t ngx_http_upstream_init_maglev(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_upstream_init_maglev_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us);
+
 static void *ngx_http_upstream_hash_create_conf(ngx_conf_t *cf);
 static char *ngx_http_upstream_hash(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
@@ -66,7 +72,7 @@ static char *ngx_http_upstream_hash(ngx_conf_t *cf, ngx_command_t *cmd,
 static ngx_command_t  ngx_http_upstream_hash_commands[] = {
 
     { ngx_string("hash"),
-      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE12,
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE123,
       ngx_http_upstream_hash,
       NGX_HTTP_SRV_CONF_OFFSET,
       0,
@@ -178,7 +184,9 @@ ngx_http_upstream_get_hash_peer(ngx_peer_connection_t *pc, void *data)
 
     ngx_http_upstream_rr_peers_rlock(hp->rrp.peers);
 
-    if (hp->tries > 20 || hp->rrp.peers->single || hp->key.len == 0) {
+    if (hp->tries > 20 || hp->rrp.peers->single || hp->key.len == 0
+        || ngx_http_upstream_rr_peers_changed(&hp->rrp))
+    {
         ngx_http_upstream_rr_peers_unlock(hp->rrp.peers);
         return hp->get_rr_peer(pc, &hp->rrp);
     }
@@ -233,7 +241,7 @@ ngx_http_upstream_get_hash_peer(ngx_peer_connection_t *pc, void *data)
         ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                        "get hash peer, value:%uD, peer:%ui", hp->hash, p);
 
-        if (peer->down) {
+        if (peer->down || peer->unhealthy) {
             ngx_http_upstream_rr_peer_unlock(hp->rrp.peers, peer);
             goto next;
         }
@@ -496,9 +504,10 @@ ngx_http_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
 
     time_t                              now;
     intptr_t                            m;
+    uint64_t                            limit;
     ngx_str_t                          *server;
     ngx_int_t                           total;
-    ngx_uint_t                          i, n, best_i;
+    ngx_uint_t                          i, n, best_i, conns;
     ngx_http_upstream_rr_peer_t        *peer, *best;
     ngx_http_upstream_chash_point_t    *point;
     ngx_http_upstream_chash_points_t   *points;
@@ -509,7 +518,9 @@ ngx_http_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
 
     ngx_http_upstream_rr_peers_wlock(hp->rrp.peers);
 
-    if (hp->tries > 20 || hp->rrp.peers->single || hp->key.len == 0) {
+    if (hp->tries > 20 || hp->rrp.peers->single || hp->key.len == 0
+        || ngx_http_upstream_rr_peers_changed(&hp->rrp))
+    {
         ngx_http_upstream_rr_peers_unlock(hp->rrp.peers);
         return hp->get_rr_peer(pc, &hp->rrp);
     }
@@ -523,6 +534,23 @@ ngx_http_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
     points = hcf->points;
     point = &points->point[0];
 
+    /*
+     * bounded loads: a peer may not have more than "bound" times
+     * its weighted share of active connections, including the new one
+     */
+
+    limit = 0;
+
+    if (hcf->bound) {
+        conns = 1;
+
+        for (peer = hp->rrp.peers->peer; peer; peer = peer->next) {
+            conns += peer->conns;
+        }
+
+        limit = (uint64_t) hcf->bound * conns;
+    }
+
     for ( ;; ) {
         server = point[hp->hash % points->number].server;
 
@@ -545,7 +573,7 @@ ngx_http_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
                 continue;
             }
 
-            if (peer->down) {
+            if (peer->down || peer->unhealthy) {
                 continue;
             }
 
@@ -560,6 +588,14 @@ ngx_http_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
                 continue;
             }
 
+            if (limit
+                && (uint64_t) (peer->conns + 1)
+                   * hp->rrp.peers->total_weight * 100
+                   > limit * peer->weight)
+            {
+                continue;
+            }
+
             if (peer->server.len != server->len
                 || ngx_strncmp(peer->server.data, server->data, server->len)
                    != 0)
@@ -619,6 +655,131 @@ found:
 }
 
 
+/*
+ * Maglev hashing: each server fills the lookup table in the order
+ * of its own permutation of the table slots, taking as many slots
+ * per round as its weight.  The table size is a prime, so the
+ * permutation (offset + j * skip) mod size visits every slot.
+ *
+ * The size only changes in large steps, as keys are remapped only
+ * when adding or removing servers keeps the size.
+ */
+
+static ngx_uint_t  ngx_http_upstream_maglev_sizes[] = {
+    1031, 2053, 4099, 8209, 16411, 32771, 65537, 131101, 262147, 524309,
+    1048583
+};
+
+
+static ngx_int_t
+ngx_http_upstream_init_maglev(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us)
+{
+    size_t                              size;
+    ngx_uint_t                          npoints, nfilled, i, k, w, *next,
+                                       *skip;
+    ngx_str_t                          *server;
+    ngx_http_upstream_rr_peer_t        *peer;
+    ngx_http_upstream_rr_peers_t       *peers;
+    ngx_http_upstream_chash_points_t   *points;
+    ngx_http_upstream_hash_srv_conf_t  *hcf;
+
+    if (ngx_http_upstream_init_round_robin(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    us->peer.init = ngx_http_upstream_init_maglev_peer;
+
+    peers = us->peer.data;
+
+    /* at least 100 slots per weight unit */
+
+    for (i = 0; i < sizeof(ngx_http_upstream_maglev_sizes)
+                    / sizeof(ngx_uint_t) - 1; i++)
+    {
+        if (ngx_http_upstream_maglev_sizes[i] >= peers->total_weight * 100) {
+            break;
+        }
+    }
+
+    npoints = ngx_http_upstream_maglev_sizes[i];
+
+    size = sizeof(ngx_http_upstream_chash_points_t)
+           + sizeof(ngx_http_upstream_chash_point_t) * (npoints - 1);
+
+    points = ngx_pcalloc(cf->pool, size);
+    if (points == NULL) {
+        return NGX_ERROR;
+    }
+
+    points->number = npoints;
+
+    next = ngx_palloc(cf->temp_pool, 2 * peers->number * sizeof(ngx_uint_t));
+    if (next == NULL) {
+        return NGX_ERROR;
+    }
+
+    skip = next + peers->number;
+
+    for (peer = peers->peer, k = 0; peer; peer = peer->next, k++) {
+        server = &peer->server;
+
+        next[k] = ngx_crc32_long(server->data, server->len) % npoints;
+        skip[k] = ngx_murmur_hash2(server->data, server->len)
+                  % (npoints - 1) + 1;
+    }
+
+    nfilled = 0;
+
+    for ( ;; ) {
+
+        for (peer = peers->peer, k = 0; peer; peer = peer->next, k++) {
+
+            for (w = 0; w < (ngx_uint_t) peer->weight; w++) {
+
+                do {
+                    i = next[k];
+                    next[k] = (next[k] + skip[k]) % npoints;
+                } while (points->point[i].server);
+
+                points->point[i].hash = i;
+                points->point[i].server = &peer->server;
+
+                if (++nfilled == npoints) {
+                    goto done;
+                }
+            }
+        }
+    }
+
+done:
+
+    hcf = ngx_http_conf_upstream_srv_conf(us, ngx_http_upstream_hash_module);
+    hcf->points = points;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_init_maglev_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_upstream_hash_peer_data_t  *hp;
+
+    if (ngx_http_upstream_init_hash_peer(r, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    r->upstream->peer.get = ngx_http_upstream_get_chash_peer;
+
+    hp = r->upstream->peer.data;
+
+    hp->hash = ngx_crc32_long(hp->key.data, hp->key.len);
+
+    return NGX_OK;
+}
+
+
 static void *
 ngx_http_upstream_hash_create_conf(ngx_conf_t *cf)
 {
@@ -630,6 +791,7 @@ ngx_http_upstream_hash_create_conf(ngx_conf_t *cf)
     }
 
     conf->points = NULL;
+    conf->bound = 0;
 
     return conf;
 }
@@ -640,6 +802,7 @@ ngx_http_upstream_hash(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
     ngx_http_upstream_hash_srv_conf_t  *hcf = conf;
 
+    ngx_int_t                          n;
     ngx_str_t                         *value;
     ngx_http_upstream_srv_conf_t      *uscf;
     ngx_http_compile_complex_value_t   ccv;
@@ -676,11 +839,34 @@ ngx_http_upstream_hash(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     } else if (ngx_strcmp(value[2].data, "consistent") == 0) {
         uscf->peer.init_upstream = ngx_http_upstream_init_chash;
 
+    } else if (ngx_strcmp(value[2].data, "maglev") == 0) {
+        uscf->peer.init_upstream = ngx_http_upstream_init_maglev;
+
     } else {
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "invalid parameter \"%V\"", &value[2]);
         return NGX_CONF_ERROR;
     }
 
+    if (cf->args->nelts == 3) {
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strncmp(value[3].data, "bounded=", 8) != 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[3]);
+        return NGX_CONF_ERROR;
+    }
+
+    n = ngx_atofp(value[3].data + 8, value[3].len - 8, 2);
+
+    if (n < 100) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid load bound \"%V\"", &value[3]);
+        return NGX_CONF_ERROR;
+    }
+
+    hcf->bound = n;
+
     return NGX_CONF_OK;
 }
@@ -0,0 +1,939 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#define NGX_HTTP_UPSTREAM_HC_TCP    1
+#define NGX_HTTP_UPSTREAM_HC_HTTP   2
+
+#define NGX_HTTP_UPSTREAM_HC_BUFFER_SIZE  4096
+
+
+typedef struct {
+    ngx_msec_t                         interval;
+    ngx_msec_t                         timeout;
+    ngx_uint_t                         fails;
+    ngx_uint_t                         passes;
+    in_port_t                          port;
+    ngx_uint_t                         type;
+    ngx_str_t                          uri;
+    ngx_uint_t                         status_min;
+    ngx_uint_t                         status_max;
+    ngx_str_t                          body;
+} ngx_http_upstream_hc_srv_conf_t;
+
+
+typedef struct {
+    ngx_event_t                        event;
+    ngx_http_upstream_srv_conf_t      *upstream;
+    ngx_http_upstream_hc_srv_conf_t   *conf;
+} ngx_http_upstream_hc_timer_t;
+
+
+typedef struct {
+    ngx_pool_t                        *pool;
+    ngx_peer_connection_t              pc;
+    ngx_str_t                          name;
+    ngx_http_upstream_srv_conf_t      *upstream;
+    ngx_http_upstream_hc_srv_conf_t   *conf;
+    ngx_http_upstream_rr_peers_t      *peers;
+    ngx_http_upstream_rr_peer_t       *peer;
+    ngx_buf_t                         *request;
+    ngx_buf_t                         *response;
+    unsigned                           connected:1;
+} ngx_http_upstream_hc_probe_t;
+
+
+static void ngx_http_upstream_hc_timer_handler(ngx_event_t *ev);
+static void ngx_http_upstream_hc_start(ngx_http_upstream_hc_timer_t *timer,
+    ngx_http_upstream_rr_peers_t *peers, ngx_http_upstream_rr_peer_t *peer);
+static void ngx_http_upstream_hc_write_handler(ngx_event_t *wev);
+static void ngx_http_upstream_hc_read_handler(ngx_event_t *rev);
+static ngx_int_t ngx_http_upstream_hc_test_connect(ngx_connection_t *c);
+static char *ngx_http_upstream_hc_check_response(
+    ngx_http_upstream_hc_probe_t *probe);
+static void ngx_http_upstream_hc_finalize(ngx_http_upstream_hc_probe_t *probe,
+    char *error);
+static u_char *ngx_http_upstream_hc_log_error(ngx_log_t *log, u_char *buf,
+    size_t len);
+
+static void *ngx_http_upstream_hc_create_conf(ngx_conf_t *cf);
+static char *ngx_http_upstream_hc(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static ngx_int_t ngx_http_upstream_hc_postconfiguration(ngx_conf_t *cf);
+static ngx_int_t ngx_http_upstream_hc_init_process(ngx_cycle_t *cycle);
+
+
+static ngx_command_t  ngx_http_upstream_hc_commands[] = {
+
+    { ngx_string("health_check"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_ANY,
+      ngx_http_upstream_hc,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_upstream_hc_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    ngx_http_upstream_hc_postconfiguration, /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_http_upstream_hc_create_conf,      /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_upstream_hc_module = {
+    NGX_MODULE_V1,
+    &ngx_http_upstream_hc_module_ctx,      /* module context */
+    ngx_http_upstream_hc_commands,         /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    ngx_http_upstream_hc_init_process,     /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+/*
+ * Each worker runs a timer for every upstream with health checks.
+ * The time of the next check of a peer is kept in the upstream zone,
+ * so a peer is probed by only one worker per interval, and the result
+ * is seen by all workers.
+ */
+
+static void
+ngx_http_upstream_hc_timer_handler(ngx_event_t *ev)
+{
+    ngx_msec_t                        now;
+    ngx_uint_t                        start;
+    ngx_http_upstream_rr_peer_t      *peer;
+    ngx_http_upstream_rr_peers_t     *peers;
+    ngx_http_upstream_hc_timer_t     *timer;
+    ngx_http_upstream_hc_srv_conf_t  *hccf;
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    timer = ev->data;
+    hccf = timer->conf;
+
+    now = ngx_current_msec;
+
+    for (peers = timer->upstream->peer.data; peers; peers = peers->next) {
+
+        ngx_http_upstream_rr_peers_rlock(peers);
+
+        for (peer = peers->peer; peer; peer = peer->next) {
+
+            if (peer->down) {
+                continue;
+            }
+
+            start = 0;
+
+            ngx_http_upstream_rr_peer_lock(peers, peer);
+
+            if ((ngx_msec_int_t) (now - peer->hc_next) >= 0) {
+                peer->hc_next = now + hccf->interval;
+
+                /* keeps the peer if it is removed by resolving */
+                peer->refs++;
+
+                start = 1;
+            }
+
+            ngx_http_upstream_rr_peer_unlock(peers, peer);
+
+            if (start) {
+                ngx_http_upstream_hc_start(timer, peers, peer);
+            }
+        }
+
+        ngx_http_upstream_rr_peers_unlock(peers);
+    }
+
+    ngx_add_timer(ev, ngx_min(hccf->interval, 1000));
+}
+
+
+/*
+ * Probes are sent in plain text even if the upstream is proxied to
+ * over SSL, as an upstream block does not know how it is used; servers
+ * which accept SSL only are checked with "type=tcp", or on a plain text
+ * port set with "port=".
+ */
+
+static void
+ngx_http_upstream_hc_start(ngx_http_upstream_hc_timer_t *timer,
+    ngx_http_upstream_rr_peers_t *peers, ngx_http_upstream_rr_peer_t *peer)
+{
+    u_char                           *p;
+    ngx_int_t                         rc;
+    ngx_log_t                        *log;
+    ngx_pool_t                       *pool;
+    ngx_connection_t                 *c;
+    ngx_http_upstream_hc_probe_t     *probe;
+    ngx_http_upstream_hc_srv_conf_t  *hccf;
+
+    hccf = timer->conf;
+
+    pool = ngx_create_pool(1024, ngx_cycle->log);
+    if (pool == NULL) {
+        goto failed;
+    }
+
+    probe = ngx_pcalloc(pool, sizeof(ngx_http_upstream_hc_probe_t));
+    if (probe == NULL) {
+        goto failed;
+    }
+
+    probe->pool = pool;
+    probe->upstream = timer->upstream;
+    probe->conf = hccf;
+    probe->peers = peers;
+    probe->peer = peer;
+
+    probe->name.len = peer->name.len;
+    probe->name.data = ngx_pstrdup(pool, &peer->name);
+    if (probe->name.data == NULL) {
+        goto failed;
+    }
+
+    log = ngx_palloc(pool, sizeof(ngx_log_t));
+    if (log == NULL) {
+        goto failed;
+    }
+
+    *log = *ngx_cycle->log;
+
+    log->handler = ngx_http_upstream_hc_log_error;
+    log->data = probe;
+    log->action = "checking health";
+
+    pool->log = log;
+
+    probe->pc.sockaddr = ngx_palloc(pool, peer->socklen);
+    if (probe->pc.sockaddr == NULL) {
+        goto failed;
+    }
+
+    ngx_memcpy(probe->pc.sockaddr, peer->sockaddr, peer->socklen);
+    probe->pc.socklen = peer->socklen;
+
+    if (hccf->port) {
+        ngx_inet_set_port(probe->pc.sockaddr, hccf->port);
+    }
+
+    probe->pc.name = &probe->name;
+    probe->pc.get = ngx_event_get_peer;
+    probe->pc.log = log;
+    probe->pc.log_error = NGX_ERROR_ERR;
+
+    if (hccf->type == NGX_HTTP_UPSTREAM_HC_HTTP) {
+        probe->request = ngx_create_temp_buf(pool,
+                                 sizeof("GET  HTTP/1.0" CRLF) - 1
+                                 + hccf->uri.len
+                                 + sizeof("Host: " CRLF) - 1 + peer->server.len
+                                 + sizeof("Connection: close" CRLF CRLF) - 1);
+        if (probe->request == NULL) {
+            goto failed;
+        }
+
+        p = probe->request->last;
+
+        p = ngx_cpymem(p, "GET ", sizeof("GET ") - 1);
+        p = ngx_cpymem(p, hccf->uri.data, hccf->uri.len);
+        p = ngx_cpymem(p, " HTTP/1.0" CRLF "Host: ",
+                       sizeof(" HTTP/1.0" CRLF "Host: ") - 1);
+        p = ngx_cpymem(p, peer->server.data, peer->server.len);
+        p = ngx_cpymem(p, CRLF "Connection: close" CRLF CRLF,
+                       sizeof(CRLF "Connection: close" CRLF CRLF) - 1);
+
+        probe->request->last = p;
+
+        probe->response = ngx_create_temp_buf(pool,
+                                            NGX_HTTP_UPSTREAM_HC_BUFFER_SIZE);
+        if (probe->response == NULL) {
+            goto failed;
+        }
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "http upstream health check: %V", &probe->name);
+
+    rc = ngx_event_connect_peer(&probe->pc);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        ngx_http_upstream_hc_finalize(probe, "connect() failed");
+        return;
+    }
+
+    /* rc == NGX_OK || rc == NGX_AGAIN */
+
+    c = probe->pc.connection;
+
+    c->data = probe;
+    c->pool = pool;
+
+    c->read->handler = ngx_http_upstream_hc_read_handler;
+    c->write->handler = ngx_http_upstream_hc_write_handler;
+
+    ngx_add_timer(c->write, hccf->timeout);
+
+    if (rc == NGX_OK) {
+        probe->connected = 1;
+        ngx_http_upstream_hc_write_handler(c->write);
+    }
+
+    return;
+
+failed:
+
+    ngx_http_upstream_rr_peer_lock(peers, peer);
+    peer->refs--;
+    ngx_http_upstream_rr_peer_unlock(peers, peer);
+
+    if (pool) {
+        ngx_destroy_pool(pool);
+    }
+}
+
+
+static void
+ngx_http_upstream_hc_write_handler(ngx_event_t *wev)
+{
+    ssize_t                        n;
+    ngx_buf_t                     *b;
+    ngx_connection_t              *c;
+    ngx_http_upstream_hc_probe_t  *probe;
+
+    c = wev->data;
+    probe = c->data;
+
+    if (wev->timedout) {
+        ngx_http_upstream_hc_finalize(probe, "timed out");
+        return;
+    }
+
+    if (!probe->connected) {
+        if (ngx_http_upstream_hc_test_connect(c) != NGX_OK) {
+            ngx_http_upstream_hc_finalize(probe, "connect() failed");
+            return;
+        }
+
+        probe->connected = 1;
+    }
+
+    if (probe->request == NULL) {
+
+        /* NGX_HTTP_UPSTREAM_HC_TCP */
+
+        ngx_http_upstream_hc_finalize(probe, NULL);
+        return;
+    }
+
+    b = probe->request;
+
+    while (b->pos < b->last) {
+
+        n = c->send(c, b->pos, b->last - b->pos);
+
+        if (n == NGX_ERROR) {
+            ngx_http_upstream_hc_finalize(probe, "send() failed");
+            return;
+        }
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+                ngx_http_upstream_hc_finalize(probe, "send() failed");
+            }
+
+            return;
+        }
+
+        b->pos += n;
+    }
+
+    if (wev->timer_set) {
+        ngx_del_timer(wev);
+    }
+
+    wev->handler = ngx_http_empty_handler;
+
+    ngx_add_timer(c->read, probe->conf->timeout);
+
+    if (c->read->ready) {
+        ngx_http_upstream_hc_read_handler(c->read);
+        return;
+    }
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        ngx_http_upstream_hc_finalize(probe, "recv() failed");
+    }
+}
+
+
+static void
+ngx_http_upstream_hc_read_handler(ngx_event_t *rev)
+{
+    ssize_t                        n;
+    ngx_buf_t                     *b;
+    ngx_connection_t              *c;
+    ngx_http_upstream_hc_probe_t  *probe;
+
+    c = rev->data;
+    probe = c->data;
+
+    if (rev->timedout) {
+        ngx_http_upstream_hc_finalize(probe, "timed out");
+        return;
+    }
+
+    if (!probe->connected) {
+        if (ngx_http_upstream_hc_test_connect(c) != NGX_OK) {
+            ngx_http_upstream_hc_finalize(probe, "connect() failed");
+            return;
+        }
+
+        probe->connected = 1;
+    }
+
+    if (probe->response == NULL) {
+
+        /* the response is not expected yet */
+
+        if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+            ngx_http_upstream_hc_finalize(probe, "recv() failed");
+        }
+
+        return;
+    }
+
+    b = probe->response;
+
+    while (b->last < b->end) {
+
+        n = c->recv(c, b->last, b->end - b->last);
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+                ngx_http_upstream_hc_finalize(probe, "recv() failed");
+            }
+
+            return;
+        }
+
+        if (n == NGX_ERROR) {
+            ngx_http_upstream_hc_finalize(probe, "recv() failed");
+            return;
+        }
+
+        if (n == 0) {
+            break;
+        }
+
+        b->last += n;
+    }
+
+    ngx_http_upstream_hc_finalize(probe,
+                                  ngx_http_upstream_hc_check_response(probe));
+}
+
+
+static ngx_int_t
+ngx_http_upstream_hc_test_connect(ngx_connection_t *c)
+{
+    int        err;
+    socklen_t  len;
+
+#if (NGX_HAVE_KQUEUE)
+
+    if (ngx_event_flags & NGX_USE_KQUEUE_EVENT)  {
+        if (c->write->pending_eof || c->read->pending_eof) {
+            if (c->write->pending_eof) {
+                err = c->write->kq_errno;
+
+            } else {
+                err = c->read->kq_errno;
+            }
+
+            (void) ngx_connection_error(c, err,
+                                    "kevent() reported that connect() failed");
+            return NGX_ERROR;
+        }
+
+    } else
+#endif
+    {
+        err = 0;
+        len = sizeof(int);
+
+        /*
+         * BSDs and Linux return 0 and set a pending error in err
+         * Solaris returns -1 and sets errno
+         */
+
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len)
+            == -1)
+        {
+            err = ngx_socket_errno;
+        }
+
+        if (err) {
+            (void) ngx_connection_error(c, err, "connect() failed");
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static char *
+ngx_http_upstream_hc_check_response(ngx_http_upstream_hc_probe_t *probe)
+{
+    u_char                           *p, *last;
+    ngx_buf_t                        *b;
+    ngx_uint_t                        status;
+    ngx_http_upstream_hc_srv_conf_t  *hccf;
+
+    hccf = probe->conf;
+    b = probe->response;
+
+    /* "HTTP/1.x NNN" */
+
+    if (b->last - b->pos < 12
+        || ngx_strncmp(b->pos, "HTTP/1.", sizeof("HTTP/1.") - 1) != 0
+        || b->pos[8] != ' ')
+    {
+        return "invalid response";
+    }
+
+    p = b->pos + 9;
+
+    if (p[0] < '1' || p[0] > '9'
+        || p[1] < '0' || p[1] > '9'
+        || p[2] < '0' || p[2] > '9')
+    {
+        return "invalid response";
+    }
+
+    status = (p[0] - '0') * 100 + (p[1] - '0') * 10 + (p[2] - '0');
+
+    if (status < hccf->status_min || status > hccf->status_max) {
+        ngx_log_error(NGX_LOG_INFO, probe->pool->log, 0,
+                      "health check returned status %ui", status);
+        return "unexpected status";
+    }
+
+    if (hccf->body.len == 0) {
+        return NULL;
+    }
+
+    last = b->last;
+
+    p = ngx_strlcasestrn(b->pos, last, (u_char *) CRLF CRLF,
+                         sizeof(CRLF CRLF) - 2);
+    if (p == NULL) {
+        return "invalid response";
+    }
+
+    p += sizeof(CRLF CRLF) - 1;
+
+    for ( /* void */ ; last - p >= (ssize_t) hccf->body.len; p++) {
+        if (ngx_memcmp(p, hccf->body.data, hccf->body.len) == 0) {
+            return NULL;
+        }
+    }
+
+    return "body does not match";
+}
+
+
+static void
+ngx_http_upstream_hc_finalize(ngx_http_upstream_hc_probe_t *probe,
+    char *error)
+{
+    ngx_log_t                        *log;
+    ngx_http_upstream_rr_peer_t      *peer;
+    ngx_http_upstream_rr_peers_t     *peers;
+    ngx_http_upstream_hc_srv_conf_t  *hccf;
+
+    log = probe->pool->log;
+    hccf = probe->conf;
+    peers = probe->peers;
+    peer = probe->peer;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "http upstream health check: %V %s",
+                   &probe->name, error ? error : "passed");
+
+    ngx_http_upstream_rr_peers_rlock(peers);
+    ngx_http_upstream_rr_peer_lock(peers, peer);
+
+    peer->refs--;
+
+    if (error == NULL) {
+        peer->hc_fails = 0;
+
+        if (peer->unhealthy && ++peer->hc_passes >= hccf->passes) {
+            peer->unhealthy = 0;
+            peer->hc_passes = 0;
+            peer->fails = 0;
+
+            ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                          "upstream server became healthy");
+        }
+
+    } else {
+        peer->hc_passes = 0;
+
+        if (!peer->unhealthy && ++peer->hc_fails >= hccf->fails) {
+            peer->unhealthy = 1;
+            peer->hc_fails = 0;
+
+            ngx_log_error(NGX_LOG_WARN, log, 0,
+                          "upstream server became unhealthy: %s", error);
+        }
+    }
+
+    ngx_http_upstream_rr_peer_unlock(peers, peer);
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    if (probe->pc.connection) {
+        ngx_close_connection(probe->pc.connection);
+    }
+
+    ngx_destroy_pool(probe->pool);
+}
+
+
+static u_char *
+ngx_http_upstream_hc_log_error(ngx_log_t *log, u_char *buf, size_t len)
+{
+    u_char                        *p;
+    ngx_http_upstream_hc_probe_t  *probe;
+
+    p = buf;
+
+    if (log->action) {
+        p = ngx_snprintf(buf, len, " while %s", log->action);
+        len -= p - buf;
+        buf = p;
+    }
+
+    probe = log->data;
+
+    p = ngx_snprintf(buf, len, ", upstream: \"%V\", peer: %V",
+                     &probe->upstream->host, &probe->name);
+
+    return p;
+}
+
+
+static void *
+ngx_http_upstream_hc_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_upstream_hc_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_hc_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->interval = 0;
+     *     conf->port = 0;
+     *     conf->type = 0;
+     *     conf->uri = { 0, NULL };
+     *     conf->body = { 0, NULL };
+     */
+
+    return conf;
+}
+
+
+static char *
+ngx_http_upstream_hc(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_upstream_hc_srv_conf_t  *hccf = conf;
+
+    u_char      *p;
+    ngx_int_t    n, m;
+    ngx_str_t   *value, s;
+    ngx_uint_t   i;
+
+    if (hccf->interval) {
+        return "is duplicate";
+    }
+
+    hccf->interval = 5000;
+    hccf->timeout = 1000;
+    hccf->fails = 1;
+    hccf->passes = 1;
+    hccf->type = NGX_HTTP_UPSTREAM_HC_HTTP;
+    ngx_str_set(&hccf->uri, "/");
+    hccf->status_min = 200;
+    hccf->status_max = 399;
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = &value[i].data[9];
+
+            hccf->interval = ngx_parse_time(&s, 0);
+            if (hccf->interval == (ngx_msec_t) NGX_ERROR
+                || hccf->interval == 0)
+            {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
+
+            s.len = value[i].len - 8;
+            s.data = &value[i].data[8];
+
+            hccf->timeout = ngx_parse_time(&s, 0);
+            if (hccf->timeout == (ngx_msec_t) NGX_ERROR
+                || hccf->timeout == 0)
+            {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "fails=", 6) == 0) {
+
+            n = ngx_atoi(&value[i].data[6], value[i].len - 6);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            hccf->fails = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "passes=", 7) == 0) {
+
+            n = ngx_atoi(&value[i].data[7], value[i].len - 7);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            hccf->passes = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "port=", 5) == 0) {
+
+            n = ngx_atoi(&value[i].data[5], value[i].len - 5);
+            if (n < 1 || n > 65535) {
+                goto invalid;
+            }
+
+            hccf->port = (in_port_t) n;
+
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "type=tcp") == 0) {
+            hccf->type = NGX_HTTP_UPSTREAM_HC_TCP;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "type=http") == 0) {
+            hccf->type = NGX_HTTP_UPSTREAM_HC_HTTP;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "uri=", 4) == 0) {
+
+            hccf->uri.len = value[i].len - 4;
+            hccf->uri.data = &value[i].data[4];
+
+            if (hccf->uri.len == 0 || hccf->uri.data[0] != '/') {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "status=", 7) == 0) {
+
+            s.len = value[i].len - 7;
+            s.data = &value[i].data[7];
+
+            p = ngx_strlchr(s.data, s.data + s.len, '-');
+
+            if (p) {
+                n = ngx_atoi(s.data, p - s.data);
+                m = ngx_atoi(p + 1, s.data + s.len - p - 1);
+
+            } else {
+                n = ngx_atoi(s.data, s.len);
+                m = n;
+            }
+
+            if (n < 100 || m > 999 || n > m) {
+                goto invalid;
+            }
+
+            hccf->status_min = n;
+            hccf->status_max = m;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "body=", 5) == 0) {
+
+            hccf->body.len = value[i].len - 5;
+            hccf->body.data = &value[i].data[5];
+
+            if (hccf->body.len == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_hc_postconfiguration(ngx_conf_t *cf)
+{
+    ngx_uint_t                        i;
+    ngx_http_upstream_srv_conf_t    **uscfp;
+    ngx_http_upstream_main_conf_t    *umcf;
+    ngx_http_upstream_hc_srv_conf_t  *hccf;
+
+    umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        hccf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                               ngx_http_upstream_hc_module);
+
+        if (hccf->interval == 0 || uscfp[i]->shm_zone) {
+            continue;
+        }
+
+        ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                      "\"health_check\" requires \"zone\" in upstream \"%V\" "
+                      "in %s:%ui",
+                      &uscfp[i]->host, uscfp[i]->file_name, uscfp[i]->line);
+
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_hc_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                        i;
+    ngx_http_upstream_srv_conf_t    **uscfp;
+    ngx_http_upstream_hc_timer_t     *timer;
+    ngx_http_upstream_main_conf_t    *umcf;
+    ngx_http_upstream_hc_srv_conf_t  *hccf;
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+
+    if (umcf == NULL) {
+        return NGX_OK;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        hccf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                               ngx_http_upstream_hc_module);
+
+        if (hccf->interval == 0) {
+            continue;
+        }
+
+        timer = ngx_pcalloc(cycle->pool, sizeof(ngx_http_upstream_hc_timer_t));
+        if (timer == NULL) {
+            return NGX_ERROR;
+        }
+
+        timer->upstream = uscfp[i];
+        timer->conf = hccf;
+
+        timer->event.handler = ngx_http_upstream_hc_timer_handler;
+        timer->event.data = timer;
+        timer->event.log = cycle->log;
+        timer->event.cancelable = 1;
+
+        /* spread the checks of different workers */
+
+        ngx_add_timer(&timer->event,
+                      ngx_random() % ngx_min(hccf->interval, 1000) + 1);
+    }
+
+    return NGX_OK;
+}
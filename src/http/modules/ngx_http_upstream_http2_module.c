@@ -0,0 +1,3544 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#define NGX_HTTP_UPSTREAM_HTTP2_PREFACE    "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+
+/* error codes */
+#define NGX_HTTP_UPSTREAM_HTTP2_NO_ERROR           0x0
+#define NGX_HTTP_UPSTREAM_HTTP2_PROTOCOL_ERROR     0x1
+#define NGX_HTTP_UPSTREAM_HTTP2_FLOW_CTRL_ERROR    0x3
+#define NGX_HTTP_UPSTREAM_HTTP2_CANCEL             0x8
+
+/* settings fields */
+#define NGX_HTTP_UPSTREAM_HTTP2_HEADER_TABLE_SIZE  0x1
+#define NGX_HTTP_UPSTREAM_HTTP2_ENABLE_PUSH        0x2
+#define NGX_HTTP_UPSTREAM_HTTP2_MAX_STREAMS        0x3
+#define NGX_HTTP_UPSTREAM_HTTP2_INIT_WINDOW_SIZE   0x4
+#define NGX_HTTP_UPSTREAM_HTTP2_MAX_FRAME_SIZE     0x5
+
+#define NGX_HTTP_UPSTREAM_HTTP2_SETTINGS_PARAM_SIZE  6
+
+/* the HPACK tables as defined in ngx_http_v2_table.c */
+#define NGX_HTTP_UPSTREAM_HTTP2_TABLE_SIZE         4096
+#define NGX_HTTP_UPSTREAM_HTTP2_STATIC_TABLE_ENTRIES  61
+
+/* stream receive window, limits response data buffered per stream */
+#define NGX_HTTP_UPSTREAM_HTTP2_WINDOW             (256 * 1024)
+
+#define NGX_HTTP_UPSTREAM_HTTP2_BUFFER_SIZE                                   \
+    (NGX_HTTP_V2_FRAME_HEADER_SIZE + NGX_HTTP_V2_DEFAULT_FRAME_SIZE)
+
+#define NGX_HTTP_UPSTREAM_HTTP2_MAX_BLOCK          (1024 * 1024)
+
+#define NGX_HTTP_UPSTREAM_HTTP2_MAX_SID            0x7fffffff
+
+/* request header encoding */
+#define NGX_HTTP_UPSTREAM_HTTP2_INDEX              1
+#define NGX_HTTP_UPSTREAM_HTTP2_NEVER_INDEX        2
+
+
+typedef struct ngx_http_upstream_http2_session_s
+    ngx_http_upstream_http2_session_t;
+typedef struct ngx_http_upstream_http2_stream_s
+    ngx_http_upstream_http2_stream_t;
+typedef struct ngx_http_upstream_http2_frame_s
+    ngx_http_upstream_http2_frame_t;
+typedef struct ngx_http_upstream_http2_in_s
+    ngx_http_upstream_http2_in_t;
+
+
+typedef struct {
+    ngx_uint_t                         streams;
+    ngx_msec_t                         timeout;
+
+    ngx_http_upstream_srv_conf_t      *upstream;
+
+    /* sessions of a worker process */
+    ngx_queue_t                        sessions;
+
+    ngx_http_upstream_init_pt          original_init_upstream;
+    ngx_http_upstream_init_peer_pt     original_init_peer;
+
+} ngx_http_upstream_http2_srv_conf_t;
+
+
+struct ngx_http_upstream_http2_frame_s {
+    ngx_http_upstream_http2_frame_t   *next;
+    ngx_chain_t                        chain;
+    ngx_buf_t                          buf;
+};
+
+
+struct ngx_http_upstream_http2_in_s {
+    ngx_http_upstream_http2_in_t      *next;
+    u_char                            *pos;
+    u_char                            *last;
+    ngx_uint_t                         data;    /* unsigned  data:1; */
+};
+
+
+struct ngx_http_upstream_http2_session_s {
+    ngx_http_upstream_http2_srv_conf_t  *conf;
+
+    ngx_queue_t                        queue;
+    ngx_connection_t                  *connection;
+    ngx_log_t                          log;
+
+    socklen_t                          socklen;
+    ngx_sockaddr_t                     sockaddr;
+    ngx_str_t                          name;
+
+#if (NGX_HTTP_SSL)
+    ngx_ssl_t                         *ssl;
+    ngx_str_t                          ssl_name;
+    ngx_flag_t                         ssl_server_name;
+    ngx_flag_t                         ssl_verify;
+#endif
+
+    ngx_queue_t                        streams;
+    ngx_uint_t                         nstreams;
+    ngx_uint_t                         max_streams;
+    ngx_uint_t                         next_sid;
+    ngx_uint_t                         last_sid;
+
+    size_t                             frame_size;
+    size_t                             init_window;
+    ssize_t                            send_window;
+    size_t                             recv_window;
+
+    /* HPACK state, reusing the tables of the HTTP/2 server */
+    ngx_http_v2_connection_t           decoder;
+    ngx_http_v2_connection_t           encoder;
+
+    u_char                            *buffer;
+    size_t                             buffered;
+
+    u_char                            *block;
+    size_t                             block_len;
+    size_t                             block_size;
+    ngx_uint_t                         block_sid;
+    ngx_uint_t                         block_flags;
+
+    ngx_http_upstream_http2_frame_t   *out;
+    ngx_http_upstream_http2_frame_t   *last;
+
+    unsigned                           connected:1;
+    unsigned                           goaway:1;
+    unsigned                           no_index:1;
+    unsigned                           table_update:1;
+};
+
+
+struct ngx_http_upstream_http2_stream_s {
+    /* the connection seen by the upstream module */
+    ngx_connection_t                   connection;
+    ngx_event_t                        read;
+    ngx_event_t                        write;
+
+    ngx_http_upstream_http2_session_t *session;
+    ngx_http_request_t                *request;
+
+    ngx_queue_t                        queue;
+    ngx_uint_t                         sid;
+
+    ssize_t                            send_window;
+    size_t                             recv_window;
+    size_t                             buffered;
+
+    u_char                            *head;
+    size_t                             head_len;
+    size_t                             head_size;
+    ngx_uint_t                         line;
+
+    off_t                              rest;
+    ngx_http_chunked_t                 chunked;
+
+    ngx_http_upstream_http2_in_t      *in;
+    ngx_http_upstream_http2_in_t      *in_last;
+
+    unsigned                           header_sent:1;
+    unsigned                           body:1;
+    unsigned                           chunked_body:1;
+    unsigned                           end_stream:1;
+    unsigned                           header_done:1;
+    unsigned                           eof:1;
+    unsigned                           reset:1;
+    unsigned                           error:1;
+    unsigned                           blocked:1;
+};
+
+
+typedef struct {
+    ngx_http_upstream_http2_srv_conf_t  *conf;
+
+    ngx_http_request_t                *request;
+    ngx_http_upstream_t               *upstream;
+    ngx_http_upstream_http2_stream_t  *stream;
+
+    void                              *data;
+
+    ngx_event_get_peer_pt              original_get_peer;
+    ngx_event_free_peer_pt             original_free_peer;
+
+} ngx_http_upstream_http2_peer_data_t;
+
+
+#define ngx_http_upstream_http2_stream(c)                                     \
+    ((ngx_http_upstream_http2_stream_t *) ((u_char *) (c)                     \
+          - offsetof(ngx_http_upstream_http2_stream_t, connection)))
+
+
+static ngx_int_t ngx_http_upstream_init_http2_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_upstream_get_http2_peer(ngx_peer_connection_t *pc,
+    void *data);
+static void ngx_http_upstream_free_http2_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
+
+static ngx_http_upstream_http2_session_t *ngx_http_upstream_http2_session(
+    ngx_http_upstream_http2_peer_data_t *hp, ngx_peer_connection_t *pc);
+#if (NGX_HTTP_SSL)
+static ngx_int_t ngx_http_upstream_http2_ssl_name(ngx_http_request_t *r,
+    ngx_http_upstream_t *u, ngx_str_t *name);
+#endif
+static void ngx_http_upstream_http2_connect_handler(ngx_event_t *ev);
+#if (NGX_HTTP_SSL)
+static void ngx_http_upstream_http2_ssl_handshake(ngx_connection_t *c);
+#endif
+static void ngx_http_upstream_http2_connected(
+    ngx_http_upstream_http2_session_t *s);
+static void ngx_http_upstream_http2_idle(ngx_http_upstream_http2_session_t *s);
+static void ngx_http_upstream_http2_close_session(
+    ngx_http_upstream_http2_session_t *s);
+static ngx_int_t ngx_http_upstream_http2_test_connect(ngx_connection_t *c);
+static u_char *ngx_http_upstream_http2_log_error(ngx_log_t *log, u_char *buf,
+    size_t len);
+
+static void ngx_http_upstream_http2_read_handler(ngx_event_t *rev);
+static void ngx_http_upstream_http2_write_handler(ngx_event_t *wev);
+static ngx_int_t ngx_http_upstream_http2_send(
+    ngx_http_upstream_http2_session_t *s);
+static ngx_int_t ngx_http_upstream_http2_process_frame(
+    ngx_http_upstream_http2_session_t *s, ngx_uint_t type, ngx_uint_t flags,
+    ngx_uint_t sid, u_char *pos, size_t len);
+static ngx_int_t ngx_http_upstream_http2_process_data(
+    ngx_http_upstream_http2_session_t *s, ngx_uint_t flags,
+    ngx_http_upstream_http2_stream_t *st, u_char *pos, size_t len);
+static ngx_int_t ngx_http_upstream_http2_process_headers(
+    ngx_http_upstream_http2_session_t *s, ngx_http_upstream_http2_stream_t *st,
+    ngx_uint_t flags);
+static ngx_int_t ngx_http_upstream_http2_process_settings(
+    ngx_http_upstream_http2_session_t *s, u_char *pos, size_t len);
+static ngx_int_t ngx_http_upstream_http2_parse_int(u_char **pos, u_char *end,
+    ngx_uint_t prefix, ngx_uint_t *value);
+static ngx_int_t ngx_http_upstream_http2_parse_string(ngx_pool_t *pool,
+    u_char **pos, u_char *end, ngx_str_t *str, ngx_log_t *log);
+static ngx_http_upstream_http2_stream_t *ngx_http_upstream_http2_find_stream(
+    ngx_http_upstream_http2_session_t *s, ngx_uint_t sid);
+static void ngx_http_upstream_http2_stream_error(
+    ngx_http_upstream_http2_stream_t *st, ngx_uint_t status);
+static void ngx_http_upstream_http2_wake(ngx_event_t *ev);
+
+static ngx_http_upstream_http2_frame_t *ngx_http_upstream_http2_alloc(
+    ngx_http_upstream_http2_session_t *s, size_t size);
+static ngx_http_upstream_http2_frame_t *ngx_http_upstream_http2_frame(
+    ngx_http_upstream_http2_session_t *s, size_t len, ngx_uint_t type,
+    ngx_uint_t flags, ngx_uint_t sid);
+static void ngx_http_upstream_http2_queue(ngx_http_upstream_http2_session_t *s,
+    ngx_http_upstream_http2_frame_t *f);
+static ngx_int_t ngx_http_upstream_http2_send_rst_stream(
+    ngx_http_upstream_http2_session_t *s, ngx_uint_t sid, ngx_uint_t status);
+static ngx_int_t ngx_http_upstream_http2_send_window_update(
+    ngx_http_upstream_http2_session_t *s, ngx_uint_t sid, size_t window);
+static void ngx_http_upstream_http2_flush(ngx_http_upstream_http2_session_t *s);
+
+static ngx_http_upstream_http2_stream_t *ngx_http_upstream_http2_stream_create(
+    ngx_http_upstream_http2_session_t *s, ngx_http_request_t *r,
+    ngx_peer_connection_t *pc);
+static void ngx_http_upstream_http2_stream_close(
+    ngx_http_upstream_http2_stream_t *st);
+static ngx_int_t ngx_http_upstream_http2_append(
+    ngx_http_upstream_http2_stream_t *st, u_char *data, size_t len,
+    ngx_uint_t flags);
+static ssize_t ngx_http_upstream_http2_recv(ngx_connection_t *c, u_char *buf,
+    size_t size);
+static ssize_t ngx_http_upstream_http2_recv_chain(ngx_connection_t *c,
+    ngx_chain_t *cl, off_t limit);
+static ssize_t ngx_http_upstream_http2_stream_send(ngx_connection_t *c,
+    u_char *buf, size_t size);
+static ngx_chain_t *ngx_http_upstream_http2_send_chain(ngx_connection_t *c,
+    ngx_chain_t *in, off_t limit);
+static ngx_int_t ngx_http_upstream_http2_read_head(
+    ngx_http_upstream_http2_stream_t *st, ngx_buf_t *b);
+static ngx_int_t ngx_http_upstream_http2_send_headers(
+    ngx_http_upstream_http2_stream_t *st);
+static u_char *ngx_http_upstream_http2_encode(
+    ngx_http_upstream_http2_session_t *s, u_char *p, ngx_str_t *name,
+    ngx_str_t *value, ngx_uint_t flags, u_char *tmp);
+static ngx_int_t ngx_http_upstream_http2_table_cmp(ngx_http_v2_hpack_t *hpack,
+    ngx_str_t *entry, ngx_str_t *str);
+static u_char *ngx_http_upstream_http2_write_int(u_char *pos,
+    ngx_uint_t prefix, ngx_uint_t value);
+static ngx_int_t ngx_http_upstream_http2_send_data(
+    ngx_http_upstream_http2_stream_t *st, ngx_buf_t *b, size_t size,
+    ngx_uint_t flags);
+
+static ngx_int_t ngx_http_upstream_init_http2(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *us);
+static void *ngx_http_upstream_http2_create_conf(ngx_conf_t *cf);
+static char *ngx_http_upstream_http2(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+static ngx_command_t  ngx_http_upstream_http2_commands[] = {
+
+    { ngx_string("http2"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE12,
+      ngx_http_upstream_http2,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_upstream_http2_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_http_upstream_http2_create_conf,   /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_upstream_http2_module = {
+    NGX_MODULE_V1,
+    &ngx_http_upstream_http2_module_ctx,   /* module context */
+    ngx_http_upstream_http2_commands,      /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_int_t
+ngx_http_upstream_init_http2(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_upstream_http2_srv_conf_t  *hcf;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cf->log, 0,
+                   "init http2");
+
+    hcf = ngx_http_conf_upstream_srv_conf(us, ngx_http_upstream_http2_module);
+
+    ngx_conf_init_uint_value(hcf->streams, 128);
+    ngx_conf_init_msec_value(hcf->timeout, 60000);
+
+    if (hcf->original_init_upstream(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    hcf->original_init_peer = us->peer.init;
+    hcf->upstream = us;
+
+    us->peer.init = ngx_http_upstream_init_http2_peer;
+
+    ngx_queue_init(&hcf->sessions);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_init_http2_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_upstream_t                  *u;
+    ngx_http_upstream_http2_srv_conf_t   *hcf;
+    ngx_http_upstream_http2_peer_data_t  *hp;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "init http2 peer");
+
+    hcf = ngx_http_conf_upstream_srv_conf(us, ngx_http_upstream_http2_module);
+
+    if (hcf->original_init_peer(r, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    u = r->upstream;
+
+    /* only requests proxied over HTTP are translated */
+
+    if (ngx_strncasecmp(u->schema.data, (u_char *) "http://", 7) != 0
+        && ngx_strncasecmp(u->schema.data, (u_char *) "https://", 8) != 0)
+    {
+        return NGX_OK;
+    }
+
+    hp = ngx_pcalloc(r->pool, sizeof(ngx_http_upstream_http2_peer_data_t));
+    if (hp == NULL) {
+        return NGX_ERROR;
+    }
+
+    hp->conf = hcf;
+    hp->request = r;
+    hp->upstream = u;
+    hp->data = u->peer.data;
+    hp->original_get_peer = u->peer.get;
+    hp->original_free_peer = u->peer.free;
+
+    u->peer.data = hp;
+    u->peer.get = ngx_http_upstream_get_http2_peer;
+    u->peer.free = ngx_http_upstream_free_http2_peer;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_get_http2_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_upstream_http2_peer_data_t  *hp = data;
+
+    ngx_int_t                           rc;
+    ngx_pool_t                         *pool;
+    ngx_connection_t                   *c;
+    ngx_http_upstream_http2_stream_t   *st;
+    ngx_http_upstream_http2_session_t  *s;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "get http2 peer");
+
+    if (!(ngx_event_flags & NGX_USE_CLEAR_EVENT)) {
+        ngx_log_error(NGX_LOG_ALERT, pc->log, 0,
+                      "http2 upstreams require the kqueue or epoll "
+                      "event method");
+        return NGX_ERROR;
+    }
+
+    /* ask balancer */
+
+    rc = hp->original_get_peer(pc, hp->data);
+
+    if (rc == NGX_DONE) {
+
+        /* a cached HTTP/1.x connection cannot be used */
+
+        c = pc->connection;
+
+#if (NGX_HTTP_SSL)
+        if (c->ssl) {
+            c->ssl->no_wait_shutdown = 1;
+            c->ssl->no_send_shutdown = 1;
+
+            (void) ngx_ssl_shutdown(c);
+        }
+#endif
+
+        pool = c->pool;
+
+        ngx_close_connection(c);
+
+        if (pool) {
+            ngx_destroy_pool(pool);
+        }
+
+        pc->connection = NULL;
+
+        rc = NGX_OK;
+    }
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    s = ngx_http_upstream_http2_session(hp, pc);
+
+    if (s == NULL) {
+        return NGX_DECLINED;
+    }
+
+    st = ngx_http_upstream_http2_stream_create(s, hp->request, pc);
+    if (st == NULL) {
+        if (s->nstreams == 0) {
+            ngx_http_upstream_http2_idle(s);
+        }
+
+        return NGX_ERROR;
+    }
+
+    hp->stream = st;
+
+    pc->connection = &st->connection;
+    pc->cached = s->connected;
+
+    /* a stream cannot outlive its peer, so it is never hedged */
+
+    hp->upstream->multiplexed = 1;
+
+    return NGX_DONE;
+}
+
+
+static void
+ngx_http_upstream_free_http2_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    ngx_http_upstream_http2_peer_data_t  *hp = data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "free http2 peer");
+
+    if (hp->stream) {
+        ngx_http_upstream_http2_stream_close(hp->stream);
+
+        hp->stream = NULL;
+        pc->connection = NULL;
+    }
+
+    hp->original_free_peer(pc, hp->data, state);
+}
+
+
+static ngx_http_upstream_http2_session_t *
+ngx_http_upstream_http2_session(ngx_http_upstream_http2_peer_data_t *hp,
+    ngx_peer_connection_t *pc)
+{
+    u_char                              *p;
+    ngx_int_t                            rc;
+    ngx_str_t                            name;
+    ngx_pool_t                          *pool;
+    ngx_queue_t                         *q;
+    ngx_connection_t                    *c;
+    ngx_http_upstream_t                 *u;
+    ngx_peer_connection_t                peer;
+    ngx_http_upstream_http2_frame_t     *f;
+    ngx_http_upstream_http2_session_t   *s;
+    ngx_http_upstream_http2_srv_conf_t  *hcf;
+
+    hcf = hp->conf;
+    u = hp->upstream;
+
+    ngx_str_null(&name);
+
+#if (NGX_HTTP_SSL)
+
+    if (u->ssl
+        && ngx_http_upstream_http2_ssl_name(hp->request, u, &name) != NGX_OK)
+    {
+        return NULL;
+    }
+
+#endif
+
+    /* pack streams into the oldest sessions that have room */
+
+    for (q = ngx_queue_head(&hcf->sessions);
+         q != ngx_queue_sentinel(&hcf->sessions);
+         q = ngx_queue_next(q))
+    {
+        s = ngx_queue_data(q, ngx_http_upstream_http2_session_t, queue);
+
+        if (s->goaway || s->nstreams >= s->max_streams) {
+            continue;
+        }
+
+        if (ngx_memn2cmp((u_char *) &s->sockaddr, (u_char *) pc->sockaddr,
+                         s->socklen, pc->socklen)
+            != 0)
+        {
+            continue;
+        }
+
+#if (NGX_HTTP_SSL)
+
+        if (s->ssl != (u->ssl ? u->conf->ssl : NULL)) {
+            continue;
+        }
+
+        if (s->ssl
+            && ngx_memn2cmp(s->ssl_name.data, name.data, s->ssl_name.len,
+                            name.len)
+               != 0)
+        {
+            continue;
+        }
+
+#endif
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "http2 upstream session %p, streams:%ui",
+                       s->connection, s->nstreams);
+
+        return s;
+    }
+
+    /* open a new session */
+
+    pool = ngx_create_pool(1024, ngx_cycle->log);
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    s = ngx_pcalloc(pool, sizeof(ngx_http_upstream_http2_session_t));
+    if (s == NULL) {
+        goto failed;
+    }
+
+    s->conf = hcf;
+
+    s->socklen = pc->socklen;
+    ngx_memcpy(&s->sockaddr, pc->sockaddr, pc->socklen);
+
+    s->name.data = ngx_pstrdup(pool, pc->name);
+    if (s->name.data == NULL) {
+        goto failed;
+    }
+
+    s->name.len = pc->name->len;
+
+#if (NGX_HTTP_SSL)
+
+    if (u->ssl) {
+        p = ngx_pnalloc(pool, name.len + 1);
+        if (p == NULL) {
+            goto failed;
+        }
+
+        (void) ngx_cpystrn(p, name.data, name.len + 1);
+
+        s->ssl_name.len = name.len;
+        s->ssl_name.data = p;
+
+        s->ssl = u->conf->ssl;
+        s->ssl_server_name = u->conf->ssl_server_name;
+        s->ssl_verify = u->conf->ssl_verify;
+    }
+
+#endif
+
+    s->buffer = ngx_palloc(pool, NGX_HTTP_UPSTREAM_HTTP2_BUFFER_SIZE);
+    if (s->buffer == NULL) {
+        goto failed;
+    }
+
+    s->log = *ngx_cycle->log;
+    s->log.handler = ngx_http_upstream_http2_log_error;
+    s->log.data = s;
+    s->log.action = "connecting to upstream";
+
+    ngx_queue_init(&s->streams);
+
+    s->max_streams = hcf->streams;
+    s->next_sid = 1;
+    s->frame_size = NGX_HTTP_V2_DEFAULT_FRAME_SIZE;
+    s->init_window = NGX_HTTP_V2_DEFAULT_WINDOW;
+    s->send_window = NGX_HTTP_V2_DEFAULT_WINDOW;
+    s->recv_window = NGX_HTTP_V2_MAX_WINDOW;
+
+    ngx_memzero(&peer, sizeof(ngx_peer_connection_t));
+
+    peer.sockaddr = &s->sockaddr.sockaddr;
+    peer.socklen = s->socklen;
+    peer.name = &s->name;
+    peer.get = ngx_event_get_peer;
+    peer.local = pc->local;
+    peer.log = &s->log;
+    peer.log_error = pc->log_error;
+
+    rc = ngx_event_connect_peer(&peer);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        goto failed;
+    }
+
+    /* rc == NGX_OK || rc == NGX_AGAIN */
+
+    c = peer.connection;
+
+    c->pool = pool;
+    c->data = s;
+
+    c->read->handler = ngx_http_upstream_http2_connect_handler;
+    c->write->handler = ngx_http_upstream_http2_connect_handler;
+
+    s->connection = c;
+    s->decoder.connection = c;
+    s->encoder.connection = c;
+
+    ngx_queue_insert_tail(&hcf->sessions, &s->queue);
+
+    /* connection preface, settings, and the connection window */
+
+    f = ngx_http_upstream_http2_alloc(s,
+                                  sizeof(NGX_HTTP_UPSTREAM_HTTP2_PREFACE) - 1);
+    if (f == NULL) {
+        goto close;
+    }
+
+    f->buf.last = ngx_cpymem(f->buf.last, NGX_HTTP_UPSTREAM_HTTP2_PREFACE,
+                             sizeof(NGX_HTTP_UPSTREAM_HTTP2_PREFACE) - 1);
+
+    ngx_http_upstream_http2_queue(s, f);
+
+    f = ngx_http_upstream_http2_frame(s,
+                               3 * NGX_HTTP_UPSTREAM_HTTP2_SETTINGS_PARAM_SIZE,
+                               NGX_HTTP_V2_SETTINGS_FRAME,
+                               NGX_HTTP_V2_NO_FLAG, 0);
+    if (f == NULL) {
+        goto close;
+    }
+
+    p = f->buf.last;
+
+    p = ngx_http_v2_write_uint16(p, NGX_HTTP_UPSTREAM_HTTP2_ENABLE_PUSH);
+    p = ngx_http_v2_write_uint32(p, 0);
+
+    p = ngx_http_v2_write_uint16(p, NGX_HTTP_UPSTREAM_HTTP2_MAX_STREAMS);
+    p = ngx_http_v2_write_uint32(p, 0);
+
+    p = ngx_http_v2_write_uint16(p, NGX_HTTP_UPSTREAM_HTTP2_INIT_WINDOW_SIZE);
+    p = ngx_http_v2_write_uint32(p, NGX_HTTP_UPSTREAM_HTTP2_WINDOW);
+
+    f->buf.last = p;
+
+    ngx_http_upstream_http2_queue(s, f);
+
+    if (ngx_http_upstream_http2_send_window_update(s, 0,
+                                                   NGX_HTTP_V2_MAX_WINDOW
+                                                   - NGX_HTTP_V2_DEFAULT_WINDOW)
+        != NGX_OK)
+    {
+        goto close;
+    }
+
+    ngx_add_timer(c->write, u->conf->connect_timeout);
+
+    if (rc == NGX_OK) {
+        ngx_post_event(c->write, &ngx_posted_events);
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "http2 upstream new session %p to %V", c, &s->name);
+
+    return s;
+
+close:
+
+    ngx_http_upstream_http2_close_session(s);
+    return NULL;
+
+failed:
+
+    ngx_destroy_pool(pool);
+    return NULL;
+}
+
+
+#if (NGX_HTTP_SSL)
+
+static ngx_int_t
+ngx_http_upstream_http2_ssl_name(ngx_http_request_t *r, ngx_http_upstream_t *u,
+    ngx_str_t *name)
+{
+    u_char  *p, *last;
+
+    if (u->conf->ssl_name) {
+        if (ngx_http_complex_value(r, u->conf->ssl_name, name) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+    } else {
+        *name = u->ssl_name;
+    }
+
+    if (name->len == 0) {
+        return NGX_OK;
+    }
+
+    /* strip port as ngx_http_upstream_ssl_name() does */
+
+    p = name->data;
+    last = name->data + name->len;
+
+    if (*p == '[') {
+        p = ngx_strlchr(p, last, ']');
+
+        if (p == NULL) {
+            p = name->data;
+        }
+    }
+
+    p = ngx_strlchr(p, last, ':');
+
+    if (p != NULL) {
+        name->len = p - name->data;
+    }
+
+    return NGX_OK;
+}
+
+#endif
+
+
+static void
+ngx_http_upstream_http2_connect_handler(ngx_event_t *ev)
+{
+    ngx_connection_t                   *c;
+    ngx_http_upstream_http2_session_t  *s;
+#if (NGX_HTTP_SSL)
+    ngx_int_t                           rc;
+#endif
+
+    c = ev->data;
+    s = c->data;
+
+    if (ev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT, "upstream timed out");
+        ngx_http_upstream_http2_close_session(s);
+        return;
+    }
+
+    if (ngx_http_upstream_http2_test_connect(c) != NGX_OK) {
+        ngx_http_upstream_http2_close_session(s);
+        return;
+    }
+
+#if (NGX_HTTP_SSL)
+
+    if (s->ssl) {
+
+        if (ngx_ssl_create_connection(s->ssl, c,
+                                      NGX_SSL_BUFFER|NGX_SSL_CLIENT)
+            != NGX_OK)
+        {
+            ngx_http_upstream_http2_close_session(s);
+            return;
+        }
+
+#ifdef TLSEXT_TYPE_application_layer_protocol_negotiation
+
+        if (SSL_set_alpn_protos(c->ssl->connection,
+                                (u_char *) NGX_HTTP_V2_ALPN_ADVERTISE,
+                                sizeof(NGX_HTTP_V2_ALPN_ADVERTISE) - 1)
+            != 0)
+        {
+            ngx_ssl_error(NGX_LOG_ERR, c->log, 0,
+                          "SSL_set_alpn_protos() failed");
+            ngx_http_upstream_http2_close_session(s);
+            return;
+        }
+
+#endif
+
+#ifdef SSL_CTRL_SET_TLSEXT_HOSTNAME
+
+        /* as per RFC 6066, literal IPv4 and IPv6 addresses are not permitted */
+
+        if (s->ssl_server_name
+            && s->ssl_name.len
+            && s->ssl_name.data[0] != '['
+            && ngx_inet_addr(s->ssl_name.data, s->ssl_name.len) == INADDR_NONE
+            && SSL_set_tlsext_host_name(c->ssl->connection,
+                                        (char *) s->ssl_name.data)
+               == 0)
+        {
+            ngx_ssl_error(NGX_LOG_ERR, c->log, 0,
+                          "SSL_set_tlsext_host_name(\"%s\") failed",
+                          s->ssl_name.data);
+            ngx_http_upstream_http2_close_session(s);
+            return;
+        }
+
+#endif
+
+        c->log->action = "SSL handshaking to upstream";
+
+        rc = ngx_ssl_handshake(c);
+
+        if (rc == NGX_AGAIN) {
+            c->ssl->handler = ngx_http_upstream_http2_ssl_handshake;
+            return;
+        }
+
+        ngx_http_upstream_http2_ssl_handshake(c);
+        return;
+    }
+
+#endif
+
+    ngx_http_upstream_http2_connected(s);
+}
+
+
+#if (NGX_HTTP_SSL)
+
+static void
+ngx_http_upstream_http2_ssl_handshake(ngx_connection_t *c)
+{
+    long                                rc;
+    ngx_http_upstream_http2_session_t  *s;
+#ifdef TLSEXT_TYPE_application_layer_protocol_negotiation
+    unsigned int                        len;
+    const unsigned char                *data;
+#endif
+
+    s = c->data;
+
+    if (!c->ssl->handshaked) {
+
+        if (c->write->timedout) {
+            ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                          "upstream timed out");
+        }
+
+        ngx_http_upstream_http2_close_session(s);
+        return;
+    }
+
+    if (s->ssl_verify) {
+        rc = SSL_get_verify_result(c->ssl->connection);
+
+        if (rc != X509_V_OK) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                          "upstream SSL certificate verify error: (%l:%s)",
+                          rc, X509_verify_cert_error_string(rc));
+            ngx_http_upstream_http2_close_session(s);
+            return;
+        }
+
+        if (ngx_ssl_check_host(c, &s->ssl_name) != NGX_OK) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                          "upstream SSL certificate does not match \"%V\"",
+                          &s->ssl_name);
+            ngx_http_upstream_http2_close_session(s);
+            return;
+        }
+    }
+
+#ifdef TLSEXT_TYPE_application_layer_protocol_negotiation
+
+    SSL_get0_alpn_selected(c->ssl->connection, &data, &len);
+
+    if (len != 2 || ngx_memcmp(data, "h2", 2) != 0) {
+        ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                      "upstream did not negotiate HTTP/2");
+        ngx_http_upstream_http2_close_session(s);
+        return;
+    }
+
+#endif
+
+    ngx_http_upstream_http2_connected(s);
+}
+
+#endif
+
+
+static void
+ngx_http_upstream_http2_connected(ngx_http_upstream_http2_session_t *s)
+{
+    ngx_connection_t  *c;
+
+    c = s->connection;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http2 upstream session %p connected", c);
+
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    c->log->action = NULL;
+
+    c->read->handler = ngx_http_upstream_http2_read_handler;
+    c->write->handler = ngx_http_upstream_http2_write_handler;
+
+    s->connected = 1;
+
+    if (ngx_http_upstream_http2_send(s) != NGX_OK) {
+        ngx_http_upstream_http2_close_session(s);
+        return;
+    }
+
+    ngx_post_event(c->read, &ngx_posted_events);
+
+    if (s->nstreams == 0) {
+        ngx_http_upstream_http2_idle(s);
+    }
+}
+
+
+static void
+ngx_http_upstream_http2_idle(ngx_http_upstream_http2_session_t *s)
+{
+    ngx_connection_t  *c;
+
+    if (!s->connected) {
+        return;
+    }
+
+    c = s->connection;
+
+    if (s->goaway || ngx_terminate || ngx_exiting) {
+        ngx_http_upstream_http2_close_session(s);
+        return;
+    }
+
+    c->idle = 1;
+
+    ngx_add_timer(c->read, s->conf->timeout);
+}
+
+
+static void
+ngx_http_upstream_http2_close_session(ngx_http_upstream_http2_session_t *s)
+{
+    ngx_pool_t                        *pool;
+    ngx_queue_t                       *q;
+    ngx_connection_t                  *c;
+    ngx_http_upstream_http2_frame_t   *f;
+    ngx_http_upstream_http2_stream_t  *st;
+
+    c = s->connection;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "close http2 upstream session %p", c);
+
+    while (!ngx_queue_empty(&s->streams)) {
+        q = ngx_queue_head(&s->streams);
+        ngx_queue_remove(q);
+
+        st = ngx_queue_data(q, ngx_http_upstream_http2_stream_t, queue);
+
+        st->session = NULL;
+
+        if (!st->eof) {
+            st->error = 1;
+        }
+
+        ngx_http_upstream_http2_wake(&st->read);
+        ngx_http_upstream_http2_wake(&st->write);
+    }
+
+    ngx_queue_remove(&s->queue);
+
+    while (s->out) {
+        f = s->out;
+        s->out = f->next;
+        ngx_free(f);
+    }
+
+    if (s->block) {
+        ngx_free(s->block);
+    }
+
+#if (NGX_HTTP_SSL)
+
+    if (c->ssl) {
+        c->ssl->no_wait_shutdown = 1;
+        c->ssl->no_send_shutdown = 1;
+
+        (void) ngx_ssl_shutdown(c);
+    }
+
+#endif
+
+    pool = c->pool;
+
+    ngx_close_connection(c);
+    ngx_destroy_pool(pool);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_test_connect(ngx_connection_t *c)
+{
+    int        err;
+    socklen_t  len;
+
+#if (NGX_HAVE_KQUEUE)
+
+    if (ngx_event_flags & NGX_USE_KQUEUE_EVENT)  {
+        if (c->write->pending_eof || c->read->pending_eof) {
+            if (c->write->pending_eof) {
+                err = c->write->kq_errno;
+
+            } else {
+                err = c->read->kq_errno;
+            }
+
+            (void) ngx_connection_error(c, err,
+                                    "kevent() reported that connect() failed");
+            return NGX_ERROR;
+        }
+
+    } else
+#endif
+    {
+        err = 0;
+        len = sizeof(int);
+
+        /*
+         * BSDs and Linux return 0 and set a pending error in err
+         * Solaris returns -1 and sets errno
+         */
+
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len)
+            == -1)
+        {
+            err = ngx_socket_errno;
+        }
+
+        if (err) {
+            (void) ngx_connection_error(c, err, "connect() failed");
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static u_char *
+ngx_http_upstream_http2_log_error(ngx_log_t *log, u_char *buf, size_t len)
+{
+    u_char                             *p;
+    ngx_http_upstream_http2_session_t  *s;
+
+    p = buf;
+
+    if (log->action) {
+        p = ngx_snprintf(buf, len, " while %s", log->action);
+        len -= p - buf;
+        buf = p;
+    }
+
+    s = log->data;
+
+    p = ngx_snprintf(buf, len, ", upstream: \"%V\", peer: %V",
+                     &s->conf->upstream->host, &s->name);
+
+    return p;
+}
+
+
+static void
+ngx_http_upstream_http2_read_handler(ngx_event_t *rev)
+{
+    u_char                             *p, *end;
+    size_t                              len;
+    ssize_t                             n;
+    uint32_t                            head;
+    ngx_uint_t                          type, flags, sid;
+    ngx_connection_t                   *c;
+    ngx_http_upstream_http2_session_t  *s;
+
+    c = rev->data;
+    s = c->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http2 upstream read handler");
+
+    if (rev->timedout || c->close) {
+
+        if (s->nstreams == 0) {
+            ngx_http_upstream_http2_close_session(s);
+            return;
+        }
+
+        rev->timedout = 0;
+        c->close = 0;
+    }
+
+    for ( ;; ) {
+
+        n = c->recv(c, s->buffer + s->buffered,
+                    NGX_HTTP_UPSTREAM_HTTP2_BUFFER_SIZE - s->buffered);
+
+        if (n == NGX_AGAIN) {
+            break;
+        }
+
+        if (n == 0) {
+            if (s->nstreams) {
+                ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                              "upstream prematurely closed connection");
+            }
+
+            ngx_http_upstream_http2_close_session(s);
+            return;
+        }
+
+        if (n == NGX_ERROR) {
+            ngx_http_upstream_http2_close_session(s);
+            return;
+        }
+
+        s->buffered += n;
+
+        p = s->buffer;
+        end = s->buffer + s->buffered;
+
+        while (end - p >= NGX_HTTP_V2_FRAME_HEADER_SIZE) {
+
+            head = ngx_http_v2_parse_uint32(p);
+
+            len = ngx_http_v2_parse_length(head);
+            type = ngx_http_v2_parse_type(head);
+            flags = p[4];
+            sid = ngx_http_v2_parse_sid(&p[5]);
+
+            if (len > NGX_HTTP_V2_DEFAULT_FRAME_SIZE) {
+                ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                              "upstream sent frame with too long length: %uz",
+                              len);
+                ngx_http_upstream_http2_close_session(s);
+                return;
+            }
+
+            if ((size_t) (end - p) < NGX_HTTP_V2_FRAME_HEADER_SIZE + len) {
+                break;
+            }
+
+            ngx_log_debug4(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                           "http2 upstream frame type:%ui f:%Xi l:%uz sid:%ui",
+                           type, flags, len, sid);
+
+            if (ngx_http_upstream_http2_process_frame(s, type, flags, sid,
+                                              p + NGX_HTTP_V2_FRAME_HEADER_SIZE,
+                                              len)
+                != NGX_OK)
+            {
+                ngx_http_upstream_http2_close_session(s);
+                return;
+            }
+
+            p += NGX_HTTP_V2_FRAME_HEADER_SIZE + len;
+        }
+
+        s->buffered = end - p;
+
+        if (s->buffered && p != s->buffer) {
+            ngx_memmove(s->buffer, p, s->buffered);
+        }
+    }
+
+    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        ngx_http_upstream_http2_close_session(s);
+        return;
+    }
+
+    if (ngx_http_upstream_http2_send(s) != NGX_OK) {
+        ngx_http_upstream_http2_close_session(s);
+    }
+}
+
+
+static void
+ngx_http_upstream_http2_write_handler(ngx_event_t *wev)
+{
+    ngx_connection_t                   *c;
+    ngx_http_upstream_http2_session_t  *s;
+
+    c = wev->data;
+    s = c->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http2 upstream write handler");
+
+    if (ngx_http_upstream_http2_send(s) != NGX_OK) {
+        ngx_http_upstream_http2_close_session(s);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_send(ngx_http_upstream_http2_session_t *s)
+{
+    ngx_chain_t                      *cl;
+    ngx_connection_t                 *c;
+    ngx_http_upstream_http2_frame_t  *f;
+
+    c = s->connection;
+
+    if (!s->connected || (s->out == NULL && !c->buffered)) {
+        return NGX_OK;
+    }
+
+    /* everything queued goes out, SSL buffering included */
+
+    if (s->last) {
+        s->last->buf.flush = 1;
+    }
+
+    cl = c->send_chain(c, s->out ? &s->out->chain : NULL, 0);
+
+    if (cl == NGX_CHAIN_ERROR) {
+        c->error = 1;
+        return NGX_ERROR;
+    }
+
+    while (s->out && &s->out->chain != cl) {
+        f = s->out;
+        s->out = f->next;
+        ngx_free(f);
+    }
+
+    if (s->out == NULL) {
+        s->last = NULL;
+
+        if (!c->buffered) {
+            return NGX_OK;
+        }
+    }
+
+    if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_process_frame(ngx_http_upstream_http2_session_t *s,
+    ngx_uint_t type, ngx_uint_t flags, ngx_uint_t sid, u_char *pos, size_t len)
+{
+    u_char                            *p;
+    size_t                             size, padding;
+    ngx_uint_t                         level, status, window;
+    ngx_queue_t                       *q;
+    ngx_connection_t                  *c;
+    ngx_http_upstream_http2_frame_t   *f;
+    ngx_http_upstream_http2_stream_t  *st;
+
+    c = s->connection;
+
+    if (s->block_sid && type != NGX_HTTP_V2_CONTINUATION_FRAME) {
+        ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                      "upstream sent frame of type %ui "
+                      "instead of CONTINUATION", type);
+        return NGX_ERROR;
+    }
+
+    switch (type) {
+
+    case NGX_HTTP_V2_DATA_FRAME:
+
+        if (sid == 0) {
+            goto protocol_error;
+        }
+
+        if (len > s->recv_window) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                          "upstream violated connection flow control, "
+                          "received %uz data frame with window %uz",
+                          len, s->recv_window);
+            return NGX_ERROR;
+        }
+
+        s->recv_window -= len;
+
+        /* streams are limited by their own windows */
+
+        if (s->recv_window < NGX_HTTP_V2_MAX_WINDOW / 2) {
+            if (ngx_http_upstream_http2_send_window_update(s, 0,
+                                       NGX_HTTP_V2_MAX_WINDOW - s->recv_window)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            s->recv_window = NGX_HTTP_V2_MAX_WINDOW;
+        }
+
+        st = ngx_http_upstream_http2_find_stream(s, sid);
+
+        if (st == NULL) {
+            return NGX_OK;
+        }
+
+        return ngx_http_upstream_http2_process_data(s, flags, st, pos, len);
+
+    case NGX_HTTP_V2_HEADERS_FRAME:
+
+        if (sid == 0) {
+            goto protocol_error;
+        }
+
+        if (flags & NGX_HTTP_V2_PADDED_FLAG) {
+            if (len == 0) {
+                goto protocol_error;
+            }
+
+            padding = *pos++;
+            len--;
+
+            if (padding > len) {
+                goto protocol_error;
+            }
+
+            len -= padding;
+        }
+
+        if (flags & NGX_HTTP_V2_PRIORITY_FLAG) {
+            if (len < 5) {
+                goto protocol_error;
+            }
+
+            pos += 5;
+            len -= 5;
+        }
+
+        s->block_len = 0;
+        s->block_sid = sid;
+        s->block_flags = flags;
+
+        /* fall through */
+
+    case NGX_HTTP_V2_CONTINUATION_FRAME:
+
+        if (s->block_sid == 0 || s->block_sid != sid) {
+            goto protocol_error;
+        }
+
+        if (s->block_len + len > s->block_size) {
+
+            size = ngx_max(s->block_size * 2, s->block_len + len);
+            size = ngx_max(size, 4096);
+
+            if (size > NGX_HTTP_UPSTREAM_HTTP2_MAX_BLOCK) {
+                ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                              "upstream sent too large header block");
+                return NGX_ERROR;
+            }
+
+            p = ngx_alloc(size, c->log);
+            if (p == NULL) {
+                return NGX_ERROR;
+            }
+
+            if (s->block) {
+                ngx_memcpy(p, s->block, s->block_len);
+                ngx_free(s->block);
+            }
+
+            s->block = p;
+            s->block_size = size;
+        }
+
+        if (len) {
+            ngx_memcpy(s->block + s->block_len, pos, len);
+            s->block_len += len;
+        }
+
+        if (!(flags & NGX_HTTP_V2_END_HEADERS_FLAG)) {
+            return NGX_OK;
+        }
+
+        st = ngx_http_upstream_http2_find_stream(s, sid);
+
+        s->block_sid = 0;
+
+        return ngx_http_upstream_http2_process_headers(s, st, s->block_flags);
+
+    case NGX_HTTP_V2_RST_STREAM_FRAME:
+
+        if (sid == 0 || len != 4) {
+            goto protocol_error;
+        }
+
+        status = ngx_http_v2_parse_uint32(pos);
+
+        st = ngx_http_upstream_http2_find_stream(s, sid);
+
+        if (st == NULL) {
+            return NGX_OK;
+        }
+
+        st->reset = 1;
+
+        if (status == NGX_HTTP_UPSTREAM_HTTP2_NO_ERROR && st->eof) {
+            /* the response is complete, the rest of request is not needed */
+            return NGX_OK;
+        }
+
+        ngx_log_error(NGX_LOG_ERR, st->connection.log, 0,
+                      "upstream reset stream %ui with error %ui",
+                      sid, status);
+
+        ngx_http_upstream_http2_stream_error(st, 0);
+
+        return NGX_OK;
+
+    case NGX_HTTP_V2_SETTINGS_FRAME:
+
+        if (sid != 0) {
+            goto protocol_error;
+        }
+
+        if (flags & NGX_HTTP_V2_ACK_FLAG) {
+            return len ? NGX_ERROR : NGX_OK;
+        }
+
+        return ngx_http_upstream_http2_process_settings(s, pos, len);
+
+    case NGX_HTTP_V2_PING_FRAME:
+
+        if (sid != 0 || len != 8) {
+            goto protocol_error;
+        }
+
+        if (flags & NGX_HTTP_V2_ACK_FLAG) {
+            return NGX_OK;
+        }
+
+        f = ngx_http_upstream_http2_frame(s, 8, NGX_HTTP_V2_PING_FRAME,
+                                          NGX_HTTP_V2_ACK_FLAG, 0);
+        if (f == NULL) {
+            return NGX_ERROR;
+        }
+
+        f->buf.last = ngx_cpymem(f->buf.last, pos, 8);
+
+        ngx_http_upstream_http2_queue(s, f);
+
+        return NGX_OK;
+
+    case NGX_HTTP_V2_GOAWAY_FRAME:
+
+        if (sid != 0 || len < 8) {
+            goto protocol_error;
+        }
+
+        s->goaway = 1;
+        s->last_sid = ngx_http_v2_parse_sid(pos);
+
+        status = ngx_http_v2_parse_uint32(&pos[4]);
+
+        level = status ? NGX_LOG_ERR : NGX_LOG_INFO;
+
+        ngx_log_error(level, c->log, 0,
+                      "upstream sent goaway with error %ui, last stream %ui",
+                      status, s->last_sid);
+
+        for (q = ngx_queue_head(&s->streams);
+             q != ngx_queue_sentinel(&s->streams);
+             q = ngx_queue_next(q))
+        {
+            st = ngx_queue_data(q, ngx_http_upstream_http2_stream_t, queue);
+
+            if (st->sid == 0 || st->sid > s->last_sid) {
+                st->reset = 1;
+                ngx_http_upstream_http2_stream_error(st, 0);
+            }
+        }
+
+        return NGX_OK;
+
+    case NGX_HTTP_V2_WINDOW_UPDATE_FRAME:
+
+        if (len != 4) {
+            goto protocol_error;
+        }
+
+        window = ngx_http_v2_parse_window(pos);
+
+        if (sid == 0) {
+
+            if (window > (size_t) (NGX_HTTP_V2_MAX_WINDOW - s->send_window)) {
+                ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                              "upstream violated connection flow control, "
+                              "window update %ui", window);
+                return NGX_ERROR;
+            }
+
+            s->send_window += window;
+
+            for (q = ngx_queue_head(&s->streams);
+                 q != ngx_queue_sentinel(&s->streams);
+                 q = ngx_queue_next(q))
+            {
+                st = ngx_queue_data(q, ngx_http_upstream_http2_stream_t,
+                                    queue);
+
+                if (st->blocked && st->send_window > 0) {
+                    st->blocked = 0;
+                    ngx_http_upstream_http2_wake(&st->write);
+                }
+            }
+
+            return NGX_OK;
+        }
+
+        st = ngx_http_upstream_http2_find_stream(s, sid);
+
+        if (st == NULL) {
+            return NGX_OK;
+        }
+
+        if (window > (size_t) (NGX_HTTP_V2_MAX_WINDOW - st->send_window)) {
+            ngx_log_error(NGX_LOG_ERR, st->connection.log, 0,
+                          "upstream violated stream flow control, "
+                          "window update %ui", window);
+            ngx_http_upstream_http2_stream_error(st,
+                                       NGX_HTTP_UPSTREAM_HTTP2_FLOW_CTRL_ERROR);
+            return NGX_OK;
+        }
+
+        st->send_window += window;
+
+        if (st->blocked && s->send_window > 0) {
+            st->blocked = 0;
+            ngx_http_upstream_http2_wake(&st->write);
+        }
+
+        return NGX_OK;
+
+    case NGX_HTTP_V2_PUSH_PROMISE_FRAME:
+
+        /* server push is disabled in settings */
+
+        goto protocol_error;
+
+    default:
+
+        /* PRIORITY and unknown frames are ignored */
+
+        return NGX_OK;
+    }
+
+protocol_error:
+
+    ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                  "upstream sent invalid frame of type %ui, stream %ui",
+                  type, sid);
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_process_data(ngx_http_upstream_http2_session_t *s,
+    ngx_uint_t flags, ngx_http_upstream_http2_stream_t *st, u_char *pos,
+    size_t len)
+{
+    size_t  padding;
+
+    if (len > st->recv_window) {
+        ngx_log_error(NGX_LOG_ERR, st->connection.log, 0,
+                      "upstream violated stream flow control, "
+                      "received %uz data frame with window %uz",
+                      len, st->recv_window);
+        ngx_http_upstream_http2_stream_error(st,
+                                       NGX_HTTP_UPSTREAM_HTTP2_FLOW_CTRL_ERROR);
+        return NGX_OK;
+    }
+
+    st->recv_window -= len;
+
+    if (flags & NGX_HTTP_V2_PADDED_FLAG) {
+        if (len == 0) {
+            return NGX_ERROR;
+        }
+
+        padding = *pos++;
+        len--;
+
+        if (padding > len) {
+            return NGX_ERROR;
+        }
+
+        len -= padding;
+    }
+
+    if (!st->header_done || st->eof) {
+        ngx_log_error(NGX_LOG_ERR, st->connection.log, 0,
+                      "upstream sent unexpected data frame");
+        ngx_http_upstream_http2_stream_error(st,
+                                        NGX_HTTP_UPSTREAM_HTTP2_PROTOCOL_ERROR);
+        return NGX_OK;
+    }
+
+    if (len) {
+        if (ngx_http_upstream_http2_append(st, pos, len, 1) != NGX_OK) {
+            ngx_http_upstream_http2_stream_error(st,
+                                               NGX_HTTP_UPSTREAM_HTTP2_CANCEL);
+            return NGX_OK;
+        }
+
+        st->buffered += len;
+    }
+
+    if (flags & NGX_HTTP_V2_END_STREAM_FLAG) {
+        st->eof = 1;
+    }
+
+    ngx_http_upstream_http2_wake(&st->read);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_process_headers(ngx_http_upstream_http2_session_t *s,
+    ngx_http_upstream_http2_stream_t *st, ngx_uint_t flags)
+{
+    u_char                *p, *end, *text, ch;
+    size_t                 len;
+    ngx_int_t              rc, status;
+    ngx_uint_t             i, j, index, size, prefix, indexing;
+    ngx_str_t              name, value;
+    ngx_pool_t            *pool;
+    ngx_array_t            headers;
+    ngx_http_v2_header_t  *h;
+
+    pool = ngx_create_pool(1024, s->connection->log);
+    if (pool == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_array_init(&headers, pool, 16, sizeof(ngx_http_v2_header_t))
+        != NGX_OK)
+    {
+        goto failed;
+    }
+
+    /* the HPACK state has to be updated even if the stream is gone */
+
+    s->decoder.state.pool = pool;
+
+    p = s->block;
+    end = s->block + s->block_len;
+
+    while (p < end) {
+
+        ch = *p;
+
+        if (ch & 0x80) {
+
+            /* indexed header field */
+
+            if (ngx_http_upstream_http2_parse_int(&p, end, 7, &index)
+                != NGX_OK
+                || ngx_http_v2_get_indexed_header(&s->decoder, index, 0)
+                   != NGX_OK)
+            {
+                goto comp_error;
+            }
+
+            name = s->decoder.state.header.name;
+            value = s->decoder.state.header.value;
+
+        } else if ((ch & 0xe0) == 0x20) {
+
+            /* dynamic table size update */
+
+            if (ngx_http_upstream_http2_parse_int(&p, end, 5, &size) != NGX_OK
+                || ngx_http_v2_table_size(&s->decoder, size) != NGX_OK)
+            {
+                goto comp_error;
+            }
+
+            continue;
+
+        } else {
+
+            /* literal header field */
+
+            indexing = ((ch & 0xc0) == 0x40);
+            prefix = indexing ? 6 : 4;
+
+            if (ngx_http_upstream_http2_parse_int(&p, end, prefix, &index)
+                != NGX_OK)
+            {
+                goto comp_error;
+            }
+
+            if (index) {
+                if (ngx_http_v2_get_indexed_header(&s->decoder, index, 1)
+                    != NGX_OK)
+                {
+                    goto comp_error;
+                }
+
+                name = s->decoder.state.header.name;
+
+            } else if (ngx_http_upstream_http2_parse_string(pool, &p, end,
+                                                            &name,
+                                                            s->connection->log)
+                       != NGX_OK)
+            {
+                goto comp_error;
+            }
+
+            if (ngx_http_upstream_http2_parse_string(pool, &p, end, &value,
+                                                     s->connection->log)
+                != NGX_OK)
+            {
+                goto comp_error;
+            }
+
+            if (indexing) {
+                s->decoder.state.header.name = name;
+                s->decoder.state.header.value = value;
+
+                if (ngx_http_v2_add_header(&s->decoder,
+                                           &s->decoder.state.header)
+                    != NGX_OK)
+                {
+                    goto failed;
+                }
+            }
+        }
+
+        h = ngx_array_push(&headers);
+        if (h == NULL) {
+            goto failed;
+        }
+
+        h->name = name;
+        h->value = value;
+    }
+
+    if (st == NULL || st->eof || st->error) {
+        ngx_destroy_pool(pool);
+        return NGX_OK;
+    }
+
+    if (st->header_done) {
+
+        /* trailers are not passed to HTTP/1.x */
+
+        goto done;
+    }
+
+    /* translate the response header to HTTP/1.1 */
+
+    status = 0;
+    len = sizeof("HTTP/1.1 000 " CRLF CRLF) - 1;
+
+    h = headers.elts;
+
+    for (i = 0; i < headers.nelts; i++) {
+
+        if (h[i].name.len && h[i].name.data[0] == ':') {
+
+            if (h[i].name.len != 7
+                || ngx_strncmp(h[i].name.data, ":status", 7) != 0
+                || h[i].value.len != 3
+                || status != 0)
+            {
+                goto invalid;
+            }
+
+            status = ngx_atoi(h[i].value.data, 3);
+
+            if (status < 100 || status > 999) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (h[i].name.len == 0) {
+            goto invalid;
+        }
+
+        for (j = 0; j < h[i].name.len; j++) {
+            ch = h[i].name.data[j];
+
+            if (ch <= 0x20 || ch == 0x7f || ch == ':'
+                || (ch >= 'A' && ch <= 'Z'))
+            {
+                goto invalid;
+            }
+        }
+
+        for (j = 0; j < h[i].value.len; j++) {
+            ch = h[i].value.data[j];
+
+            if (ch == '\0' || ch == CR || ch == LF) {
+                goto invalid;
+            }
+        }
+
+        len += h[i].name.len + sizeof(": " CRLF) - 1 + h[i].value.len;
+    }
+
+    if (status == 0) {
+        goto invalid;
+    }
+
+    if (status < 200) {
+
+        /* informational responses are not passed */
+
+        if (flags & NGX_HTTP_V2_END_STREAM_FLAG) {
+            goto invalid;
+        }
+
+        ngx_destroy_pool(pool);
+        return NGX_OK;
+    }
+
+    text = ngx_pnalloc(pool, len);
+    if (text == NULL) {
+        goto failed;
+    }
+
+    /*
+     * a status line with an empty reason phrase, the proxy module
+     * replaces it with the standard one
+     */
+
+    p = ngx_sprintf(text, "HTTP/1.1 %03i " CRLF, status);
+
+    for (i = 0; i < headers.nelts; i++) {
+
+        name = h[i].name;
+
+        if (name.data[0] == ':') {
+            continue;
+        }
+
+        /* connection-specific headers are not valid in HTTP/2 */
+
+        if ((name.len == 10
+             && ngx_strncmp(name.data, "connection", 10) == 0)
+            || (name.len == 10
+                && ngx_strncmp(name.data, "keep-alive", 10) == 0)
+            || (name.len == 16
+                && ngx_strncmp(name.data, "proxy-connection", 16) == 0)
+            || (name.len == 17
+                && ngx_strncmp(name.data, "transfer-encoding", 17) == 0)
+            || (name.len == 7
+                && ngx_strncmp(name.data, "upgrade", 7) == 0))
+        {
+            continue;
+        }
+
+        p = ngx_cpymem(p, name.data, name.len);
+        *p++ = ':'; *p++ = ' ';
+        p = ngx_cpymem(p, h[i].value.data, h[i].value.len);
+        *p++ = CR; *p++ = LF;
+    }
+
+    *p++ = CR; *p++ = LF;
+
+    rc = ngx_http_upstream_http2_append(st, text, p - text, 0);
+
+    if (rc != NGX_OK) {
+        goto failed;
+    }
+
+    st->header_done = 1;
+
+done:
+
+    if (flags & NGX_HTTP_V2_END_STREAM_FLAG) {
+        st->eof = 1;
+    }
+
+    ngx_http_upstream_http2_wake(&st->read);
+
+    ngx_destroy_pool(pool);
+
+    return NGX_OK;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_ERR, st->connection.log, 0,
+                  "upstream sent invalid header");
+
+    ngx_http_upstream_http2_stream_error(st,
+                                        NGX_HTTP_UPSTREAM_HTTP2_PROTOCOL_ERROR);
+
+    ngx_destroy_pool(pool);
+
+    return NGX_OK;
+
+comp_error:
+
+    ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                  "upstream sent invalid header block");
+
+failed:
+
+    ngx_destroy_pool(pool);
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_process_settings(ngx_http_upstream_http2_session_t *s,
+    u_char *pos, size_t len)
+{
+    ssize_t                            delta;
+    ngx_uint_t                         id, value;
+    ngx_queue_t                       *q;
+    ngx_connection_t                  *c;
+    ngx_http_upstream_http2_frame_t   *f;
+    ngx_http_upstream_http2_stream_t  *st;
+
+    c = s->connection;
+
+    if (len % NGX_HTTP_UPSTREAM_HTTP2_SETTINGS_PARAM_SIZE) {
+        ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                      "upstream sent settings frame with invalid length %uz",
+                      len);
+        return NGX_ERROR;
+    }
+
+    for ( /* void */ ;
+         len >= NGX_HTTP_UPSTREAM_HTTP2_SETTINGS_PARAM_SIZE;
+         len -= NGX_HTTP_UPSTREAM_HTTP2_SETTINGS_PARAM_SIZE,
+         pos += NGX_HTTP_UPSTREAM_HTTP2_SETTINGS_PARAM_SIZE)
+    {
+        id = ngx_http_v2_parse_uint16(pos);
+        value = ngx_http_v2_parse_uint32(&pos[2]);
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "http2 upstream setting %ui:%ui", id, value);
+
+        switch (id) {
+
+        case NGX_HTTP_UPSTREAM_HTTP2_HEADER_TABLE_SIZE:
+
+            /* a smaller table is signalled once and then not used at all */
+
+            if (value < NGX_HTTP_UPSTREAM_HTTP2_TABLE_SIZE && !s->no_index) {
+                s->no_index = 1;
+                s->table_update = 1;
+            }
+
+            break;
+
+        case NGX_HTTP_UPSTREAM_HTTP2_MAX_STREAMS:
+
+            s->max_streams = ngx_min(value, s->conf->streams);
+            break;
+
+        case NGX_HTTP_UPSTREAM_HTTP2_INIT_WINDOW_SIZE:
+
+            if (value > NGX_HTTP_V2_MAX_WINDOW) {
+                ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                              "upstream sent settings with too large "
+                              "initial window size %ui", value);
+                return NGX_ERROR;
+            }
+
+            delta = value - s->init_window;
+            s->init_window = value;
+
+            for (q = ngx_queue_head(&s->streams);
+                 q != ngx_queue_sentinel(&s->streams);
+                 q = ngx_queue_next(q))
+            {
+                st = ngx_queue_data(q, ngx_http_upstream_http2_stream_t,
+                                    queue);
+
+                if (st->sid == 0) {
+                    continue;
+                }
+
+                st->send_window += delta;
+
+                if (st->blocked && st->send_window > 0 && s->send_window > 0)
+                {
+                    st->blocked = 0;
+                    ngx_http_upstream_http2_wake(&st->write);
+                }
+            }
+
+            break;
+
+        case NGX_HTTP_UPSTREAM_HTTP2_MAX_FRAME_SIZE:
+
+            if (value < NGX_HTTP_V2_DEFAULT_FRAME_SIZE
+                || value > NGX_HTTP_V2_MAX_FRAME_SIZE)
+            {
+                ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                              "upstream sent settings with invalid "
+                              "max frame size %ui", value);
+                return NGX_ERROR;
+            }
+
+            s->frame_size = value;
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    f = ngx_http_upstream_http2_frame(s, 0, NGX_HTTP_V2_SETTINGS_FRAME,
+                                      NGX_HTTP_V2_ACK_FLAG, 0);
+    if (f == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_http_upstream_http2_queue(s, f);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_parse_int(u_char **pos, u_char *end, ngx_uint_t prefix,
+    ngx_uint_t *value)
+{
+    u_char      *p, ch;
+    ngx_uint_t   n, shift;
+
+    p = *pos;
+
+    if (p == end) {
+        return NGX_ERROR;
+    }
+
+    prefix = ngx_http_v2_prefix(prefix);
+
+    n = *p++ & prefix;
+
+    if (n == prefix) {
+
+        for (shift = 0; /* void */; shift += 7) {
+
+            if (p == end || shift >= NGX_HTTP_V2_INT_OCTETS * 7) {
+                return NGX_ERROR;
+            }
+
+            ch = *p++;
+
+            n += (ngx_uint_t) (ch & 0x7f) << shift;
+
+            if (!(ch & 0x80)) {
+                break;
+            }
+        }
+    }
+
+    *pos = p;
+    *value = n;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_parse_string(ngx_pool_t *pool, u_char **pos,
+    u_char *end, ngx_str_t *str, ngx_log_t *log)
+{
+    u_char      *p, *dst, state;
+    ngx_uint_t   huff, len;
+
+    p = *pos;
+
+    if (p == end) {
+        return NGX_ERROR;
+    }
+
+    huff = *p & 0x80;
+
+    if (ngx_http_upstream_http2_parse_int(&p, end, 7, &len) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if ((size_t) (end - p) < len) {
+        return NGX_ERROR;
+    }
+
+    if (huff) {
+        dst = ngx_pnalloc(pool, len * 8 / 5 + 1);
+        if (dst == NULL) {
+            return NGX_ERROR;
+        }
+
+        str->data = dst;
+        state = 0;
+
+        if (ngx_http_v2_huff_decode(&state, p, len, &dst, 1, log) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        str->len = dst - str->data;
+
+    } else {
+
+        /* the header block outlives the decoded header */
+
+        str->data = p;
+        str->len = len;
+    }
+
+    *pos = p + len;
+
+    return NGX_OK;
+}
+
+
+static ngx_http_upstream_http2_stream_t *
+ngx_http_upstream_http2_find_stream(ngx_http_upstream_http2_session_t *s,
+    ngx_uint_t sid)
+{
+    ngx_queue_t                       *q;
+    ngx_http_upstream_http2_stream_t  *st;
+
+    for (q = ngx_queue_head(&s->streams);
+         q != ngx_queue_sentinel(&s->streams);
+         q = ngx_queue_next(q))
+    {
+        st = ngx_queue_data(q, ngx_http_upstream_http2_stream_t, queue);
+
+        if (st->sid == sid) {
+            return st;
+        }
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_http_upstream_http2_stream_error(ngx_http_upstream_http2_stream_t *st,
+    ngx_uint_t status)
+{
+    ngx_http_upstream_http2_session_t  *s;
+
+    s = st->session;
+
+    if (status && !st->reset) {
+        (void) ngx_http_upstream_http2_send_rst_stream(s, st->sid, status);
+        st->reset = 1;
+    }
+
+    st->error = 1;
+
+    ngx_http_upstream_http2_wake(&st->read);
+    ngx_http_upstream_http2_wake(&st->write);
+}
+
+
+static void
+ngx_http_upstream_http2_wake(ngx_event_t *ev)
+{
+    ev->ready = 1;
+
+    ngx_post_event(ev, &ngx_posted_events);
+}
+
+
+static ngx_http_upstream_http2_frame_t *
+ngx_http_upstream_http2_alloc(ngx_http_upstream_http2_session_t *s,
+    size_t size)
+{
+    ngx_http_upstream_http2_frame_t  *f;
+
+    f = ngx_alloc(sizeof(ngx_http_upstream_http2_frame_t) + size,
+                  s->connection->log);
+    if (f == NULL) {
+        return NULL;
+    }
+
+    ngx_memzero(&f->buf, sizeof(ngx_buf_t));
+
+    f->buf.start = (u_char *) f + sizeof(ngx_http_upstream_http2_frame_t);
+    f->buf.pos = f->buf.start;
+    f->buf.last = f->buf.start;
+    f->buf.end = f->buf.start + size;
+    f->buf.memory = 1;
+
+    f->chain.buf = &f->buf;
+    f->chain.next = NULL;
+
+    f->next = NULL;
+
+    return f;
+}
+
+
+static ngx_http_upstream_http2_frame_t *
+ngx_http_upstream_http2_frame(ngx_http_upstream_http2_session_t *s, size_t len,
+    ngx_uint_t type, ngx_uint_t flags, ngx_uint_t sid)
+{
+    u_char                           *p;
+    ngx_http_upstream_http2_frame_t  *f;
+
+    f = ngx_http_upstream_http2_alloc(s, NGX_HTTP_V2_FRAME_HEADER_SIZE + len);
+    if (f == NULL) {
+        return NULL;
+    }
+
+    p = f->buf.last;
+
+    p = ngx_http_v2_write_len_and_type(p, len, type);
+    *p++ = (u_char) flags;
+    p = ngx_http_v2_write_sid(p, sid);
+
+    f->buf.last = p;
+
+    return f;
+}
+
+
+static void
+ngx_http_upstream_http2_queue(ngx_http_upstream_http2_session_t *s,
+    ngx_http_upstream_http2_frame_t *f)
+{
+    if (s->last) {
+        s->last->next = f;
+        s->last->chain.next = &f->chain;
+
+    } else {
+        s->out = f;
+    }
+
+    s->last = f;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_send_rst_stream(ngx_http_upstream_http2_session_t *s,
+    ngx_uint_t sid, ngx_uint_t status)
+{
+    ngx_http_upstream_http2_frame_t  *f;
+
+    if (sid == 0) {
+        return NGX_OK;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, s->connection->log, 0,
+                   "http2 upstream send RST_STREAM sid:%ui status:%ui",
+                   sid, status);
+
+    f = ngx_http_upstream_http2_frame(s, 4, NGX_HTTP_V2_RST_STREAM_FRAME,
+                                      NGX_HTTP_V2_NO_FLAG, sid);
+    if (f == NULL) {
+        return NGX_ERROR;
+    }
+
+    f->buf.last = ngx_http_v2_write_uint32(f->buf.last, status);
+
+    ngx_http_upstream_http2_queue(s, f);
+    ngx_http_upstream_http2_flush(s);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_send_window_update(
+    ngx_http_upstream_http2_session_t *s, ngx_uint_t sid, size_t window)
+{
+    ngx_http_upstream_http2_frame_t  *f;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, s->connection->log, 0,
+                   "http2 upstream send WINDOW_UPDATE sid:%ui window:%uz",
+                   sid, window);
+
+    f = ngx_http_upstream_http2_frame(s, 4, NGX_HTTP_V2_WINDOW_UPDATE_FRAME,
+                                      NGX_HTTP_V2_NO_FLAG, sid);
+    if (f == NULL) {
+        return NGX_ERROR;
+    }
+
+    f->buf.last = ngx_http_v2_write_uint32(f->buf.last, window);
+
+    ngx_http_upstream_http2_queue(s, f);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_http2_flush(ngx_http_upstream_http2_session_t *s)
+{
+    if (s->connected && s->out) {
+        ngx_post_event(s->connection->write, &ngx_posted_events);
+    }
+}
+
+
+static ngx_http_upstream_http2_stream_t *
+ngx_http_upstream_http2_stream_create(ngx_http_upstream_http2_session_t *s,
+    ngx_http_request_t *r, ngx_peer_connection_t *pc)
+{
+    ngx_pool_t                        *pool;
+    ngx_connection_t                  *c, *fc;
+    ngx_http_upstream_http2_stream_t  *st;
+
+    c = s->connection;
+
+    pool = ngx_create_pool(1024, pc->log);
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    st = ngx_pcalloc(pool, sizeof(ngx_http_upstream_http2_stream_t));
+    if (st == NULL) {
+        ngx_destroy_pool(pool);
+        return NULL;
+    }
+
+    /*
+     * the upstream module works with the stream through a fake connection
+     * which shares the socket of the session but never touches it directly
+     */
+
+    fc = &st->connection;
+
+    fc->fd = c->fd;
+    fc->read = &st->read;
+    fc->write = &st->write;
+    fc->pool = pool;
+    fc->log = pc->log;
+    fc->log_error = pc->log_error;
+
+    fc->recv = ngx_http_upstream_http2_recv;
+    fc->send = ngx_http_upstream_http2_stream_send;
+    fc->recv_chain = ngx_http_upstream_http2_recv_chain;
+    fc->send_chain = ngx_http_upstream_http2_send_chain;
+
+    fc->sockaddr = c->sockaddr;
+    fc->socklen = c->socklen;
+    fc->number = c->number;
+
+    fc->sndlowat = 1;
+    fc->tcp_nodelay = NGX_TCP_NODELAY_SET;
+    fc->tcp_nopush = NGX_TCP_NOPUSH_DISABLED;
+
+    st->read.data = fc;
+    st->read.log = pc->log;
+    st->read.index = NGX_INVALID_INDEX;
+    st->read.active = 1;
+
+    st->write.data = fc;
+    st->write.log = pc->log;
+    st->write.index = NGX_INVALID_INDEX;
+    st->write.write = 1;
+    st->write.active = 1;
+    st->write.ready = 1;
+
+    st->session = s;
+    st->request = r;
+    st->recv_window = NGX_HTTP_UPSTREAM_HTTP2_WINDOW;
+
+    ngx_queue_insert_tail(&s->streams, &st->queue);
+    s->nstreams++;
+
+    c->idle = 0;
+
+    if (c->read->timer_set) {
+        ngx_del_timer(c->read);
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "http2 upstream stream %p, session %p", st, c);
+
+    return st;
+}
+
+
+static void
+ngx_http_upstream_http2_stream_close(ngx_http_upstream_http2_stream_t *st)
+{
+    ngx_http_upstream_http2_in_t       *in;
+    ngx_http_upstream_http2_session_t  *s;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, st->connection.log, 0,
+                   "http2 upstream close stream %p, sid:%ui", st, st->sid);
+
+    s = st->session;
+
+    if (s) {
+
+        if (!st->reset && !(st->eof && st->end_stream)) {
+            (void) ngx_http_upstream_http2_send_rst_stream(s, st->sid,
+                                               NGX_HTTP_UPSTREAM_HTTP2_CANCEL);
+        }
+
+        ngx_queue_remove(&st->queue);
+
+        if (--s->nstreams == 0) {
+            ngx_http_upstream_http2_idle(s);
+        }
+    }
+
+    while (st->in) {
+        in = st->in;
+        st->in = in->next;
+        ngx_free(in);
+    }
+
+    if (st->read.timer_set) {
+        ngx_del_timer(&st->read);
+    }
+
+    if (st->write.timer_set) {
+        ngx_del_timer(&st->write);
+    }
+
+    if (st->read.posted) {
+        ngx_delete_posted_event(&st->read);
+    }
+
+    if (st->write.posted) {
+        ngx_delete_posted_event(&st->write);
+    }
+
+    ngx_destroy_pool(st->connection.pool);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_append(ngx_http_upstream_http2_stream_t *st,
+    u_char *data, size_t len, ngx_uint_t flags)
+{
+    ngx_http_upstream_http2_in_t  *in;
+
+    in = ngx_alloc(sizeof(ngx_http_upstream_http2_in_t) + len,
+                   st->connection.log);
+    if (in == NULL) {
+        return NGX_ERROR;
+    }
+
+    in->pos = (u_char *) in + sizeof(ngx_http_upstream_http2_in_t);
+    in->last = ngx_cpymem(in->pos, data, len);
+    in->data = flags;
+    in->next = NULL;
+
+    if (st->in_last) {
+        st->in_last->next = in;
+
+    } else {
+        st->in = in;
+    }
+
+    st->in_last = in;
+
+    return NGX_OK;
+}
+
+
+static ssize_t
+ngx_http_upstream_http2_recv(ngx_connection_t *c, u_char *buf, size_t size)
+{
+    size_t                              n, len, consumed, window;
+    ngx_event_t                        *rev;
+    ngx_http_upstream_http2_in_t       *in;
+    ngx_http_upstream_http2_stream_t   *st;
+    ngx_http_upstream_http2_session_t  *s;
+
+    st = ngx_http_upstream_http2_stream(c);
+    rev = c->read;
+
+    n = 0;
+    consumed = 0;
+
+    while (st->in && n < size) {
+        in = st->in;
+
+        len = ngx_min((size_t) (in->last - in->pos), size - n);
+
+        ngx_memcpy(buf + n, in->pos, len);
+
+        in->pos += len;
+        n += len;
+
+        if (in->data) {
+            consumed += len;
+        }
+
+        if (in->pos == in->last) {
+            st->in = in->next;
+
+            if (st->in == NULL) {
+                st->in_last = NULL;
+            }
+
+            ngx_free(in);
+        }
+    }
+
+    s = st->session;
+
+    if (consumed) {
+        st->buffered -= consumed;
+
+        /* reopen the stream window once half of it is consumed */
+
+        if (s && !st->eof && !st->reset) {
+            window = NGX_HTTP_UPSTREAM_HTTP2_WINDOW
+                     - st->recv_window - st->buffered;
+
+            if (window >= NGX_HTTP_UPSTREAM_HTTP2_WINDOW / 2
+                && ngx_http_upstream_http2_send_window_update(s, st->sid,
+                                                              window)
+                   == NGX_OK)
+            {
+                st->recv_window += window;
+                ngx_http_upstream_http2_flush(s);
+            }
+        }
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http2 upstream recv: %uz of %uz", n, size);
+
+    if (n) {
+        rev->ready = (st->in || st->eof || st->error);
+        return n;
+    }
+
+    if (st->error) {
+        rev->ready = 0;
+        rev->error = 1;
+        return NGX_ERROR;
+    }
+
+    if (st->eof) {
+        rev->ready = 0;
+        rev->eof = 1;
+        return 0;
+    }
+
+    rev->ready = 0;
+
+    return NGX_AGAIN;
+}
+
+
+static ssize_t
+ngx_http_upstream_http2_recv_chain(ngx_connection_t *c, ngx_chain_t *cl,
+    off_t limit)
+{
+    size_t      size;
+    ssize_t     n, total;
+    ngx_buf_t  *b;
+
+    total = 0;
+
+    for ( /* void */ ; cl; cl = cl->next) {
+
+        b = cl->buf;
+        size = b->end - b->last;
+
+        if (limit) {
+            if (total >= limit) {
+                break;
+            }
+
+            size = ngx_min(size, (size_t) (limit - total));
+        }
+
+        if (size == 0) {
+            continue;
+        }
+
+        /* like ngx_readv_chain(), buffers are advanced by the caller */
+
+        n = ngx_http_upstream_http2_recv(c, b->last, size);
+
+        if (n > 0) {
+            total += n;
+
+            if ((size_t) n < size) {
+                break;
+            }
+
+            continue;
+        }
+
+        if (total) {
+            break;
+        }
+
+        return n;
+    }
+
+    return total;
+}
+
+
+static ssize_t
+ngx_http_upstream_http2_stream_send(ngx_connection_t *c, u_char *buf,
+    size_t size)
+{
+    ngx_buf_t    b;
+    ngx_chain_t  cl;
+
+    ngx_memzero(&b, sizeof(ngx_buf_t));
+
+    b.start = buf;
+    b.pos = buf;
+    b.last = buf + size;
+    b.end = buf + size;
+    b.memory = 1;
+
+    cl.buf = &b;
+    cl.next = NULL;
+
+    if (ngx_http_upstream_http2_send_chain(c, &cl, 0) == NGX_CHAIN_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if (b.pos == buf) {
+        return NGX_AGAIN;
+    }
+
+    return b.pos - buf;
+}
+
+
+static ngx_chain_t *
+ngx_http_upstream_http2_send_chain(ngx_connection_t *c, ngx_chain_t *in,
+    off_t limit)
+{
+    off_t                               size, n;
+    ngx_int_t                           rc;
+    ngx_buf_t                          *b;
+    ngx_http_upstream_http2_stream_t   *st;
+    ngx_http_upstream_http2_session_t  *s;
+
+    st = ngx_http_upstream_http2_stream(c);
+    s = st->session;
+
+    if (s == NULL || st->error) {
+        goto failed;
+    }
+
+    for ( ;; ) {
+
+        while (in && ngx_buf_size(in->buf) == 0) {
+            in = in->next;
+        }
+
+        if (in == NULL) {
+            break;
+        }
+
+        b = in->buf;
+        size = ngx_buf_size(b);
+
+        if (!st->header_sent) {
+
+            if (!ngx_buf_in_memory(b)) {
+                ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                              "http2 upstream request header in file");
+                goto failed;
+            }
+
+            rc = ngx_http_upstream_http2_read_head(st, b);
+
+            if (rc == NGX_ERROR) {
+                goto failed;
+            }
+
+            if (rc == NGX_OK
+                && ngx_http_upstream_http2_send_headers(st) != NGX_OK)
+            {
+                goto failed;
+            }
+
+            c->sent += size - ngx_buf_size(b);
+            continue;
+        }
+
+        if (st->end_stream || st->reset) {
+
+            /* the rest of the request body is not needed */
+
+            if (ngx_buf_in_memory(b)) {
+                b->pos = b->last;
+            }
+
+            if (b->in_file) {
+                b->file_pos = b->file_last;
+            }
+
+            c->sent += size;
+            continue;
+        }
+
+        if (st->send_window <= 0 || s->send_window <= 0) {
+            st->blocked = 1;
+            break;
+        }
+
+        n = ngx_min(st->send_window, s->send_window);
+        n = ngx_min(n, (off_t) s->frame_size);
+
+        if (st->chunked_body) {
+
+            if (!ngx_buf_in_memory(b)) {
+                ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                              "http2 upstream chunked request body in file");
+                goto failed;
+            }
+
+            rc = ngx_http_parse_chunked(st->request, b, &st->chunked);
+
+            if (rc == NGX_OK) {
+
+                /* a chunk has been parsed successfully */
+
+                n = ngx_min(n, st->chunked.size);
+                n = ngx_min(n, b->last - b->pos);
+
+                if (n && ngx_http_upstream_http2_send_data(st, b, n, 0)
+                         != NGX_OK)
+                {
+                    goto failed;
+                }
+
+                st->chunked.size -= n;
+
+            } else if (rc == NGX_DONE) {
+
+                /* a whole request body has been parsed successfully */
+
+                if (ngx_http_upstream_http2_send_data(st, NULL, 0,
+                                                  NGX_HTTP_V2_END_STREAM_FLAG)
+                    != NGX_OK)
+                {
+                    goto failed;
+                }
+
+            } else if (rc != NGX_AGAIN) {
+                ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                              "http2 upstream invalid chunked request body");
+                goto failed;
+            }
+
+        } else {
+
+            n = ngx_min(n, size);
+            n = ngx_min(n, st->rest);
+
+            if (ngx_http_upstream_http2_send_data(st, b, n,
+                                                  st->rest == n
+                                                  ? NGX_HTTP_V2_END_STREAM_FLAG
+                                                  : 0)
+                != NGX_OK)
+            {
+                goto failed;
+            }
+
+            st->rest -= n;
+        }
+
+        c->sent += size - ngx_buf_size(b);
+    }
+
+    ngx_http_upstream_http2_flush(s);
+
+    if (st->blocked) {
+        c->write->ready = 0;
+    }
+
+    return in;
+
+failed:
+
+    st->error = 1;
+    c->write->error = 1;
+
+    return NGX_CHAIN_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_read_head(ngx_http_upstream_http2_stream_t *st,
+    ngx_buf_t *b)
+{
+    u_char  *p, *head, ch;
+    size_t   size;
+
+    for (p = b->pos; p < b->last; p++) {
+
+        if (st->head_len == st->head_size) {
+            size = ngx_max(st->head_size * 2, (size_t) (b->last - b->pos));
+            size = ngx_max(size, 1024);
+
+            head = ngx_pnalloc(st->connection.pool, size);
+            if (head == NULL) {
+                return NGX_ERROR;
+            }
+
+            if (st->head_len) {
+                ngx_memcpy(head, st->head, st->head_len);
+            }
+
+            st->head = head;
+            st->head_size = size;
+        }
+
+        ch = *p;
+
+        st->head[st->head_len++] = ch;
+
+        if (ch == LF) {
+
+            if (st->line == 0) {
+                b->pos = p + 1;
+                return NGX_OK;
+            }
+
+            st->line = 0;
+            continue;
+        }
+
+        if (ch != CR) {
+            st->line++;
+        }
+    }
+
+    b->pos = b->last;
+
+    return NGX_AGAIN;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_send_headers(ngx_http_upstream_http2_stream_t *st)
+{
+    u_char                             *p, *last, *end, *sp, *pos, *block, *tmp;
+    size_t                              len, n;
+    ngx_str_t                           method, path, scheme, authority;
+    ngx_str_t                           name, value;
+    ngx_uint_t                          i, type, flags, indexing;
+    ngx_array_t                         headers;
+    ngx_http_v2_header_t               *h;
+    ngx_http_upstream_http2_frame_t    *f;
+    ngx_http_upstream_http2_session_t  *s;
+
+    static ngx_str_t  method_name = ngx_string(":method");
+    static ngx_str_t  scheme_name = ngx_string(":scheme");
+    static ngx_str_t  authority_name = ngx_string(":authority");
+    static ngx_str_t  path_name = ngx_string(":path");
+
+    s = st->session;
+
+    if (s->goaway) {
+        ngx_log_error(NGX_LOG_ERR, st->connection.log, 0,
+                      "http2 upstream session is closing");
+        return NGX_ERROR;
+    }
+
+    if (ngx_array_init(&headers, st->connection.pool, 16,
+                       sizeof(ngx_http_v2_header_t))
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    /* the request line as generated by the proxy module */
+
+    p = st->head;
+    last = st->head + st->head_len;
+
+    end = ngx_strlchr(p, last, LF);
+
+    if (end > p && *(end - 1) == CR) {
+        end--;
+    }
+
+    sp = ngx_strlchr(p, end, ' ');
+
+    if (sp == NULL) {
+        goto invalid;
+    }
+
+    method.data = p;
+    method.len = sp - p;
+
+    p = sp + 1;
+
+    for (sp = end - 1; sp > p && *sp != ' '; sp--) { /* void */ }
+
+    if (sp == p) {
+        goto invalid;
+    }
+
+    path.data = p;
+    path.len = sp - p;
+
+    ngx_str_null(&authority);
+
+    /* header lines */
+
+    for (p = ngx_strlchr(p, last, LF) + 1; p < last; p = end + 1) {
+
+        end = ngx_strlchr(p, last, LF);
+
+        if (end == NULL) {
+            end = last;
+        }
+
+        name.data = p;
+
+        p = end;
+
+        if (p > name.data && *(p - 1) == CR) {
+            p--;
+        }
+
+        if (p == name.data) {
+            break;
+        }
+
+        sp = ngx_strlchr(name.data, p, ':');
+
+        if (sp == NULL) {
+            goto invalid;
+        }
+
+        name.len = sp - name.data;
+        ngx_strlow(name.data, name.data, name.len);
+
+        for (sp++; sp < p && (*sp == ' ' || *sp == '\t'); sp++) { /* void */ }
+
+        while (p > sp && (*(p - 1) == ' ' || *(p - 1) == '\t')) {
+            p--;
+        }
+
+        value.data = sp;
+        value.len = p - sp;
+
+        if (name.len == 4 && ngx_strncmp(name.data, "host", 4) == 0) {
+            authority = value;
+            continue;
+        }
+
+        if (name.len == 14
+            && ngx_strncmp(name.data, "content-length", 14) == 0)
+        {
+            st->rest = ngx_atoof(value.data, value.len);
+
+            if (st->rest == NGX_ERROR) {
+                goto invalid;
+            }
+
+            st->body = (st->rest > 0);
+
+        } else if (name.len == 17
+                   && ngx_strncmp(name.data, "transfer-encoding", 17) == 0)
+        {
+            if (value.len == 7
+                && ngx_strncasecmp(value.data, (u_char *) "chunked", 7) == 0)
+            {
+                st->chunked_body = 1;
+                st->body = 1;
+            }
+
+            continue;
+
+        } else if ((name.len == 10
+                    && ngx_strncmp(name.data, "connection", 10) == 0)
+                   || (name.len == 10
+                       && ngx_strncmp(name.data, "keep-alive", 10) == 0)
+                   || (name.len == 16
+                       && ngx_strncmp(name.data, "proxy-connection", 16) == 0)
+                   || (name.len == 7
+                       && ngx_strncmp(name.data, "upgrade", 7) == 0))
+        {
+            continue;
+
+        } else if (name.len == 2 && ngx_strncmp(name.data, "te", 2) == 0) {
+
+            if (value.len != 8
+                || ngx_strncasecmp(value.data, (u_char *) "trailers", 8) != 0)
+            {
+                continue;
+            }
+        }
+
+        h = ngx_array_push(&headers);
+        if (h == NULL) {
+            return NGX_ERROR;
+        }
+
+        h->name = name;
+        h->value = value;
+    }
+
+#if (NGX_HTTP_SSL)
+    if (s->ssl) {
+        ngx_str_set(&scheme, "https");
+
+    } else
+#endif
+    {
+        ngx_str_set(&scheme, "http");
+    }
+
+    /* literal fields take at most a few octets more than the text */
+
+    len = st->head_len + 16 * (headers.nelts + 5);
+
+    block = ngx_pnalloc(st->connection.pool, len);
+    if (block == NULL) {
+        return NGX_ERROR;
+    }
+
+    tmp = ngx_pnalloc(st->connection.pool, st->head_len);
+    if (tmp == NULL) {
+        return NGX_ERROR;
+    }
+
+    /*
+     * from now on the HPACK state of the session is modified,
+     * so a failure has to close the whole session
+     */
+
+    pos = block;
+
+    if (s->table_update) {
+        *pos = 0x20;
+        pos = ngx_http_upstream_http2_write_int(pos, ngx_http_v2_prefix(5), 0);
+        s->table_update = 0;
+    }
+
+    pos = ngx_http_upstream_http2_encode(s, pos, &method_name, &method,
+                                         NGX_HTTP_UPSTREAM_HTTP2_INDEX, tmp);
+    if (pos == NULL) {
+        goto failed;
+    }
+
+    pos = ngx_http_upstream_http2_encode(s, pos, &scheme_name, &scheme,
+                                         NGX_HTTP_UPSTREAM_HTTP2_INDEX, tmp);
+    if (pos == NULL) {
+        goto failed;
+    }
+
+    if (authority.len) {
+        pos = ngx_http_upstream_http2_encode(s, pos, &authority_name,
+                                             &authority,
+                                             NGX_HTTP_UPSTREAM_HTTP2_INDEX,
+                                             tmp);
+        if (pos == NULL) {
+            goto failed;
+        }
+    }
+
+    pos = ngx_http_upstream_http2_encode(s, pos, &path_name, &path, 0, tmp);
+    if (pos == NULL) {
+        goto failed;
+    }
+
+    h = headers.elts;
+
+    for (i = 0; i < headers.nelts; i++) {
+
+        /*
+         * requests of different clients share the compression context,
+         * so credentials are never indexed
+         */
+
+        if ((h[i].name.len == 13
+             && ngx_strncmp(h[i].name.data, "authorization", 13) == 0)
+            || (h[i].name.len == 19
+                && ngx_strncmp(h[i].name.data, "proxy-authorization", 19)
+                   == 0)
+            || (h[i].name.len == 6
+                && ngx_strncmp(h[i].name.data, "cookie", 6) == 0))
+        {
+            indexing = NGX_HTTP_UPSTREAM_HTTP2_NEVER_INDEX;
+
+        } else if ((h[i].name.len == 14
+                    && ngx_strncmp(h[i].name.data, "content-length", 14) == 0)
+                   || h[i].value.len > 256)
+        {
+            indexing = 0;
+
+        } else {
+            indexing = NGX_HTTP_UPSTREAM_HTTP2_INDEX;
+        }
+
+        pos = ngx_http_upstream_http2_encode(s, pos, &h[i].name, &h[i].value,
+                                             indexing, tmp);
+        if (pos == NULL) {
+            goto failed;
+        }
+    }
+
+    len = pos - block;
+
+    st->sid = s->next_sid;
+    s->next_sid += 2;
+
+    /* stop opening streams well before identifiers run out */
+
+    if (s->next_sid + 2 * s->conf->streams > NGX_HTTP_UPSTREAM_HTTP2_MAX_SID) {
+        s->goaway = 1;
+    }
+
+    st->send_window = s->init_window;
+    st->header_sent = 1;
+
+    if (!st->body) {
+        st->end_stream = 1;
+    }
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, st->connection.log, 0,
+                   "http2 upstream stream sid:%ui \"%V %V\" header:%uz",
+                   st->sid, &method, &path, len);
+
+    type = NGX_HTTP_V2_HEADERS_FRAME;
+    p = block;
+
+    do {
+        n = ngx_min(len, s->frame_size);
+
+        flags = (n == len) ? NGX_HTTP_V2_END_HEADERS_FLAG : NGX_HTTP_V2_NO_FLAG;
+
+        if (type == NGX_HTTP_V2_HEADERS_FRAME && !st->body) {
+            flags |= NGX_HTTP_V2_END_STREAM_FLAG;
+        }
+
+        f = ngx_http_upstream_http2_frame(s, n, type, flags, st->sid);
+        if (f == NULL) {
+            goto failed;
+        }
+
+        f->buf.last = ngx_cpymem(f->buf.last, p, n);
+
+        ngx_http_upstream_http2_queue(s, f);
+
+        p += n;
+        len -= n;
+
+        type = NGX_HTTP_V2_CONTINUATION_FRAME;
+
+    } while (len);
+
+    return NGX_OK;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_ALERT, st->connection.log, 0,
+                  "http2 upstream cannot parse request header");
+
+    return NGX_ERROR;
+
+failed:
+
+    ngx_http_upstream_http2_close_session(s);
+
+    return NGX_ERROR;
+}
+
+
+static u_char *
+ngx_http_upstream_http2_encode(ngx_http_upstream_http2_session_t *s, u_char *p,
+    ngx_str_t *name, ngx_str_t *value, ngx_uint_t flags, u_char *tmp)
+{
+    ngx_str_t             *n, *v;
+    ngx_uint_t             i, index;
+    ngx_http_v2_hpack_t   *hpack;
+    ngx_http_v2_header_t  *entry, header;
+
+    index = 0;
+
+    for (i = 1; i <= NGX_HTTP_UPSTREAM_HTTP2_STATIC_TABLE_ENTRIES; i++) {
+        n = ngx_http_v2_get_static_name(i);
+
+        if (n->len != name->len
+            || ngx_strncmp(n->data, name->data, n->len) != 0)
+        {
+            continue;
+        }
+
+        v = ngx_http_v2_get_static_value(i);
+
+        if (v->len
+            && v->len == value->len
+            && ngx_strncmp(v->data, value->data, v->len) == 0)
+        {
+            *p = 0x80;
+            return ngx_http_upstream_http2_write_int(p, ngx_http_v2_prefix(7),
+                                                     i);
+        }
+
+        if (index == 0) {
+            index = i;
+        }
+    }
+
+    hpack = &s->encoder.hpack;
+
+    if (!s->no_index && hpack->entries) {
+
+        for (i = 0; i < hpack->added - hpack->deleted; i++) {
+            entry = hpack->entries[(hpack->added - i - 1) % hpack->allocated];
+
+            if (ngx_http_upstream_http2_table_cmp(hpack, &entry->name, name)
+                != 0)
+            {
+                continue;
+            }
+
+            if (ngx_http_upstream_http2_table_cmp(hpack, &entry->value, value)
+                == 0)
+            {
+                *p = 0x80;
+                return ngx_http_upstream_http2_write_int(p,
+                                 ngx_http_v2_prefix(7),
+                                 NGX_HTTP_UPSTREAM_HTTP2_STATIC_TABLE_ENTRIES
+                                 + 1 + i);
+            }
+
+            if (index == 0) {
+                index = NGX_HTTP_UPSTREAM_HTTP2_STATIC_TABLE_ENTRIES + 1 + i;
+            }
+        }
+    }
+
+    if ((flags & NGX_HTTP_UPSTREAM_HTTP2_INDEX) && !s->no_index) {
+
+        /* literal header field with incremental indexing */
+
+        *p = 0x40;
+        p = ngx_http_upstream_http2_write_int(p, ngx_http_v2_prefix(6), index);
+
+        header.name = *name;
+        header.value = *value;
+
+        if (ngx_http_v2_add_header(&s->encoder, &header) != NGX_OK) {
+            return NULL;
+        }
+
+    } else {
+
+        /* literal header field without indexing or never indexed */
+
+        *p = (flags & NGX_HTTP_UPSTREAM_HTTP2_NEVER_INDEX) ? 0x10 : 0;
+        p = ngx_http_upstream_http2_write_int(p, ngx_http_v2_prefix(4), index);
+    }
+
+    if (index == 0) {
+        p = ngx_http_v2_write_name(p, name->data, name->len, tmp);
+    }
+
+    return ngx_http_v2_write_value(p, value->data, value->len, tmp);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_table_cmp(ngx_http_v2_hpack_t *hpack, ngx_str_t *entry,
+    ngx_str_t *str)
+{
+    size_t  rest;
+
+    if (entry->len != str->len) {
+        return 1;
+    }
+
+    /* entries may wrap around the end of the table storage */
+
+    rest = hpack->storage + NGX_HTTP_UPSTREAM_HTTP2_TABLE_SIZE - entry->data;
+
+    if (entry->len > rest) {
+        return ngx_memcmp(entry->data, str->data, rest)
+               || ngx_memcmp(hpack->storage, str->data + rest,
+                             entry->len - rest);
+    }
+
+    return ngx_memcmp(entry->data, str->data, entry->len);
+}
+
+
+static u_char *
+ngx_http_upstream_http2_write_int(u_char *pos, ngx_uint_t prefix,
+    ngx_uint_t value)
+{
+    if (value < prefix) {
+        *pos++ |= value;
+        return pos;
+    }
+
+    *pos++ |= prefix;
+    value -= prefix;
+
+    while (value >= 128) {
+        *pos++ = value % 128 + 128;
+        value /= 128;
+    }
+
+    *pos++ = (u_char) value;
+
+    return pos;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_send_data(ngx_http_upstream_http2_stream_t *st,
+    ngx_buf_t *b, size_t size, ngx_uint_t flags)
+{
+    ssize_t                             n;
+    ngx_http_upstream_http2_frame_t    *f;
+    ngx_http_upstream_http2_session_t  *s;
+
+    s = st->session;
+
+    f = ngx_http_upstream_http2_frame(s, size, NGX_HTTP_V2_DATA_FRAME, flags,
+                                      st->sid);
+    if (f == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (size) {
+
+        if (ngx_buf_in_memory(b)) {
+            f->buf.last = ngx_cpymem(f->buf.last, b->pos, size);
+            b->pos += size;
+
+        } else {
+            n = ngx_read_file(b->file, f->buf.last, size, b->file_pos);
+
+            if (n != (ssize_t) size) {
+                ngx_free(f);
+                return NGX_ERROR;
+            }
+
+            f->buf.last += size;
+        }
+
+        if (b->in_file) {
+            b->file_pos += size;
+        }
+    }
+
+    ngx_http_upstream_http2_queue(s, f);
+
+    st->send_window -= size;
+    s->send_window -= size;
+
+    if (flags & NGX_HTTP_V2_END_STREAM_FLAG) {
+        st->end_stream = 1;
+    }
+
+    return NGX_OK;
+}
+
+
+static void *
+ngx_http_upstream_http2_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_upstream_http2_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_http2_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->original_init_upstream = NULL;
+     *     conf->original_init_peer = NULL;
+     *     conf->upstream = NULL;
+     */
+
+    conf->streams = NGX_CONF_UNSET_UINT;
+    conf->timeout = NGX_CONF_UNSET_MSEC;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_upstream_http2(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_upstream_http2_srv_conf_t  *hcf = conf;
+
+    ngx_int_t                      n;
+    ngx_str_t                     *value, s;
+    ngx_uint_t                     i;
+    ngx_msec_t                     timeout;
+    ngx_http_upstream_srv_conf_t  *uscf;
+
+    if (hcf->original_init_upstream) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "streams=", 8) == 0) {
+
+            n = ngx_atoi(value[i].data + 8, value[i].len - 8);
+
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            hcf->streams = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
+
+            s.len = value[i].len - 8;
+            s.data = value[i].data + 8;
+
+            timeout = ngx_parse_time(&s, 0);
+
+            if (timeout == (ngx_msec_t) NGX_ERROR || timeout == 0) {
+                goto invalid;
+            }
+
+            hcf->timeout = timeout;
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    /* init upstream handler */
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    hcf->original_init_upstream = uscf->peer.init_upstream
+                                  ? uscf->peer.init_upstream
+                                  : ngx_http_upstream_init_round_robin;
+
+    uscf->peer.init_upstream = ngx_http_upstream_init_http2;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
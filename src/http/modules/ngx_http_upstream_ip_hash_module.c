@@ -163,7 +163,9 @@ ngx_http_upstream_get_ip_hash_peer(ngx_peer_connection_t *pc, void *data)
 
     ngx_http_upstream_rr_peers_rlock(iphp->rrp.peers);
 
-    if (iphp->tries > 20 || iphp->rrp.peers->single) {
+    if (iphp->tries > 20 || iphp->rrp.peers->single
+        || ngx_http_upstream_rr_peers_changed(&iphp->rrp))
+    {
         ngx_http_upstream_rr_peers_unlock(iphp->rrp.peers);
         return iphp->get_rr_peer(pc, &iphp->rrp);
     }
@@ -203,7 +205,7 @@ ngx_http_upstream_get_ip_hash_peer(ngx_peer_connection_t *pc, void *data)
 
         ngx_http_upstream_rr_peer_lock(iphp->rrp.peers, peer);
 
-        if (peer->down) {
+        if (peer->down || peer->unhealthy) {
             ngx_http_upstream_rr_peer_unlock(iphp->rrp.peers, peer);
             goto next;
         }
@@ -8,6 +8,34 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 #include <ngx_http.h>
+#if !(NGX_WIN32)
+#include <ngx_channel.h>
+#endif
+
+
+#define NGX_HTTP_UPSTREAM_KEEPALIVE_WANTED  16
+#define NGX_HTTP_UPSTREAM_KEEPALIVE_SLOT    0x7ff
+
+#define NGX_HTTP_UPSTREAM_KEEPALIVE_BURST   4
+
+
+typedef struct {
+    ngx_atomic_t                       hits;
+    ngx_atomic_t                       misses;
+    ngx_atomic_t                       passed;
+
+    /* (peer hash & ~SLOT) | (process slot + 1) of a worker that missed */
+    ngx_atomic_t                       wanted[NGX_HTTP_UPSTREAM_KEEPALIVE_WANTED];
+
+    ngx_uint_t                         workers;
+    ngx_atomic_t                       idle[1];
+} ngx_http_upstream_keepalive_shctx_t;
+
+
+typedef struct {
+    ngx_array_t                        upstreams;
+    ngx_cycle_t                       *cycle;
+} ngx_http_upstream_keepalive_main_conf_t;
 
 
 typedef struct {
@@ -18,6 +46,35 @@ typedef struct {
     ngx_queue_t                        cache;
     ngx_queue_t                        free;
 
+    ngx_uint_t                         cached;
+
+    ngx_flag_t                         shared;
+    ngx_uint_t                         index;
+    ngx_str_t                          name;
+    ngx_http_upstream_keepalive_shctx_t  *sh;
+
+    ngx_flag_t                         prewarm;
+    ngx_uint_t                         prewarm_min;
+    ngx_uint_t                         prewarm_max;
+    ngx_msec_t                         prewarm_interval;
+
+    ngx_http_upstream_srv_conf_t      *upstream;
+
+    /* prewarm state of a worker process */
+
+    ngx_uint_t                         workers;
+    ngx_uint_t                         busy;
+    ngx_msec_t                         busy_time;
+    ngx_uint_t                         demand;
+    ngx_queue_t                        pending;
+    ngx_event_t                        event;
+    ngx_msec_t                         last;
+    ngx_http_upstream_conf_t          *conf;
+#if (NGX_HTTP_SSL)
+    ngx_uint_t                         ssl;
+    ngx_str_t                          ssl_name;
+#endif
+
     ngx_http_upstream_init_pt          original_init_upstream;
     ngx_http_upstream_init_peer_pt     original_init_peer;
 
@@ -36,6 +93,21 @@ typedef struct {
 } ngx_http_upstream_keepalive_cache_t;
 
 
+typedef struct {
+    ngx_http_upstream_keepalive_srv_conf_t  *conf;
+
+    ngx_queue_t                        queue;
+    ngx_peer_connection_t              peer;
+    ngx_http_upstream_rr_peer_data_t   rrp;
+    ngx_log_t                          log;
+
+    socklen_t                          socklen;
+    ngx_sockaddr_t                     sockaddr;
+    ngx_str_t                          name;
+
+} ngx_http_upstream_keepalive_prewarm_t;
+
+
 typedef struct {
     ngx_http_upstream_keepalive_srv_conf_t  *conf;
 
@@ -43,6 +115,9 @@ typedef struct {
 
     void                              *data;
 
+    ngx_msec_t                         start;
+    ngx_uint_t                         busy;
+
     ngx_event_get_peer_pt              original_get_peer;
     ngx_event_free_peer_pt             original_free_peer;
 
@@ -61,10 +136,28 @@ static ngx_int_t ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc,
 static void ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc,
     void *data, ngx_uint_t state);
 
+static void ngx_http_upstream_keepalive_save(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf, ngx_connection_t *c,
+    struct sockaddr *sockaddr, socklen_t socklen);
 static void ngx_http_upstream_keepalive_dummy_handler(ngx_event_t *ev);
 static void ngx_http_upstream_keepalive_close_handler(ngx_event_t *ev);
 static void ngx_http_upstream_keepalive_close(ngx_connection_t *c);
 
+static ngx_uint_t ngx_http_upstream_keepalive_idle(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf);
+static ngx_uint_t ngx_http_upstream_keepalive_share(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf);
+static void ngx_http_upstream_keepalive_account(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf);
+#if !(NGX_WIN32)
+static void ngx_http_upstream_keepalive_want(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf, ngx_peer_connection_t *pc);
+static ngx_int_t ngx_http_upstream_keepalive_pass(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf, ngx_connection_t *c,
+    ngx_peer_connection_t *pc);
+static void ngx_http_upstream_keepalive_receive(ngx_channel_t *ch);
+#endif
+
 #if (NGX_HTTP_SSL)
 static ngx_int_t ngx_http_upstream_keepalive_set_session(
     ngx_peer_connection_t *pc, void *data);
@@ -72,15 +165,52 @@ static void ngx_http_upstream_keepalive_save_session(ngx_peer_connection_t *pc,
     void *data);
 #endif
 
+static void ngx_http_upstream_keepalive_prewarm_handler(ngx_event_t *ev);
+static ngx_uint_t ngx_http_upstream_keepalive_count(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf, struct sockaddr *sockaddr,
+    socklen_t socklen);
+static void ngx_http_upstream_keepalive_prewarm_connect(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf,
+    ngx_http_upstream_rr_peers_t *peers, ngx_http_upstream_rr_peer_t *peer);
+static void ngx_http_upstream_keepalive_prewarm_connect_handler(
+    ngx_event_t *ev);
+#if (NGX_HTTP_SSL)
+static void ngx_http_upstream_keepalive_prewarm_ssl_handshake(
+    ngx_connection_t *c);
+#endif
+static void ngx_http_upstream_keepalive_prewarm_done(
+    ngx_http_upstream_keepalive_prewarm_t *pw);
+static void ngx_http_upstream_keepalive_prewarm_failed(
+    ngx_http_upstream_keepalive_prewarm_t *pw);
+static ngx_int_t ngx_http_upstream_keepalive_test_connect(ngx_connection_t *c);
+static u_char *ngx_http_upstream_keepalive_log_error(ngx_log_t *log,
+    u_char *buf, size_t len);
+static void ngx_http_upstream_keepalive_learn(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf, ngx_http_upstream_t *u,
+    ngx_connection_t *c);
+
+static ngx_int_t ngx_http_upstream_keepalive_status_handler(
+    ngx_http_request_t *r);
+
+static ngx_int_t ngx_http_upstream_keepalive_init(ngx_conf_t *cf);
+static ngx_int_t ngx_http_upstream_keepalive_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+static ngx_int_t ngx_http_upstream_keepalive_init_process(ngx_cycle_t *cycle);
+
+static void *ngx_http_upstream_keepalive_create_main_conf(ngx_conf_t *cf);
 static void *ngx_http_upstream_keepalive_create_conf(ngx_conf_t *cf);
 static char *ngx_http_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char *ngx_http_upstream_keepalive_prewarm(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static char *ngx_http_upstream_keepalive_status(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
 
 
 static ngx_command_t  ngx_http_upstream_keepalive_commands[] = {
 
     { ngx_string("keepalive"),
-      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE12,
       ngx_http_upstream_keepalive,
       NGX_HTTP_SRV_CONF_OFFSET,
       0,
@@ -100,15 +230,30 @@ static ngx_command_t  ngx_http_upstream_keepalive_commands[] = {
       offsetof(ngx_http_upstream_keepalive_srv_conf_t, requests),
       NULL },
 
+    { ngx_string("keepalive_prewarm"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE123,
+      ngx_http_upstream_keepalive_prewarm,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("upstream_keepalive_status"),
+      NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_http_upstream_keepalive_status,
+      0,
+      0,
+      NULL },
+
       ngx_null_command
 };
 
 
 static ngx_http_module_t  ngx_http_upstream_keepalive_module_ctx = {
     NULL,                                  /* preconfiguration */
-    NULL,                                  /* postconfiguration */
+    ngx_http_upstream_keepalive_init,      /* postconfiguration */
 
-    NULL,                                  /* create main configuration */
+    ngx_http_upstream_keepalive_create_main_conf,
+                                           /* create main configuration */
     NULL,                                  /* init main configuration */
 
     ngx_http_upstream_keepalive_create_conf, /* create server configuration */
@@ -126,7 +271,7 @@ ngx_module_t  ngx_http_upstream_keepalive_module = {
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_http_upstream_keepalive_init_process, /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
     NULL,                                  /* exit process */
@@ -157,6 +302,7 @@ ngx_http_upstream_init_keepalive(ngx_conf_t *cf,
     }
 
     kcf->original_init_peer = us->peer.init;
+    kcf->upstream = us;
 
     us->peer.init = ngx_http_upstream_init_keepalive_peer;
 
@@ -207,6 +353,7 @@ ngx_http_upstream_init_keepalive_peer(ngx_http_request_t *r,
     kp->data = r->upstream->peer.data;
     kp->original_get_peer = r->upstream->peer.get;
     kp->original_free_peer = r->upstream->peer.free;
+    kp->busy = 0;
 
     r->upstream->peer.data = kp;
     r->upstream->peer.get = ngx_http_upstream_get_keepalive_peer;
@@ -244,6 +391,12 @@ ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc, void *data)
         return rc;
     }
 
+    if (kp->conf->prewarm) {
+        kp->start = ngx_current_msec;
+        kp->busy = 1;
+        kp->conf->busy++;
+    }
+
     /* search cache for suitable connection */
 
     cache = &kp->conf->cache;
@@ -266,10 +419,23 @@ ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc, void *data)
         }
     }
 
+#if !(NGX_WIN32)
+    if (kp->conf->shared) {
+        ngx_http_upstream_keepalive_want(kp->conf, pc);
+    }
+#endif
+
     return NGX_OK;
 
 found:
 
+    kp->conf->cached--;
+
+    if (kp->conf->shared) {
+        ngx_http_upstream_keepalive_account(kp->conf);
+        (void) ngx_atomic_fetch_add(&kp->conf->sh->hits, 1);
+    }
+
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "get keepalive peer: using connection %p", c);
 
@@ -297,15 +463,19 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
     ngx_uint_t state)
 {
     ngx_http_upstream_keepalive_peer_data_t  *kp = data;
-    ngx_http_upstream_keepalive_cache_t      *item;
 
-    ngx_queue_t          *q;
     ngx_connection_t     *c;
     ngx_http_upstream_t  *u;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "free keepalive peer");
 
+    if (kp->busy) {
+        kp->busy = 0;
+        kp->conf->busy--;
+        kp->conf->busy_time += ngx_current_msec - kp->start;
+    }
+
     /* cache valid connections */
 
     u = kp->upstream;
@@ -330,6 +500,13 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
         goto invalid;
     }
 
+    if (u->multiplexed) {
+
+        /* a stream is owned by its multiplexed connection */
+
+        goto invalid;
+    }
+
     if (!u->request_body_sent) {
         goto invalid;
     }
@@ -342,12 +519,59 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
         goto invalid;
     }
 
+    if (kp->conf->shared) {
+
+#if !(NGX_WIN32)
+        if (ngx_http_upstream_keepalive_pass(kp->conf, c, pc) == NGX_OK) {
+            ngx_http_upstream_keepalive_close(c);
+            pc->connection = NULL;
+            goto invalid;
+        }
+#endif
+
+        /*
+         * each worker may keep its fair share of the limit, a worker
+         * above it stops caching while the limit is exceeded
+         */
+
+        if (kp->conf->cached >= ngx_http_upstream_keepalive_share(kp->conf)
+            && ngx_http_upstream_keepalive_idle(kp->conf)
+               > kp->conf->max_cached)
+        {
+            goto invalid;
+        }
+    }
+
+    if (kp->conf->prewarm) {
+        ngx_http_upstream_keepalive_learn(kp->conf, u, c);
+    }
+
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "free keepalive peer: saving connection %p", c);
 
-    if (ngx_queue_empty(&kp->conf->free)) {
+    pc->connection = NULL;
+
+    ngx_http_upstream_keepalive_save(kp->conf, c, pc->sockaddr, pc->socklen);
+
+invalid:
+
+    kp->original_free_peer(pc, kp->data, state);
+}
+
+
+static void
+ngx_http_upstream_keepalive_save(ngx_http_upstream_keepalive_srv_conf_t *kcf,
+    ngx_connection_t *c, struct sockaddr *sockaddr, socklen_t socklen)
+{
+    ngx_queue_t                          *q;
+    ngx_http_upstream_keepalive_cache_t  *item;
 
-        q = ngx_queue_last(&kp->conf->cache);
+    if (ngx_queue_empty(&kcf->free)
+        || (kcf->shared
+            && kcf->cached >= ngx_http_upstream_keepalive_share(kcf)
+            && ngx_http_upstream_keepalive_idle(kcf) >= kcf->max_cached))
+    {
+        q = ngx_queue_last(&kcf->cache);
         ngx_queue_remove(q);
 
         item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
@@ -355,20 +579,24 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
         ngx_http_upstream_keepalive_close(item->connection);
 
     } else {
-        q = ngx_queue_head(&kp->conf->free);
+        q = ngx_queue_head(&kcf->free);
         ngx_queue_remove(q);
 
         item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
+
+        kcf->cached++;
+
+        if (kcf->shared) {
+            ngx_http_upstream_keepalive_account(kcf);
+        }
     }
 
-    ngx_queue_insert_head(&kp->conf->cache, q);
+    ngx_queue_insert_head(&kcf->cache, q);
 
     item->connection = c;
 
-    pc->connection = NULL;
-
     c->read->delayed = 0;
-    ngx_add_timer(c->read, kp->conf->timeout);
+    ngx_add_timer(c->read, kcf->timeout);
 
     if (c->write->timer_set) {
         ngx_del_timer(c->write);
@@ -384,16 +612,12 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
     c->write->log = ngx_cycle->log;
     c->pool->log = ngx_cycle->log;
 
-    item->socklen = pc->socklen;
-    ngx_memcpy(&item->sockaddr, pc->sockaddr, pc->socklen);
+    item->socklen = socklen;
+    ngx_memcpy(&item->sockaddr, sockaddr, socklen);
 
     if (c->read->ready) {
         ngx_http_upstream_keepalive_close_handler(c->read);
     }
-
-invalid:
-
-    kp->original_free_peer(pc, kp->data, state);
 }
 
 
@@ -445,6 +669,12 @@ close:
 
     ngx_queue_remove(&item->queue);
     ngx_queue_insert_head(&conf->free, &item->queue);
+
+    conf->cached--;
+
+    if (conf->shared) {
+        ngx_http_upstream_keepalive_account(conf);
+    }
 }
 
 
@@ -471,92 +701,1286 @@ ngx_http_upstream_keepalive_close(ngx_connection_t *c)
 }
 
 
-#if (NGX_HTTP_SSL)
+static ngx_uint_t
+ngx_http_upstream_keepalive_idle(ngx_http_upstream_keepalive_srv_conf_t *kcf)
+{
+    ngx_uint_t  i, n;
 
-static ngx_int_t
-ngx_http_upstream_keepalive_set_session(ngx_peer_connection_t *pc, void *data)
+    n = 0;
+
+    for (i = 0; i < kcf->sh->workers; i++) {
+        n += kcf->sh->idle[i];
+    }
+
+    return n;
+}
+
+
+static ngx_uint_t
+ngx_http_upstream_keepalive_share(ngx_http_upstream_keepalive_srv_conf_t *kcf)
 {
-    ngx_http_upstream_keepalive_peer_data_t  *kp = data;
+    ngx_uint_t  n;
 
-    return kp->original_set_session(pc, kp->data);
+    n = kcf->max_cached / kcf->sh->workers;
+
+    return n ? n : 1;
 }
 
 
 static void
-ngx_http_upstream_keepalive_save_session(ngx_peer_connection_t *pc, void *data)
+ngx_http_upstream_keepalive_account(ngx_http_upstream_keepalive_srv_conf_t *kcf)
 {
-    ngx_http_upstream_keepalive_peer_data_t  *kp = data;
+    if (ngx_worker < kcf->sh->workers) {
+        kcf->sh->idle[ngx_worker] = kcf->cached;
+    }
+}
 
-    kp->original_save_session(pc, kp->data);
-    return;
+
+#if !(NGX_WIN32)
+
+static void
+ngx_http_upstream_keepalive_want(ngx_http_upstream_keepalive_srv_conf_t *kcf,
+    ngx_peer_connection_t *pc)
+{
+    uint32_t  hash;
+
+    (void) ngx_atomic_fetch_add(&kcf->sh->misses, 1);
+
+    if (ngx_process != NGX_PROCESS_WORKER) {
+        return;
+    }
+
+    /*
+     * remember that this worker has no idle connection to the peer,
+     * so that the next worker which frees one will pass it over
+     */
+
+    hash = ngx_crc32_short((u_char *) pc->sockaddr, pc->socklen);
+
+    kcf->sh->wanted[hash % NGX_HTTP_UPSTREAM_KEEPALIVE_WANTED] =
+                                (hash & ~NGX_HTTP_UPSTREAM_KEEPALIVE_SLOT)
+                                | (ngx_process_slot + 1);
 }
 
+
+static ngx_int_t
+ngx_http_upstream_keepalive_pass(ngx_http_upstream_keepalive_srv_conf_t *kcf,
+    ngx_connection_t *c, ngx_peer_connection_t *pc)
+{
+    uint32_t           hash;
+    ngx_int_t          slot;
+    ngx_atomic_t      *wanted;
+    ngx_channel_t      ch;
+    ngx_atomic_uint_t  v;
+
+    if (ngx_process != NGX_PROCESS_WORKER) {
+        return NGX_DECLINED;
+    }
+
+#if (NGX_HTTP_SSL)
+
+    /* SSL state cannot be passed to another process */
+
+    if (c->ssl) {
+        return NGX_DECLINED;
+    }
+
 #endif
 
+    hash = ngx_crc32_short((u_char *) pc->sockaddr, pc->socklen);
 
-static void *
-ngx_http_upstream_keepalive_create_conf(ngx_conf_t *cf)
-{
-    ngx_http_upstream_keepalive_srv_conf_t  *conf;
+    wanted = &kcf->sh->wanted[hash % NGX_HTTP_UPSTREAM_KEEPALIVE_WANTED];
+    v = *wanted;
 
-    conf = ngx_pcalloc(cf->pool,
-                       sizeof(ngx_http_upstream_keepalive_srv_conf_t));
-    if (conf == NULL) {
-        return NULL;
+    if (v == 0
+        || (v & ~NGX_HTTP_UPSTREAM_KEEPALIVE_SLOT)
+           != (hash & ~NGX_HTTP_UPSTREAM_KEEPALIVE_SLOT))
+    {
+        return NGX_DECLINED;
+    }
+
+    slot = (v & NGX_HTTP_UPSTREAM_KEEPALIVE_SLOT) - 1;
+
+    if (slot == ngx_process_slot
+        || slot >= ngx_last_process
+        || ngx_processes[slot].pid == -1
+        || ngx_processes[slot].channel[0] == -1)
+    {
+        return NGX_DECLINED;
+    }
+
+    if (!ngx_atomic_cmp_set(wanted, v, 0)) {
+        return NGX_DECLINED;
+    }
+
+    ngx_memzero(&ch, sizeof(ngx_channel_t));
+
+    ch.command = NGX_CMD_PASS_CONNECTION;
+    ch.pid = ngx_pid;
+    ch.slot = ngx_process_slot;
+    ch.fd = c->fd;
+    ch.tag = kcf->index;
+
+    if (ngx_write_channel(ngx_processes[slot].channel[0],
+                          &ch, sizeof(ngx_channel_t), pc->log)
+        != NGX_OK)
+    {
+        /* the other worker still wants a connection, unless wanted again */
+
+        (void) ngx_atomic_cmp_set(wanted, 0, v);
+
+        return NGX_DECLINED;
     }
 
     /*
-     * set by ngx_pcalloc():
-     *
-     *     conf->original_init_upstream = NULL;
-     *     conf->original_init_peer = NULL;
-     *     conf->max_cached = 0;
+     * the socket stays open in the other process, so closing it here
+     * does not remove it from the epoll set: delete the events explicitly
      */
 
-    conf->timeout = NGX_CONF_UNSET_MSEC;
-    conf->requests = NGX_CONF_UNSET_UINT;
+    if (ngx_del_conn) {
+        ngx_del_conn(c, 0);
 
-    return conf;
+    } else {
+        if (c->read->active || c->read->disabled) {
+            ngx_del_event(c->read, NGX_READ_EVENT, 0);
+        }
+
+        if (c->write->active || c->write->disabled) {
+            ngx_del_event(c->write, NGX_WRITE_EVENT, 0);
+        }
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "free keepalive peer: passed connection %p to %P fd:%d",
+                   c, ngx_processes[slot].pid, c->fd);
+
+    (void) ngx_atomic_fetch_add(&kcf->sh->passed, 1);
+
+    return NGX_OK;
 }
 
 
-static char *
-ngx_http_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+static void
+ngx_http_upstream_keepalive_receive(ngx_channel_t *ch)
 {
-    ngx_http_upstream_srv_conf_t            *uscf;
-    ngx_http_upstream_keepalive_srv_conf_t  *kcf = conf;
+    ngx_int_t                                 event;
+    ngx_log_t                                *log;
+    socklen_t                                 socklen;
+    ngx_sockaddr_t                            sa;
+    ngx_connection_t                         *c;
+    ngx_http_upstream_keepalive_srv_conf_t  **kcfp;
+    ngx_http_upstream_keepalive_main_conf_t  *kmcf;
+
+    log = ngx_cycle->log;
+
+    kmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+                                           ngx_http_upstream_keepalive_module);
+
+    if (kmcf == NULL
+        || ch->tag >= kmcf->upstreams.nelts
+        || ngx_terminate
+        || ngx_exiting)
+    {
+        goto failed;
+    }
 
-    ngx_int_t    n;
-    ngx_str_t   *value;
+    kcfp = kmcf->upstreams.elts;
 
-    if (kcf->max_cached) {
-        return "is duplicate";
+    socklen = sizeof(ngx_sockaddr_t);
+
+    if (getpeername(ch->fd, &sa.sockaddr, &socklen) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_socket_errno,
+                      "getpeername() of passed connection failed");
+        goto failed;
     }
 
-    /* read options */
+    c = ngx_get_connection(ch->fd, log);
+    if (c == NULL) {
+        goto failed;
+    }
 
-    value = cf->args->elts;
+    c->pool = ngx_create_pool(128, log);
+    if (c->pool == NULL) {
+        ngx_close_connection(c);
+        return;
+    }
 
-    n = ngx_atoi(value[1].data, value[1].len);
+    c->recv = ngx_recv;
+    c->send = ngx_send;
+    c->recv_chain = ngx_recv_chain;
+    c->send_chain = ngx_send_chain;
 
-    if (n == NGX_ERROR || n == 0) {
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                           "invalid value \"%V\" in \"%V\" directive",
-                           &value[1], &cmd->name);
-        return NGX_CONF_ERROR;
+    c->sendfile = 1;
+    c->log_error = NGX_ERROR_ERR;
+
+    c->read->log = log;
+    c->write->log = log;
+
+    c->number = ngx_atomic_fetch_add(ngx_connection_counter, 1);
+
+    if (ngx_add_conn) {
+        if (ngx_add_conn(c) == NGX_ERROR) {
+            goto close;
+        }
+
+    } else {
+        event = (ngx_event_flags & NGX_USE_CLEAR_EVENT) ? NGX_CLEAR_EVENT
+                                                        : NGX_LEVEL_EVENT;
+
+        if (ngx_add_event(c->read, NGX_READ_EVENT, event) != NGX_OK) {
+            goto close;
+        }
     }
 
-    kcf->max_cached = n;
+    c->write->ready = 1;
 
-    /* init upstream handler */
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "keepalive connection %p fd:%d passed from %P",
+                   c, c->fd, ch->pid);
 
-    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+    ngx_http_upstream_keepalive_save(kcfp[ch->tag], c, &sa.sockaddr, socklen);
 
-    kcf->original_init_upstream = uscf->peer.init_upstream
-                                  ? uscf->peer.init_upstream
-                                  : ngx_http_upstream_init_round_robin;
+    return;
 
-    uscf->peer.init_upstream = ngx_http_upstream_init_keepalive;
+close:
 
-    return NGX_CONF_OK;
+    ngx_destroy_pool(c->pool);
+    ngx_close_connection(c);
+    return;
+
+failed:
+
+    if (close(ch->fd) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      "close() passed connection failed");
+    }
+}
+
+#endif
+
+
+static void
+ngx_http_upstream_keepalive_prewarm_handler(ngx_event_t *ev)
+{
+    ngx_http_upstream_keepalive_srv_conf_t *kcf = ev->data;
+
+    ngx_msec_t                     elapsed;
+    ngx_uint_t                     demand, min, max, limit, want, have, total,
+                                   n;
+    ngx_queue_t                   *q;
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_rr_peers_t  *peers;
+
+    if (ngx_terminate || ngx_exiting) {
+        return;
+    }
+
+    /*
+     * the number of connections busy on average over the last interval
+     * is the request rate multiplied by the time a request holds
+     * a connection; the target decays slowly when the rate falls
+     */
+
+    elapsed = ngx_current_msec - kcf->last;
+    kcf->last = ngx_current_msec;
+
+    if (elapsed == 0) {
+        elapsed = 1;
+    }
+
+    demand = (kcf->busy_time + elapsed - 1) / elapsed;
+    demand = ngx_max(demand, kcf->busy);
+
+    kcf->busy_time = 0;
+
+    if (demand >= kcf->demand) {
+        kcf->demand = demand;
+
+    } else {
+        kcf->demand -= (kcf->demand - demand + 3) / 4;
+    }
+
+    /* limits are set for all workers, each worker keeps its part */
+
+    min = (kcf->prewarm_min + kcf->workers - 1 - ngx_worker) / kcf->workers;
+    max = kcf->prewarm_max
+          ? (kcf->prewarm_max + kcf->workers - 1 - ngx_worker) / kcf->workers
+          : kcf->max_cached;
+
+    limit = kcf->shared ? ngx_http_upstream_keepalive_share(kcf)
+                        : kcf->max_cached;
+
+    total = kcf->cached;
+
+    for (q = ngx_queue_head(&kcf->pending);
+         q != ngx_queue_sentinel(&kcf->pending);
+         q = ngx_queue_next(q))
+    {
+        total++;
+    }
+
+    peers = kcf->upstream->peer.data;
+
+    ngx_http_upstream_rr_peers_rlock(peers);
+
+    for (peer = peers->peer; peer; peer = peer->next) {
+
+        if (peer->down || peer->unhealthy) {
+            continue;
+        }
+
+        want = (kcf->demand * peer->weight + peers->total_weight - 1)
+               / peers->total_weight;
+
+        want = ngx_max(want, min);
+        want = ngx_min(want, max);
+
+        have = ngx_http_upstream_keepalive_count(kcf, peer->sockaddr,
+                                                 peer->socklen);
+
+        for (n = 0;
+             have + n < want
+             && n < NGX_HTTP_UPSTREAM_KEEPALIVE_BURST
+             && total < limit;
+             n++, total++)
+        {
+            ngx_http_upstream_keepalive_prewarm_connect(kcf, peers, peer);
+        }
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    ngx_add_timer(ev, kcf->prewarm_interval);
+}
+
+
+static ngx_uint_t
+ngx_http_upstream_keepalive_count(ngx_http_upstream_keepalive_srv_conf_t *kcf,
+    struct sockaddr *sockaddr, socklen_t socklen)
+{
+    ngx_uint_t                              n;
+    ngx_queue_t                            *q;
+    ngx_http_upstream_keepalive_cache_t    *item;
+    ngx_http_upstream_keepalive_prewarm_t  *pw;
+
+    n = 0;
+
+    for (q = ngx_queue_head(&kcf->cache);
+         q != ngx_queue_sentinel(&kcf->cache);
+         q = ngx_queue_next(q))
+    {
+        item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
+
+        if (ngx_memn2cmp((u_char *) &item->sockaddr, (u_char *) sockaddr,
+                         item->socklen, socklen)
+            == 0)
+        {
+            n++;
+        }
+    }
+
+    for (q = ngx_queue_head(&kcf->pending);
+         q != ngx_queue_sentinel(&kcf->pending);
+         q = ngx_queue_next(q))
+    {
+        pw = ngx_queue_data(q, ngx_http_upstream_keepalive_prewarm_t, queue);
+
+        if (ngx_memn2cmp((u_char *) &pw->sockaddr, (u_char *) sockaddr,
+                         pw->socklen, socklen)
+            == 0)
+        {
+            n++;
+        }
+    }
+
+    return n;
+}
+
+
+static void
+ngx_http_upstream_keepalive_prewarm_connect(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf,
+    ngx_http_upstream_rr_peers_t *peers, ngx_http_upstream_rr_peer_t *peer)
+{
+    ngx_int_t                               rc;
+    ngx_msec_t                              timeout;
+    ngx_pool_t                             *pool;
+    ngx_connection_t                       *c;
+    ngx_http_upstream_keepalive_prewarm_t  *pw;
+
+    pool = ngx_create_pool(128, ngx_cycle->log);
+    if (pool == NULL) {
+        return;
+    }
+
+    pw = ngx_pcalloc(pool, sizeof(ngx_http_upstream_keepalive_prewarm_t));
+    if (pw == NULL) {
+        goto failed;
+    }
+
+    pw->conf = kcf;
+
+    pw->socklen = peer->socklen;
+    ngx_memcpy(&pw->sockaddr, peer->sockaddr, peer->socklen);
+
+    pw->name.data = ngx_pstrdup(pool, &peer->name);
+    if (pw->name.data == NULL) {
+        goto failed;
+    }
+
+    pw->name.len = peer->name.len;
+
+    /* the peer may be gone by the time the connection is established */
+
+    pw->rrp.peers = peers;
+    pw->rrp.current = peer;
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    pw->rrp.config = peers->config ? *peers->config : 0;
+#endif
+
+    pw->log = *ngx_cycle->log;
+    pw->log.handler = ngx_http_upstream_keepalive_log_error;
+    pw->log.data = pw;
+    pw->log.action = "prewarming connection";
+
+    pw->peer.sockaddr = &pw->sockaddr.sockaddr;
+    pw->peer.socklen = pw->socklen;
+    pw->peer.name = &pw->name;
+    pw->peer.get = ngx_event_get_peer;
+    pw->peer.log = &pw->log;
+    pw->peer.log_error = NGX_ERROR_ERR;
+
+    rc = ngx_event_connect_peer(&pw->peer);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        goto failed;
+    }
+
+    /* rc == NGX_OK || rc == NGX_AGAIN */
+
+    c = pw->peer.connection;
+
+    c->pool = pool;
+    c->data = pw;
+
+    c->read->handler = ngx_http_upstream_keepalive_prewarm_connect_handler;
+    c->write->handler = ngx_http_upstream_keepalive_prewarm_connect_handler;
+
+    ngx_queue_insert_tail(&kcf->pending, &pw->queue);
+
+    timeout = kcf->conf ? kcf->conf->connect_timeout : 60000;
+
+    ngx_add_timer(c->write, timeout);
+
+    if (rc == NGX_OK) {
+        ngx_post_event(c->write, &ngx_posted_events);
+    }
+
+    return;
+
+failed:
+
+    ngx_destroy_pool(pool);
+}
+
+
+static void
+ngx_http_upstream_keepalive_prewarm_connect_handler(ngx_event_t *ev)
+{
+    ngx_connection_t                        *c;
+    ngx_http_upstream_keepalive_prewarm_t   *pw;
+#if (NGX_HTTP_SSL)
+    ngx_int_t                                rc;
+    ngx_http_upstream_keepalive_srv_conf_t  *kcf;
+#endif
+
+    c = ev->data;
+    pw = c->data;
+
+    if (ev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                      "upstream timed out");
+        ngx_http_upstream_keepalive_prewarm_failed(pw);
+        return;
+    }
+
+    if (ngx_http_upstream_keepalive_test_connect(c) != NGX_OK) {
+        ngx_http_upstream_keepalive_prewarm_failed(pw);
+        return;
+    }
+
+#if (NGX_HTTP_SSL)
+
+    kcf = pw->conf;
+
+    if (kcf->ssl) {
+
+        if (ngx_ssl_create_connection(kcf->conf->ssl, c,
+                                      NGX_SSL_BUFFER|NGX_SSL_CLIENT)
+            != NGX_OK)
+        {
+            ngx_http_upstream_keepalive_prewarm_failed(pw);
+            return;
+        }
+
+#ifdef SSL_CTRL_SET_TLSEXT_HOSTNAME
+
+        if (kcf->conf->ssl_server_name && kcf->ssl_name.len) {
+            if (SSL_set_tlsext_host_name(c->ssl->connection,
+                                         (char *) kcf->ssl_name.data)
+                == 0)
+            {
+                ngx_ssl_error(NGX_LOG_ERR, c->log, 0,
+                              "SSL_set_tlsext_host_name(\"%s\") failed",
+                              kcf->ssl_name.data);
+                ngx_http_upstream_keepalive_prewarm_failed(pw);
+                return;
+            }
+        }
+
+#endif
+
+        if (kcf->conf->ssl_session_reuse
+            && !ngx_http_upstream_rr_peers_changed(&pw->rrp))
+        {
+            if (ngx_http_upstream_set_round_robin_peer_session(&pw->peer,
+                                                               &pw->rrp)
+                != NGX_OK)
+            {
+                ngx_http_upstream_keepalive_prewarm_failed(pw);
+                return;
+            }
+        }
+
+        c->log->action = "SSL handshaking to upstream";
+
+        rc = ngx_ssl_handshake(c);
+
+        if (rc == NGX_AGAIN) {
+            c->ssl->handler = ngx_http_upstream_keepalive_prewarm_ssl_handshake;
+            return;
+        }
+
+        ngx_http_upstream_keepalive_prewarm_ssl_handshake(c);
+        return;
+    }
+
+#endif
+
+    ngx_http_upstream_keepalive_prewarm_done(pw);
+}
+
+
+#if (NGX_HTTP_SSL)
+
+static void
+ngx_http_upstream_keepalive_prewarm_ssl_handshake(ngx_connection_t *c)
+{
+    long                                     rc;
+    ngx_http_upstream_keepalive_prewarm_t   *pw;
+    ngx_http_upstream_keepalive_srv_conf_t  *kcf;
+
+    pw = c->data;
+    kcf = pw->conf;
+
+    if (!c->ssl->handshaked) {
+
+        if (c->write->timedout) {
+            ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                          "upstream timed out");
+        }
+
+        ngx_http_upstream_keepalive_prewarm_failed(pw);
+        return;
+    }
+
+    if (kcf->conf->ssl_verify) {
+        rc = SSL_get_verify_result(c->ssl->connection);
+
+        if (rc != X509_V_OK) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                          "upstream SSL certificate verify error: (%l:%s)",
+                          rc, X509_verify_cert_error_string(rc));
+            ngx_http_upstream_keepalive_prewarm_failed(pw);
+            return;
+        }
+
+        if (ngx_ssl_check_host(c, &kcf->ssl_name) != NGX_OK) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                          "upstream SSL certificate does not match \"%V\"",
+                          &kcf->ssl_name);
+            ngx_http_upstream_keepalive_prewarm_failed(pw);
+            return;
+        }
+    }
+
+    if (kcf->conf->ssl_session_reuse
+        && !ngx_http_upstream_rr_peers_changed(&pw->rrp))
+    {
+        ngx_http_upstream_save_round_robin_peer_session(&pw->peer, &pw->rrp);
+    }
+
+    /* file buffers can only be sent over kernel TLS */
+
+    c->sendfile = c->ssl->sendfile;
+
+    ngx_http_upstream_keepalive_prewarm_done(pw);
+}
+
+#endif
+
+
+static void
+ngx_http_upstream_keepalive_prewarm_done(
+    ngx_http_upstream_keepalive_prewarm_t *pw)
+{
+    ngx_connection_t  *c;
+
+    c = pw->peer.connection;
+
+    ngx_queue_remove(&pw->queue);
+
+    if (ngx_terminate
+        || ngx_exiting
+        || ngx_handle_read_event(c->read, 0) != NGX_OK)
+    {
+        ngx_http_upstream_keepalive_close(c);
+        return;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "keepalive prewarm: saving connection %p to %V",
+                   c, &pw->name);
+
+    ngx_http_upstream_keepalive_save(pw->conf, c, &pw->sockaddr.sockaddr,
+                                     pw->socklen);
+}
+
+
+static void
+ngx_http_upstream_keepalive_prewarm_failed(
+    ngx_http_upstream_keepalive_prewarm_t *pw)
+{
+    ngx_queue_remove(&pw->queue);
+
+    ngx_http_upstream_keepalive_close(pw->peer.connection);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_keepalive_test_connect(ngx_connection_t *c)
+{
+    int        err;
+    socklen_t  len;
+
+#if (NGX_HAVE_KQUEUE)
+
+    if (ngx_event_flags & NGX_USE_KQUEUE_EVENT)  {
+        if (c->write->pending_eof || c->read->pending_eof) {
+            if (c->write->pending_eof) {
+                err = c->write->kq_errno;
+
+            } else {
+                err = c->read->kq_errno;
+            }
+
+            (void) ngx_connection_error(c, err,
+                                    "kevent() reported that connect() failed");
+            return NGX_ERROR;
+        }
+
+    } else
+#endif
+    {
+        err = 0;
+        len = sizeof(int);
+
+        /*
+         * BSDs and Linux return 0 and set a pending error in err
+         * Solaris returns -1 and sets errno
+         */
+
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len)
+            == -1)
+        {
+            err = ngx_socket_errno;
+        }
+
+        if (err) {
+            (void) ngx_connection_error(c, err, "connect() failed");
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static u_char *
+ngx_http_upstream_keepalive_log_error(ngx_log_t *log, u_char *buf, size_t len)
+{
+    u_char                                 *p;
+    ngx_http_upstream_keepalive_prewarm_t  *pw;
+
+    p = buf;
+
+    if (log->action) {
+        p = ngx_snprintf(buf, len, " while %s", log->action);
+        len -= p - buf;
+        buf = p;
+    }
+
+    pw = log->data;
+
+    p = ngx_snprintf(buf, len, ", upstream: \"%V\", peer: %V",
+                     &pw->conf->upstream->host, &pw->name);
+
+    return p;
+}
+
+
+static void
+ngx_http_upstream_keepalive_learn(ngx_http_upstream_keepalive_srv_conf_t *kcf,
+    ngx_http_upstream_t *u, ngx_connection_t *c)
+{
+    /*
+     * proxy parameters are only known from requests, so prewarmed
+     * connections are made like those of the first request seen
+     */
+
+    if (kcf->conf == NULL) {
+        kcf->conf = u->conf;
+    }
+
+#if (NGX_HTTP_SSL)
+
+    if (c->ssl && !kcf->ssl) {
+
+        kcf->ssl_name.data = ngx_pnalloc(ngx_cycle->pool, u->ssl_name.len + 1);
+        if (kcf->ssl_name.data == NULL) {
+            return;
+        }
+
+        (void) ngx_cpystrn(kcf->ssl_name.data, u->ssl_name.data,
+                           u->ssl_name.len + 1);
+        kcf->ssl_name.len = u->ssl_name.len;
+
+        kcf->conf = u->conf;
+        kcf->ssl = 1;
+    }
+
+#endif
+}
+
+
+static ngx_int_t
+ngx_http_upstream_keepalive_status_handler(ngx_http_request_t *r)
+{
+    size_t                                    len;
+    ngx_int_t                                 rc;
+    ngx_buf_t                                *b;
+    ngx_uint_t                                i;
+    ngx_chain_t                               out;
+    ngx_http_upstream_keepalive_shctx_t      *sh;
+    ngx_http_upstream_keepalive_srv_conf_t  **kcfp;
+    ngx_http_upstream_keepalive_main_conf_t  *kmcf;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    kmcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_keepalive_module);
+    kcfp = kmcf->upstreams.elts;
+
+    len = 0;
+
+    for (i = 0; i < kmcf->upstreams.nelts; i++) {
+        len += sizeof("upstream  idle  hits  misses  passed " CRLF) - 1
+               + kcfp[i]->name.len + 4 * NGX_ATOMIC_T_LEN;
+    }
+
+    r->headers_out.content_type_len = sizeof("text/plain") - 1;
+    ngx_str_set(&r->headers_out.content_type, "text/plain");
+    r->headers_out.content_type_lowcase = NULL;
+
+    if (len == 0) {
+        r->header_only = 1;
+    }
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = 0;
+
+    b = NULL;
+
+    if (len) {
+        b = ngx_create_temp_buf(r->pool, len);
+        if (b == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        for (i = 0; i < kmcf->upstreams.nelts; i++) {
+            sh = kcfp[i]->sh;
+
+            b->last = ngx_sprintf(b->last,
+                                  "upstream %V idle %ui hits %uA misses %uA "
+                                  "passed %uA" CRLF,
+                                  &kcfp[i]->name,
+                                  ngx_http_upstream_keepalive_idle(kcfp[i]),
+                                  sh->hits, sh->misses, sh->passed);
+        }
+
+        b->last_buf = (r == r->main) ? 1 : 0;
+        b->last_in_chain = 1;
+
+        r->headers_out.content_length_n = b->last - b->pos;
+    }
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+#if (NGX_HTTP_SSL)
+
+static ngx_int_t
+ngx_http_upstream_keepalive_set_session(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_upstream_keepalive_peer_data_t  *kp = data;
+
+    return kp->original_set_session(pc, kp->data);
+}
+
+
+static void
+ngx_http_upstream_keepalive_save_session(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_upstream_keepalive_peer_data_t  *kp = data;
+
+    kp->original_save_session(pc, kp->data);
+    return;
+}
+
+#endif
+
+
+static ngx_int_t
+ngx_http_upstream_keepalive_init(ngx_conf_t *cf)
+{
+    size_t                                    size;
+    ngx_str_t                                 name;
+    ngx_uint_t                                i;
+    ngx_shm_zone_t                           *shm_zone;
+    ngx_http_upstream_srv_conf_t            **uscfp;
+    ngx_http_upstream_main_conf_t            *umcf;
+    ngx_http_upstream_keepalive_srv_conf_t   *kcf;
+    ngx_http_upstream_keepalive_main_conf_t  *kmcf;
+
+    umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        kcf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                          ngx_http_upstream_keepalive_module);
+
+        if (kcf->prewarm && kcf->max_cached == 0) {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                          "\"keepalive_prewarm\" requires \"keepalive\" "
+                          "in upstream \"%V\" in %s:%ui",
+                          &uscfp[i]->host, uscfp[i]->file_name,
+                          uscfp[i]->line);
+            return NGX_ERROR;
+        }
+    }
+
+    kmcf = ngx_http_conf_get_module_main_conf(cf,
+                                           ngx_http_upstream_keepalive_module);
+
+    if (kmcf->upstreams.nelts == 0) {
+        return NGX_OK;
+    }
+
+    kmcf->cycle = cf->cycle;
+
+    size = 8 * ngx_pagesize
+           + kmcf->upstreams.nelts
+             * (sizeof(ngx_http_upstream_keepalive_shctx_t)
+                + NGX_MAX_PROCESSES * sizeof(ngx_atomic_t));
+
+    ngx_str_set(&name, "upstream_keepalive");
+
+    shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                     &ngx_http_upstream_keepalive_module);
+    if (shm_zone == NULL) {
+        return NGX_ERROR;
+    }
+
+    shm_zone->init = ngx_http_upstream_keepalive_init_zone;
+    shm_zone->data = kmcf;
+
+    /* peers' slots and channels are only valid within one generation */
+
+    shm_zone->noreuse = 1;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_keepalive_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_upstream_keepalive_main_conf_t  *kmcf = shm_zone->data;
+
+    ngx_uint_t                                i, workers;
+    ngx_slab_pool_t                          *shpool;
+    ngx_core_conf_t                          *ccf;
+    ngx_http_upstream_keepalive_shctx_t      *sh;
+    ngx_http_upstream_keepalive_srv_conf_t  **kcfp;
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(kmcf->cycle->conf_ctx,
+                                           ngx_core_module);
+
+    workers = ngx_min((ngx_uint_t) ccf->worker_processes, NGX_MAX_PROCESSES);
+
+    if (workers == 0) {
+        workers = 1;
+    }
+
+    kcfp = kmcf->upstreams.elts;
+
+    for (i = 0; i < kmcf->upstreams.nelts; i++) {
+
+        sh = ngx_slab_calloc(shpool,
+                             sizeof(ngx_http_upstream_keepalive_shctx_t)
+                             + (workers - 1) * sizeof(ngx_atomic_t));
+        if (sh == NULL) {
+            return NGX_ERROR;
+        }
+
+        sh->workers = workers;
+
+        kcfp[i]->sh = sh;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_keepalive_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                                i, workers;
+    ngx_core_conf_t                          *ccf;
+    ngx_http_upstream_srv_conf_t            **uscfp;
+    ngx_http_upstream_main_conf_t            *umcf;
+    ngx_http_upstream_keepalive_srv_conf_t   *kcf, **kcfp;
+    ngx_http_upstream_keepalive_main_conf_t  *kmcf;
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+
+    if (umcf == NULL) {
+        return NGX_OK;
+    }
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
+
+    workers = (ngx_process == NGX_PROCESS_WORKER) ? ccf->worker_processes : 1;
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        kcf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                          ngx_http_upstream_keepalive_module);
+
+        if (!kcf->prewarm) {
+            continue;
+        }
+
+        kcf->workers = workers;
+        kcf->last = ngx_current_msec;
+
+        ngx_queue_init(&kcf->pending);
+
+        kcf->event.handler = ngx_http_upstream_keepalive_prewarm_handler;
+        kcf->event.data = kcf;
+        kcf->event.log = cycle->log;
+        kcf->event.cancelable = 1;
+
+        /* spread connecting of different workers over the interval */
+
+        ngx_add_timer(&kcf->event,
+                      kcf->prewarm_interval * ngx_worker / workers
+                      + ngx_random() % 100 + 1);
+    }
+
+    kmcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                           ngx_http_upstream_keepalive_module);
+
+    if (kmcf->upstreams.nelts == 0) {
+        return NGX_OK;
+    }
+
+    /* connections cached by a previous process in this slot are gone */
+
+    kcfp = kmcf->upstreams.elts;
+
+    for (i = 0; i < kmcf->upstreams.nelts; i++) {
+        ngx_http_upstream_keepalive_account(kcfp[i]);
+    }
+
+#if !(NGX_WIN32)
+    ngx_channel_pass_connection = ngx_http_upstream_keepalive_receive;
+#endif
+
+    return NGX_OK;
+}
+
+
+static void *
+ngx_http_upstream_keepalive_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_upstream_keepalive_main_conf_t  *kmcf;
+
+    kmcf = ngx_pcalloc(cf->pool,
+                       sizeof(ngx_http_upstream_keepalive_main_conf_t));
+    if (kmcf == NULL) {
+        return NULL;
+    }
+
+    if (ngx_array_init(&kmcf->upstreams, cf->pool, 4,
+                       sizeof(ngx_http_upstream_keepalive_srv_conf_t *))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    return kmcf;
+}
+
+
+static void *
+ngx_http_upstream_keepalive_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_upstream_keepalive_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool,
+                       sizeof(ngx_http_upstream_keepalive_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->original_init_upstream = NULL;
+     *     conf->original_init_peer = NULL;
+     *     conf->max_cached = 0;
+     *     conf->cached = 0;
+     *     conf->shared = 0;
+     *     conf->sh = NULL;
+     *     conf->prewarm = 0;
+     *     conf->prewarm_min = 0;
+     *     conf->prewarm_max = 0;
+     *     conf->conf = NULL;
+     */
+
+    conf->timeout = NGX_CONF_UNSET_MSEC;
+    conf->requests = NGX_CONF_UNSET_UINT;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_upstream_srv_conf_t            *uscf;
+    ngx_http_upstream_keepalive_srv_conf_t  *kcf = conf;
+
+    ngx_int_t                                 n;
+    ngx_str_t                                *value;
+    ngx_http_upstream_keepalive_srv_conf_t  **kcfp;
+    ngx_http_upstream_keepalive_main_conf_t  *kmcf;
+
+    if (kcf->max_cached) {
+        return "is duplicate";
+    }
+
+    /* read options */
+
+    value = cf->args->elts;
+
+    n = ngx_atoi(value[1].data, value[1].len);
+
+    if (n == NGX_ERROR || n == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid value \"%V\" in \"%V\" directive",
+                           &value[1], &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    kcf->max_cached = n;
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    if (cf->args->nelts == 3) {
+
+        if (ngx_strcmp(value[2].data, "shared") != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+
+#if (NGX_WIN32)
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"shared\" is not supported on this platform");
+        return NGX_CONF_ERROR;
+#else
+        kmcf = ngx_http_conf_get_module_main_conf(cf,
+                                           ngx_http_upstream_keepalive_module);
+
+        kcfp = ngx_array_push(&kmcf->upstreams);
+        if (kcfp == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        *kcfp = kcf;
+
+        kcf->shared = 1;
+        kcf->index = kmcf->upstreams.nelts - 1;
+        kcf->name = uscf->host;
+#endif
+    }
+
+    /* init upstream handler */
+
+    kcf->original_init_upstream = uscf->peer.init_upstream
+                                  ? uscf->peer.init_upstream
+                                  : ngx_http_upstream_init_round_robin;
+
+    uscf->peer.init_upstream = ngx_http_upstream_init_keepalive;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_upstream_keepalive_status(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_upstream_keepalive_status_handler;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_upstream_keepalive_prewarm(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_upstream_keepalive_srv_conf_t  *kcf = conf;
+
+    ngx_int_t    n;
+    ngx_str_t   *value, s;
+    ngx_uint_t   i;
+    ngx_msec_t   interval;
+
+    if (kcf->prewarm) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    n = ngx_atoi(value[1].data, value[1].len);
+
+    if (n == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid value \"%V\" in \"%V\" directive",
+                           &value[1], &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    kcf->prewarm_min = n;
+    kcf->prewarm_max = 0;
+    kcf->prewarm_interval = 1000;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "max=", 4) == 0) {
+
+            n = ngx_atoi(&value[i].data[4], value[i].len - 4);
+
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            kcf->prewarm_max = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = &value[i].data[9];
+
+            interval = ngx_parse_time(&s, 0);
+
+            if (interval == (ngx_msec_t) NGX_ERROR || interval == 0) {
+                goto invalid;
+            }
+
+            kcf->prewarm_interval = interval;
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    if (kcf->prewarm_max && kcf->prewarm_max < kcf->prewarm_min) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"max\" is less than the number of connections");
+        return NGX_CONF_ERROR;
+    }
+
+    kcf->prewarm = 1;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
 }
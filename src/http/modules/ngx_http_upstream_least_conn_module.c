@@ -124,6 +124,11 @@ ngx_http_upstream_get_least_conn_peer(ngx_peer_connection_t *pc, void *data)
 
     ngx_http_upstream_rr_peers_wlock(peers);
 
+    if (ngx_http_upstream_rr_peers_changed(rrp)) {
+        ngx_http_upstream_rr_peers_unlock(peers);
+        return ngx_http_upstream_get_round_robin_peer(pc, rrp);
+    }
+
     best = NULL;
     total = 0;
 
@@ -143,7 +148,7 @@ ngx_http_upstream_get_least_conn_peer(ngx_peer_connection_t *pc, void *data)
             continue;
         }
 
-        if (peer->down) {
+        if (peer->down || peer->unhealthy) {
             continue;
         }
 
@@ -198,7 +203,7 @@ ngx_http_upstream_get_least_conn_peer(ngx_peer_connection_t *pc, void *data)
                 continue;
             }
 
-            if (peer->down) {
+            if (peer->down || peer->unhealthy) {
                 continue;
             }
 
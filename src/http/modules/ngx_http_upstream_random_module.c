@@ -15,9 +15,21 @@ typedef struct {
 } ngx_http_upstream_random_range_t;
 
 
+#define NGX_HTTP_UPSTREAM_RANDOM_LEAST_CONN   0
+#define NGX_HTTP_UPSTREAM_RANDOM_PEAK_EWMA    1
+
+/* the cost of a peer without latency samples but with active requests */
+#define NGX_HTTP_UPSTREAM_RANDOM_PENALTY      1000000000
+
+
 typedef struct {
     ngx_uint_t                            two;
+    ngx_uint_t                            method;
+    ngx_msec_t                            decay;
     ngx_http_upstream_random_range_t     *ranges;
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    ngx_uint_t                            config;
+#endif
 } ngx_http_upstream_random_srv_conf_t;
 
 
@@ -26,6 +38,7 @@ typedef struct {
     ngx_http_upstream_rr_peer_data_t      rrp;
 
     ngx_http_upstream_random_srv_conf_t  *conf;
+    ngx_http_upstream_t                  *upstream;
     u_char                                tries;
 } ngx_http_upstream_random_peer_data_t;
 
@@ -44,6 +57,10 @@ static ngx_int_t ngx_http_upstream_get_random2_peer(ngx_peer_connection_t *pc,
 static ngx_uint_t ngx_http_upstream_peek_random_peer(
     ngx_http_upstream_rr_peers_t *peers,
     ngx_http_upstream_random_peer_data_t *rp);
+static uint64_t ngx_http_upstream_random_peer_cost(
+    ngx_http_upstream_random_peer_data_t *rp, ngx_http_upstream_rr_peer_t *peer);
+static void ngx_http_upstream_free_random_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
 static void *ngx_http_upstream_random_create_conf(ngx_conf_t *cf);
 static char *ngx_http_upstream_random(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
@@ -52,7 +69,7 @@ static char *ngx_http_upstream_random(ngx_conf_t *cf, ngx_command_t *cmd,
 static ngx_command_t  ngx_http_upstream_random_commands[] = {
 
     { ngx_string("random"),
-      NGX_HTTP_UPS_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE12,
+      NGX_HTTP_UPS_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE123,
       ngx_http_upstream_random,
       NGX_HTTP_SRV_CONF_OFFSET,
       0,
@@ -136,6 +153,19 @@ ngx_http_upstream_update_random(ngx_pool_t *pool,
         return NGX_ERROR;
     }
 
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    if (peers->config) {
+
+        /* the peers were updated by resolving */
+
+        if (rcf->ranges) {
+            ngx_free(rcf->ranges);
+        }
+
+        rcf->config = *peers->config;
+    }
+#endif
+
     total_weight = 0;
 
     for (peer = peers->peer, i = 0; peer; peer = peer->next, i++) {
@@ -176,17 +206,24 @@ ngx_http_upstream_init_random_peer(ngx_http_request_t *r,
     if (rcf->two) {
         r->upstream->peer.get = ngx_http_upstream_get_random2_peer;
 
+        if (rcf->method == NGX_HTTP_UPSTREAM_RANDOM_PEAK_EWMA) {
+            r->upstream->peer.free = ngx_http_upstream_free_random_peer;
+        }
+
     } else {
         r->upstream->peer.get = ngx_http_upstream_get_random_peer;
     }
 
     rp->conf = rcf;
+    rp->upstream = r->upstream;
     rp->tries = 0;
 
     ngx_http_upstream_rr_peers_rlock(rp->rrp.peers);
 
 #if (NGX_HTTP_UPSTREAM_ZONE)
-    if (rp->rrp.peers->shpool && rcf->ranges == NULL) {
+    if (rp->rrp.peers->shpool
+        && (rcf->ranges == NULL || rcf->config != *rp->rrp.peers->config))
+    {
         if (ngx_http_upstream_update_random(NULL, us) != NGX_OK) {
             ngx_http_upstream_rr_peers_unlock(rp->rrp.peers);
             return NGX_ERROR;
@@ -220,7 +257,9 @@ ngx_http_upstream_get_random_peer(ngx_peer_connection_t *pc, void *data)
 
     ngx_http_upstream_rr_peers_rlock(peers);
 
-    if (rp->tries > 20 || peers->single) {
+    if (rp->tries > 20 || peers->single
+        || ngx_http_upstream_rr_peers_changed(rrp))
+    {
         ngx_http_upstream_rr_peers_unlock(peers);
         return ngx_http_upstream_get_round_robin_peer(pc, rrp);
     }
@@ -245,7 +284,7 @@ ngx_http_upstream_get_random_peer(ngx_peer_connection_t *pc, void *data)
 
         ngx_http_upstream_rr_peer_lock(peers, peer);
 
-        if (peer->down) {
+        if (peer->down || peer->unhealthy) {
             ngx_http_upstream_rr_peer_unlock(peers, peer);
             goto next;
         }
@@ -314,7 +353,9 @@ ngx_http_upstream_get_random2_peer(ngx_peer_connection_t *pc, void *data)
 
     ngx_http_upstream_rr_peers_wlock(peers);
 
-    if (rp->tries > 20 || peers->single) {
+    if (rp->tries > 20 || peers->single
+        || ngx_http_upstream_rr_peers_changed(rrp))
+    {
         ngx_http_upstream_rr_peers_unlock(peers);
         return ngx_http_upstream_get_round_robin_peer(pc, rrp);
     }
@@ -347,7 +388,7 @@ ngx_http_upstream_get_random2_peer(ngx_peer_connection_t *pc, void *data)
             goto next;
         }
 
-        if (peer->down) {
+        if (peer->down || peer->unhealthy) {
             goto next;
         }
 
@@ -363,8 +404,22 @@ ngx_http_upstream_get_random2_peer(ngx_peer_connection_t *pc, void *data)
         }
 
         if (prev) {
-            if (peer->conns * prev->weight > prev->conns * peer->weight) {
+            if (rp->conf->method == NGX_HTTP_UPSTREAM_RANDOM_PEAK_EWMA) {
+                if (ngx_http_upstream_random_peer_cost(rp, peer)
+                    * prev->weight
+                    > ngx_http_upstream_random_peer_cost(rp, prev)
+                      * peer->weight)
+                {
+                    peer = prev;
+                }
+
+            } else if (peer->conns * prev->weight
+                       > prev->conns * peer->weight)
+            {
                 peer = prev;
+            }
+
+            if (peer == prev) {
                 n = p / (8 * sizeof(uintptr_t));
                 m = (uintptr_t) 1 << p % (8 * sizeof(uintptr_t));
             }
@@ -429,6 +484,106 @@ ngx_http_upstream_peek_random_peer(ngx_http_upstream_rr_peers_t *peers,
 }
 
 
+/*
+ * Peak EWMA: the expected latency of a peer is a moving average
+ * of its response header times, which jumps to the peak on slow responses
+ * and decays towards zero while the peer is not observed.  It is multiplied
+ * by the number of active requests to the peer, as all workers see them
+ * in the upstream zone.
+ */
+
+static uint64_t
+ngx_http_upstream_random_peer_cost(ngx_http_upstream_random_peer_data_t *rp,
+    ngx_http_upstream_rr_peer_t *peer)
+{
+    uint64_t    ewma;
+    ngx_msec_t  elapsed, decay;
+
+    if (peer->ewma == 0) {
+        return peer->conns ? NGX_HTTP_UPSTREAM_RANDOM_PENALTY + peer->conns
+                           : 0;
+    }
+
+    decay = rp->conf->decay;
+    elapsed = ngx_current_msec - peer->ewma_time;
+
+    if ((ngx_msec_int_t) elapsed < 0) {
+        elapsed = 0;
+    }
+
+    ewma = (uint64_t) peer->ewma * decay / (decay + elapsed);
+
+    return (ewma + 1) * (peer->conns + 1);
+}
+
+
+static void
+ngx_http_upstream_free_random_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    ngx_http_upstream_random_peer_data_t  *rp = data;
+
+    uint64_t                       ewma, rtt;
+    ngx_msec_t                     elapsed, decay;
+    ngx_http_upstream_t           *u;
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_rr_peers_t  *peers;
+
+    u = rp->upstream;
+    peer = rp->rrp.current;
+    peers = rp->rrp.peers;
+
+    if (peer == NULL || u->state == NULL) {
+        goto done;
+    }
+
+    /* latency is kept in microseconds */
+
+    if (u->state->header_time != (ngx_msec_t) -1) {
+        rtt = (uint64_t) u->state->header_time * 1000;
+
+    } else if (state & NGX_PEER_FAILED) {
+
+        /* a failed peer may only look slower than it was */
+
+        rtt = (uint64_t) (ngx_current_msec - u->start_time) * 1000;
+
+    } else {
+        goto done;
+    }
+
+    ngx_http_upstream_rr_peers_rlock(peers);
+    ngx_http_upstream_rr_peer_lock(peers, peer);
+
+    ewma = peer->ewma;
+
+    if (rtt > ewma) {
+        ewma = rtt;
+
+    } else if (!(state & NGX_PEER_FAILED)) {
+        decay = rp->conf->decay;
+        elapsed = ngx_current_msec - peer->ewma_time;
+
+        if ((ngx_msec_int_t) elapsed > 0) {
+            ewma = (ewma * decay + rtt * elapsed) / (decay + elapsed);
+        }
+    }
+
+    peer->ewma = (ngx_uint_t) ewma;
+    peer->ewma_time = ngx_current_msec;
+
+    ngx_http_upstream_rr_peer_unlock(peers, peer);
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "free random peer, rtt: %uL, ewma: %uL", rtt, ewma);
+
+done:
+
+    ngx_http_upstream_free_round_robin_peer(pc, &rp->rrp, state);
+}
+
+
 static void *
 ngx_http_upstream_random_create_conf(ngx_conf_t *cf)
 {
@@ -443,8 +598,11 @@ ngx_http_upstream_random_create_conf(ngx_conf_t *cf)
      * set by ngx_pcalloc():
      *
      *     conf->two = 0;
+     *     conf->method = NGX_HTTP_UPSTREAM_RANDOM_LEAST_CONN;
      */
 
+    conf->decay = 10000;
+
     return conf;
 }
 
@@ -454,7 +612,7 @@ ngx_http_upstream_random(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
     ngx_http_upstream_random_srv_conf_t  *rcf = conf;
 
-    ngx_str_t                     *value;
+    ngx_str_t                      s, *value;
     ngx_http_upstream_srv_conf_t  *uscf;
 
     uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
@@ -492,11 +650,40 @@ ngx_http_upstream_random(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_OK;
     }
 
-    if (ngx_strcmp(value[2].data, "least_conn") != 0) {
+    if (ngx_strcmp(value[2].data, "least_conn") == 0) {
+        rcf->method = NGX_HTTP_UPSTREAM_RANDOM_LEAST_CONN;
+
+    } else if (ngx_strcmp(value[2].data, "peak_ewma") == 0) {
+        rcf->method = NGX_HTTP_UPSTREAM_RANDOM_PEAK_EWMA;
+
+    } else {
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "invalid parameter \"%V\"", &value[2]);
         return NGX_CONF_ERROR;
     }
 
+    if (cf->args->nelts == 3) {
+        return NGX_CONF_OK;
+    }
+
+    if (rcf->method != NGX_HTTP_UPSTREAM_RANDOM_PEAK_EWMA
+        || ngx_strncmp(value[3].data, "decay=", 6) != 0)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[3]);
+        return NGX_CONF_ERROR;
+    }
+
+    s.len = value[3].len - 6;
+    s.data = &value[3].data[6];
+
+    rcf->decay = ngx_parse_time(&s, 0);
+
+    if (rcf->decay == (ngx_msec_t) NGX_ERROR || rcf->decay == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid decay value \"%V\"", &value[3]);
+        return NGX_CONF_ERROR;
+    }
+
     return NGX_CONF_OK;
 }
@@ -10,6 +10,17 @@
 #include <ngx_http.h>
 
 
+#define NGX_HTTP_UPSTREAM_ZONE_RESOLVE_MIN    1000
+#define NGX_HTTP_UPSTREAM_ZONE_RESOLVE_RETRY  10000
+
+
+typedef struct {
+    ngx_event_t                     event;
+    ngx_http_upstream_srv_conf_t   *upstream;
+    ngx_http_upstream_server_t     *server;
+} ngx_http_upstream_zone_host_t;
+
+
 static char *ngx_http_upstream_zone(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static ngx_int_t ngx_http_upstream_init_zone(ngx_shm_zone_t *shm_zone,
@@ -18,6 +29,15 @@ static ngx_http_upstream_rr_peers_t *ngx_http_upstream_zone_copy_peers(
     ngx_slab_pool_t *shpool, ngx_http_upstream_srv_conf_t *uscf);
 static ngx_http_upstream_rr_peer_t *ngx_http_upstream_zone_copy_peer(
     ngx_http_upstream_rr_peers_t *peers, ngx_http_upstream_rr_peer_t *src);
+static void ngx_http_upstream_zone_free_peer(
+    ngx_http_upstream_rr_peers_t *peers, ngx_http_upstream_rr_peer_t *peer);
+
+static ngx_int_t ngx_http_upstream_zone_postconfiguration(ngx_conf_t *cf);
+static ngx_int_t ngx_http_upstream_zone_init_process(ngx_cycle_t *cycle);
+static void ngx_http_upstream_zone_resolve_timer(ngx_event_t *ev);
+static void ngx_http_upstream_zone_resolve_handler(ngx_resolver_ctx_t *ctx);
+static ngx_int_t ngx_http_upstream_zone_update_peers(
+    ngx_http_upstream_zone_host_t *host, ngx_resolver_ctx_t *ctx);
 
 
 static ngx_command_t  ngx_http_upstream_zone_commands[] = {
@@ -35,7 +55,7 @@ static ngx_command_t  ngx_http_upstream_zone_commands[] = {
 
 static ngx_http_module_t  ngx_http_upstream_zone_module_ctx = {
     NULL,                                  /* preconfiguration */
-    NULL,                                  /* postconfiguration */
+    ngx_http_upstream_zone_postconfiguration, /* postconfiguration */
 
     NULL,                                  /* create main configuration */
     NULL,                                  /* init main configuration */
@@ -55,7 +75,7 @@ ngx_module_t  ngx_http_upstream_zone_module = {
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_http_upstream_zone_init_process,   /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
     NULL,                                  /* exit process */
@@ -215,6 +235,11 @@ ngx_http_upstream_zone_copy_peers(ngx_slab_pool_t *shpool,
 
     peers->shpool = shpool;
 
+    peers->config = ngx_slab_calloc(shpool, sizeof(ngx_uint_t));
+    if (peers->config == NULL) {
+        return NULL;
+    }
+
     for (peerp = &peers->peer; *peerp; peerp = &peer->next) {
         /* pool is unlocked */
         peer = ngx_http_upstream_zone_copy_peer(peers, *peerp);
@@ -239,6 +264,7 @@ ngx_http_upstream_zone_copy_peers(ngx_slab_pool_t *shpool,
     backup->name = name;
 
     backup->shpool = shpool;
+    backup->config = peers->config;
 
     for (peerp = &backup->peer; *peerp; peerp = &peer->next) {
         /* pool is unlocked */
@@ -323,3 +349,429 @@ failed:
 
     return NULL;
 }
+
+
+static void
+ngx_http_upstream_zone_free_peer(ngx_http_upstream_rr_peers_t *peers,
+    ngx_http_upstream_rr_peer_t *peer)
+{
+    ngx_slab_pool_t  *pool;
+
+    pool = peers->shpool;
+
+    ngx_shmtx_lock(&pool->mutex);
+
+#if (NGX_HTTP_SSL)
+    if (peer->ssl_session) {
+        ngx_slab_free_locked(pool, peer->ssl_session);
+    }
+#endif
+
+    ngx_slab_free_locked(pool, peer->server.data);
+    ngx_slab_free_locked(pool, peer->name.data);
+    ngx_slab_free_locked(pool, peer->sockaddr);
+    ngx_slab_free_locked(pool, peer);
+
+    ngx_shmtx_unlock(&pool->mutex);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_zone_postconfiguration(ngx_conf_t *cf)
+{
+    ngx_uint_t                      i, j;
+    ngx_http_core_loc_conf_t       *clcf;
+    ngx_http_upstream_server_t     *server;
+    ngx_http_upstream_srv_conf_t  **uscfp;
+    ngx_http_upstream_main_conf_t  *umcf;
+
+    umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->servers == NULL) {
+            continue;
+        }
+
+        server = uscfp[i]->servers->elts;
+
+        for (j = 0; j < uscfp[i]->servers->nelts; j++) {
+
+            if (!server[j].resolve) {
+                continue;
+            }
+
+            if (uscfp[i]->shm_zone == NULL) {
+                ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                              "\"resolve\" requires \"zone\" "
+                              "in upstream \"%V\" in %s:%ui",
+                              &uscfp[i]->host, uscfp[i]->file_name,
+                              uscfp[i]->line);
+                return NGX_ERROR;
+            }
+
+            if (clcf->resolver == NULL
+                || clcf->resolver->connections.nelts == 0)
+            {
+                ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                              "no resolver defined to resolve \"%V\" "
+                              "in upstream \"%V\" in %s:%ui",
+                              &server[j].host, &uscfp[i]->host,
+                              uscfp[i]->file_name, uscfp[i]->line);
+                return NGX_ERROR;
+            }
+
+            uscfp[i]->resolver = clcf->resolver;
+            uscfp[i]->resolver_timeout =
+                          clcf->resolver_timeout == NGX_CONF_UNSET_MSEC
+                          ? 30000 : clcf->resolver_timeout;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * Servers with the "resolve" parameter are re-resolved by the first worker
+ * when their DNS records expire, and the peers in the zone are updated
+ * for all workers.  Peers with unchanged addresses are kept as is, along
+ * with their state and keepalive connections.
+ */
+
+static ngx_int_t
+ngx_http_upstream_zone_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                      i, j;
+    ngx_http_upstream_server_t     *server;
+    ngx_http_upstream_srv_conf_t  **uscfp;
+    ngx_http_upstream_zone_host_t  *host;
+    ngx_http_upstream_main_conf_t  *umcf;
+
+    if ((ngx_process != NGX_PROCESS_WORKER
+         && ngx_process != NGX_PROCESS_SINGLE)
+        || ngx_worker != 0)
+    {
+        return NGX_OK;
+    }
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+
+    if (umcf == NULL) {
+        return NGX_OK;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->resolver == NULL) {
+            continue;
+        }
+
+        server = uscfp[i]->servers->elts;
+
+        for (j = 0; j < uscfp[i]->servers->nelts; j++) {
+
+            if (!server[j].resolve) {
+                continue;
+            }
+
+            host = ngx_pcalloc(cycle->pool,
+                               sizeof(ngx_http_upstream_zone_host_t));
+            if (host == NULL) {
+                return NGX_ERROR;
+            }
+
+            host->upstream = uscfp[i];
+            host->server = &server[j];
+
+            host->event.handler = ngx_http_upstream_zone_resolve_timer;
+            host->event.data = host;
+            host->event.log = cycle->log;
+            host->event.cancelable = 1;
+
+            ngx_add_timer(&host->event, NGX_HTTP_UPSTREAM_ZONE_RESOLVE_MIN);
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_zone_resolve_timer(ngx_event_t *ev)
+{
+    ngx_resolver_ctx_t             *ctx, temp;
+    ngx_http_upstream_zone_host_t  *host;
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    host = ev->data;
+
+    temp.name = host->server->host;
+
+    ctx = ngx_resolve_start(host->upstream->resolver, &temp);
+    if (ctx == NULL || ctx == NGX_NO_RESOLVER) {
+        ngx_log_error(NGX_LOG_ALERT, ev->log, 0,
+                      "failed to start resolving \"%V\" in upstream \"%V\"",
+                      &host->server->host, &host->upstream->host);
+        ngx_add_timer(ev, NGX_HTTP_UPSTREAM_ZONE_RESOLVE_RETRY);
+        return;
+    }
+
+    if (ctx == &temp) {
+
+        /* the address was given, nothing to resolve */
+
+        return;
+    }
+
+    ctx->name = host->server->host;
+    ctx->handler = ngx_http_upstream_zone_resolve_handler;
+    ctx->data = host;
+    ctx->timeout = host->upstream->resolver_timeout;
+
+    if (ngx_resolve_name(ctx) != NGX_OK) {
+        ngx_add_timer(ev, NGX_HTTP_UPSTREAM_ZONE_RESOLVE_RETRY);
+    }
+}
+
+
+static void
+ngx_http_upstream_zone_resolve_handler(ngx_resolver_ctx_t *ctx)
+{
+    time_t                          valid;
+    ngx_msec_t                      timer;
+    ngx_http_upstream_zone_host_t  *host;
+
+    host = ctx->data;
+
+    if (ctx->state) {
+        ngx_log_error(NGX_LOG_ERR, host->event.log, 0,
+                      "%V could not be resolved (%i: %s) "
+                      "in upstream \"%V\"",
+                      &ctx->name, ctx->state,
+                      ngx_resolver_strerror(ctx->state),
+                      &host->upstream->host);
+
+    } else if (ngx_http_upstream_zone_update_peers(host, ctx) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ALERT, host->event.log, 0,
+                      "could not update peers of \"%V\" "
+                      "in upstream \"%V\"",
+                      &ctx->name, &host->upstream->host);
+    }
+
+    valid = ctx->valid - ngx_time();
+    timer = valid > 0 ? (ngx_msec_t) valid * 1000 : 0;
+
+    if (ctx->state) {
+        timer = ngx_max(timer, NGX_HTTP_UPSTREAM_ZONE_RESOLVE_RETRY);
+    }
+
+    ngx_resolve_name_done(ctx);
+
+    ngx_add_timer(&host->event,
+                  ngx_max(timer, NGX_HTTP_UPSTREAM_ZONE_RESOLVE_MIN));
+}
+
+
+static ngx_int_t
+ngx_http_upstream_zone_update_peers(ngx_http_upstream_zone_host_t *host,
+    ngx_resolver_ctx_t *ctx)
+{
+    u_char                        *found;
+    ngx_int_t                      rc;
+    ngx_uint_t                     i, changed;
+    ngx_http_upstream_server_t    *server;
+    ngx_http_upstream_rr_peer_t   *peer, **peerp;
+    ngx_http_upstream_rr_peers_t  *primary, *peers;
+
+    server = host->server;
+    primary = host->upstream->peer.data;
+    peers = server->backup ? primary->next : primary;
+
+    found = ngx_calloc(ctx->naddrs, host->event.log);
+    if (found == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < ctx->naddrs; i++) {
+        ngx_inet_set_port(ctx->addrs[i].sockaddr, server->port);
+    }
+
+    rc = NGX_OK;
+    changed = 0;
+
+    ngx_http_upstream_rr_peers_wlock(peers);
+
+    /* free the peers removed earlier and no longer used */
+
+    for (peerp = &peers->removed; *peerp; /* void */) {
+        peer = *peerp;
+
+        if (peer->conns || peer->refs) {
+            peerp = &peer->next;
+            continue;
+        }
+
+        *peerp = peer->next;
+        ngx_http_upstream_zone_free_peer(peers, peer);
+    }
+
+    /* find the addresses already known */
+
+    for (peer = peers->peer; peer; peer = peer->next) {
+
+        if (peer->server.len != server->name.len
+            || ngx_strncmp(peer->server.data, server->name.data,
+                           server->name.len)
+               != 0)
+        {
+            continue;
+        }
+
+        for (i = 0; i < ctx->naddrs; i++) {
+            if (ngx_cmp_sockaddr(peer->sockaddr, peer->socklen,
+                                 ctx->addrs[i].sockaddr,
+                                 ctx->addrs[i].socklen, 1)
+                == NGX_OK)
+            {
+                found[i] = 1;
+                break;
+            }
+        }
+    }
+
+    /* add the new addresses */
+
+    for (i = 0; i < ctx->naddrs; i++) {
+
+        if (found[i]) {
+            continue;
+        }
+
+        ngx_shmtx_lock(&peers->shpool->mutex);
+
+        peer = ngx_http_upstream_zone_copy_peer(peers, NULL);
+
+        if (peer) {
+            peer->server.data = ngx_slab_alloc_locked(peers->shpool,
+                                                      server->name.len);
+            if (peer->server.data == NULL) {
+                ngx_slab_free_locked(peers->shpool, peer->name.data);
+                ngx_slab_free_locked(peers->shpool, peer->sockaddr);
+                ngx_slab_free_locked(peers->shpool, peer);
+                peer = NULL;
+            }
+        }
+
+        ngx_shmtx_unlock(&peers->shpool->mutex);
+
+        if (peer == NULL) {
+            rc = NGX_ERROR;
+            goto done;
+        }
+
+        ngx_memcpy(peer->server.data, server->name.data, server->name.len);
+        peer->server.len = server->name.len;
+
+        ngx_memcpy(peer->sockaddr, ctx->addrs[i].sockaddr,
+                   ctx->addrs[i].socklen);
+        peer->socklen = ctx->addrs[i].socklen;
+
+        peer->name.len = ngx_sock_ntop(peer->sockaddr, peer->socklen,
+                                       peer->name.data, NGX_SOCKADDR_STRLEN,
+                                       1);
+
+        peer->weight = server->weight;
+        peer->effective_weight = server->weight;
+        peer->max_conns = server->max_conns;
+        peer->max_fails = server->max_fails;
+        peer->fail_timeout = server->fail_timeout;
+        peer->down = server->down;
+
+        ngx_log_error(NGX_LOG_NOTICE, host->event.log, 0,
+                      "added peer %V of \"%V\" to upstream \"%V\"",
+                      &peer->name, &server->name, &host->upstream->host);
+
+        peer->next = peers->peer;
+        peers->peer = peer;
+
+        peers->number++;
+        peers->total_weight += peer->weight;
+        changed = 1;
+    }
+
+    /* remove the addresses which are no longer resolved */
+
+    for (peerp = &peers->peer; *peerp; /* void */) {
+        peer = *peerp;
+
+        if (peer->server.len != server->name.len
+            || ngx_strncmp(peer->server.data, server->name.data,
+                           server->name.len)
+               != 0)
+        {
+            peerp = &peer->next;
+            continue;
+        }
+
+        for (i = 0; i < ctx->naddrs; i++) {
+            if (ngx_cmp_sockaddr(peer->sockaddr, peer->socklen,
+                                 ctx->addrs[i].sockaddr,
+                                 ctx->addrs[i].socklen, 1)
+                == NGX_OK)
+            {
+                break;
+            }
+        }
+
+        if (i < ctx->naddrs) {
+            peerp = &peer->next;
+            continue;
+        }
+
+        ngx_log_error(NGX_LOG_NOTICE, host->event.log, 0,
+                      "removed peer %V of \"%V\" from upstream \"%V\"",
+                      &peer->name, &server->name, &host->upstream->host);
+
+        *peerp = peer->next;
+
+        /*
+         * the peer may still be used by requests in progress
+         * and health checks, it is freed by a later update;
+         * the list is kept in the zone to survive a worker restart
+         */
+
+        peer->next = peers->removed;
+        peers->removed = peer;
+
+        peers->number--;
+        peers->total_weight -= peer->weight;
+        changed = 1;
+    }
+
+done:
+
+    if (changed) {
+        if (peers == primary) {
+            peers->single = (peers->number == 1 && peers->next == NULL);
+        }
+
+        peers->weighted = (peers->total_weight != peers->number);
+
+        (*peers->config)++;
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    ngx_free(found);
+
+    return rc;
+}
@@ -440,7 +440,9 @@ ngx_http_init_headers_in_hash(ngx_conf_t *cf, ngx_http_core_main_conf_t *cmcf)
     hash.pool = cf->pool;
     hash.temp_pool = NULL;
 
-    if (ngx_hash_init(&hash, headers_in.elts, headers_in.nelts) != NGX_OK) {
+    if (ngx_hash_perfect_init(&hash, headers_in.elts, headers_in.nelts)
+        != NGX_OK)
+    {
         return NGX_ERROR;
     }
 
@@ -1497,7 +1499,14 @@ ngx_http_server_names(ngx_conf_t *cf, ngx_http_core_main_conf_t *cmcf,
         hash.hash = &addr->hash;
         hash.temp_pool = NULL;
 
-        if (ngx_hash_init(&hash, ha.keys.elts, ha.keys.nelts) != NGX_OK) {
+        if (cmcf->server_names_hash_perfect) {
+            rc = ngx_hash_perfect_init(&hash, ha.keys.elts, ha.keys.nelts);
+
+        } else {
+            rc = ngx_hash_init(&hash, ha.keys.elts, ha.keys.nelts);
+        }
+
+        if (rc != NGX_OK) {
             goto failed;
         }
     }
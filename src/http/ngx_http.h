@@ -84,6 +84,10 @@ ngx_int_t ngx_http_add_listen(ngx_conf_t *cf, ngx_http_core_srv_conf_t *cscf,
 
 void ngx_http_init_connection(ngx_connection_t *c);
 void ngx_http_close_connection(ngx_connection_t *c);
+void ngx_http_header_buffers_exit(ngx_cycle_t *cycle);
+ngx_int_t ngx_http_batch_pipelined_output(ngx_http_request_t *r, off_t size);
+ngx_int_t ngx_http_flush_pipelined_output(ngx_http_request_t *r);
+void ngx_http_stop_pipelined_output(ngx_http_request_t *r);
 
 #if (NGX_HTTP_SSL && defined SSL_CTRL_SET_TLSEXT_HOSTNAME)
 int ngx_http_ssl_servername(ngx_ssl_conn_t *ssl_conn, int *ad, void *arg);
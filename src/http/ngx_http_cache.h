@@ -27,7 +27,21 @@
 #define NGX_HTTP_CACHE_ETAG_LEN      128
 #define NGX_HTTP_CACHE_VARY_LEN      128
 
-#define NGX_HTTP_CACHE_VERSION       5
+#define NGX_HTTP_CACHE_VERSION       6
+
+#define NGX_HTTP_CACHE_INDEX_VERSION 2
+
+#define NGX_HTTP_CACHE_INDEX_ADD     1
+#define NGX_HTTP_CACHE_INDEX_DELETE  2
+
+#define NGX_HTTP_CACHE_EVICT_LRU     0
+#define NGX_HTTP_CACHE_EVICT_TINYLFU 1
+
+#define NGX_HTTP_CACHE_MAX_SHARDS    32
+
+
+#define ngx_http_file_cache_map_len(length, block)                            \
+    (size_t) ((((length) + (block) - 1) / (block) + 7) / 8)
 
 
 typedef struct {
@@ -36,6 +50,19 @@ typedef struct {
 } ngx_http_cache_valid_t;
 
 
+typedef struct {
+    off_t                            length;
+    ngx_pid_t                        pid;
+    ngx_uint_t                       refs;
+    unsigned                         complete:1;
+    unsigned                         failed:1;
+    u_char                           name[1];
+} ngx_http_file_cache_stream_t;
+
+
+typedef struct ngx_http_file_cache_link_s  ngx_http_file_cache_link_t;
+
+
 typedef struct {
     ngx_rbtree_node_t                node;
     ngx_queue_t                      queue;
@@ -51,7 +78,9 @@ typedef struct {
     unsigned                         updating:1;
     unsigned                         deleting:1;
     unsigned                         purged:1;
-                                     /* 10 unused bits */
+    unsigned                         admitted:1;
+    unsigned                         shard:5;
+                                     /* 4 unused bits */
 
     ngx_file_uniq_t                  uniq;
     time_t                           expire;
@@ -59,9 +88,41 @@ typedef struct {
     size_t                           body_start;
     off_t                            fs_size;
     ngx_msec_t                       lock_time;
+    ngx_http_file_cache_stream_t    *stream;
+    ngx_http_file_cache_link_t      *tags;
 } ngx_http_file_cache_node_t;
 
 
+typedef struct {
+    ngx_str_node_t                   sn;
+    ngx_queue_t                      links;
+    u_char                           data[1];
+} ngx_http_file_cache_tag_t;
+
+
+struct ngx_http_file_cache_link_s {
+    ngx_queue_t                      queue;
+    ngx_http_file_cache_tag_t       *tag;
+    ngx_http_file_cache_node_t      *node;
+    ngx_http_file_cache_link_t      *next;
+};
+
+
+typedef struct {
+    ngx_rbtree_node_t                node;
+    ngx_queue_t                      queue;
+
+    u_char                           key[NGX_HTTP_CACHE_KEY_LEN
+                                         - sizeof(ngx_rbtree_key_t)];
+
+    ngx_uint_t                       uses;
+    ngx_file_uniq_t                  uniq;
+    off_t                            fs_size;
+    size_t                           len;
+    u_char                           data[1];
+} ngx_http_file_cache_memory_node_t;
+
+
 struct ngx_http_cache_s {
     ngx_file_t                       file;
     ngx_array_t                      keys;
@@ -80,15 +141,25 @@ struct ngx_http_cache_s {
     ngx_str_t                        vary;
     u_char                           variant[NGX_HTTP_CACHE_KEY_LEN];
 
+    ngx_str_t                        tags;
+
     size_t                           header_start;
     size_t                           body_start;
     off_t                            length;
     off_t                            fs_size;
 
+    size_t                           map_start;
+    off_t                            sparse_length;
+    off_t                            range_start;
+    off_t                            range_end;
+    off_t                            fill_start;
+    off_t                            fill_end;
+
     ngx_uint_t                       min_uses;
     ngx_uint_t                       error;
     ngx_uint_t                       valid_msec;
     ngx_uint_t                       vary_tag;
+    ngx_uint_t                       shard;
 
     ngx_buf_t                       *buf;
 
@@ -105,6 +176,12 @@ struct ngx_http_cache_s {
     ngx_msec_t                       wait_time;
 
     ngx_event_t                      wait_event;
+    ngx_queue_t                      wait_queue;
+
+    ngx_http_file_cache_stream_t    *stream;
+    off_t                            stream_offset;
+    ngx_chain_t                     *stream_free;
+    ngx_chain_t                     *stream_busy;
 
     unsigned                         lock:1;
     unsigned                         waiting:1;
@@ -120,6 +197,20 @@ struct ngx_http_cache_s {
 
     unsigned                         stale_updating:1;
     unsigned                         stale_error:1;
+
+    unsigned                         memory:1;
+    unsigned                         complete:1;
+    unsigned                         streaming:1;
+
+    unsigned                         range:1;
+    unsigned                         sparse:1;
+    unsigned                         ranged:1;
+    unsigned                         fill:1;
+    unsigned                         stitch:1;
+
+    unsigned                         ahead:1;
+    unsigned                         refresh:1;
+    unsigned                         scheduled:1;
 };
 
 
@@ -134,6 +225,9 @@ typedef struct {
     u_short                          valid_msec;
     u_short                          header_start;
     u_short                          body_start;
+    u_short                          map_start;
+    uint32_t                         block;
+    off_t                            length;
     u_char                           etag_len;
     u_char                           etag[NGX_HTTP_CACHE_ETAG_LEN];
     u_char                           vary_len;
@@ -142,6 +236,39 @@ typedef struct {
 } ngx_http_file_cache_header_t;
 
 
+typedef struct {
+    u_char                           magic[8];
+    uint32_t                         version;
+    uint32_t                         bsize;
+    uint32_t                         level[NGX_MAX_PATH_LEVEL];
+    uint32_t                         shards;
+    uint64_t                         snapshot;
+} ngx_http_file_cache_index_header_t;
+
+
+typedef struct {
+    u_char                           key[NGX_HTTP_CACHE_KEY_LEN];
+    uint64_t                         fs_size;
+    uint32_t                         op;
+    uint32_t                         shard;
+} ngx_http_file_cache_index_record_t;
+
+
+typedef struct {
+    ngx_queue_t                         queue;
+    ngx_http_file_cache_index_record_t  record;
+} ngx_http_file_cache_index_entry_t;
+
+
+typedef struct {
+    ngx_uint_t                       fails;
+    time_t                           checked;
+    ngx_atomic_t                     reads;
+    ngx_atomic_t                     writes;
+    ngx_atomic_t                     errors;
+} ngx_http_file_cache_shard_sh_t;
+
+
 typedef struct {
     ngx_rbtree_t                     rbtree;
     ngx_rbtree_node_t                sentinel;
@@ -151,15 +278,62 @@ typedef struct {
     off_t                            size;
     ngx_uint_t                       count;
     ngx_uint_t                       watermark;
+    ngx_queue_t                      index_queue;
+    ngx_uint_t                       index_queued;
+    ngx_uint_t                       index_journal;
+    ngx_uint_t                       index_checkpoint;
+    ngx_atomic_t                     index_walk;
+    ngx_queue_t                      main;
+    ngx_uint_t                       main_count;
+    u_char                          *sketch;
+    ngx_uint_t                       sketch_mask;
+    ngx_uint_t                       sketch_adds;
+    ngx_atomic_t                     hits;
+    ngx_atomic_t                     hit_bytes;
+    ngx_atomic_t                     misses;
+    ngx_atomic_t                     miss_bytes;
+    ngx_rbtree_t                     tags;
+    ngx_rbtree_node_t                tags_sentinel;
+    ngx_uint_t                       updates;
+    ngx_uint_t                       update_uses;
+    ngx_http_file_cache_shard_sh_t   shards[NGX_HTTP_CACHE_MAX_SHARDS];
 } ngx_http_file_cache_sh_t;
 
 
+typedef struct {
+    ngx_rbtree_t                     rbtree;
+    ngx_rbtree_node_t                sentinel;
+    ngx_queue_t                      queue;
+    size_t                           size;
+    ngx_uint_t                       count;
+    ngx_atomic_t                     hits;
+    ngx_atomic_t                     misses;
+    ngx_atomic_t                     disk_hits;
+    ngx_atomic_t                     rejected;
+} ngx_http_file_cache_memory_sh_t;
+
+
+typedef struct {
+    ngx_path_t                      *path;
+    uint32_t                         hash;
+#if (NGX_THREADS || NGX_COMPAT)
+    ngx_queue_t                      ops;
+    ngx_uint_t                       busy;
+#endif
+} ngx_http_file_cache_shard_t;
+
+
 struct ngx_http_file_cache_s {
     ngx_http_file_cache_sh_t        *sh;
     ngx_slab_pool_t                 *shpool;
 
     ngx_path_t                      *path;
 
+    ngx_array_t                      shards;
+    ngx_uint_t                       shard_max_fails;
+    time_t                           shard_fail_timeout;
+    ngx_uint_t                       walk_shard;
+
     off_t                            min_free;
     off_t                            max_size;
     size_t                           bsize;
@@ -180,6 +354,28 @@ struct ngx_http_file_cache_s {
 
     ngx_shm_zone_t                  *shm_zone;
 
+    ngx_http_file_cache_memory_sh_t *memory;
+    ngx_slab_pool_t                 *memory_shpool;
+    ngx_shm_zone_t                  *memory_zone;
+    size_t                           memory_max_object;
+
+    ngx_uint_t                       eviction;
+    ngx_msec_t                       report;
+
+    size_t                           sparse;
+
+    ngx_uint_t                       updates;
+    time_t                           refresh_ahead;
+
+    ngx_file_t                       index;
+
+#if (NGX_THREADS || NGX_COMPAT)
+    ngx_thread_pool_t               *thread_pool;
+    ngx_uint_t                       thread_max;
+#endif
+
+    ngx_flag_t                       fsync;
+
     ngx_uint_t                       use_temp_path;
                                      /* unsigned use_temp_path:1 */
 };
@@ -192,8 +388,13 @@ ngx_int_t ngx_http_file_cache_open(ngx_http_request_t *r);
 ngx_int_t ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf);
 void ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf);
 void ngx_http_file_cache_update_header(ngx_http_request_t *r);
+void ngx_http_file_cache_stream(ngx_http_request_t *r, ngx_temp_file_t *tf);
 ngx_int_t ngx_http_cache_send(ngx_http_request_t *);
+ngx_int_t ngx_http_cache_send_range(ngx_http_request_t *r, off_t start,
+    off_t end);
 void ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf);
+ngx_int_t ngx_http_file_cache_purge(ngx_http_request_t *r, ngx_str_t *tags);
+ngx_int_t ngx_http_file_cache_schedule(ngx_http_request_t *r);
 time_t ngx_http_file_cache_valid(ngx_array_t *cache_valid, ngx_uint_t status);
 
 char *ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
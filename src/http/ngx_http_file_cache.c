@@ -11,13 +11,82 @@
 #include <ngx_md5.h>
 
 
+#define NGX_HTTP_CACHE_INDEX_QUEUE  65536
+#define NGX_HTTP_CACHE_INDEX_BATCH  256
+#define NGX_HTTP_CACHE_INDEX_READ   32768
+
+#define NGX_HTTP_CACHE_SKETCH_ROWS  4
+#define NGX_HTTP_CACHE_SKETCH_MAX   15
+
+#define NGX_HTTP_CACHE_WAIT_POLL    50
+
+#define NGX_HTTP_CACHE_OP_RENAME    1
+#define NGX_HTTP_CACHE_OP_HEADER    2
+#define NGX_HTTP_CACHE_OP_UNLINK    3
+#define NGX_HTTP_CACHE_OP_FILL      4
+
+#define NGX_HTTP_CACHE_OP_BATCH     16
+#define NGX_HTTP_CACHE_OP_TIMER     60000
+
+#define NGX_HTTP_CACHE_FILL_BUFFER  65536
+
+
+typedef struct {
+    ngx_queue_t                      queue;
+    ngx_uint_t                       type;
+    ngx_http_file_cache_t           *cache;
+    ngx_http_file_cache_node_t      *node;
+    ngx_uint_t                       shard;
+    u_char                           key[NGX_HTTP_CACHE_KEY_LEN];
+    size_t                           body_start;
+    ngx_file_uniq_t                  uniq;
+    off_t                            length;
+    off_t                            fs_size;
+    off_t                            offset;
+    off_t                            size;
+    size_t                           temp_start;
+    ngx_uint_t                       merge;
+    ngx_int_t                        rc;
+    ngx_err_t                        err;
+    char                            *failed;
+    u_char                          *file;
+    ngx_str_t                        from;
+    ngx_str_t                        to;
+    ngx_http_file_cache_header_t     header;
+} ngx_http_file_cache_op_t;
+
+
+#if (NGX_THREADS)
+
+typedef struct {
+    ngx_thread_task_t                task;
+    ngx_event_t                      timer;
+    ngx_queue_t                      ops;
+    ngx_http_file_cache_t           *cache;
+    ngx_uint_t                       shard;
+} ngx_http_file_cache_batch_t;
+
+#endif
+
+
 static ngx_int_t ngx_http_file_cache_lock(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 static void ngx_http_file_cache_lock_wait_handler(ngx_event_t *ev);
 static void ngx_http_file_cache_lock_wait(ngx_http_request_t *r,
     ngx_http_cache_t *c);
+static void ngx_http_file_cache_unwait(ngx_http_cache_t *c);
+static void ngx_http_file_cache_wakeup(ngx_http_file_cache_node_t *fcn);
+static ngx_int_t ngx_http_file_cache_stream_attach(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static void ngx_http_file_cache_stream_close(ngx_http_file_cache_t *cache,
+    ngx_http_cache_t *c, off_t length);
+static ngx_int_t ngx_http_file_cache_stream_send(ngx_http_request_t *r);
+static void ngx_http_file_cache_stream_handler(ngx_event_t *ev);
+static void ngx_http_file_cache_stream_writer(ngx_http_request_t *r);
 static ngx_int_t ngx_http_file_cache_read(ngx_http_request_t *r,
     ngx_http_cache_t *c);
+static ngx_int_t ngx_http_file_cache_sparse(ngx_http_request_t *r,
+    ngx_http_cache_t *c, ngx_http_file_cache_header_t *h, size_t size);
 static ssize_t ngx_http_file_cache_aio_read(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 #if (NGX_HAVE_FILE_AIO)
@@ -31,7 +100,21 @@ static void ngx_http_cache_thread_event_handler(ngx_event_t *ev);
 static ngx_int_t ngx_http_file_cache_exists(ngx_http_file_cache_t *cache,
     ngx_http_cache_t *c);
 static ngx_int_t ngx_http_file_cache_name(ngx_http_request_t *r,
-    ngx_path_t *path);
+    ngx_http_file_cache_t *cache);
+static ngx_uint_t ngx_http_file_cache_shard(ngx_http_file_cache_t *cache,
+    u_char *key);
+static ngx_uint_t ngx_http_file_cache_shard_down(ngx_http_file_cache_t *cache,
+    ngx_uint_t n, time_t now);
+static void ngx_http_file_cache_shard_failed(ngx_http_file_cache_t *cache,
+    ngx_uint_t n, ngx_log_t *log);
+static void ngx_http_file_cache_shard_ok(ngx_http_file_cache_t *cache,
+    ngx_uint_t n);
+static void ngx_http_file_cache_shard_delete(ngx_http_file_cache_t *cache,
+    u_char *key, ngx_uint_t n);
+static void ngx_http_file_cache_shards_remap(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_t *ocache, ngx_log_t *log);
+static uint32_t ngx_http_file_cache_shards_hash(ngx_http_file_cache_t *cache);
+static size_t ngx_http_file_cache_name_len(ngx_http_file_cache_t *cache);
 static ngx_http_file_cache_node_t *
     ngx_http_file_cache_lookup(ngx_http_file_cache_t *cache, u_char *key);
 static void ngx_http_file_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
@@ -45,6 +128,33 @@ static ngx_int_t ngx_http_file_cache_reopen(ngx_http_request_t *r,
 static ngx_int_t ngx_http_file_cache_update_variant(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 static void ngx_http_file_cache_cleanup(void *data);
+static ngx_int_t ngx_http_file_cache_tag(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn, ngx_str_t *tags);
+static void ngx_http_file_cache_untag(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn);
+static u_char *ngx_http_file_cache_next_tag(u_char *p, u_char *last,
+    ngx_str_t *tag);
+static ngx_uint_t ngx_http_file_cache_purge_node(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn);
+static ngx_http_file_cache_op_t *ngx_http_file_cache_op_create(
+    ngx_http_file_cache_t *cache, ngx_uint_t type, ngx_uint_t shard,
+    u_char *key, ngx_str_t *from, ngx_str_t *to);
+static void ngx_http_file_cache_op_post(ngx_http_file_cache_op_t *op);
+static void ngx_http_file_cache_op_run(ngx_http_file_cache_op_t *op,
+    ngx_log_t *log);
+static void ngx_http_file_cache_op_header(ngx_http_file_cache_op_t *op,
+    ngx_log_t *log);
+static void ngx_http_file_cache_op_fill(ngx_http_file_cache_op_t *op,
+    ngx_log_t *log);
+static void ngx_http_file_cache_op_done(ngx_http_file_cache_op_t *op);
+static void ngx_http_file_cache_update_done(ngx_http_file_cache_op_t *op);
+#if (NGX_THREADS)
+static void ngx_http_file_cache_op_dispatch(ngx_http_file_cache_t *cache,
+    ngx_uint_t n);
+static void ngx_http_file_cache_op_thread(void *data, ngx_log_t *log);
+static void ngx_http_file_cache_op_event(ngx_event_t *ev);
+static void ngx_http_file_cache_op_timer(ngx_event_t *ev);
+#endif
 static time_t ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache);
 static time_t ngx_http_file_cache_expire(ngx_http_file_cache_t *cache);
 static void ngx_http_file_cache_delete(ngx_http_file_cache_t *cache,
@@ -63,6 +173,45 @@ static ngx_int_t ngx_http_file_cache_add(ngx_http_file_cache_t *cache,
 static ngx_int_t ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
 static void ngx_http_file_cache_set_watermark(ngx_http_file_cache_t *cache);
+static ngx_int_t ngx_http_file_cache_memory_read(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static void ngx_http_file_cache_memory_add(ngx_http_cache_t *c);
+static void ngx_http_file_cache_memory_delete(ngx_http_file_cache_t *cache,
+    u_char *key);
+static ngx_http_file_cache_memory_node_t *
+    ngx_http_file_cache_memory_lookup(ngx_http_file_cache_t *cache,
+    u_char *key);
+static void ngx_http_file_cache_memory_free(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_memory_node_t *mn);
+static void ngx_http_file_cache_memory_report(ngx_http_file_cache_t *cache);
+static void ngx_http_file_cache_report(ngx_http_file_cache_t *cache);
+static ngx_int_t ngx_http_file_cache_sketch_init(ngx_http_file_cache_t *cache,
+    ngx_shm_zone_t *shm_zone);
+static void ngx_http_file_cache_sketch_add(ngx_http_file_cache_t *cache,
+    u_char *key);
+static ngx_uint_t ngx_http_file_cache_sketch_estimate(
+    ngx_http_file_cache_t *cache, ngx_http_file_cache_node_t *fcn);
+static ngx_queue_t *ngx_http_file_cache_queue(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn);
+static ngx_queue_t *ngx_http_file_cache_last(ngx_http_file_cache_t *cache);
+static ngx_queue_t *ngx_http_file_cache_victim(ngx_http_file_cache_t *cache);
+static ngx_int_t ngx_http_file_cache_index_load(ngx_http_file_cache_t *cache,
+    ngx_log_t *log);
+static ngx_int_t ngx_http_file_cache_index_valid(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_index_header_t *h);
+static void ngx_http_file_cache_index_record(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn, ngx_uint_t op);
+static void ngx_http_file_cache_index(ngx_http_file_cache_t *cache);
+static ngx_int_t ngx_http_file_cache_index_open(ngx_http_file_cache_t *cache);
+static ngx_int_t ngx_http_file_cache_index_flush(ngx_http_file_cache_t *cache,
+    ngx_uint_t write);
+static ngx_int_t ngx_http_file_cache_index_checkpoint(
+    ngx_http_file_cache_t *cache);
+static ngx_http_file_cache_node_t *
+    ngx_http_file_cache_index_next(ngx_http_file_cache_t *cache, u_char *key);
+
+
+static u_char  ngx_http_file_cache_index_magic[] = "NGXCIDX";
 
 
 ngx_str_t  ngx_http_cache_status[] = {
@@ -79,6 +228,13 @@ ngx_str_t  ngx_http_cache_status[] = {
 static u_char  ngx_http_file_cache_key[] = { LF, 'K', 'E', 'Y', ':', ' ' };
 
 
+/* requests of this process waiting for a cache node being updated */
+
+static ngx_queue_t  ngx_http_file_cache_waiting = {
+    &ngx_http_file_cache_waiting, &ngx_http_file_cache_waiting
+};
+
+
 static ngx_int_t
 ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 {
@@ -117,11 +273,24 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 
         cache->max_size /= cache->bsize;
 
-        if (!cache->sh->cold || cache->sh->loading) {
+        ngx_http_file_cache_shards_remap(cache, ocache, shm_zone->shm.log);
+
+        if ((!cache->sh->cold && !cache->sh->index_walk)
+            || cache->sh->loading)
+        {
             cache->path->loader = NULL;
         }
 
-        return NGX_OK;
+        if (cache->index.name.len
+            && (ocache->index.name.len != cache->index.name.len
+                || ngx_strcmp(ocache->index.name.data, cache->index.name.data)
+                   != 0))
+        {
+            /* the index file does not reflect the zone */
+            cache->sh->index_checkpoint = 1;
+        }
+
+        return ngx_http_file_cache_sketch_init(cache, shm_zone);
     }
 
     cache->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
@@ -144,13 +313,30 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
     ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
                     ngx_http_file_cache_rbtree_insert_value);
 
+    ngx_rbtree_init(&cache->sh->tags, &cache->sh->tags_sentinel,
+                    ngx_str_rbtree_insert_value);
+
     ngx_queue_init(&cache->sh->queue);
+    ngx_queue_init(&cache->sh->index_queue);
+    ngx_queue_init(&cache->sh->main);
 
     cache->sh->cold = 1;
     cache->sh->loading = 0;
     cache->sh->size = 0;
     cache->sh->count = 0;
     cache->sh->watermark = (ngx_uint_t) -1;
+    cache->sh->index_queued = 0;
+    cache->sh->index_journal = 0;
+    cache->sh->index_checkpoint = 0;
+    cache->sh->index_walk = 0;
+    cache->sh->main_count = 0;
+    cache->sh->sketch = NULL;
+    cache->sh->hits = 0;
+    cache->sh->hit_bytes = 0;
+    cache->sh->misses = 0;
+    cache->sh->miss_bytes = 0;
+    cache->sh->updates = 0;
+    cache->sh->update_uses = 0;
 
     cache->bsize = ngx_fs_bsize(cache->path->name.data);
 
@@ -168,6 +354,84 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 
     cache->shpool->log_nomem = 0;
 
+    if (ngx_http_file_cache_sketch_init(cache, shm_zone) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (cache->index.name.len && !ngx_test_config) {
+
+        if (ngx_http_file_cache_index_load(cache, shm_zone->shm.log) == NGX_OK)
+        {
+            /*
+             * the cache is usable at once, the loader still walks
+             * the cache directory to pick up files written after
+             * the last journal flush
+             */
+
+            cache->sh->cold = 0;
+            cache->sh->index_walk = 1;
+
+        } else {
+            cache->sh->index_checkpoint = 1;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_memory_init(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_file_cache_t  *ocache = data;
+
+    size_t                  len;
+    ngx_http_file_cache_t  *cache;
+
+    cache = shm_zone->data;
+
+    if (ocache && ocache->memory) {
+        cache->memory = ocache->memory;
+        cache->memory_shpool = ocache->memory_shpool;
+
+        return NGX_OK;
+    }
+
+    cache->memory_shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        cache->memory = cache->memory_shpool->data;
+
+        return NGX_OK;
+    }
+
+    cache->memory = ngx_slab_calloc(cache->memory_shpool,
+                                    sizeof(ngx_http_file_cache_memory_sh_t));
+    if (cache->memory == NULL) {
+        return NGX_ERROR;
+    }
+
+    cache->memory_shpool->data = cache->memory;
+
+    /* memory nodes start with the same fields as the keys zone nodes */
+
+    ngx_rbtree_init(&cache->memory->rbtree, &cache->memory->sentinel,
+                    ngx_http_file_cache_rbtree_insert_value);
+
+    ngx_queue_init(&cache->memory->queue);
+
+    len = sizeof(" in cache memory zone \"\"") + shm_zone->shm.name.len;
+
+    cache->memory_shpool->log_ctx = ngx_slab_alloc(cache->memory_shpool, len);
+    if (cache->memory_shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(cache->memory_shpool->log_ctx, " in cache memory zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    cache->memory_shpool->log_nomem = 0;
+
     return NGX_OK;
 }
 
@@ -216,7 +480,7 @@ ngx_http_file_cache_create(ngx_http_request_t *r)
         return NGX_ERROR;
     }
 
-    if (ngx_http_file_cache_name(r, cache->path) != NGX_OK) {
+    if (ngx_http_file_cache_name(r, cache) != NGX_OK) {
         return NGX_ERROR;
     }
 
@@ -335,7 +599,7 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
         }
     }
 
-    if (ngx_http_file_cache_name(r, cache->path) != NGX_OK) {
+    if (ngx_http_file_cache_name(r, cache) != NGX_OK) {
         return NGX_ERROR;
     }
 
@@ -343,6 +607,18 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
         goto done;
     }
 
+    if (c->exists && cache->memory) {
+        rc = ngx_http_file_cache_memory_read(r, c);
+
+        if (rc == NGX_OK) {
+            return ngx_http_file_cache_read(r, c);
+        }
+
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+    }
+
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
     ngx_memzero(&of, sizeof(ngx_open_file_info_t));
@@ -369,6 +645,9 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
         default:
             ngx_log_error(NGX_LOG_CRIT, r->connection->log, of.err,
                           ngx_open_file_n " \"%s\" failed", c->file.name.data);
+
+            ngx_http_file_cache_shard_failed(cache, c->shard,
+                                             r->connection->log);
             return NGX_ERROR;
         }
     }
@@ -376,12 +655,22 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http file cache fd: %d", of.fd);
 
+    (void) ngx_atomic_fetch_add(&cache->sh->shards[c->shard].reads, 1);
+
     c->file.fd = of.fd;
     c->file.log = r->connection->log;
     c->uniq = of.uniq;
     c->length = of.size;
     c->fs_size = (of.fs_size + cache->bsize - 1) / cache->bsize;
 
+    if (cache->memory
+        && c->length > (off_t) c->body_start
+        && c->length <= (off_t) cache->memory_max_object)
+    {
+        /* read the whole file, so it can be kept in memory */
+        c->body_start = (size_t) c->length;
+    }
+
     c->buf = ngx_create_temp_buf(r->pool, c->body_start);
     if (c->buf == NULL) {
         return NGX_ERROR;
@@ -402,6 +691,7 @@ done:
 static ngx_int_t
 ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
+    ngx_int_t                  rc;
     ngx_msec_t                 now, timer;
     ngx_http_file_cache_t     *cache;
 
@@ -438,8 +728,6 @@ ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
         return NGX_HTTP_CACHE_SCARCE;
     }
 
-    c->waiting = 1;
-
     if (c->wait_time == 0) {
         c->wait_time = now + c->lock_timeout;
 
@@ -448,9 +736,29 @@ ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
         c->wait_event.log = r->connection->log;
     }
 
+    /* the response is being written, read it while it is written */
+
+    rc = ngx_http_file_cache_stream_attach(r, c);
+
+    if (rc != NGX_DECLINED) {
+        return rc;
+    }
+
+    c->waiting = 1;
+
+    /*
+     * the request is woken up by the lock holder if it runs in this
+     * process, and polls otherwise
+     */
+
+    if (c->wait_queue.prev == NULL) {
+        ngx_queue_insert_tail(&ngx_http_file_cache_waiting, &c->wait_queue);
+    }
+
     timer = c->wait_time - now;
 
-    ngx_add_timer(&c->wait_event, (timer > 500) ? 500 : timer);
+    ngx_add_timer(&c->wait_event, (timer > NGX_HTTP_CACHE_WAIT_POLL)
+                                  ? NGX_HTTP_CACHE_WAIT_POLL : timer);
 
     r->main->blocked++;
 
@@ -505,39 +813,277 @@ ngx_http_file_cache_lock_wait(ngx_http_request_t *r, ngx_http_cache_t *c)
 
     if (c->node->updating && (ngx_msec_int_t) timer > 0) {
         wait = 1;
+
+        if (c->node->stream && c->node->stream->length) {
+            wait = 0;
+        }
     }
 
     ngx_shmtx_unlock(&cache->shpool->mutex);
 
     if (wait) {
-        ngx_add_timer(&c->wait_event, (timer > 500) ? 500 : timer);
+        ngx_add_timer(&c->wait_event, (timer > NGX_HTTP_CACHE_WAIT_POLL)
+                                      ? NGX_HTTP_CACHE_WAIT_POLL : timer);
         return;
     }
 
 wakeup:
 
+    ngx_http_file_cache_unwait(c);
+
     c->waiting = 0;
     r->main->blocked--;
     r->write_event_handler(r);
 }
 
 
+static void
+ngx_http_file_cache_unwait(ngx_http_cache_t *c)
+{
+    if (c->wait_queue.prev) {
+        ngx_queue_remove(&c->wait_queue);
+        c->wait_queue.prev = NULL;
+    }
+
+    if (c->wait_event.timer_set) {
+        ngx_del_timer(&c->wait_event);
+    }
+
+    if (c->wait_event.posted) {
+        ngx_delete_posted_event(&c->wait_event);
+    }
+}
+
+
+static void
+ngx_http_file_cache_wakeup(ngx_http_file_cache_node_t *fcn)
+{
+    ngx_queue_t       *q;
+    ngx_http_cache_t  *c;
+
+    for (q = ngx_queue_head(&ngx_http_file_cache_waiting);
+         q != ngx_queue_sentinel(&ngx_http_file_cache_waiting);
+         q = ngx_queue_next(q))
+    {
+        c = ngx_queue_data(q, ngx_http_cache_t, wait_queue);
+
+        if (c->node == fcn && !c->wait_event.posted) {
+            ngx_post_event(&c->wait_event, &ngx_posted_events);
+        }
+    }
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_stream_attach(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    off_t                          length;
+    ngx_fd_t                       fd;
+    ngx_pool_cleanup_t            *cln;
+    ngx_pool_cleanup_file_t       *clnf;
+    ngx_http_file_cache_t         *cache;
+    ngx_http_file_cache_stream_t  *st;
+
+    cache = c->file_cache;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    st = c->node->stream;
+
+    if (st == NULL || st->length == 0 || st->complete || st->failed) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    st->refs++;
+    length = st->length;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    c->stream = st;
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_pool_cleanup_file_t));
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* the name is kept in the zone while the stream is referenced */
+
+    fd = ngx_open_file(st->name, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+    if (fd == NGX_INVALID_FILE) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, ngx_errno,
+                       "http file cache stream open \"%s\" failed",
+                       st->name);
+
+        ngx_shmtx_lock(&cache->shpool->mutex);
+        ngx_http_file_cache_stream_close(cache, c, -1);
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        return NGX_DECLINED;
+    }
+
+    cln->handler = ngx_pool_cleanup_file;
+    clnf = cln->data;
+
+    clnf->fd = fd;
+    clnf->name = st->name;
+    clnf->log = r->pool->log;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache stream: \"%s\" %O", st->name, length);
+
+    c->file.fd = fd;
+    c->file.log = r->connection->log;
+    c->length = length;
+    c->uniq = 0;
+    c->fs_size = 0;
+    c->streaming = 1;
+
+    c->buf = ngx_create_temp_buf(r->pool, c->body_start);
+    if (c->buf == NULL) {
+        return NGX_ERROR;
+    }
+
+    return ngx_http_file_cache_read(r, c);
+}
+
+
+void
+ngx_http_file_cache_stream(ngx_http_request_t *r, ngx_temp_file_t *tf)
+{
+    size_t                         len;
+    ngx_http_cache_t              *c;
+    ngx_http_file_cache_t         *cache;
+    ngx_http_file_cache_stream_t  *st;
+
+    c = r->cache;
+
+    if (!c->lock
+        || !c->updating
+        || c->updated
+        || tf == NULL
+        || tf->file.fd == NGX_INVALID_FILE
+        || tf->offset == 0)
+    {
+        return;
+    }
+
+    cache = c->file_cache;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    st = c->stream;
+
+    if (st == NULL) {
+
+        if (c->node->stream || c->node->lock_time != c->lock_time) {
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+            return;
+        }
+
+        len = tf->file.name.len;
+
+        st = ngx_slab_alloc_locked(cache->shpool,
+                                   sizeof(ngx_http_file_cache_stream_t) + len);
+        if (st == NULL) {
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+            return;
+        }
+
+        st->length = 0;
+        st->pid = ngx_pid;
+        st->refs = 1;
+        st->complete = 0;
+        st->failed = 0;
+
+        (void) ngx_cpystrn(st->name, tf->file.name.data, len + 1);
+
+        c->node->stream = st;
+        c->stream = st;
+
+    } else if (st->length == tf->offset) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return;
+    }
+
+    st->length = tf->offset;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache stream write: \"%V\" %O",
+                   &tf->file.name, tf->offset);
+
+    ngx_http_file_cache_wakeup(c->node);
+}
+
+
+static void
+ngx_http_file_cache_stream_close(ngx_http_file_cache_t *cache,
+    ngx_http_cache_t *c, off_t length)
+{
+    ngx_http_file_cache_stream_t  *st;
+
+    /* called with the zone locked, length is -1 on failure */
+
+    st = c->stream;
+
+    if (st == NULL) {
+        return;
+    }
+
+    if (!c->streaming) {
+
+        /* the response is written by this request */
+
+        if (c->node->stream == st) {
+            c->node->stream = NULL;
+        }
+
+        if (length >= 0) {
+            st->length = length;
+            st->complete = 1;
+
+        } else {
+            st->failed = 1;
+        }
+    }
+
+    if (--st->refs == 0) {
+        ngx_slab_free_locked(cache->shpool, st);
+    }
+
+    c->stream = NULL;
+}
+
+
 static ngx_int_t
 ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
     u_char                        *p;
-    time_t                         now;
+    time_t                         now, ahead;
     ssize_t                        n;
     ngx_str_t                     *key;
     ngx_int_t                      rc;
-    ngx_uint_t                     i;
+    ngx_uint_t                     i, expired;
     ngx_http_file_cache_t         *cache;
     ngx_http_file_cache_header_t  *h;
 
-    n = ngx_http_file_cache_aio_read(r, c);
+    if (c->memory) {
+        n = (ssize_t) c->length;
 
-    if (n < 0) {
-        return n;
+    } else {
+        n = ngx_http_file_cache_aio_read(r, c);
+
+        if (n == NGX_ERROR && !c->streaming) {
+            ngx_http_file_cache_shard_failed(c->file_cache, c->shard,
+                                             r->connection->log);
+        }
+
+        if (n < 0) {
+            return n;
+        }
     }
 
     if ((size_t) n < c->header_start) {
@@ -613,8 +1159,23 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 
     r->cached = 1;
 
+    if (c->streaming) {
+        return NGX_OK;
+    }
+
     cache = c->file_cache;
 
+    if (cache->memory) {
+
+        if ((off_t) n == c->length) {
+            c->complete = 1;
+        }
+
+        if (!c->memory) {
+            (void) ngx_atomic_fetch_add(&cache->memory->disk_hits, 1);
+        }
+    }
+
     if (cache->sh->cold) {
 
         ngx_shmtx_lock(&cache->shpool->mutex);
@@ -632,11 +1193,56 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
         ngx_shmtx_unlock(&cache->shpool->mutex);
     }
 
+    if (h->block) {
+        c->complete = 0;
+        return ngx_http_file_cache_sparse(r, c, h, n);
+    }
+
     now = ngx_time();
 
-    if (c->valid_sec < now) {
-        c->stale_updating = c->valid_sec + c->updating_sec >= now;
-        c->stale_error = c->valid_sec + c->error_sec >= now;
+    rc = NGX_OK;
+    expired = (c->valid_sec < now);
+
+    if (!expired && cache->refresh_ahead) {
+
+        /*
+         * a response is updated in background shortly before it expires,
+         * the point within the refresh_ahead window depends on the key,
+         * so responses cached at the same time are not updated together
+         */
+
+        ahead = 1 + (time_t) ((c->key[0] << 8 | c->key[1])
+                              % cache->refresh_ahead);
+
+        if (c->valid_sec - ahead < now) {
+
+            if (r->background) {
+                /* the background update itself */
+                expired = 1;
+
+            } else if (c->ahead) {
+                ngx_shmtx_lock(&cache->shpool->mutex);
+
+                if (!c->node->updating) {
+                    c->node->updating = 1;
+                    c->updating = 1;
+                    c->refresh = 1;
+                    c->lock_time = c->node->lock_time;
+                    rc = NGX_HTTP_CACHE_STALE;
+                }
+
+                ngx_shmtx_unlock(&cache->shpool->mutex);
+
+                ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                               "http file cache refresh: %i %T %T",
+                               rc, c->valid_sec, now);
+            }
+        }
+    }
+
+    if (expired) {
+        c->stale_updating = c->valid_sec + c->updating_sec >= now;
+        c->stale_error = c->valid_sec + c->error_sec >= now;
 
         ngx_shmtx_lock(&cache->shpool->mutex);
 
@@ -659,7 +1265,148 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
         return rc;
     }
 
-    return NGX_OK;
+    if (c->complete
+        && !c->memory
+        && c->length <= (off_t) cache->memory_max_object)
+    {
+        ngx_http_file_cache_memory_add(c);
+    }
+
+    (void) ngx_atomic_fetch_add(&cache->sh->hits, 1);
+    (void) ngx_atomic_fetch_add(&cache->sh->hit_bytes, c->length);
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_sparse(ngx_http_request_t *r, ngx_http_cache_t *c,
+    ngx_http_file_cache_header_t *h, size_t size)
+{
+    u_char                 *map;
+    off_t                   start, end;
+    ngx_int_t               rc;
+    ngx_uint_t              i, first, last, missing;
+    ngx_msec_t              now, timer;
+    ngx_http_file_cache_t  *cache;
+
+    cache = c->file_cache;
+
+    if (h->block != cache->sparse
+        || h->length <= 0
+        || (size_t) h->map_start < c->header_start
+        || (size_t) h->map_start
+           + ngx_http_file_cache_map_len(h->length, h->block)
+           != (size_t) h->body_start
+        || size < (size_t) h->body_start)
+    {
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                      "cache file \"%s\" has incompatible block map",
+                      c->file.name.data);
+        return NGX_DECLINED;
+    }
+
+    if (c->valid_sec < ngx_time()) {
+
+        /* expired sparse entries are replaced rather than revalidated */
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache sparse expired: %T", c->valid_sec);
+        return NGX_DECLINED;
+    }
+
+    c->sparse = 1;
+    c->sparse_length = h->length;
+    c->map_start = h->map_start;
+    c->length = c->body_start + h->length;
+
+    if (!c->range) {
+        start = 0;
+        end = h->length;
+
+    } else if (c->range_start == -1) {
+        start = h->length - c->range_end;
+        end = h->length;
+
+        if (start < 0) {
+            start = 0;
+        }
+
+    } else {
+        start = c->range_start;
+        end = c->range_end;
+
+        if (end == -1 || end > h->length) {
+            end = h->length;
+        }
+    }
+
+    map = c->buf->pos + h->map_start;
+
+    missing = 0;
+    first = 0;
+    last = 0;
+
+    if (start < end) {
+        for (i = start / h->block; i <= (ngx_uint_t) ((end - 1) / h->block);
+             i++)
+        {
+            if (map[i / 8] & (1 << (i % 8))) {
+                continue;
+            }
+
+            if (missing++ == 0) {
+                first = i;
+            }
+
+            last = i;
+        }
+    }
+
+    ngx_log_debug5(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache sparse: %O-%O/%O missing:%ui at %ui",
+                   start, end, h->length, missing, first);
+
+    if (missing == 0) {
+        (void) ngx_atomic_fetch_add(&cache->sh->hits, 1);
+        (void) ngx_atomic_fetch_add(&cache->sh->hit_bytes, end - start);
+
+        return NGX_OK;
+    }
+
+    /*
+     * only one request at a time fills blocks of an entry,
+     * others are passed to the upstream server as is
+     */
+
+    now = ngx_current_msec;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    timer = c->node->lock_time - now;
+
+    if (!c->node->updating || (ngx_msec_int_t) timer <= 0) {
+        c->node->updating = 1;
+        c->node->lock_time = now + c->lock_age;
+        c->updating = 1;
+        c->lock_time = c->node->lock_time;
+        rc = NGX_DECLINED;
+
+    } else {
+        rc = NGX_HTTP_CACHE_SCARCE;
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    if (rc == NGX_DECLINED) {
+        c->ranged = 1;
+        c->range_start = start;
+        c->range_end = end;
+        c->fill_start = (off_t) first * h->block;
+        c->fill_end = ngx_min((off_t) (last + 1) * h->block, h->length);
+    }
+
+    return rc;
 }
 
 
@@ -828,14 +1575,28 @@ ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
 
     if (fcn == NULL) {
         fcn = ngx_http_file_cache_lookup(cache, c->key);
+
+        if (cache->sh->sketch) {
+            ngx_http_file_cache_sketch_add(cache, c->key);
+        }
     }
 
     if (fcn) {
         ngx_queue_remove(&fcn->queue);
 
         if (c->node == NULL) {
-            fcn->uses++;
+
+            if (fcn->uses < 1023) {
+                /* saturated, as it prioritizes background updates */
+                fcn->uses++;
+            }
+
             fcn->count++;
+
+            if (cache->sh->sketch && fcn->exists && !fcn->admitted) {
+                fcn->admitted = 1;
+                cache->sh->main_count++;
+            }
         }
 
         if (fcn->error) {
@@ -851,11 +1612,30 @@ ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
 
         if (fcn->exists || fcn->uses >= c->min_uses) {
 
-            c->exists = fcn->exists;
+            /* a purged response is fetched anew over the old file */
+
+            c->exists = fcn->exists && !fcn->purged;
             if (fcn->body_start) {
                 c->body_start = fcn->body_start;
             }
 
+            if (fcn->exists) {
+
+                if (!ngx_http_file_cache_shard_down(cache, fcn->shard,
+                                                    ngx_time()))
+                {
+                    c->shard = fcn->shard;
+                    rc = NGX_OK;
+                    goto done;
+                }
+
+                /* the shard has failed, the response is cached anew */
+
+                c->exists = 0;
+            }
+
+            c->shard = ngx_http_file_cache_shard(cache, c->key);
+
             rc = NGX_OK;
 
             goto done;
@@ -903,6 +1683,8 @@ renew:
 
     rc = NGX_DECLINED;
 
+    c->shard = ngx_http_file_cache_shard(cache, c->key);
+
     fcn->valid_msec = 0;
     fcn->error = 0;
     fcn->exists = 0;
@@ -915,7 +1697,7 @@ done:
 
     fcn->expire = ngx_time() + cache->inactive;
 
-    ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+    ngx_queue_insert_head(ngx_http_file_cache_queue(cache, fcn), &fcn->queue);
 
     c->uniq = fcn->uniq;
     c->error = fcn->error;
@@ -930,10 +1712,12 @@ failed:
 
 
 static ngx_int_t
-ngx_http_file_cache_name(ngx_http_request_t *r, ngx_path_t *path)
+ngx_http_file_cache_name(ngx_http_request_t *r, ngx_http_file_cache_t *cache)
 {
-    u_char            *p;
-    ngx_http_cache_t  *c;
+    u_char                       *p;
+    ngx_path_t                   *path;
+    ngx_http_cache_t             *c;
+    ngx_http_file_cache_shard_t  *shard;
 
     c = r->cache;
 
@@ -941,6 +1725,9 @@ ngx_http_file_cache_name(ngx_http_request_t *r, ngx_path_t *path)
         return NGX_OK;
     }
 
+    shard = cache->shards.elts;
+    path = shard[c->shard].path;
+
     c->file.name.len = path->name.len + 1 + path->len
                        + 2 * NGX_HTTP_CACHE_KEY_LEN;
 
@@ -964,159 +1751,471 @@ ngx_http_file_cache_name(ngx_http_request_t *r, ngx_path_t *path)
 }
 
 
-static ngx_http_file_cache_node_t *
-ngx_http_file_cache_lookup(ngx_http_file_cache_t *cache, u_char *key)
+static ngx_uint_t
+ngx_http_file_cache_shard(ngx_http_file_cache_t *cache, u_char *key)
 {
-    ngx_int_t                    rc;
-    ngx_rbtree_key_t             node_key;
-    ngx_rbtree_node_t           *node, *sentinel;
-    ngx_http_file_cache_node_t  *fcn;
+    time_t                           now;
+    uint32_t                         h, k, max;
+    ngx_uint_t                       i, n, all;
+    ngx_http_file_cache_shard_t     *shard;
+    ngx_http_file_cache_shard_sh_t  *sh;
 
-    ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
+    if (cache->shards.nelts == 1) {
+        return 0;
+    }
 
-    node = cache->sh->rbtree.root;
-    sentinel = cache->sh->rbtree.sentinel;
+    /*
+     * rendezvous hashing: a key is placed on the shard with the highest
+     * score, so a failed or removed shard only moves its own keys
+     */
 
-    while (node != sentinel) {
+    shard = cache->shards.elts;
+    now = ngx_time();
 
-        if (node_key < node->key) {
-            node = node->left;
-            continue;
-        }
+    ngx_memcpy(&k, &key[sizeof(uint32_t)], sizeof(uint32_t));
 
-        if (node_key > node->key) {
-            node = node->right;
-            continue;
-        }
+    n = NGX_HTTP_CACHE_MAX_SHARDS;
+    max = 0;
 
-        /* node_key == node->key */
+    /* if all shards have failed, keys are placed as if none did */
 
-        fcn = (ngx_http_file_cache_node_t *) node;
+    for (all = 0; n == NGX_HTTP_CACHE_MAX_SHARDS; all++) {
 
-        rc = ngx_memcmp(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
-                        NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+        for (i = 0; i < cache->shards.nelts; i++) {
 
-        if (rc == 0) {
-            return fcn;
-        }
+            if (!all && ngx_http_file_cache_shard_down(cache, i, now)) {
+                continue;
+            }
 
-        node = (rc < 0) ? node->left : node->right;
+            /* murmurhash3 finalizer */
+
+            h = k ^ shard[i].hash;
+            h ^= h >> 16;
+            h *= 0x85ebca6b;
+            h ^= h >> 13;
+            h *= 0xc2b2ae35;
+            h ^= h >> 16;
+
+            if (n == NGX_HTTP_CACHE_MAX_SHARDS || h > max) {
+                max = h;
+                n = i;
+            }
+        }
     }
 
-    /* not found */
+    sh = &cache->sh->shards[n];
 
-    return NULL;
+    if (cache->shard_max_fails && sh->fails >= cache->shard_max_fails) {
+
+        /* the first key after fail_timeout probes the shard again */
+
+        sh->checked = now;
+    }
+
+    return n;
 }
 
 
-static void
-ngx_http_file_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
-    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+static ngx_uint_t
+ngx_http_file_cache_shard_down(ngx_http_file_cache_t *cache, ngx_uint_t n,
+    time_t now)
 {
-    ngx_rbtree_node_t           **p;
-    ngx_http_file_cache_node_t   *cn, *cnt;
+    ngx_http_file_cache_shard_sh_t  *sh;
 
-    for ( ;; ) {
+    if (cache->shard_max_fails == 0) {
+        return 0;
+    }
 
-        if (node->key < temp->key) {
+    sh = &cache->sh->shards[n];
 
-            p = &temp->left;
+    return (sh->fails >= cache->shard_max_fails
+            && now - sh->checked <= cache->shard_fail_timeout);
+}
 
-        } else if (node->key > temp->key) {
 
-            p = &temp->right;
+static void
+ngx_http_file_cache_shard_failed(ngx_http_file_cache_t *cache, ngx_uint_t n,
+    ngx_log_t *log)
+{
+    ngx_http_file_cache_shard_t     *shard;
+    ngx_http_file_cache_shard_sh_t  *sh;
 
-        } else { /* node->key == temp->key */
+    sh = &cache->sh->shards[n];
 
-            cn = (ngx_http_file_cache_node_t *) node;
-            cnt = (ngx_http_file_cache_node_t *) temp;
+    (void) ngx_atomic_fetch_add(&sh->errors, 1);
 
-            p = (ngx_memcmp(cn->key, cnt->key,
-                            NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t))
-                 < 0)
-                    ? &temp->left : &temp->right;
-        }
+    if (cache->shard_max_fails == 0) {
+        return;
+    }
 
-        if (*p == sentinel) {
-            break;
-        }
+    ngx_shmtx_lock(&cache->shpool->mutex);
 
-        temp = *p;
+    sh->fails++;
+    sh->checked = ngx_time();
+
+    if (sh->fails == cache->shard_max_fails) {
+        shard = cache->shards.elts;
+
+        ngx_log_error(NGX_LOG_WARN, log, 0,
+                      "cache shard \"%V\" temporarily disabled",
+                      &shard[n].path->name);
     }
 
-    *p = node;
-    node->parent = temp;
-    node->left = sentinel;
-    node->right = sentinel;
-    ngx_rbt_red(node);
+    ngx_shmtx_unlock(&cache->shpool->mutex);
 }
 
 
 static void
-ngx_http_file_cache_vary(ngx_http_request_t *r, u_char *vary, size_t len,
-    u_char *hash)
+ngx_http_file_cache_shard_ok(ngx_http_file_cache_t *cache, ngx_uint_t n)
 {
-    u_char     *p, *last;
-    ngx_str_t   name;
-    ngx_md5_t   md5;
-    u_char      buf[NGX_HTTP_CACHE_VARY_LEN];
-
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache vary: \"%*s\"", len, vary);
+    ngx_http_file_cache_shard_sh_t  *sh;
 
-    ngx_md5_init(&md5);
-    ngx_md5_update(&md5, r->cache->main, NGX_HTTP_CACHE_KEY_LEN);
+    sh = &cache->sh->shards[n];
 
-    ngx_strlow(buf, vary, len);
+    if (sh->fails == 0) {
+        return;
+    }
 
-    p = buf;
-    last = buf + len;
+    ngx_shmtx_lock(&cache->shpool->mutex);
+    sh->fails = 0;
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
 
-    while (p < last) {
 
-        while (p < last && (*p == ' ' || *p == ',')) { p++; }
+static void
+ngx_http_file_cache_shard_delete(ngx_http_file_cache_t *cache, u_char *key,
+    ngx_uint_t n)
+{
+    u_char                       *p;
+    ngx_str_t                     name;
+    ngx_path_t                   *path;
+    ngx_http_file_cache_op_t     *op;
+    ngx_http_file_cache_shard_t  *shard;
 
-        name.data = p;
+    /*
+     * the previous copy of a response moved to another shard, copies left
+     * on failed shards are removed by the cache loader
+     */
 
-        while (p < last && *p != ',' && *p != ' ') { p++; }
+    shard = cache->shards.elts;
+    path = shard[n].path;
 
-        name.len = p - name.data;
+    name.len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+    name.data = NULL;
 
-        if (name.len == 0) {
-            break;
-        }
+    op = ngx_http_file_cache_op_create(cache, NGX_HTTP_CACHE_OP_UNLINK, n,
+                                       key, NULL, &name);
+    if (op == NULL) {
+        return;
+    }
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "http file cache vary: %V", &name);
+    ngx_memcpy(op->to.data, path->name.data, path->name.len);
 
-        ngx_md5_update(&md5, name.data, name.len);
-        ngx_md5_update(&md5, (u_char *) ":", sizeof(":") - 1);
+    p = op->to.data + path->name.len + 1 + path->len;
+    p = ngx_hex_dump(p, key, NGX_HTTP_CACHE_KEY_LEN);
+    *p = '\0';
 
-        ngx_http_file_cache_vary_header(r, &md5, &name);
+    ngx_create_hashed_filename(path, op->to.data, op->to.len);
 
-        ngx_md5_update(&md5, (u_char *) CRLF, sizeof(CRLF) - 1);
-    }
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache moved from: \"%s\"", op->to.data);
 
-    ngx_md5_final(hash, &md5);
+    ngx_http_file_cache_op_post(op);
 }
 
 
 static void
-ngx_http_file_cache_vary_header(ngx_http_request_t *r, ngx_md5_t *md5,
-    ngx_str_t *name)
+ngx_http_file_cache_shards_remap(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_t *ocache, ngx_log_t *log)
 {
-    size_t            len;
-    u_char           *p, *start, *last;
-    ngx_uint_t        i, multiple, normalize;
-    ngx_list_part_t  *part;
-    ngx_table_elt_t  *header;
+    ngx_uint_t                       i, j, changed, dropped;
+    ngx_queue_t                     *q, *queue;
+    ngx_http_file_cache_node_t      *fcn;
+    ngx_http_file_cache_shard_t     *shard, *oshard;
+    ngx_http_file_cache_shard_sh_t   sh[NGX_HTTP_CACHE_MAX_SHARDS];
+    u_char                           map[NGX_HTTP_CACHE_MAX_SHARDS];
+
+    shard = cache->shards.elts;
+    oshard = ocache->shards.elts;
+
+    changed = (cache->shards.nelts != ocache->shards.nelts);
+
+    for (i = 0; i < ocache->shards.nelts; i++) {
+        map[i] = NGX_HTTP_CACHE_MAX_SHARDS;
+
+        for (j = 0; j < cache->shards.nelts; j++) {
+            if (oshard[i].path->name.len == shard[j].path->name.len
+                && ngx_strncmp(oshard[i].path->name.data,
+                               shard[j].path->name.data,
+                               shard[j].path->name.len)
+                   == 0)
+            {
+                map[i] = (u_char) j;
+                break;
+            }
+        }
 
-    multiple = 0;
-    normalize = 0;
+        if (map[i] != i) {
+            changed = 1;
+        }
+    }
 
-    if (name->len == sizeof("Accept-Charset") - 1
-        && ngx_strncasecmp(name->data, (u_char *) "Accept-Charset",
-                           sizeof("Accept-Charset") - 1) == 0)
+    if (!changed) {
+        return;
+    }
+
+    /*
+     * shards were added, removed, or reordered: nodes are renumbered,
+     * and those of removed shards are no longer cached
+     */
+
+    ngx_memzero(sh, sizeof(sh));
+    dropped = 0;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    for (i = 0; i < ocache->shards.nelts; i++) {
+        if (map[i] != NGX_HTTP_CACHE_MAX_SHARDS) {
+            sh[map[i]] = cache->sh->shards[i];
+        }
+    }
+
+    ngx_memcpy(cache->sh->shards, sh, sizeof(sh));
+
+    for (i = 0; i < 2; i++) {
+        queue = (i == 0) ? &cache->sh->queue : &cache->sh->main;
+
+        for (q = ngx_queue_head(queue);
+             q != ngx_queue_sentinel(queue);
+             q = ngx_queue_next(q))
+        {
+            fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+            if (fcn->shard < ocache->shards.nelts
+                && map[fcn->shard] != NGX_HTTP_CACHE_MAX_SHARDS)
+            {
+                fcn->shard = map[fcn->shard];
+                continue;
+            }
+
+            if (fcn->exists) {
+                cache->sh->size -= fcn->fs_size;
+                fcn->fs_size = 0;
+                fcn->exists = 0;
+                fcn->uniq = 0;
+                dropped++;
+            }
+
+            fcn->shard = 0;
+        }
+    }
+
+    /* the index refers to shards by number */
+
+    cache->sh->index_checkpoint = 1;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                  "cache \"%V\" shards changed, %ui entries dropped",
+                  &cache->shm_zone->shm.name, dropped);
+}
+
+
+static uint32_t
+ngx_http_file_cache_shards_hash(ngx_http_file_cache_t *cache)
+{
+    uint32_t                      crc;
+    ngx_uint_t                    i;
+    ngx_http_file_cache_shard_t  *shard;
+
+    shard = cache->shards.elts;
+
+    ngx_crc32_init(crc);
+
+    for (i = 0; i < cache->shards.nelts; i++) {
+        ngx_crc32_update(&crc, (u_char *) &shard[i].hash, sizeof(uint32_t));
+    }
+
+    ngx_crc32_final(crc);
+
+    return crc;
+}
+
+
+static size_t
+ngx_http_file_cache_name_len(ngx_http_file_cache_t *cache)
+{
+    size_t                        len;
+    ngx_uint_t                    i;
+    ngx_http_file_cache_shard_t  *shard;
+
+    shard = cache->shards.elts;
+    len = 0;
+
+    for (i = 0; i < cache->shards.nelts; i++) {
+        if (len < shard[i].path->name.len) {
+            len = shard[i].path->name.len;
+        }
+    }
+
+    return len + 1 + cache->path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+}
+
+
+static ngx_http_file_cache_node_t *
+ngx_http_file_cache_lookup(ngx_http_file_cache_t *cache, u_char *key)
+{
+    ngx_int_t                    rc;
+    ngx_rbtree_key_t             node_key;
+    ngx_rbtree_node_t           *node, *sentinel;
+    ngx_http_file_cache_node_t  *fcn;
+
+    ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
+
+    node = cache->sh->rbtree.root;
+    sentinel = cache->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (node_key < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (node_key > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* node_key == node->key */
+
+        fcn = (ngx_http_file_cache_node_t *) node;
+
+        rc = ngx_memcmp(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
+                        NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+        if (rc == 0) {
+            return fcn;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    /* not found */
+
+    return NULL;
+}
+
+
+static void
+ngx_http_file_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t           **p;
+    ngx_http_file_cache_node_t   *cn, *cnt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            cn = (ngx_http_file_cache_node_t *) node;
+            cnt = (ngx_http_file_cache_node_t *) temp;
+
+            p = (ngx_memcmp(cn->key, cnt->key,
+                            NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t))
+                 < 0)
+                    ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static void
+ngx_http_file_cache_vary(ngx_http_request_t *r, u_char *vary, size_t len,
+    u_char *hash)
+{
+    u_char     *p, *last;
+    ngx_str_t   name;
+    ngx_md5_t   md5;
+    u_char      buf[NGX_HTTP_CACHE_VARY_LEN];
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache vary: \"%*s\"", len, vary);
+
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, r->cache->main, NGX_HTTP_CACHE_KEY_LEN);
+
+    ngx_strlow(buf, vary, len);
+
+    p = buf;
+    last = buf + len;
+
+    while (p < last) {
+
+        while (p < last && (*p == ' ' || *p == ',')) { p++; }
+
+        name.data = p;
+
+        while (p < last && *p != ',' && *p != ' ') { p++; }
+
+        name.len = p - name.data;
+
+        if (name.len == 0) {
+            break;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache vary: %V", &name);
+
+        ngx_md5_update(&md5, name.data, name.len);
+        ngx_md5_update(&md5, (u_char *) ":", sizeof(":") - 1);
+
+        ngx_http_file_cache_vary_header(r, &md5, &name);
+
+        ngx_md5_update(&md5, (u_char *) CRLF, sizeof(CRLF) - 1);
+    }
+
+    ngx_md5_final(hash, &md5);
+}
+
+
+static void
+ngx_http_file_cache_vary_header(ngx_http_request_t *r, ngx_md5_t *md5,
+    ngx_str_t *name)
+{
+    size_t            len;
+    u_char           *p, *start, *last;
+    ngx_uint_t        i, multiple, normalize;
+    ngx_list_part_t  *part;
+    ngx_table_elt_t  *header;
+
+    multiple = 0;
+    normalize = 0;
+
+    if (name->len == sizeof("Accept-Charset") - 1
+        && ngx_strncasecmp(name->data, (u_char *) "Accept-Charset",
+                           sizeof("Accept-Charset") - 1) == 0)
     {
         normalize = 1;
 
@@ -1223,12 +2322,17 @@ ngx_http_file_cache_reopen(ngx_http_request_t *r, ngx_http_cache_t *c)
 
     ngx_shmtx_lock(&cache->shpool->mutex);
 
+    ngx_http_file_cache_stream_close(cache, c, -1);
+
     c->node->count--;
     c->node = NULL;
 
     ngx_shmtx_unlock(&cache->shpool->mutex);
 
     c->secondary = 1;
+    c->memory = 0;
+    c->complete = 0;
+    c->streaming = 0;
     c->file.name.len = 0;
     c->body_start = c->buf->end - c->buf->start;
 
@@ -1344,7 +2448,7 @@ ngx_http_file_cache_update_variant(ngx_http_request_t *r, ngx_http_cache_t *c)
         return NGX_ERROR;
     }
 
-    if (ngx_http_file_cache_name(r, cache->path) != NGX_OK) {
+    if (ngx_http_file_cache_name(r, cache) != NGX_OK) {
         return NGX_ERROR;
     }
 
@@ -1355,13 +2459,9 @@ ngx_http_file_cache_update_variant(ngx_http_request_t *r, ngx_http_cache_t *c)
 void
 ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
 {
-    off_t                   fs_size;
-    ngx_int_t               rc;
-    ngx_file_uniq_t         uniq;
-    ngx_file_info_t         fi;
-    ngx_http_cache_t        *c;
-    ngx_ext_rename_file_t   ext;
-    ngx_http_file_cache_t  *cache;
+    ngx_http_cache_t          *c;
+    ngx_http_file_cache_t     *cache;
+    ngx_http_file_cache_op_t  *op;
 
     c = r->cache;
 
@@ -1377,139 +2477,212 @@ ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
     c->updated = 1;
     c->updating = 0;
 
-    uniq = 0;
-    fs_size = 0;
+    if (c->stream) {
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache rename: \"%s\" to \"%s\"",
-                   tf->file.name.data, c->file.name.data);
+        /* the temporary file is complete, whether it is renamed or not */
 
-    ext.access = NGX_FILE_OWNER_ACCESS;
-    ext.path_access = NGX_FILE_OWNER_ACCESS;
-    ext.time = -1;
-    ext.create_path = 1;
-    ext.delete_file = 1;
-    ext.log = r->connection->log;
+        ngx_shmtx_lock(&cache->shpool->mutex);
+        ngx_http_file_cache_stream_close(cache, c, tf->offset);
+        ngx_shmtx_unlock(&cache->shpool->mutex);
 
-    rc = ngx_ext_rename_file(&tf->file.name, &c->file.name, &ext);
+        ngx_http_file_cache_wakeup(c->node);
+    }
 
-    if (rc == NGX_OK) {
+    if (c->fill) {
+        ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache fill: \"%s\" to \"%s\" %O-%O",
+                       tf->file.name.data, c->file.name.data,
+                       c->fill_start, c->fill_end);
 
-        if (ngx_fd_info(tf->file.fd, &fi) == NGX_FILE_ERROR) {
-            ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
-                          ngx_fd_info_n " \"%s\" failed", tf->file.name.data);
+        op = ngx_http_file_cache_op_create(cache, NGX_HTTP_CACHE_OP_FILL,
+                                           c->shard, c->key, &tf->file.name,
+                                           &c->file.name);
 
-            rc = NGX_ERROR;
+    } else {
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache rename: \"%s\" to \"%s\"",
+                       tf->file.name.data, c->file.name.data);
 
-        } else {
-            uniq = ngx_file_uniq(&fi);
-            fs_size = (ngx_file_fs_size(&fi) + cache->bsize - 1) / cache->bsize;
-        }
+        op = ngx_http_file_cache_op_create(cache, NGX_HTTP_CACHE_OP_RENAME,
+                                           c->shard, c->key, &tf->file.name,
+                                           &c->file.name);
     }
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    if (op == NULL) {
 
-    c->node->count--;
-    c->node->error = 0;
-    c->node->uniq = uniq;
-    c->node->body_start = c->body_start;
+        if (ngx_delete_file(tf->file.name.data) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                          ngx_delete_file_n " \"%s\" failed",
+                          tf->file.name.data);
+        }
 
-    cache->sh->size += fs_size - c->node->fs_size;
-    c->node->fs_size = fs_size;
+        ngx_shmtx_lock(&cache->shpool->mutex);
 
-    if (rc == NGX_OK) {
-        c->node->exists = 1;
-    }
+        c->node->count--;
+        c->node->updating = 0;
 
-    c->node->updating = 0;
+        ngx_shmtx_unlock(&cache->shpool->mutex);
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
-}
+        ngx_http_file_cache_wakeup(c->node);
 
+        return;
+    }
 
-void
-ngx_http_file_cache_update_header(ngx_http_request_t *r)
-{
-    ssize_t                        n;
-    ngx_err_t                      err;
-    ngx_file_t                     file;
-    ngx_file_info_t                fi;
-    ngx_http_cache_t              *c;
-    ngx_http_file_cache_header_t   h;
+    op->node = c->node;
+    op->body_start = c->body_start;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache update header");
+    if (c->fill) {
 
-    c = r->cache;
+        /*
+         * a new entry keeps the header of the temporary file and gets
+         * the block map right after it
+         */
 
-    ngx_memzero(&file, sizeof(ngx_file_t));
+        op->merge = c->sparse;
+        op->uniq = c->uniq;
+        op->offset = c->fill_start;
+        op->size = tf->offset - c->body_start;
+        op->length = op->size;
+        op->temp_start = c->body_start;
+
+        op->header.version = NGX_HTTP_CACHE_VERSION;
+        op->header.crc32 = c->crc32;
+        op->header.header_start = (u_short) c->header_start;
+        op->header.map_start = (u_short) (c->sparse ? c->map_start
+                                                    : c->body_start);
+        op->header.block = (uint32_t) cache->sparse;
+        op->header.length = c->sparse_length;
+
+        op->body_start = op->header.map_start
+                         + ngx_http_file_cache_map_len(c->sparse_length,
+                                                       cache->sparse);
+        op->header.body_start = (u_short) op->body_start;
+    }
 
-    file.name = c->file.name;
-    file.log = r->connection->log;
-    file.fd = ngx_open_file(file.name.data, NGX_FILE_RDWR, NGX_FILE_OPEN, 0);
+    ngx_shmtx_lock(&cache->shpool->mutex);
 
-    if (file.fd == NGX_INVALID_FILE) {
-        err = ngx_errno;
+    c->node->purged = 0;
 
-        /* cache file may have been deleted */
+    ngx_http_file_cache_untag(cache, c->node);
 
-        if (err == NGX_ENOENT) {
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                           "http file cache \"%s\" not found",
-                           file.name.data);
-            return;
+    if (c->tags.len
+        && ngx_http_file_cache_tag(cache, c->node, &c->tags) != NGX_OK)
+    {
+        /* an entry which cannot be found by its tags is not served */
+
+        ngx_http_file_cache_untag(cache, c->node);
+        c->node->purged = 1;
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_http_file_cache_op_post(op);
+}
+
+
+static void
+ngx_http_file_cache_update_done(ngx_http_file_cache_op_t *op)
+{
+    off_t                        fs_size;
+    ngx_uint_t                   shard, moved;
+    ngx_http_file_cache_t       *cache;
+    ngx_http_file_cache_node_t  *fcn;
+
+    cache = op->cache;
+    fcn = op->node;
+
+    if (op->rc == NGX_DECLINED) {
+
+        /* the file was replaced or removed while being filled */
+
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        fcn->count--;
+        fcn->updating = 0;
+
+        if (fcn->exists) {
+            /* the file may not match the tags of the entry anymore */
+            fcn->purged = 1;
         }
 
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, err,
-                      ngx_open_file_n " \"%s\" failed", file.name.data);
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        ngx_http_file_cache_wakeup(fcn);
+
         return;
     }
 
-    /*
-     * make sure cache file wasn't replaced;
-     * if it was, do nothing
-     */
+    fs_size = 0;
 
-    if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
-                      ngx_fd_info_n " \"%s\" failed", file.name.data);
-        goto done;
-    }
+    if (op->rc == NGX_OK) {
+        fs_size = (op->fs_size + cache->bsize - 1) / cache->bsize;
 
-    if (c->uniq != ngx_file_uniq(&fi)
-        || c->length != ngx_file_size(&fi))
-    {
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "http file cache \"%s\" changed",
-                       file.name.data);
-        goto done;
-    }
+        ngx_http_file_cache_shard_ok(cache, op->shard);
 
-    n = ngx_read_file(&file, (u_char *) &h,
-                      sizeof(ngx_http_file_cache_header_t), 0);
+        (void) ngx_atomic_fetch_add(&cache->sh->shards[op->shard].writes, 1);
+        (void) ngx_atomic_fetch_add(&cache->sh->misses, 1);
+        (void) ngx_atomic_fetch_add(&cache->sh->miss_bytes, op->length);
 
-    if (n == NGX_ERROR) {
-        goto done;
+    } else {
+        ngx_http_file_cache_shard_failed(cache, op->shard, ngx_cycle->log);
     }
 
-    if ((size_t) n != sizeof(ngx_http_file_cache_header_t)) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
-                      ngx_read_file_n " read only %z of %z from \"%s\"",
-                      n, sizeof(ngx_http_file_cache_header_t), file.name.data);
-        goto done;
+    shard = 0;
+    moved = 0;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    fcn->count--;
+    fcn->error = 0;
+    fcn->uniq = op->uniq;
+    fcn->body_start = op->body_start;
+
+    cache->sh->size += fs_size - fcn->fs_size;
+    fcn->fs_size = fs_size;
+
+    if (op->rc == NGX_OK) {
+
+        if (fcn->exists && fcn->shard != op->shard) {
+            shard = fcn->shard;
+            moved = 1;
+        }
+
+        fcn->shard = op->shard;
+        fcn->exists = 1;
+        fcn->uses = 1;
+
+        ngx_http_file_cache_index_record(cache, fcn,
+                                         NGX_HTTP_CACHE_INDEX_ADD);
+
+    } else if (fcn->exists) {
+        fcn->purged = 1;
     }
 
-    if (h.version != NGX_HTTP_CACHE_VERSION
-        || h.last_modified != c->last_modified
-        || h.crc32 != c->crc32
-        || (size_t) h.header_start != c->header_start
-        || (size_t) h.body_start != c->body_start)
-    {
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "http file cache \"%s\" content changed",
-                       file.name.data);
-        goto done;
+    fcn->updating = 0;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_http_file_cache_wakeup(fcn);
+
+    ngx_http_file_cache_memory_delete(cache, op->key);
+
+    if (moved && !ngx_http_file_cache_shard_down(cache, shard, ngx_time())) {
+        ngx_http_file_cache_shard_delete(cache, op->key, shard);
     }
+}
+
+
+void
+ngx_http_file_cache_update_header(ngx_http_request_t *r)
+{
+    ngx_http_cache_t              *c;
+    ngx_http_file_cache_op_t      *op;
+    ngx_http_file_cache_header_t   h;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache update header");
+
+    c = r->cache;
 
     /*
      * update cache file header with new data,
@@ -1529,6 +2702,12 @@ ngx_http_file_cache_update_header(ngx_http_request_t *r)
     h.header_start = (u_short) c->header_start;
     h.body_start = (u_short) c->body_start;
 
+    if (c->sparse) {
+        h.map_start = (u_short) c->map_start;
+        h.block = (uint32_t) c->file_cache->sparse;
+        h.length = c->sparse_length;
+    }
+
     if (c->etag.len <= NGX_HTTP_CACHE_ETAG_LEN) {
         h.etag_len = (u_char) c->etag.len;
         ngx_memcpy(h.etag, c->etag.data, c->etag.len);
@@ -1547,741 +2726,3347 @@ ngx_http_file_cache_update_header(ngx_http_request_t *r)
         ngx_memcpy(h.variant, c->variant, NGX_HTTP_CACHE_KEY_LEN);
     }
 
-    (void) ngx_write_file(&file, (u_char *) &h,
-                          sizeof(ngx_http_file_cache_header_t), 0);
+    op = ngx_http_file_cache_op_create(c->file_cache,
+                                       NGX_HTTP_CACHE_OP_HEADER, c->shard,
+                                       c->key, NULL, &c->file.name);
+    if (op == NULL) {
+        return;
+    }
 
-done:
+    op->uniq = c->uniq;
+    op->length = c->length;
+    op->header = h;
 
-    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
-        ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
-                      ngx_close_file_n " \"%s\" failed", file.name.data);
-    }
+    ngx_http_file_cache_op_post(op);
 }
 
 
-ngx_int_t
-ngx_http_cache_send(ngx_http_request_t *r)
+static ngx_http_file_cache_op_t *
+ngx_http_file_cache_op_create(ngx_http_file_cache_t *cache, ngx_uint_t type,
+    ngx_uint_t shard, u_char *key, ngx_str_t *from, ngx_str_t *to)
 {
-    ngx_int_t          rc;
-    ngx_buf_t         *b;
-    ngx_chain_t        out;
-    ngx_http_cache_t  *c;
+    size_t                     len;
+    ngx_http_file_cache_op_t  *op;
 
-    c = r->cache;
+    /*
+     * operations outlive requests, so they are allocated separately
+     * along with copies of the file names
+     */
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache send: %s", c->file.name.data);
+    len = sizeof(ngx_http_file_cache_op_t) + to->len + 1;
 
-    if (r != r->main && c->length - c->body_start == 0) {
-        return ngx_http_send_header(r);
+    if (from) {
+        len += from->len + 1;
     }
 
-    /* we need to allocate all before the header would be sent */
+    op = ngx_alloc(len, ngx_cycle->log);
+    if (op == NULL) {
+        return NULL;
+    }
 
-    b = ngx_calloc_buf(r->pool);
-    if (b == NULL) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    ngx_memzero(op, sizeof(ngx_http_file_cache_op_t));
+
+    op->type = type;
+    op->cache = cache;
+    op->shard = shard;
+
+    ngx_memcpy(op->key, key, NGX_HTTP_CACHE_KEY_LEN);
+
+    op->to.len = to->len;
+    op->to.data = (u_char *) op + sizeof(ngx_http_file_cache_op_t);
+
+    if (to->data) {
+        ngx_memcpy(op->to.data, to->data, to->len + 1);
     }
 
-    b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
-    if (b->file == NULL) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    if (from) {
+        op->from.len = from->len;
+        op->from.data = op->to.data + to->len + 1;
+        ngx_memcpy(op->from.data, from->data, from->len + 1);
     }
 
-    rc = ngx_http_send_header(r);
+    return op;
+}
 
-    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
-        return rc;
-    }
 
-    b->file_pos = c->body_start;
-    b->file_last = c->length;
+static void
+ngx_http_file_cache_op_post(ngx_http_file_cache_op_t *op)
+{
+#if (NGX_THREADS)
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_shard_t  *shard;
 
-    b->in_file = (c->length - c->body_start) ? 1: 0;
-    b->last_buf = (r == r->main) ? 1: 0;
-    b->last_in_chain = 1;
+    cache = op->cache;
 
-    b->file->fd = c->file.fd;
-    b->file->name = c->file.name;
-    b->file->log = r->connection->log;
+    if (cache->thread_pool) {
+        shard = cache->shards.elts;
 
-    out.buf = b;
-    out.next = NULL;
+        ngx_queue_insert_tail(&shard[op->shard].ops, &op->queue);
 
-    return ngx_http_output_filter(r, &out);
+        ngx_http_file_cache_op_dispatch(cache, op->shard);
+        return;
+    }
+#endif
+
+    ngx_http_file_cache_op_run(op, ngx_cycle->log);
+    ngx_http_file_cache_op_done(op);
 }
 
 
-void
-ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
+static void
+ngx_http_file_cache_op_run(ngx_http_file_cache_op_t *op, ngx_log_t *log)
 {
-    ngx_http_file_cache_t       *cache;
-    ngx_http_file_cache_node_t  *fcn;
+    ngx_fd_t               fd;
+    ngx_file_info_t        fi;
+    ngx_ext_rename_file_t  ext;
 
-    if (c->updated || c->node == NULL) {
-        return;
-    }
+    /* may be called in a thread */
 
-    cache = c->file_cache;
+    switch (op->type) {
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
-                   "http file cache free, fd: %d", c->file.fd);
+    case NGX_HTTP_CACHE_OP_RENAME:
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+        if (op->cache->fsync) {
+            fd = ngx_open_file(op->from.data, NGX_FILE_RDONLY, NGX_FILE_OPEN,
+                               0);
 
-    fcn = c->node;
-    fcn->count--;
+            if (fd == NGX_INVALID_FILE) {
+                op->err = ngx_errno;
+                op->failed = ngx_open_file_n;
+                op->file = op->from.data;
+                op->rc = NGX_ERROR;
+                return;
+            }
 
-    if (c->updating && fcn->lock_time == c->lock_time) {
-        fcn->updating = 0;
-    }
+            if (ngx_fsync_file(fd) == NGX_FILE_ERROR) {
+                op->err = ngx_errno;
+                op->failed = ngx_fsync_file_n;
+                op->file = op->from.data;
+            }
 
-    if (c->error) {
-        fcn->error = c->error;
+            (void) ngx_close_file(fd);
 
-        if (c->valid_sec) {
-            fcn->valid_sec = c->valid_sec;
-            fcn->valid_msec = c->valid_msec;
+            if (op->failed) {
+                op->rc = NGX_ERROR;
+                return;
+            }
         }
 
-    } else if (!fcn->exists && fcn->count == 0 && c->min_uses == 1) {
-        ngx_queue_remove(&fcn->queue);
-        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
-        ngx_slab_free_locked(cache->shpool, fcn);
-        cache->sh->count--;
-        c->node = NULL;
-    }
-
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+        ext.access = NGX_FILE_OWNER_ACCESS;
+        ext.path_access = NGX_FILE_OWNER_ACCESS;
+        ext.time = -1;
+        ext.create_path = 1;
+        ext.delete_file = 1;
+        ext.log = log;
 
-    c->updated = 1;
-    c->updating = 0;
+        op->rc = ngx_ext_rename_file(&op->from, &op->to, &ext);
 
-    if (c->temp_file) {
-        if (tf && tf->file.fd != NGX_INVALID_FILE) {
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
-                           "http file cache incomplete: \"%s\"",
-                           tf->file.name.data);
+        if (op->rc != NGX_OK) {
+            return;
+        }
 
-            if (ngx_delete_file(tf->file.name.data) == NGX_FILE_ERROR) {
-                ngx_log_error(NGX_LOG_CRIT, c->file.log, ngx_errno,
-                              ngx_delete_file_n " \"%s\" failed",
-                              tf->file.name.data);
-            }
+        if (ngx_file_info(op->to.data, &fi) == NGX_FILE_ERROR) {
+            op->err = ngx_errno;
+            op->failed = ngx_file_info_n;
+            op->rc = NGX_ERROR;
+            return;
         }
-    }
 
-    if (c->wait_event.timer_set) {
-        ngx_del_timer(&c->wait_event);
-    }
-}
+        op->uniq = ngx_file_uniq(&fi);
+        op->length = ngx_file_size(&fi);
+        op->fs_size = ngx_file_fs_size(&fi);
 
+        return;
 
-static void
-ngx_http_file_cache_cleanup(void *data)
-{
-    ngx_http_cache_t  *c = data;
+    case NGX_HTTP_CACHE_OP_HEADER:
+        ngx_http_file_cache_op_header(op, log);
+        return;
 
-    if (c->updated) {
+    case NGX_HTTP_CACHE_OP_FILL:
+        ngx_http_file_cache_op_fill(op, log);
         return;
-    }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
-                   "http file cache cleanup");
+    default: /* NGX_HTTP_CACHE_OP_UNLINK */
 
-    if (c->updating && !c->background) {
-        ngx_log_error(NGX_LOG_ALERT, c->file.log, 0,
-                      "stalled cache updating, error:%ui", c->error);
-    }
+        if (ngx_delete_file(op->to.data) == NGX_FILE_ERROR) {
+            op->err = ngx_errno;
 
-    ngx_http_file_cache_free(c, NULL);
+            if (op->err != NGX_ENOENT) {
+                op->failed = ngx_delete_file_n;
+            }
+
+            op->rc = NGX_ERROR;
+            return;
+        }
+
+        op->rc = NGX_OK;
+        return;
+    }
 }
 
 
-static time_t
-ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
+static void
+ngx_http_file_cache_op_header(ngx_http_file_cache_op_t *op, ngx_log_t *log)
 {
-    u_char                      *name, *p;
-    size_t                       len;
-    time_t                       wait;
-    ngx_uint_t                   tries;
-    ngx_path_t                  *path;
-    ngx_queue_t                 *q, *sentinel;
-    ngx_http_file_cache_node_t  *fcn;
-    u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
-
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache forced expire");
+    ssize_t                        n;
+    ngx_file_t                     file;
+    ngx_file_info_t                fi;
+    ngx_http_file_cache_header_t   h;
 
-    path = cache->path;
-    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+    op->rc = NGX_DECLINED;
 
-    name = ngx_alloc(len + 1, ngx_cycle->log);
-    if (name == NULL) {
-        return 10;
-    }
+    ngx_memzero(&file, sizeof(ngx_file_t));
 
-    ngx_memcpy(name, path->name.data, path->name.len);
+    file.name = op->to;
+    file.log = log;
+    file.fd = ngx_open_file(file.name.data, NGX_FILE_RDWR, NGX_FILE_OPEN, 0);
 
-    wait = 10;
-    tries = 20;
-    sentinel = NULL;
+    if (file.fd == NGX_INVALID_FILE) {
+        op->err = ngx_errno;
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+        /* cache file may have been deleted */
 
-    for ( ;; ) {
-        if (ngx_queue_empty(&cache->sh->queue)) {
-            break;
+        if (op->err != NGX_ENOENT) {
+            op->failed = ngx_open_file_n;
         }
 
-        q = ngx_queue_last(&cache->sh->queue);
+        return;
+    }
 
-        if (q == sentinel) {
-            break;
-        }
+    /*
+     * make sure cache file wasn't replaced;
+     * if it was, do nothing
+     */
 
-        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+    if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
+        op->err = ngx_errno;
+        op->failed = ngx_fd_info_n;
+        goto done;
+    }
 
-        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                  "http file cache forced expire: #%d %d %02xd%02xd%02xd%02xd",
-                  fcn->count, fcn->exists,
-                  fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+    if (op->uniq != ngx_file_uniq(&fi)
+        || op->length != ngx_file_size(&fi))
+    {
+        goto done;
+    }
+
+    n = ngx_read_file(&file, (u_char *) &h,
+                      sizeof(ngx_http_file_cache_header_t), 0);
+
+    if (n == NGX_ERROR) {
+        goto done;
+    }
+
+    if ((size_t) n != sizeof(ngx_http_file_cache_header_t)) {
+        op->failed = ngx_read_file_n;
+        goto done;
+    }
+
+    if (h.version != NGX_HTTP_CACHE_VERSION
+        || h.last_modified != op->header.last_modified
+        || h.crc32 != op->header.crc32
+        || h.header_start != op->header.header_start
+        || h.body_start != op->header.body_start
+        || h.block != op->header.block)
+    {
+        goto done;
+    }
+
+    if (ngx_write_file(&file, (u_char *) &op->header,
+                       sizeof(ngx_http_file_cache_header_t), 0)
+        != NGX_ERROR)
+    {
+        op->rc = NGX_OK;
+    }
+
+done:
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        op->err = ngx_errno;
+        op->failed = ngx_close_file_n;
+    }
+}
+
+
+static void
+ngx_http_file_cache_op_fill(ngx_http_file_cache_op_t *op, ngx_log_t *log)
+{
+    off_t                          end, size, n;
+    size_t                         len, map_len;
+    u_char                        *buf;
+    ssize_t                        rc;
+    ngx_uint_t                     i, first, last, block;
+    ngx_file_t                     file, temp;
+    ngx_file_info_t                fi;
+    ngx_ext_rename_file_t          ext;
+    ngx_http_file_cache_header_t   h;
+
+    op->rc = NGX_ERROR;
+
+    block = op->header.block;
+    map_len = ngx_http_file_cache_map_len(op->header.length, block);
+
+    /* only completely received blocks are marked as present */
+
+    end = op->offset + op->size;
+
+    first = op->offset / block;
+    last = (end == op->header.length) ? (end + block - 1) / block
+                                      : end / block;
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+    ngx_memzero(&temp, sizeof(ngx_file_t));
+
+    file.fd = NGX_INVALID_FILE;
+    file.log = log;
+
+    temp.fd = NGX_INVALID_FILE;
+    temp.name = op->from;
+    temp.log = log;
+
+    buf = NULL;
+
+    if (last <= first) {
+        op->rc = NGX_DECLINED;
+        goto done;
+    }
+
+    size = ngx_min(op->size, (off_t) (last * block) - op->offset);
+
+    buf = ngx_alloc(ngx_max(NGX_HTTP_CACHE_FILL_BUFFER, map_len), log);
+    if (buf == NULL) {
+        goto done;
+    }
+
+    temp.fd = ngx_open_file(temp.name.data, NGX_FILE_RDWR, NGX_FILE_OPEN, 0);
+
+    if (temp.fd == NGX_INVALID_FILE) {
+        op->err = ngx_errno;
+        op->failed = ngx_open_file_n;
+        op->file = temp.name.data;
+        goto done;
+    }
+
+    if (op->merge) {
+        file.name = op->to;
+        file.fd = ngx_open_file(file.name.data, NGX_FILE_RDWR, NGX_FILE_OPEN,
+                                0);
+
+        if (file.fd == NGX_INVALID_FILE) {
+            op->err = ngx_errno;
+
+            /* cache file may have been deleted */
+
+            if (op->err != NGX_ENOENT) {
+                op->failed = ngx_open_file_n;
+
+            } else {
+                op->rc = NGX_DECLINED;
+            }
+
+            goto done;
+        }
+
+        /* make sure cache file wasn't replaced since it was read */
+
+        if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
+            op->err = ngx_errno;
+            op->failed = ngx_fd_info_n;
+            goto done;
+        }
+
+        if (op->uniq != ngx_file_uniq(&fi)) {
+            op->rc = NGX_DECLINED;
+            goto done;
+        }
+
+        rc = ngx_read_file(&file, (u_char *) &h,
+                           sizeof(ngx_http_file_cache_header_t), 0);
+
+        if (rc == NGX_ERROR) {
+            goto done;
+        }
+
+        if ((size_t) rc != sizeof(ngx_http_file_cache_header_t)
+            || h.version != NGX_HTTP_CACHE_VERSION
+            || h.crc32 != op->header.crc32
+            || h.map_start != op->header.map_start
+            || h.body_start != op->header.body_start
+            || h.block != op->header.block
+            || h.length != op->header.length)
+        {
+            op->rc = NGX_DECLINED;
+            goto done;
+        }
+
+        /* copy the blocks into the cache file */
+
+        for (n = 0; n < size; n += len) {
+            len = (size_t) ngx_min(size - n, NGX_HTTP_CACHE_FILL_BUFFER);
+
+            rc = ngx_read_file(&temp, buf, len, op->temp_start + n);
+
+            if (rc == NGX_ERROR) {
+                goto done;
+            }
+
+            if ((size_t) rc != len) {
+                op->failed = ngx_read_file_n;
+                op->file = temp.name.data;
+                goto done;
+            }
+
+            if (ngx_write_file(&file, buf, len,
+                               op->body_start + op->offset + n)
+                == NGX_ERROR)
+            {
+                goto done;
+            }
+        }
+
+        /* fills of an entry are serialized, so the map is updated in place */
+
+        len = (last - 1) / 8 - first / 8 + 1;
+
+        rc = ngx_read_file(&file, buf, len, op->header.map_start + first / 8);
+
+        if (rc == NGX_ERROR) {
+            goto done;
+        }
+
+        if ((size_t) rc != len) {
+            op->failed = ngx_read_file_n;
+            goto done;
+        }
+
+        for (i = first; i < last; i++) {
+            buf[i / 8 - first / 8] |= 1 << (i % 8);
+        }
+
+        if (ngx_write_file(&file, buf, len, op->header.map_start + first / 8)
+            == NGX_ERROR)
+        {
+            goto done;
+        }
+
+        if (op->cache->fsync && ngx_fsync_file(file.fd) == NGX_FILE_ERROR) {
+            op->err = ngx_errno;
+            op->failed = ngx_fsync_file_n;
+            goto done;
+        }
+
+        if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
+            op->err = ngx_errno;
+            op->failed = ngx_fd_info_n;
+            goto done;
+        }
+
+        op->uniq = ngx_file_uniq(&fi);
+        op->fs_size = ngx_file_fs_size(&fi);
+        op->rc = NGX_OK;
+
+        goto done;
+    }
+
+    /*
+     * a new entry is built in the temporary file: the blocks are moved
+     * up to their offsets, backwards as the areas may overlap, and the
+     * block map is placed between the response header and the body
+     */
+
+    for (n = size; n > 0; /* void */) {
+        len = (size_t) ngx_min(n, NGX_HTTP_CACHE_FILL_BUFFER);
+        n -= len;
+
+        rc = ngx_read_file(&temp, buf, len, op->temp_start + n);
+
+        if (rc == NGX_ERROR) {
+            goto done;
+        }
+
+        if ((size_t) rc != len) {
+            op->failed = ngx_read_file_n;
+            op->file = temp.name.data;
+            goto done;
+        }
+
+        if (ngx_write_file(&temp, buf, len, op->body_start + op->offset + n)
+            == NGX_ERROR)
+        {
+            goto done;
+        }
+    }
+
+    ngx_memzero(buf, map_len);
+
+    for (i = first; i < last; i++) {
+        buf[i / 8] |= 1 << (i % 8);
+    }
+
+    if (ngx_write_file(&temp, buf, map_len, op->header.map_start)
+        == NGX_ERROR)
+    {
+        goto done;
+    }
+
+    rc = ngx_read_file(&temp, (u_char *) &h,
+                       sizeof(ngx_http_file_cache_header_t), 0);
+
+    if (rc == NGX_ERROR) {
+        goto done;
+    }
+
+    if ((size_t) rc != sizeof(ngx_http_file_cache_header_t)) {
+        op->failed = ngx_read_file_n;
+        op->file = temp.name.data;
+        goto done;
+    }
+
+    h.map_start = op->header.map_start;
+    h.body_start = op->header.body_start;
+    h.block = op->header.block;
+    h.length = op->header.length;
+
+    if (ngx_write_file(&temp, (u_char *) &h,
+                       sizeof(ngx_http_file_cache_header_t), 0)
+        == NGX_ERROR)
+    {
+        goto done;
+    }
+
+    if (op->cache->fsync && ngx_fsync_file(temp.fd) == NGX_FILE_ERROR) {
+        op->err = ngx_errno;
+        op->failed = ngx_fsync_file_n;
+        op->file = temp.name.data;
+        goto done;
+    }
+
+    ngx_free(buf);
+
+    if (ngx_close_file(temp.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", temp.name.data);
+    }
+
+    ext.access = NGX_FILE_OWNER_ACCESS;
+    ext.path_access = NGX_FILE_OWNER_ACCESS;
+    ext.time = -1;
+    ext.create_path = 1;
+    ext.delete_file = 1;
+    ext.log = log;
+
+    op->rc = ngx_ext_rename_file(&op->from, &op->to, &ext);
+
+    if (op->rc != NGX_OK) {
+        return;
+    }
+
+    if (ngx_file_info(op->to.data, &fi) == NGX_FILE_ERROR) {
+        op->err = ngx_errno;
+        op->failed = ngx_file_info_n;
+        op->rc = NGX_ERROR;
+        return;
+    }
+
+    op->uniq = ngx_file_uniq(&fi);
+    op->fs_size = ngx_file_fs_size(&fi);
+
+    return;
+
+done:
+
+    /* the temporary file is not needed anymore, whether merged or not */
+
+    if (buf) {
+        ngx_free(buf);
+    }
+
+    if (file.fd != NGX_INVALID_FILE) {
+        if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                          ngx_close_file_n " \"%s\" failed", file.name.data);
+        }
+    }
+
+    if (temp.fd != NGX_INVALID_FILE) {
+        if (ngx_close_file(temp.fd) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                          ngx_close_file_n " \"%s\" failed", temp.name.data);
+        }
+    }
+
+    if (ngx_delete_file(temp.name.data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", temp.name.data);
+    }
+}
+
+
+static void
+ngx_http_file_cache_op_done(ngx_http_file_cache_op_t *op)
+{
+    if (op->failed) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, op->err,
+                      "%s \"%s\" failed", op->failed,
+                      op->file ? op->file : op->to.data);
+    }
+
+    switch (op->type) {
+
+    case NGX_HTTP_CACHE_OP_RENAME:
+    case NGX_HTTP_CACHE_OP_FILL:
+        ngx_http_file_cache_update_done(op);
+        break;
+
+    case NGX_HTTP_CACHE_OP_HEADER:
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache header \"%s\": %i",
+                       op->to.data, op->rc);
+
+        if (op->rc == NGX_OK) {
+
+            /* the memory copy still has the old header */
+
+            ngx_http_file_cache_memory_delete(op->cache, op->key);
+        }
+
+        break;
+
+    default: /* NGX_HTTP_CACHE_OP_UNLINK */
+        break;
+    }
+
+    ngx_free(op);
+}
+
+
+#if (NGX_THREADS)
+
+static void
+ngx_http_file_cache_op_dispatch(ngx_http_file_cache_t *cache, ngx_uint_t n)
+{
+    ngx_uint_t                    i;
+    ngx_queue_t                  *q;
+    ngx_http_file_cache_op_t     *op;
+    ngx_http_file_cache_batch_t  *b;
+    ngx_http_file_cache_shard_t  *shard;
+
+    shard = cache->shards.elts;
+    shard = &shard[n];
+
+    /* each path has a limited number of batches in the thread pool */
+
+    while (shard->busy < cache->thread_max && !ngx_queue_empty(&shard->ops)) {
+
+        b = ngx_calloc(sizeof(ngx_http_file_cache_batch_t), ngx_cycle->log);
+        if (b == NULL) {
+            break;
+        }
+
+        b->cache = cache;
+        b->shard = n;
+
+        ngx_queue_init(&b->ops);
+
+        for (i = 0; i < NGX_HTTP_CACHE_OP_BATCH; i++) {
+
+            if (ngx_queue_empty(&shard->ops)) {
+                break;
+            }
+
+            q = ngx_queue_head(&shard->ops);
+            ngx_queue_remove(q);
+            ngx_queue_insert_tail(&b->ops, q);
+        }
+
+        b->task.ctx = b;
+        b->task.handler = ngx_http_file_cache_op_thread;
+        b->task.event.data = b;
+        b->task.event.handler = ngx_http_file_cache_op_event;
+        b->task.event.log = ngx_cycle->log;
+
+        if (ngx_thread_task_post(cache->thread_pool, &b->task) != NGX_OK) {
+
+            /* the thread pool queue overflowed */
+
+            while (!ngx_queue_empty(&b->ops)) {
+                q = ngx_queue_head(&b->ops);
+                ngx_queue_remove(q);
+
+                op = ngx_queue_data(q, ngx_http_file_cache_op_t, queue);
+
+                ngx_http_file_cache_op_run(op, ngx_cycle->log);
+                ngx_http_file_cache_op_done(op);
+            }
+
+            ngx_free(b);
+            continue;
+        }
+
+        /*
+         * the timer keeps a gracefully exiting worker around
+         * until the batch completes
+         */
+
+        b->timer.data = b;
+        b->timer.handler = ngx_http_file_cache_op_timer;
+        b->timer.log = ngx_cycle->log;
+
+        ngx_add_timer(&b->timer, NGX_HTTP_CACHE_OP_TIMER);
+
+        shard->busy++;
+    }
+
+    if (!ngx_queue_empty(&shard->ops) && shard->busy == 0) {
+
+        /* no memory for a batch, the operations are done here */
+
+        while (!ngx_queue_empty(&shard->ops)) {
+            q = ngx_queue_head(&shard->ops);
+            ngx_queue_remove(q);
+
+            op = ngx_queue_data(q, ngx_http_file_cache_op_t, queue);
+
+            ngx_http_file_cache_op_run(op, ngx_cycle->log);
+            ngx_http_file_cache_op_done(op);
+        }
+    }
+}
+
+
+static void
+ngx_http_file_cache_op_thread(void *data, ngx_log_t *log)
+{
+    ngx_http_file_cache_batch_t *b = data;
+
+    ngx_queue_t               *q;
+    ngx_http_file_cache_op_t  *op;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_CORE, log, 0, "http file cache batch thread");
+
+    for (q = ngx_queue_head(&b->ops);
+         q != ngx_queue_sentinel(&b->ops);
+         q = ngx_queue_next(q))
+    {
+        op = ngx_queue_data(q, ngx_http_file_cache_op_t, queue);
+        ngx_http_file_cache_op_run(op, log);
+    }
+}
+
+
+static void
+ngx_http_file_cache_op_event(ngx_event_t *ev)
+{
+    ngx_http_file_cache_batch_t *b = ev->data;
+
+    ngx_queue_t                  *q;
+    ngx_http_file_cache_op_t     *op;
+    ngx_http_file_cache_shard_t  *shard;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "http file cache batch done");
+
+    if (b->timer.timer_set) {
+        ngx_del_timer(&b->timer);
+    }
+
+    shard = b->cache->shards.elts;
+    shard[b->shard].busy--;
+
+    while (!ngx_queue_empty(&b->ops)) {
+        q = ngx_queue_head(&b->ops);
+        ngx_queue_remove(q);
+
+        op = ngx_queue_data(q, ngx_http_file_cache_op_t, queue);
+        ngx_http_file_cache_op_done(op);
+    }
+
+    ngx_http_file_cache_op_dispatch(b->cache, b->shard);
+
+    ngx_free(b);
+}
+
+
+static void
+ngx_http_file_cache_op_timer(ngx_event_t *ev)
+{
+    ngx_log_error(NGX_LOG_WARN, ev->log, 0,
+                  "http file cache operations take too long");
+
+    ngx_add_timer(ev, NGX_HTTP_CACHE_OP_TIMER);
+}
+
+#endif
+
+
+ngx_int_t
+ngx_http_cache_send(ngx_http_request_t *r)
+{
+    ngx_int_t          rc;
+    ngx_buf_t         *b;
+    ngx_chain_t        out;
+    ngx_http_cache_t  *c;
+
+    c = r->cache;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache send: %s", c->file.name.data);
+
+    if (c->streaming) {
+        rc = ngx_http_send_header(r);
+
+        if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+            return rc;
+        }
+
+        c->stream_offset = c->body_start;
+
+        c->wait_event.handler = ngx_http_file_cache_stream_handler;
+        c->wait_event.data = r;
+        c->wait_event.log = r->connection->log;
+
+        ngx_queue_insert_tail(&ngx_http_file_cache_waiting, &c->wait_queue);
+
+        r->write_event_handler = ngx_http_file_cache_stream_writer;
+
+        return ngx_http_file_cache_stream_send(r);
+    }
+
+    if (r != r->main && c->length - c->body_start == 0) {
+        return ngx_http_send_header(r);
+    }
+
+    /* we need to allocate all before the header would be sent */
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (!c->complete) {
+        b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+        if (b->file == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    if (c->complete) {
+
+        /* the whole cache file is in the buffer */
+
+        b->pos = c->buf->start + c->body_start;
+        b->last = c->buf->start + c->length;
+
+        b->memory = (c->length - c->body_start) ? 1: 0;
+
+    } else {
+        b->file_pos = c->body_start;
+        b->file_last = c->length;
+
+        b->in_file = (c->length - c->body_start) ? 1: 0;
+
+        b->file->fd = c->file.fd;
+        b->file->name = c->file.name;
+        b->file->log = r->connection->log;
+    }
+
+    b->last_buf = (r == r->main) ? 1: 0;
+    b->last_in_chain = 1;
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+ngx_int_t
+ngx_http_cache_send_range(ngx_http_request_t *r, off_t start, off_t end)
+{
+    size_t             body_start;
+    ngx_buf_t         *b;
+    ngx_chain_t        out;
+    ngx_http_cache_t  *c;
+
+    c = r->cache;
+
+    /* blocks of a sparse cache file, sent around the upstream response */
+
+    body_start = c->map_start
+                 + ngx_http_file_cache_map_len(c->sparse_length,
+                                               c->file_cache->sparse);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache send range: %s %O-%O",
+                   c->file.name.data, start, end);
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
+
+    b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+    if (b->file == NULL) {
+        return NGX_ERROR;
+    }
+
+    b->file_pos = body_start + start;
+    b->file_last = body_start + end;
+
+    b->in_file = 1;
+
+    b->file->fd = c->file.fd;
+    b->file->name = c->file.name;
+    b->file->log = r->connection->log;
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_stream_send(ngx_http_request_t *r)
+{
+    off_t                          length;
+    ngx_int_t                      rc;
+    ngx_buf_t                     *b;
+    ngx_uint_t                     complete, failed, local;
+    ngx_chain_t                   *cl, *out;
+    ngx_event_t                   *wev;
+    ngx_http_cache_t              *c;
+    ngx_http_file_cache_t         *cache;
+    ngx_http_core_loc_conf_t      *clcf;
+    ngx_http_file_cache_stream_t  *st;
+
+    c = r->cache;
+    cache = c->file_cache;
+    st = c->stream;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    length = st->length;
+    complete = st->complete;
+    failed = st->failed;
+    local = (st->pid == ngx_pid);
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache stream send: %O of %O c:%ui f:%ui",
+                   c->stream_offset, length, complete, failed);
+
+    if (failed) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "cache file \"%s\" was not completely written",
+                      c->file.name.data);
+        return NGX_ERROR;
+    }
+
+    out = NULL;
+
+    if (c->stream_offset < length || complete) {
+
+        cl = ngx_chain_get_free_buf(r->pool, &c->stream_free);
+        if (cl == NULL) {
+            return NGX_ERROR;
+        }
+
+        b = cl->buf;
+
+        ngx_memzero(b, sizeof(ngx_buf_t));
+
+        b->tag = (ngx_buf_tag_t) &ngx_http_file_cache_stream_send;
+
+        if (c->stream_offset < length) {
+            b->file = &c->file;
+            b->file_pos = c->stream_offset;
+            b->file_last = length;
+            b->in_file = 1;
+
+            c->stream_offset = length;
+        }
+
+        if (complete) {
+            b->last_buf = (r == r->main) ? 1 : 0;
+            b->last_in_chain = 1;
+
+            if (!b->in_file && !b->last_buf) {
+                b->sync = 1;
+            }
+        }
+
+        out = cl;
+    }
+
+    rc = ngx_http_output_filter(r, out);
+
+    if (rc == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    ngx_chain_update_chains(r->pool, &c->stream_free, &c->stream_busy, &out,
+                            (ngx_buf_tag_t) &ngx_http_file_cache_stream_send);
+
+    if (complete) {
+        ngx_http_file_cache_unwait(c);
+
+        ngx_shmtx_lock(&cache->shpool->mutex);
+        ngx_http_file_cache_stream_close(cache, c, -1);
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        c->streaming = 0;
+
+        return rc;
+    }
+
+    wev = r->connection->write;
+
+    if (r->connection->buffered || r->buffered) {
+        clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+        if (!wev->delayed) {
+            ngx_add_timer(wev, clcf->send_timeout);
+        }
+
+        if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+    } else if (wev->timer_set) {
+        ngx_del_timer(wev);
+    }
+
+    /* the lock holder of this process posts the event on writes */
+
+    if (!local && !c->wait_event.timer_set) {
+        ngx_add_timer(&c->wait_event, NGX_HTTP_CACHE_WAIT_POLL);
+    }
+
+    return NGX_DONE;
+}
+
+
+static void
+ngx_http_file_cache_stream_handler(ngx_event_t *ev)
+{
+    ngx_int_t            rc;
+    ngx_connection_t    *c;
+    ngx_http_request_t  *r;
+
+    r = ev->data;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http file cache stream: \"%V?%V\"", &r->uri, &r->args);
+
+    if (ev->timer_set) {
+        ngx_del_timer(ev);
+    }
+
+    rc = ngx_http_file_cache_stream_send(r);
+
+    if (rc != NGX_DONE) {
+        ngx_http_finalize_request(r, rc);
+    }
+
+    ngx_http_run_posted_requests(c);
+}
+
+
+static void
+ngx_http_file_cache_stream_writer(ngx_http_request_t *r)
+{
+    ngx_int_t          rc;
+    ngx_event_t       *wev;
+    ngx_connection_t  *c;
+
+    c = r->connection;
+    wev = c->write;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http file cache stream writer: \"%V?%V\"",
+                   &r->uri, &r->args);
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT,
+                      "client timed out");
+        c->timedout = 1;
+        ngx_http_finalize_request(r, NGX_HTTP_REQUEST_TIME_OUT);
+        return;
+    }
+
+    if (wev->delayed || r->aio) {
+        return;
+    }
+
+    rc = ngx_http_file_cache_stream_send(r);
+
+    if (rc != NGX_DONE) {
+        ngx_http_finalize_request(r, rc);
+    }
+}
+
+
+void
+ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
+{
+    ngx_http_file_cache_t       *cache;
+    ngx_http_file_cache_op_t    *op;
+    ngx_http_file_cache_node_t  *fcn;
+
+    if (c->updated || c->node == NULL) {
+        return;
+    }
+
+    cache = c->file_cache;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                   "http file cache free, fd: %d", c->file.fd);
+
+    ngx_http_file_cache_unwait(c);
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    fcn = c->node;
+    fcn->count--;
+
+    if (c->updating && fcn->lock_time == c->lock_time) {
+        fcn->updating = 0;
+    }
+
+    if (c->scheduled) {
+        cache->sh->updates--;
+    }
+
+    ngx_http_file_cache_stream_close(cache, c, -1);
+
+    if (c->error) {
+        fcn->error = c->error;
+
+        if (c->valid_sec) {
+            fcn->valid_sec = c->valid_sec;
+            fcn->valid_msec = c->valid_msec;
+        }
+
+    } else if (!fcn->exists && fcn->count == 0 && c->min_uses == 1) {
+
+        if (fcn->admitted) {
+            cache->sh->main_count--;
+        }
+
+        ngx_http_file_cache_untag(cache, fcn);
+
+        ngx_queue_remove(&fcn->queue);
+        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
+        ngx_slab_free_locked(cache->shpool, fcn);
+        cache->sh->count--;
+        c->node = NULL;
+
+    } else if (fcn->purged && fcn->count == 0) {
+
+        /* the cache manager deletes the file once the entry is released */
+
+        ngx_queue_remove(&fcn->queue);
+        fcn->expire = ngx_time();
+        ngx_queue_insert_tail(ngx_http_file_cache_queue(cache, fcn),
+                              &fcn->queue);
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    if (c->updating && c->node) {
+        ngx_http_file_cache_wakeup(c->node);
+    }
+
+    c->updated = 1;
+    c->updating = 0;
+
+    if (c->temp_file) {
+        if (tf && tf->file.fd != NGX_INVALID_FILE) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                           "http file cache incomplete: \"%s\"",
+                           tf->file.name.data);
+
+            op = ngx_http_file_cache_op_create(cache,
+                                               NGX_HTTP_CACHE_OP_UNLINK,
+                                               c->shard, c->key, NULL,
+                                               &tf->file.name);
+            if (op) {
+                ngx_http_file_cache_op_post(op);
+            }
+        }
+    }
+
+    if (c->wait_event.timer_set) {
+        ngx_del_timer(&c->wait_event);
+    }
+}
+
+
+static void
+ngx_http_file_cache_cleanup(void *data)
+{
+    ngx_http_cache_t  *c = data;
+
+    if (c->updated) {
+        return;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                   "http file cache cleanup");
+
+    if (c->updating && !c->background) {
+        ngx_log_error(NGX_LOG_ALERT, c->file.log, 0,
+                      "stalled cache updating, error:%ui", c->error);
+    }
+
+    ngx_http_file_cache_free(c, NULL);
+}
+
+
+ngx_int_t
+ngx_http_file_cache_schedule(ngx_http_request_t *r)
+{
+    ngx_uint_t                   uses;
+    ngx_http_cache_t            *c;
+    ngx_http_file_cache_t       *cache;
+    ngx_http_file_cache_node_t  *fcn;
+
+    c = r->cache;
+    cache = c->file_cache;
+
+    if (cache->updates == 0) {
+        return NGX_OK;
+    }
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    fcn = c->node;
+
+    uses = cache->sh->sketch ? ngx_http_file_cache_sketch_estimate(cache, fcn)
+                             : fcn->uses;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache schedule: %ui of %ui, uses:%ui",
+                   cache->sh->updates, cache->updates, uses);
+
+    /*
+     * the first half of the updates is available to any response,
+     * the rest only to responses which are requested at least as often
+     * as those recently updated
+     */
+
+    if (cache->sh->updates < (cache->updates + 1) / 2
+        || (cache->sh->updates < cache->updates
+            && uses >= cache->sh->update_uses))
+    {
+        cache->sh->updates++;
+        cache->sh->update_uses = (cache->sh->update_uses * 3 + uses) / 4;
+        c->scheduled = 1;
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        return NGX_OK;
+    }
+
+    /* the update is left to a later request */
+
+    if (c->updating && fcn->lock_time == c->lock_time) {
+        fcn->updating = 0;
+    }
+
+    c->updating = 0;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_http_file_cache_wakeup(fcn);
+
+    return NGX_DECLINED;
+}
+
+
+ngx_int_t
+ngx_http_file_cache_purge(ngx_http_request_t *r, ngx_str_t *tags)
+{
+    u_char                      *p, *last;
+    ngx_str_t                    name;
+    ngx_uint_t                   n;
+    ngx_queue_t                 *q;
+    ngx_http_cache_t            *c;
+    ngx_http_file_cache_t       *cache;
+    ngx_http_file_cache_tag_t   *tag;
+    ngx_http_file_cache_link_t  *link;
+    ngx_http_file_cache_node_t  *fcn;
+
+    c = r->cache;
+    cache = c->file_cache;
+
+    n = 0;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    if (tags == NULL || tags->len == 0) {
+        fcn = ngx_http_file_cache_lookup(cache, c->key);
+
+        if (fcn) {
+            n = ngx_http_file_cache_purge_node(cache, fcn);
+        }
+
+        goto done;
+    }
+
+    p = tags->data;
+    last = p + tags->len;
+
+    for ( ;; ) {
+        p = ngx_http_file_cache_next_tag(p, last, &name);
+
+        if (name.len == 0) {
+            break;
+        }
+
+        tag = (ngx_http_file_cache_tag_t *)
+                  ngx_str_rbtree_lookup(&cache->sh->tags, &name,
+                                        ngx_crc32_short(name.data, name.len));
+
+        while (tag) {
+            q = ngx_queue_head(&tag->links);
+            link = ngx_queue_data(q, ngx_http_file_cache_link_t, queue);
+
+            if (ngx_queue_next(q) == ngx_queue_sentinel(&tag->links)) {
+                /* the tag is freed along with its last link */
+                tag = NULL;
+            }
+
+            n += ngx_http_file_cache_purge_node(cache, link->node);
+        }
+    }
+
+done:
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache purge: %ui", n);
+
+    return n ? NGX_OK : NGX_DECLINED;
+}
+
+
+static ngx_uint_t
+ngx_http_file_cache_purge_node(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn)
+{
+    ngx_http_file_cache_untag(cache, fcn);
+
+    if (fcn->error) {
+        fcn->error = 0;
+        fcn->valid_sec = 0;
+        fcn->valid_msec = 0;
+
+    } else if (fcn->exists && !fcn->purged) {
+        fcn->purged = 1;
+
+    } else {
+        return 0;
+    }
+
+    if (fcn->count == 0) {
+
+        /* the file is left to the cache manager */
+
+        ngx_queue_remove(&fcn->queue);
+        fcn->expire = ngx_time();
+        ngx_queue_insert_tail(ngx_http_file_cache_queue(cache, fcn),
+                              &fcn->queue);
+    }
+
+    return 1;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_tag(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn, ngx_str_t *tags)
+{
+    u_char                      *p, *last;
+    uint32_t                     hash;
+    ngx_str_t                    name;
+    ngx_http_file_cache_tag_t   *tag;
+    ngx_http_file_cache_link_t  *link;
+
+    p = tags->data;
+    last = p + tags->len;
+
+    for ( ;; ) {
+        p = ngx_http_file_cache_next_tag(p, last, &name);
+
+        if (name.len == 0) {
+            return NGX_OK;
+        }
+
+        hash = ngx_crc32_short(name.data, name.len);
+
+        tag = (ngx_http_file_cache_tag_t *)
+                  ngx_str_rbtree_lookup(&cache->sh->tags, &name, hash);
+
+        if (tag) {
+            for (link = fcn->tags; link; link = link->next) {
+                if (link->tag == tag) {
+                    break;
+                }
+            }
+
+            if (link) {
+                continue;
+            }
+
+        } else {
+            tag = ngx_slab_alloc_locked(cache->shpool,
+                                       offsetof(ngx_http_file_cache_tag_t, data)
+                                       + name.len);
+            if (tag == NULL) {
+                return NGX_ERROR;
+            }
+
+            ngx_memcpy(tag->data, name.data, name.len);
+
+            tag->sn.node.key = hash;
+            tag->sn.str.len = name.len;
+            tag->sn.str.data = tag->data;
+
+            ngx_queue_init(&tag->links);
+
+            ngx_rbtree_insert(&cache->sh->tags, &tag->sn.node);
+        }
+
+        link = ngx_slab_alloc_locked(cache->shpool,
+                                     sizeof(ngx_http_file_cache_link_t));
+        if (link == NULL) {
+
+            if (ngx_queue_empty(&tag->links)) {
+                ngx_rbtree_delete(&cache->sh->tags, &tag->sn.node);
+                ngx_slab_free_locked(cache->shpool, tag);
+            }
+
+            return NGX_ERROR;
+        }
+
+        link->tag = tag;
+        link->node = fcn;
+        link->next = fcn->tags;
+        fcn->tags = link;
+
+        ngx_queue_insert_tail(&tag->links, &link->queue);
+    }
+}
+
+
+static void
+ngx_http_file_cache_untag(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn)
+{
+    ngx_http_file_cache_tag_t   *tag;
+    ngx_http_file_cache_link_t  *link, *next;
+
+    for (link = fcn->tags; link; link = next) {
+        next = link->next;
+        tag = link->tag;
+
+        ngx_queue_remove(&link->queue);
+        ngx_slab_free_locked(cache->shpool, link);
+
+        if (ngx_queue_empty(&tag->links)) {
+            ngx_rbtree_delete(&cache->sh->tags, &tag->sn.node);
+            ngx_slab_free_locked(cache->shpool, tag);
+        }
+    }
+
+    fcn->tags = NULL;
+}
+
+
+static u_char *
+ngx_http_file_cache_next_tag(u_char *p, u_char *last, ngx_str_t *tag)
+{
+    /* tags are separated by spaces or commas */
+
+    while (p < last && (*p == ' ' || *p == ',' || *p == '\t')) {
+        p++;
+    }
+
+    tag->data = p;
+
+    while (p < last && *p != ' ' && *p != ',' && *p != '\t') {
+        p++;
+    }
+
+    tag->len = p - tag->data;
+
+    return p;
+}
+
+
+
+static time_t
+ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
+{
+    u_char                      *name, *p;
+    size_t                       len;
+    time_t                       wait;
+    ngx_uint_t                   tries;
+    ngx_queue_t                 *q, *sentinel;
+    ngx_http_file_cache_node_t  *fcn;
+    u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache forced expire");
+
+    len = ngx_http_file_cache_name_len(cache);
+
+    name = ngx_alloc(len + 1, ngx_cycle->log);
+    if (name == NULL) {
+        return 10;
+    }
+
+    wait = 10;
+    tries = 20;
+    sentinel = NULL;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    for ( ;; ) {
+        q = ngx_http_file_cache_victim(cache);
+
+        if (q == NULL || q == sentinel) {
+            break;
+        }
+
+        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                  "http file cache forced expire: #%d %d %02xd%02xd%02xd%02xd",
+                  fcn->count, fcn->exists,
+                  fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+
+        if (fcn->count == 0) {
+            ngx_http_file_cache_delete(cache, q, name);
+            wait = 0;
+            break;
+        }
+
+        p = ngx_hex_dump(key, (u_char *) &fcn->node.key,
+                         sizeof(ngx_rbtree_key_t));
+        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
+        (void) ngx_hex_dump(p, fcn->key, len);
+
+        /*
+         * abnormally exited workers may leave locked cache entries,
+         * and although it may be safe to remove them completely,
+         * we prefer to just move them to the top of the inactive queue
+         */
+
+        ngx_queue_remove(q);
+        fcn->expire = ngx_time() + cache->inactive;
+        ngx_queue_insert_head(ngx_http_file_cache_queue(cache, fcn), q);
+
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                      "ignore long locked inactive cache entry %*s, count:%d",
+                      (size_t) 2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
+
+        if (sentinel == NULL) {
+            sentinel = q;
+        }
+
+        if (--tries) {
+            continue;
+        }
+
+        wait = 1;
+        break;
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_free(name);
+
+    return wait;
+}
+
+
+static time_t
+ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
+{
+    u_char                      *name, *p;
+    size_t                       len;
+    time_t                       now, wait;
+    ngx_msec_t                   elapsed;
+    ngx_queue_t                 *q;
+    ngx_http_file_cache_node_t  *fcn;
+    u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache expire");
+
+    len = ngx_http_file_cache_name_len(cache);
+
+    name = ngx_alloc(len + 1, ngx_cycle->log);
+    if (name == NULL) {
+        return 10;
+    }
+
+    now = ngx_time();
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    for ( ;; ) {
+
+        if (ngx_quit || ngx_terminate) {
+            wait = 1;
+            break;
+        }
+
+        q = ngx_http_file_cache_last(cache);
+
+        if (q == NULL) {
+            wait = 10;
+            break;
+        }
+
+        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+        wait = fcn->expire - now;
+
+        if (wait > 0) {
+            wait = wait > 10 ? 10 : wait;
+            break;
+        }
+
+        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache expire: #%d %d %02xd%02xd%02xd%02xd",
+                       fcn->count, fcn->exists,
+                       fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+
+        if (fcn->count == 0) {
+            ngx_http_file_cache_delete(cache, q, name);
+            goto next;
+        }
+
+        if (fcn->deleting) {
+            wait = 1;
+            break;
+        }
+
+        if (fcn->purged) {
+            ngx_queue_remove(q);
+            fcn->expire = now + cache->inactive;
+            ngx_queue_insert_head(ngx_http_file_cache_queue(cache, fcn), q);
+
+            goto next;
+        }
+
+        p = ngx_hex_dump(key, (u_char *) &fcn->node.key,
+                         sizeof(ngx_rbtree_key_t));
+        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
+        (void) ngx_hex_dump(p, fcn->key, len);
+
+        /*
+         * abnormally exited workers may leave locked cache entries,
+         * and although it may be safe to remove them completely,
+         * we prefer to just move them to the top of the inactive queue
+         */
+
+        ngx_queue_remove(q);
+        fcn->expire = ngx_time() + cache->inactive;
+        ngx_queue_insert_head(ngx_http_file_cache_queue(cache, fcn), q);
+
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                      "ignore long locked inactive cache entry %*s, count:%d",
+                      (size_t) 2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
+
+next:
+
+        if (++cache->files >= cache->manager_files) {
+            wait = 0;
+            break;
+        }
+
+        ngx_time_update();
+
+        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+
+        if (elapsed >= cache->manager_threshold) {
+            wait = 0;
+            break;
+        }
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_free(name);
+
+    return wait;
+}
+
+
+static void
+ngx_http_file_cache_delete(ngx_http_file_cache_t *cache, ngx_queue_t *q,
+    u_char *name)
+{
+    u_char                       *p;
+    size_t                        len;
+    ngx_err_t                     err;
+    ngx_uint_t                    n;
+    ngx_path_t                   *path;
+    ngx_http_file_cache_node_t   *fcn;
+    ngx_http_file_cache_shard_t  *shard;
+    u_char                        key[NGX_HTTP_CACHE_KEY_LEN];
+
+    fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+    if (fcn->exists) {
+        cache->sh->size -= fcn->fs_size;
+
+        n = fcn->shard;
+        shard = cache->shards.elts;
+        path = shard[n].path;
+
+        ngx_memcpy(name, path->name.data, path->name.len);
+
+        p = name + path->name.len + 1 + path->len;
+        p = ngx_hex_dump(p, (u_char *) &fcn->node.key,
+                         sizeof(ngx_rbtree_key_t));
+        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
+        p = ngx_hex_dump(p, fcn->key, len);
+        *p = '\0';
+
+        ngx_http_file_cache_index_record(cache, fcn,
+                                         NGX_HTTP_CACHE_INDEX_DELETE);
+
+        fcn->count++;
+        fcn->deleting = 1;
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+        ngx_create_hashed_filename(path, name, len);
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache expire: \"%s\"", name);
+
+        if (ngx_delete_file(name) == NGX_FILE_ERROR) {
+            err = ngx_errno;
+
+            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, err,
+                          ngx_delete_file_n " \"%s\" failed", name);
+
+            if (err != NGX_ENOENT) {
+                ngx_http_file_cache_shard_failed(cache, n, ngx_cycle->log);
+            }
+        }
+
+        if (cache->memory) {
+            ngx_memcpy(key, &fcn->node.key, sizeof(ngx_rbtree_key_t));
+            ngx_memcpy(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
+                       NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+            ngx_http_file_cache_memory_delete(cache, key);
+        }
+
+        ngx_shmtx_lock(&cache->shpool->mutex);
+        fcn->count--;
+        fcn->deleting = 0;
+    }
+
+    if (fcn->count == 0) {
+
+        if (fcn->admitted) {
+            cache->sh->main_count--;
+        }
+
+        ngx_http_file_cache_untag(cache, fcn);
+
+        ngx_queue_remove(q);
+        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
+        ngx_slab_free_locked(cache->shpool, fcn);
+        cache->sh->count--;
+    }
+}
+
+
+static ngx_msec_t
+ngx_http_file_cache_manager(void *data)
+{
+    ngx_http_file_cache_t  *cache = data;
+
+    off_t                         size, free, avail;
+    time_t                        wait;
+    ngx_msec_t                    elapsed, next;
+    ngx_uint_t                    i, count, watermark;
+    ngx_http_file_cache_shard_t  *shard;
+
+    cache->last = ngx_current_msec;
+    cache->files = 0;
+
+    ngx_http_file_cache_report(cache);
+
+    if (cache->index.name.len) {
+        ngx_http_file_cache_index(cache);
+    }
+
+    next = (ngx_msec_t) ngx_http_file_cache_expire(cache) * 1000;
+
+    if (next == 0) {
+        next = cache->manager_sleep;
+        goto done;
+    }
+
+    for ( ;; ) {
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        size = cache->sh->size;
+        count = cache->sh->count;
+        watermark = cache->sh->watermark;
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache size: %O c:%ui w:%i",
+                       size, count, (ngx_int_t) watermark);
+
+        if (size < cache->max_size && count < watermark) {
+
+            if (!cache->min_free) {
+                break;
+            }
+
+            /* the fullest shard is what has to be relieved */
+
+            shard = cache->shards.elts;
+            free = NGX_MAX_OFF_T_VALUE;
+
+            for (i = 0; i < cache->shards.nelts; i++) {
+                avail = ngx_fs_available(shard[i].path->name.data);
+
+                if (avail < free) {
+                    free = avail;
+                }
+            }
+
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                           "http file cache free: %O", free);
+
+            if (free > cache->min_free) {
+                break;
+            }
+        }
+
+        wait = ngx_http_file_cache_forced_expire(cache);
+
+        if (wait > 0) {
+            next = (ngx_msec_t) wait * 1000;
+            break;
+        }
+
+        if (ngx_quit || ngx_terminate) {
+            break;
+        }
+
+        if (++cache->files >= cache->manager_files) {
+            next = cache->manager_sleep;
+            break;
+        }
+
+        ngx_time_update();
+
+        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+
+        if (elapsed >= cache->manager_threshold) {
+            next = cache->manager_sleep;
+            break;
+        }
+    }
+
+done:
+
+    elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache manager: %ui e:%M n:%M",
+                   cache->files, elapsed, next);
+
+    return next;
+}
+
+
+static void
+ngx_http_file_cache_loader(void *data)
+{
+    ngx_http_file_cache_t  *cache = data;
+
+    ngx_uint_t                    i;
+    ngx_tree_ctx_t                tree;
+    ngx_http_file_cache_shard_t  *shard;
+
+    if ((!cache->sh->cold && !cache->sh->index_walk) || cache->sh->loading) {
+        return;
+    }
+
+    if (!ngx_atomic_cmp_set(&cache->sh->loading, 0, ngx_pid)) {
+        return;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache loader");
+
+    tree.init_handler = NULL;
+    tree.file_handler = ngx_http_file_cache_manage_file;
+    tree.pre_tree_handler = ngx_http_file_cache_manage_directory;
+    tree.post_tree_handler = ngx_http_file_cache_noop;
+    tree.spec_handler = ngx_http_file_cache_delete_file;
+    tree.data = cache;
+    tree.alloc = 0;
+    tree.log = ngx_cycle->log;
+
+    cache->last = ngx_current_msec;
+    cache->files = 0;
+
+    shard = cache->shards.elts;
+
+    for (i = 0; i < cache->shards.nelts; i++) {
+        cache->walk_shard = i;
+
+        if (ngx_walk_tree(&tree, &shard[i].path->name) == NGX_ABORT) {
+            cache->sh->loading = 0;
+            return;
+        }
+    }
+
+    cache->sh->cold = 0;
+    cache->sh->index_walk = 0;
+    cache->sh->loading = 0;
+
+    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                  "http file cache: %V %.3fM, bsize: %uz",
+                  &cache->path->name,
+                  ((double) cache->sh->size * cache->bsize) / (1024 * 1024),
+                  cache->bsize);
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_noop(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_manage_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    ngx_msec_t              elapsed;
+    ngx_http_file_cache_t  *cache;
+
+    cache = ctx->data;
+
+    if (ngx_http_file_cache_add_file(ctx, path) != NGX_OK) {
+        (void) ngx_http_file_cache_delete_file(ctx, path);
+    }
+
+    if (++cache->files >= cache->loader_files) {
+        ngx_http_file_cache_loader_sleep(cache);
+
+    } else {
+        ngx_time_update();
+
+        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache loader time elapsed: %M", elapsed);
+
+        if (elapsed >= cache->loader_threshold) {
+            ngx_http_file_cache_loader_sleep(cache);
+        }
+    }
+
+    return (ngx_quit || ngx_terminate) ? NGX_ABORT : NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_manage_directory(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    if (path->len >= 5
+        && ngx_strncmp(path->data + path->len - 5, "/temp", 5) == 0)
+    {
+        return NGX_DECLINED;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache)
+{
+    ngx_msleep(cache->loader_sleep);
+
+    ngx_time_update();
+
+    cache->last = ngx_current_msec;
+    cache->files = 0;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_add_file(ngx_tree_ctx_t *ctx, ngx_str_t *name)
+{
+    u_char                 *p;
+    ngx_int_t               n;
+    ngx_uint_t              i;
+    ngx_http_cache_t        c;
+    ngx_http_file_cache_t  *cache;
+
+    if (name->len < 2 * NGX_HTTP_CACHE_KEY_LEN) {
+        return NGX_ERROR;
+    }
+
+    /*
+     * Temporary files in cache have a suffix consisting of a dot
+     * followed by 10 digits.
+     */
+
+    if (name->len >= 2 * NGX_HTTP_CACHE_KEY_LEN + 1 + 10
+        && name->data[name->len - 10 - 1] == '.')
+    {
+        return NGX_OK;
+    }
+
+    if (ctx->size < (off_t) sizeof(ngx_http_file_cache_header_t)) {
+        ngx_log_error(NGX_LOG_CRIT, ctx->log, 0,
+                      "cache file \"%s\" is too small", name->data);
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(&c, sizeof(ngx_http_cache_t));
+    cache = ctx->data;
+
+    c.length = ctx->size;
+    c.fs_size = (ctx->fs_size + cache->bsize - 1) / cache->bsize;
+    c.shard = cache->walk_shard;
+
+    p = &name->data[name->len - 2 * NGX_HTTP_CACHE_KEY_LEN];
+
+    for (i = 0; i < NGX_HTTP_CACHE_KEY_LEN; i++) {
+        n = ngx_hextoi(p, 2);
+
+        if (n == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        p += 2;
+
+        c.key[i] = (u_char) n;
+    }
+
+    return ngx_http_file_cache_add(cache, &c);
+}
 
-        if (fcn->count == 0) {
-            ngx_http_file_cache_delete(cache, q, name);
-            wait = 0;
+
+static ngx_int_t
+ngx_http_file_cache_add(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
+{
+    ngx_http_file_cache_node_t  *fcn;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    fcn = ngx_http_file_cache_lookup(cache, c->key);
+
+    if (fcn == NULL) {
+
+        fcn = ngx_slab_calloc_locked(cache->shpool,
+                                     sizeof(ngx_http_file_cache_node_t));
+        if (fcn == NULL) {
+            ngx_http_file_cache_set_watermark(cache);
+
+            if (cache->fail_time != ngx_time()) {
+                cache->fail_time = ngx_time();
+                ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                           "could not allocate node%s", cache->shpool->log_ctx);
+            }
+
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+            return NGX_ERROR;
+        }
+
+        cache->sh->count++;
+
+        ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
+
+        ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
+                   NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+        ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
+
+        fcn->uses = 1;
+        fcn->exists = 1;
+        fcn->shard = c->shard;
+        fcn->fs_size = c->fs_size;
+
+        cache->sh->size += c->fs_size;
+
+        ngx_http_file_cache_index_record(cache, fcn,
+                                         NGX_HTTP_CACHE_INDEX_ADD);
+
+    } else if (fcn->exists && fcn->shard != c->shard) {
+
+        /* a stale copy left on another shard */
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_DECLINED;
+
+    } else {
+        ngx_queue_remove(&fcn->queue);
+    }
+
+    fcn->expire = ngx_time() + cache->inactive;
+
+    ngx_queue_insert_head(ngx_http_file_cache_queue(cache, fcn), &fcn->queue);
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                   "http file cache delete: \"%s\"", path->data);
+
+    if (ngx_delete_file(path->data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ctx->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", path->data);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_file_cache_set_watermark(ngx_http_file_cache_t *cache)
+{
+    cache->sh->watermark = cache->sh->count - cache->sh->count / 8;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache watermark: %ui", cache->sh->watermark);
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_memory_read(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    ngx_http_file_cache_t              *cache;
+    ngx_http_file_cache_memory_node_t  *mn;
+
+    cache = c->file_cache;
+
+    ngx_shmtx_lock(&cache->memory_shpool->mutex);
+
+    mn = ngx_http_file_cache_memory_lookup(cache, c->key);
+
+    if (mn == NULL) {
+        goto miss;
+    }
+
+    if (mn->uniq != c->uniq) {
+
+        /* the cache file was replaced */
+
+        ngx_http_file_cache_memory_free(cache, mn);
+        goto miss;
+    }
+
+    if (mn->len > c->body_start) {
+        c->body_start = mn->len;
+    }
+
+    c->buf = ngx_create_temp_buf(r->pool, c->body_start);
+    if (c->buf == NULL) {
+        ngx_shmtx_unlock(&cache->memory_shpool->mutex);
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(c->buf->pos, mn->data, mn->len);
+
+    c->length = mn->len;
+    c->fs_size = mn->fs_size;
+
+    mn->uses++;
+
+    ngx_queue_remove(&mn->queue);
+    ngx_queue_insert_head(&cache->memory->queue, &mn->queue);
+
+    ngx_shmtx_unlock(&cache->memory_shpool->mutex);
+
+    (void) ngx_atomic_fetch_add(&cache->memory->hits, 1);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache memory hit: %O", c->length);
+
+    c->memory = 1;
+
+    return NGX_OK;
+
+miss:
+
+    ngx_shmtx_unlock(&cache->memory_shpool->mutex);
+
+    (void) ngx_atomic_fetch_add(&cache->memory->misses, 1);
+
+    return NGX_DECLINED;
+}
+
+
+static void
+ngx_http_file_cache_memory_add(ngx_http_cache_t *c)
+{
+    size_t                              size;
+    ngx_uint_t                          uses, tries;
+    ngx_queue_t                        *q;
+    ngx_http_file_cache_t              *cache;
+    ngx_http_file_cache_memory_node_t  *mn, *victim;
+
+    cache = c->file_cache;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    if (c->node->uniq == 0) {
+        /* nodes added by the cache loader do not know the file yet */
+        c->node->uniq = c->uniq;
+    }
+
+    uses = c->node->uses;
+
+    if (c->node->uniq != c->uniq) {
+        uses = 0;
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    if (uses == 0) {
+        return;
+    }
+
+    size = offsetof(ngx_http_file_cache_memory_node_t, data) + c->length;
+
+    ngx_shmtx_lock(&cache->memory_shpool->mutex);
+
+    mn = ngx_http_file_cache_memory_lookup(cache, c->key);
+
+    if (mn) {
+        if (mn->uniq == c->uniq) {
+            goto done;
+        }
+
+        ngx_http_file_cache_memory_free(cache, mn);
+    }
+
+    for (tries = 0; /* void */ ; tries++) {
+
+        mn = ngx_slab_alloc_locked(cache->memory_shpool, size);
+
+        if (mn) {
             break;
         }
 
-        p = ngx_hex_dump(key, (u_char *) &fcn->node.key,
-                         sizeof(ngx_rbtree_key_t));
-        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
-        (void) ngx_hex_dump(p, fcn->key, len);
+        if (ngx_queue_empty(&cache->memory->queue) || tries == 20) {
+            goto rejected;
+        }
+
+        q = ngx_queue_last(&cache->memory->queue);
+        victim = ngx_queue_data(q, ngx_http_file_cache_memory_node_t, queue);
+
+        /*
+         * TinyLFU-like admission: an object only displaces least
+         * recently used objects which were requested less often;
+         * the frequency of a defending object is halved, so that
+         * formerly popular objects are eventually displaced too
+         */
+
+        if (victim->uses > uses) {
+            victim->uses /= 2;
+            goto rejected;
+        }
+
+        ngx_http_file_cache_memory_free(cache, victim);
+    }
+
+    ngx_memcpy((u_char *) &mn->node.key, c->key, sizeof(ngx_rbtree_key_t));
+
+    ngx_memcpy(mn->key, &c->key[sizeof(ngx_rbtree_key_t)],
+               NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+    mn->uses = uses;
+    mn->uniq = c->uniq;
+    mn->fs_size = c->fs_size;
+    mn->len = (size_t) c->length;
+
+    ngx_memcpy(mn->data, c->buf->pos, mn->len);
+
+    ngx_rbtree_insert(&cache->memory->rbtree, &mn->node);
+    ngx_queue_insert_head(&cache->memory->queue, &mn->queue);
+
+    cache->memory->size += mn->len;
+    cache->memory->count++;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                   "http file cache memory add: %uz u:%ui", mn->len, uses);
+
+done:
+
+    ngx_shmtx_unlock(&cache->memory_shpool->mutex);
+
+    return;
+
+rejected:
+
+    ngx_shmtx_unlock(&cache->memory_shpool->mutex);
+
+    (void) ngx_atomic_fetch_add(&cache->memory->rejected, 1);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                   "http file cache memory reject: %O", c->length);
+}
+
+
+static void
+ngx_http_file_cache_memory_delete(ngx_http_file_cache_t *cache, u_char *key)
+{
+    ngx_http_file_cache_memory_node_t  *mn;
+
+    if (cache->memory == NULL) {
+        return;
+    }
+
+    ngx_shmtx_lock(&cache->memory_shpool->mutex);
+
+    mn = ngx_http_file_cache_memory_lookup(cache, key);
+
+    if (mn) {
+        ngx_http_file_cache_memory_free(cache, mn);
+    }
+
+    ngx_shmtx_unlock(&cache->memory_shpool->mutex);
+}
+
+
+static ngx_http_file_cache_memory_node_t *
+ngx_http_file_cache_memory_lookup(ngx_http_file_cache_t *cache, u_char *key)
+{
+    ngx_int_t                           rc;
+    ngx_rbtree_key_t                    node_key;
+    ngx_rbtree_node_t                  *node, *sentinel;
+    ngx_http_file_cache_memory_node_t  *mn;
+
+    ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
+
+    node = cache->memory->rbtree.root;
+    sentinel = cache->memory->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (node_key < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (node_key > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* node_key == node->key */
+
+        mn = (ngx_http_file_cache_memory_node_t *) node;
+
+        rc = ngx_memcmp(&key[sizeof(ngx_rbtree_key_t)], mn->key,
+                        NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+        if (rc == 0) {
+            return mn;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    /* not found */
+
+    return NULL;
+}
+
+
+static void
+ngx_http_file_cache_memory_free(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_memory_node_t *mn)
+{
+    ngx_queue_remove(&mn->queue);
+    ngx_rbtree_delete(&cache->memory->rbtree, &mn->node);
+
+    cache->memory->size -= mn->len;
+    cache->memory->count--;
+
+    ngx_slab_free_locked(cache->memory_shpool, mn);
+}
+
+
+static void
+ngx_http_file_cache_memory_report(ngx_http_file_cache_t *cache)
+{
+    double             ratio;
+    ngx_atomic_uint_t  hits, misses, disk_hits;
+
+    hits = cache->memory->hits;
+    misses = cache->memory->misses;
+    disk_hits = cache->memory->disk_hits;
+
+    if (hits + disk_hits == 0) {
+        return;
+    }
+
+    ratio = (double) hits * 100 / (hits + disk_hits);
+
+    ngx_log_error(NGX_LOG_INFO, ngx_cycle->log, 0,
+                  "http file cache \"%V\": memory %uz bytes in %ui objects, "
+                  "hits memory:%uA disk:%uA (%.2f%% from memory), "
+                  "memory misses:%uA rejected:%uA",
+                  &cache->shm_zone->shm.name, cache->memory->size,
+                  cache->memory->count, hits, disk_hits, ratio, misses,
+                  cache->memory->rejected);
+}
+
+
+static void
+ngx_http_file_cache_report(ngx_http_file_cache_t *cache)
+{
+    double                            ratio, byte_ratio;
+    ngx_uint_t                        i;
+    ngx_atomic_uint_t                 hits, misses, hit_bytes, miss_bytes;
+    ngx_http_file_cache_shard_t      *shard;
+    ngx_http_file_cache_shard_sh_t   *sh;
+
+    if (cache->report && ngx_current_msec - cache->report < 60000) {
+        return;
+    }
 
-        /*
-         * abnormally exited workers may leave locked cache entries,
-         * and although it may be safe to remove them completely,
-         * we prefer to just move them to the top of the inactive queue
-         */
+    cache->report = ngx_current_msec;
 
-        ngx_queue_remove(q);
-        fcn->expire = ngx_time() + cache->inactive;
-        ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+    if (cache->memory) {
+        ngx_http_file_cache_memory_report(cache);
+    }
 
-        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                      "ignore long locked inactive cache entry %*s, count:%d",
-                      (size_t) 2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
+    if (cache->shards.nelts > 1) {
+        shard = cache->shards.elts;
 
-        if (sentinel == NULL) {
-            sentinel = q;
-        }
+        for (i = 0; i < cache->shards.nelts; i++) {
+            sh = &cache->sh->shards[i];
 
-        if (--tries) {
-            continue;
+            ngx_log_error(NGX_LOG_INFO, ngx_cycle->log, 0,
+                          "http file cache \"%V\" shard \"%V\": "
+                          "reads:%uA writes:%uA errors:%uA%s",
+                          &cache->shm_zone->shm.name, &shard[i].path->name,
+                          sh->reads, sh->writes, sh->errors,
+                          ngx_http_file_cache_shard_down(cache, i, ngx_time())
+                          ? " down" : "");
         }
-
-        wait = 1;
-        break;
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    hits = cache->sh->hits;
+    misses = cache->sh->misses;
+    hit_bytes = cache->sh->hit_bytes;
+    miss_bytes = cache->sh->miss_bytes;
 
-    ngx_free(name);
+    if (hits + misses == 0) {
+        return;
+    }
 
-    return wait;
+    ratio = (double) hits * 100 / (hits + misses);
+    byte_ratio = (hit_bytes + miss_bytes)
+                 ? (double) hit_bytes * 100 / (hit_bytes + miss_bytes) : 0;
+
+    ngx_log_error(NGX_LOG_INFO, ngx_cycle->log, 0,
+                  "http file cache \"%V\": eviction %s, "
+                  "hits:%uA misses:%uA (%.2f%%), "
+                  "hit bytes:%uA miss bytes:%uA (%.2f%%)",
+                  &cache->shm_zone->shm.name,
+                  cache->eviction == NGX_HTTP_CACHE_EVICT_TINYLFU
+                  ? "tinylfu" : "lru",
+                  hits, misses, ratio, hit_bytes, miss_bytes, byte_ratio);
 }
 
 
-static time_t
-ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
+static ngx_int_t
+ngx_http_file_cache_sketch_init(ngx_http_file_cache_t *cache,
+    ngx_shm_zone_t *shm_zone)
 {
-    u_char                      *name, *p;
-    size_t                       len;
-    time_t                       now, wait;
-    ngx_path_t                  *path;
-    ngx_msec_t                   elapsed;
-    ngx_queue_t                 *q;
-    ngx_http_file_cache_node_t  *fcn;
-    u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
+    u_char      *sketch;
+    ngx_uint_t   width;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache expire");
+    if (cache->eviction != NGX_HTTP_CACHE_EVICT_TINYLFU
+        || cache->sh->sketch)
+    {
+        return NGX_OK;
+    }
+
+    /*
+     * the sketch has a counter per node that fits into the zone in each
+     * of its rows, that is, it takes about 3% of the zone
+     */
 
-    path = cache->path;
-    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+    width = 1024;
 
-    name = ngx_alloc(len + 1, ngx_cycle->log);
-    if (name == NULL) {
-        return 10;
+    while (width * 2 * sizeof(ngx_http_file_cache_node_t)
+           <= shm_zone->shm.size)
+    {
+        width *= 2;
     }
 
-    ngx_memcpy(name, path->name.data, path->name.len);
-
-    now = ngx_time();
+    sketch = ngx_slab_calloc(cache->shpool,
+                             NGX_HTTP_CACHE_SKETCH_ROWS * width);
+    if (sketch == NULL) {
+        ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                      "could not allocate frequency sketch%s",
+                      cache->shpool->log_ctx);
+        return NGX_ERROR;
+    }
 
     ngx_shmtx_lock(&cache->shpool->mutex);
 
-    for ( ;; ) {
+    cache->sh->sketch_mask = width - 1;
+    cache->sh->sketch_adds = 0;
+    cache->sh->sketch = sketch;
 
-        if (ngx_quit || ngx_terminate) {
-            wait = 1;
-            break;
-        }
+    ngx_shmtx_unlock(&cache->shpool->mutex);
 
-        if (ngx_queue_empty(&cache->sh->queue)) {
-            wait = 10;
-            break;
-        }
+    return NGX_OK;
+}
 
-        q = ngx_queue_last(&cache->sh->queue);
 
-        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+static void
+ngx_http_file_cache_sketch_add(ngx_http_file_cache_t *cache, u_char *key)
+{
+    u_char      *counter, min;
+    uint32_t     hash[NGX_HTTP_CACHE_SKETCH_ROWS];
+    ngx_uint_t   i, width;
 
-        wait = fcn->expire - now;
+    /* the key is an md5 hash already, its words index the rows */
 
-        if (wait > 0) {
-            wait = wait > 10 ? 10 : wait;
-            break;
-        }
+    ngx_memcpy(hash, key, sizeof(hash));
 
-        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache expire: #%d %d %02xd%02xd%02xd%02xd",
-                       fcn->count, fcn->exists,
-                       fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+    width = cache->sh->sketch_mask + 1;
+    min = NGX_HTTP_CACHE_SKETCH_MAX;
 
-        if (fcn->count == 0) {
-            ngx_http_file_cache_delete(cache, q, name);
-            goto next;
+    for (i = 0; i < NGX_HTTP_CACHE_SKETCH_ROWS; i++) {
+        counter = &cache->sh->sketch[i * width
+                                     + (hash[i] & cache->sh->sketch_mask)];
+        if (*counter < min) {
+            min = *counter;
         }
+    }
 
-        if (fcn->deleting) {
-            wait = 1;
-            break;
+    if (min == NGX_HTTP_CACHE_SKETCH_MAX) {
+        return;
+    }
+
+    /* conservative update: only the smallest counters are incremented */
+
+    for (i = 0; i < NGX_HTTP_CACHE_SKETCH_ROWS; i++) {
+        counter = &cache->sh->sketch[i * width
+                                     + (hash[i] & cache->sh->sketch_mask)];
+        if (*counter == min) {
+            (*counter)++;
         }
+    }
 
-        p = ngx_hex_dump(key, (u_char *) &fcn->node.key,
-                         sizeof(ngx_rbtree_key_t));
-        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
-        (void) ngx_hex_dump(p, fcn->key, len);
+    if (++cache->sh->sketch_adds < 10 * width) {
+        return;
+    }
 
-        /*
-         * abnormally exited workers may leave locked cache entries,
-         * and although it may be safe to remove them completely,
-         * we prefer to just move them to the top of the inactive queue
-         */
+    /* aging: all counters are halved once every 10 * width additions */
 
-        ngx_queue_remove(q);
-        fcn->expire = ngx_time() + cache->inactive;
-        ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+    for (i = 0; i < NGX_HTTP_CACHE_SKETCH_ROWS * width; i++) {
+        cache->sh->sketch[i] >>= 1;
+    }
 
-        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                      "ignore long locked inactive cache entry %*s, count:%d",
-                      (size_t) 2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
+    cache->sh->sketch_adds /= 2;
+}
 
-next:
 
-        if (++cache->files >= cache->manager_files) {
-            wait = 0;
-            break;
-        }
+static ngx_uint_t
+ngx_http_file_cache_sketch_estimate(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn)
+{
+    u_char      *counter, min;
+    uint32_t     hash[NGX_HTTP_CACHE_SKETCH_ROWS];
+    ngx_uint_t   i, width;
+    u_char       key[NGX_HTTP_CACHE_KEY_LEN];
 
-        ngx_time_update();
+    ngx_memcpy(key, &fcn->node.key, sizeof(ngx_rbtree_key_t));
+    ngx_memcpy(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
+               NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
 
-        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+    ngx_memcpy(hash, key, sizeof(hash));
 
-        if (elapsed >= cache->manager_threshold) {
-            wait = 0;
-            break;
+    width = cache->sh->sketch_mask + 1;
+    min = NGX_HTTP_CACHE_SKETCH_MAX;
+
+    for (i = 0; i < NGX_HTTP_CACHE_SKETCH_ROWS; i++) {
+        counter = &cache->sh->sketch[i * width
+                                     + (hash[i] & cache->sh->sketch_mask)];
+        if (*counter < min) {
+            min = *counter;
         }
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    return min;
+}
 
-    ngx_free(name);
 
-    return wait;
+static ngx_queue_t *
+ngx_http_file_cache_queue(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn)
+{
+    return fcn->admitted ? &cache->sh->main : &cache->sh->queue;
 }
 
 
-static void
-ngx_http_file_cache_delete(ngx_http_file_cache_t *cache, ngx_queue_t *q,
-    u_char *name)
+static ngx_queue_t *
+ngx_http_file_cache_last(ngx_http_file_cache_t *cache)
 {
-    u_char                      *p;
-    size_t                       len;
-    ngx_path_t                  *path;
-    ngx_http_file_cache_node_t  *fcn;
+    ngx_queue_t                 *wq, *mq;
+    ngx_http_file_cache_node_t  *wn, *mn;
 
-    fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+    /* the least recently used node of both queues */
 
-    if (fcn->exists) {
-        cache->sh->size -= fcn->fs_size;
+    if (ngx_queue_empty(&cache->sh->main)) {
+        return ngx_queue_empty(&cache->sh->queue)
+               ? NULL : ngx_queue_last(&cache->sh->queue);
+    }
 
-        path = cache->path;
-        p = name + path->name.len + 1 + path->len;
-        p = ngx_hex_dump(p, (u_char *) &fcn->node.key,
-                         sizeof(ngx_rbtree_key_t));
-        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
-        p = ngx_hex_dump(p, fcn->key, len);
-        *p = '\0';
+    if (ngx_queue_empty(&cache->sh->queue)) {
+        return ngx_queue_last(&cache->sh->main);
+    }
 
-        fcn->count++;
-        fcn->deleting = 1;
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+    wq = ngx_queue_last(&cache->sh->queue);
+    mq = ngx_queue_last(&cache->sh->main);
 
-        len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
-        ngx_create_hashed_filename(path, name, len);
+    wn = ngx_queue_data(wq, ngx_http_file_cache_node_t, queue);
+    mn = ngx_queue_data(mq, ngx_http_file_cache_node_t, queue);
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache expire: \"%s\"", name);
+    return (wn->expire <= mn->expire) ? wq : mq;
+}
 
-        if (ngx_delete_file(name) == NGX_FILE_ERROR) {
-            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
-                          ngx_delete_file_n " \"%s\" failed", name);
-        }
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
-        fcn->count--;
-        fcn->deleting = 0;
+static ngx_queue_t *
+ngx_http_file_cache_victim(ngx_http_file_cache_t *cache)
+{
+    off_t                        wsize, msize;
+    ngx_uint_t                   window, wfreq, mfreq;
+    ngx_queue_t                 *wq, *mq;
+    ngx_http_file_cache_node_t  *wn, *mn;
+
+    if (cache->eviction != NGX_HTTP_CACHE_EVICT_TINYLFU
+        || cache->sh->sketch == NULL)
+    {
+        return ngx_http_file_cache_last(cache);
     }
 
-    if (fcn->count == 0) {
-        ngx_queue_remove(q);
-        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
-        ngx_slab_free_locked(cache->shpool, fcn);
-        cache->sh->count--;
+    /*
+     * W-TinyLFU: new nodes enter the window queue and move to the main
+     * queue once requested again; when the window holds more than 1%
+     * of nodes, its least recently used node is admitted to the main
+     * queue only if it is requested more often per block than the least
+     * recently used node of the main queue, and one of the two is evicted
+     */
+
+    if (ngx_queue_empty(&cache->sh->queue)) {
+        return ngx_queue_empty(&cache->sh->main)
+               ? NULL : ngx_queue_last(&cache->sh->main);
+    }
+
+    wq = ngx_queue_last(&cache->sh->queue);
+
+    window = cache->sh->count - cache->sh->main_count;
+
+    if (window * 100 <= cache->sh->count
+        && !ngx_queue_empty(&cache->sh->main))
+    {
+        return ngx_queue_last(&cache->sh->main);
+    }
+
+    wn = ngx_queue_data(wq, ngx_http_file_cache_node_t, queue);
+
+    if (wn->count || !wn->exists) {
+        return wq;
+    }
+
+    if (ngx_queue_empty(&cache->sh->main)) {
+        return wq;
+    }
+
+    mq = ngx_queue_last(&cache->sh->main);
+    mn = ngx_queue_data(mq, ngx_http_file_cache_node_t, queue);
+
+    wfreq = ngx_http_file_cache_sketch_estimate(cache, wn);
+    mfreq = ngx_http_file_cache_sketch_estimate(cache, mn);
+
+    wsize = ngx_max(wn->fs_size, 1);
+    msize = ngx_max(mn->fs_size, 1);
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache admission: %ui/%O vs %ui/%O",
+                   wfreq, wsize, mfreq, msize);
+
+    if ((off_t) wfreq * msize <= (off_t) mfreq * wsize) {
+        return wq;
     }
+
+    ngx_queue_remove(wq);
+    wn->admitted = 1;
+    ngx_queue_insert_head(&cache->sh->main, wq);
+    cache->sh->main_count++;
+
+    return mq;
 }
 
 
-static ngx_msec_t
-ngx_http_file_cache_manager(void *data)
+static ngx_int_t
+ngx_http_file_cache_index_load(ngx_http_file_cache_t *cache, ngx_log_t *log)
 {
-    ngx_http_file_cache_t  *cache = data;
+    u_char                              *buf, *p, *last;
+    off_t                                offset;
+    time_t                               now;
+    ssize_t                              n;
+    ngx_err_t                            err;
+    ngx_int_t                            rc;
+    ngx_msec_t                           start;
+    ngx_uint_t                           records;
+    ngx_file_t                           file;
+    ngx_http_file_cache_node_t          *fcn;
+    ngx_http_file_cache_index_header_t   h;
+    ngx_http_file_cache_index_record_t  *rec;
 
-    off_t       size, free;
-    time_t      wait;
-    ngx_msec_t  elapsed, next;
-    ngx_uint_t  count, watermark;
+    ngx_memzero(&file, sizeof(ngx_file_t));
 
-    cache->last = ngx_current_msec;
-    cache->files = 0;
+    file.name = cache->index.name;
+    file.log = log;
 
-    next = (ngx_msec_t) ngx_http_file_cache_expire(cache) * 1000;
+    file.fd = ngx_open_file(file.name.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
 
-    if (next == 0) {
-        next = cache->manager_sleep;
+    if (file.fd == NGX_INVALID_FILE) {
+        err = ngx_errno;
+
+        if (err != NGX_ENOENT) {
+            ngx_log_error(NGX_LOG_CRIT, log, err,
+                          ngx_open_file_n " \"%s\" failed", file.name.data);
+        }
+
+        return NGX_DECLINED;
+    }
+
+    buf = NULL;
+    rc = NGX_DECLINED;
+
+    n = ngx_read_file(&file, (u_char *) &h, sizeof(h), 0);
+
+    if (n == NGX_ERROR) {
+        goto done;
+    }
+
+    if ((size_t) n != sizeof(h)
+        || ngx_http_file_cache_index_valid(cache, &h) != NGX_OK)
+    {
+        ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                      "cache index \"%s\" is not compatible, ignored",
+                      file.name.data);
+        goto done;
+    }
+
+    buf = ngx_alloc(NGX_HTTP_CACHE_INDEX_READ
+                    * sizeof(ngx_http_file_cache_index_record_t), log);
+    if (buf == NULL) {
         goto done;
     }
 
+    start = ngx_current_msec;
+    now = ngx_time();
+
+    offset = sizeof(h);
+    records = 0;
+
     for ( ;; ) {
-        ngx_shmtx_lock(&cache->shpool->mutex);
+        n = ngx_read_file(&file, buf, NGX_HTTP_CACHE_INDEX_READ
+                          * sizeof(ngx_http_file_cache_index_record_t),
+                          offset);
 
-        size = cache->sh->size;
-        count = cache->sh->count;
-        watermark = cache->sh->watermark;
+        if (n == NGX_ERROR) {
+            goto done;
+        }
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+        /* a partially written record at the end is ignored */
 
-        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache size: %O c:%ui w:%i",
-                       size, count, (ngx_int_t) watermark);
+        n -= n % sizeof(ngx_http_file_cache_index_record_t);
 
-        if (size < cache->max_size && count < watermark) {
+        if (n == 0) {
+            break;
+        }
 
-            if (!cache->min_free) {
-                break;
+        offset += n;
+        last = buf + n;
+
+        for (p = buf; p < last;
+             p += sizeof(ngx_http_file_cache_index_record_t))
+        {
+            rec = (ngx_http_file_cache_index_record_t *) p;
+            records++;
+
+            fcn = ngx_http_file_cache_lookup(cache, rec->key);
+
+            if (rec->op == NGX_HTTP_CACHE_INDEX_DELETE
+                || rec->shard >= cache->shards.nelts)
+            {
+
+                if (fcn) {
+                    cache->sh->size -= fcn->fs_size;
+
+                    ngx_queue_remove(&fcn->queue);
+                    ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
+                    ngx_slab_free_locked(cache->shpool, fcn);
+                    cache->sh->count--;
+                }
+
+                continue;
             }
 
-            free = ngx_fs_available(cache->path->name.data);
+            if (fcn) {
+                cache->sh->size += (off_t) rec->fs_size - fcn->fs_size;
+                fcn->fs_size = (off_t) rec->fs_size;
+                fcn->shard = rec->shard;
+                continue;
+            }
 
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                           "http file cache free: %O", free);
+            fcn = ngx_slab_calloc_locked(cache->shpool,
+                                         sizeof(ngx_http_file_cache_node_t));
+            if (fcn == NULL) {
+                ngx_http_file_cache_set_watermark(cache);
 
-            if (free > cache->min_free) {
-                break;
+                ngx_log_error(NGX_LOG_ALERT, log, 0,
+                              "could not allocate node%s",
+                              cache->shpool->log_ctx);
+                goto done;
             }
-        }
 
-        wait = ngx_http_file_cache_forced_expire(cache);
+            cache->sh->count++;
 
-        if (wait > 0) {
-            next = (ngx_msec_t) wait * 1000;
-            break;
-        }
+            ngx_memcpy((u_char *) &fcn->node.key, rec->key,
+                       sizeof(ngx_rbtree_key_t));
 
-        if (ngx_quit || ngx_terminate) {
-            break;
-        }
+            ngx_memcpy(fcn->key, &rec->key[sizeof(ngx_rbtree_key_t)],
+                       NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
 
-        if (++cache->files >= cache->manager_files) {
-            next = cache->manager_sleep;
-            break;
-        }
+            ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
 
-        ngx_time_update();
+            fcn->uses = 1;
+            fcn->exists = 1;
+            fcn->shard = rec->shard;
+            fcn->fs_size = (off_t) rec->fs_size;
+            fcn->expire = now + cache->inactive;
 
-        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+            ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
 
-        if (elapsed >= cache->manager_threshold) {
-            next = cache->manager_sleep;
-            break;
+            cache->sh->size += fcn->fs_size;
         }
     }
 
+    if (records > h.snapshot) {
+        cache->sh->index_journal = records - (ngx_uint_t) h.snapshot;
+    }
+
+    ngx_time_update();
+
+    ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                  "http file cache: %V %.3fM, bsize: %uz, "
+                  "%ui entries from index \"%s\" in %Mms",
+                  &cache->path->name,
+                  ((double) cache->sh->size * cache->bsize) / (1024 * 1024),
+                  cache->bsize, cache->sh->count, file.name.data,
+                  ngx_current_msec - start);
+
+    rc = NGX_OK;
+
 done:
 
-    elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+    if (buf) {
+        ngx_free(buf);
+    }
 
-    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache manager: %ui e:%M n:%M",
-                   cache->files, elapsed, next);
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", file.name.data);
+    }
 
-    return next;
+    return rc;
 }
 
 
-static void
-ngx_http_file_cache_loader(void *data)
+static ngx_int_t
+ngx_http_file_cache_index_valid(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_index_header_t *h)
 {
-    ngx_http_file_cache_t  *cache = data;
+    ngx_uint_t  n;
 
-    ngx_tree_ctx_t  tree;
+    if (ngx_memcmp(h->magic, ngx_http_file_cache_index_magic,
+                   sizeof(ngx_http_file_cache_index_magic))
+        != 0)
+    {
+        return NGX_DECLINED;
+    }
 
-    if (!cache->sh->cold || cache->sh->loading) {
-        return;
+    if (h->version != NGX_HTTP_CACHE_INDEX_VERSION
+        || h->bsize != cache->bsize
+        || h->shards != ngx_http_file_cache_shards_hash(cache))
+    {
+        return NGX_DECLINED;
     }
 
-    if (!ngx_atomic_cmp_set(&cache->sh->loading, 0, ngx_pid)) {
-        return;
+    for (n = 0; n < NGX_MAX_PATH_LEVEL; n++) {
+        if (h->level[n] != cache->path->level[n]) {
+            return NGX_DECLINED;
+        }
     }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache loader");
+    return NGX_OK;
+}
 
-    tree.init_handler = NULL;
-    tree.file_handler = ngx_http_file_cache_manage_file;
-    tree.pre_tree_handler = ngx_http_file_cache_manage_directory;
-    tree.post_tree_handler = ngx_http_file_cache_noop;
-    tree.spec_handler = ngx_http_file_cache_delete_file;
-    tree.data = cache;
-    tree.alloc = 0;
-    tree.log = ngx_cycle->log;
 
-    cache->last = ngx_current_msec;
-    cache->files = 0;
+static void
+ngx_http_file_cache_index_record(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn, ngx_uint_t op)
+{
+    ngx_http_file_cache_index_entry_t  *ie;
 
-    if (ngx_walk_tree(&tree, &cache->path->name) == NGX_ABORT) {
-        cache->sh->loading = 0;
+    if (cache->index.name.len == 0 || cache->sh->index_checkpoint) {
         return;
     }
 
-    cache->sh->cold = 0;
-    cache->sh->loading = 0;
+    if (cache->sh->index_queued >= NGX_HTTP_CACHE_INDEX_QUEUE) {
+        goto overflow;
+    }
 
-    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
-                  "http file cache: %V %.3fM, bsize: %uz",
-                  &cache->path->name,
-                  ((double) cache->sh->size * cache->bsize) / (1024 * 1024),
-                  cache->bsize);
+    ie = ngx_slab_alloc_locked(cache->shpool,
+                               sizeof(ngx_http_file_cache_index_entry_t));
+    if (ie == NULL) {
+        goto overflow;
+    }
+
+    ngx_memcpy(ie->record.key, &fcn->node.key, sizeof(ngx_rbtree_key_t));
+    ngx_memcpy(&ie->record.key[sizeof(ngx_rbtree_key_t)], fcn->key,
+               NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+    ie->record.fs_size = (uint64_t) fcn->fs_size;
+    ie->record.op = (uint32_t) op;
+    ie->record.shard = fcn->shard;
+
+    ngx_queue_insert_tail(&cache->sh->index_queue, &ie->queue);
+    cache->sh->index_queued++;
+
+    return;
+
+overflow:
+
+    /* the cache manager is behind, the whole index will be rewritten */
+
+    cache->sh->index_checkpoint = 1;
 }
 
 
-static ngx_int_t
-ngx_http_file_cache_noop(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+static void
+ngx_http_file_cache_index(ngx_http_file_cache_t *cache)
 {
-    return NGX_OK;
+    if (cache->sh->cold) {
+        return;
+    }
+
+    if (cache->index.fd == NGX_INVALID_FILE
+        && !cache->sh->index_checkpoint
+        && ngx_http_file_cache_index_open(cache) != NGX_OK)
+    {
+        cache->sh->index_checkpoint = 1;
+    }
+
+    /* the journal is compacted once it exceeds the number of entries */
+
+    if (cache->sh->index_checkpoint
+        || cache->sh->index_journal > cache->sh->count + 1024)
+    {
+        (void) ngx_http_file_cache_index_checkpoint(cache);
+        return;
+    }
+
+    (void) ngx_http_file_cache_index_flush(cache, 1);
 }
 
 
 static ngx_int_t
-ngx_http_file_cache_manage_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+ngx_http_file_cache_index_open(ngx_http_file_cache_t *cache)
 {
-    ngx_msec_t              elapsed;
-    ngx_http_file_cache_t  *cache;
+    off_t                                size;
+    ssize_t                              n;
+    ngx_fd_t                             fd;
+    ngx_err_t                            err;
+    ngx_file_info_t                      fi;
+    ngx_http_file_cache_index_header_t   h;
 
-    cache = ctx->data;
+    cache->index.log = ngx_cycle->log;
 
-    if (ngx_http_file_cache_add_file(ctx, path) != NGX_OK) {
-        (void) ngx_http_file_cache_delete_file(ctx, path);
-    }
+    fd = ngx_open_file(cache->index.name.data, NGX_FILE_RDWR, NGX_FILE_OPEN,
+                       0);
 
-    if (++cache->files >= cache->loader_files) {
-        ngx_http_file_cache_loader_sleep(cache);
+    if (fd == NGX_INVALID_FILE) {
+        err = ngx_errno;
 
-    } else {
-        ngx_time_update();
+        if (err != NGX_ENOENT) {
+            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, err,
+                          ngx_open_file_n " \"%s\" failed",
+                          cache->index.name.data);
+        }
 
-        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+        return NGX_ERROR;
+    }
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache loader time elapsed: %M", elapsed);
+    cache->index.fd = fd;
 
-        if (elapsed >= cache->loader_threshold) {
-            ngx_http_file_cache_loader_sleep(cache);
-        }
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", cache->index.name.data);
+        goto failed;
     }
 
-    return (ngx_quit || ngx_terminate) ? NGX_ABORT : NGX_OK;
-}
+    n = ngx_read_file(&cache->index, (u_char *) &h, sizeof(h), 0);
 
+    if (n == NGX_ERROR) {
+        goto failed;
+    }
 
-static ngx_int_t
-ngx_http_file_cache_manage_directory(ngx_tree_ctx_t *ctx, ngx_str_t *path)
-{
-    if (path->len >= 5
-        && ngx_strncmp(path->data + path->len - 5, "/temp", 5) == 0)
+    if ((size_t) n != sizeof(h)
+        || ngx_http_file_cache_index_valid(cache, &h) != NGX_OK)
     {
-        return NGX_DECLINED;
+        goto failed;
     }
 
+    /* a partially written record at the end will be overwritten */
+
+    size = ngx_file_size(&fi) - sizeof(h);
+    size -= size % sizeof(ngx_http_file_cache_index_record_t);
+
+    cache->index.offset = sizeof(h) + size;
+
     return NGX_OK;
-}
 
+failed:
 
-static void
-ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache)
-{
-    ngx_msleep(cache->loader_sleep);
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed",
+                      cache->index.name.data);
+    }
 
-    ngx_time_update();
+    cache->index.fd = NGX_INVALID_FILE;
 
-    cache->last = ngx_current_msec;
-    cache->files = 0;
+    return NGX_ERROR;
 }
 
 
 static ngx_int_t
-ngx_http_file_cache_add_file(ngx_tree_ctx_t *ctx, ngx_str_t *name)
+ngx_http_file_cache_index_flush(ngx_http_file_cache_t *cache,
+    ngx_uint_t write)
 {
-    u_char                 *p;
-    ngx_int_t               n;
-    ngx_uint_t              i;
-    ngx_http_cache_t        c;
-    ngx_http_file_cache_t  *cache;
+    ngx_uint_t                          n;
+    ngx_queue_t                        *q;
+    ngx_http_file_cache_index_entry_t  *ie;
+    ngx_http_file_cache_index_record_t  records[NGX_HTTP_CACHE_INDEX_BATCH];
 
-    if (name->len < 2 * NGX_HTTP_CACHE_KEY_LEN) {
-        return NGX_ERROR;
-    }
+    for ( ;; ) {
+        n = 0;
 
-    /*
-     * Temporary files in cache have a suffix consisting of a dot
-     * followed by 10 digits.
-     */
+        ngx_shmtx_lock(&cache->shpool->mutex);
 
-    if (name->len >= 2 * NGX_HTTP_CACHE_KEY_LEN + 1 + 10
-        && name->data[name->len - 10 - 1] == '.')
-    {
-        return NGX_OK;
-    }
+        while (!ngx_queue_empty(&cache->sh->index_queue)
+               && n < NGX_HTTP_CACHE_INDEX_BATCH)
+        {
+            q = ngx_queue_head(&cache->sh->index_queue);
+            ie = ngx_queue_data(q, ngx_http_file_cache_index_entry_t, queue);
 
-    if (ctx->size < (off_t) sizeof(ngx_http_file_cache_header_t)) {
-        ngx_log_error(NGX_LOG_CRIT, ctx->log, 0,
-                      "cache file \"%s\" is too small", name->data);
-        return NGX_ERROR;
-    }
+            records[n++] = ie->record;
 
-    ngx_memzero(&c, sizeof(ngx_http_cache_t));
-    cache = ctx->data;
+            ngx_queue_remove(q);
+            ngx_slab_free_locked(cache->shpool, ie);
+            cache->sh->index_queued--;
+        }
 
-    c.length = ctx->size;
-    c.fs_size = (ctx->fs_size + cache->bsize - 1) / cache->bsize;
+        ngx_shmtx_unlock(&cache->shpool->mutex);
 
-    p = &name->data[name->len - 2 * NGX_HTTP_CACHE_KEY_LEN];
+        if (n == 0) {
+            return NGX_OK;
+        }
 
-    for (i = 0; i < NGX_HTTP_CACHE_KEY_LEN; i++) {
-        n = ngx_hextoi(p, 2);
+        if (!write) {
+            continue;
+        }
 
-        if (n == NGX_ERROR) {
+        if (ngx_write_file(&cache->index, (u_char *) records,
+                           n * sizeof(ngx_http_file_cache_index_record_t),
+                           cache->index.offset)
+            == NGX_ERROR)
+        {
+            cache->sh->index_checkpoint = 1;
             return NGX_ERROR;
         }
 
-        p += 2;
+        cache->sh->index_journal += n;
 
-        c.key[i] = (u_char) n;
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache index journal: %ui", n);
     }
-
-    return ngx_http_file_cache_add(cache, &c);
 }
 
 
 static ngx_int_t
-ngx_http_file_cache_add(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
+ngx_http_file_cache_index_checkpoint(ngx_http_file_cache_t *cache)
 {
-    ngx_http_file_cache_node_t  *fcn;
+    u_char                              *name;
+    ngx_uint_t                           n, total;
+    ngx_file_t                           file;
+    ngx_rbtree_node_t                   *node;
+    ngx_http_file_cache_node_t          *fcn;
+    ngx_http_file_cache_index_header_t   h;
+    u_char                               key[NGX_HTTP_CACHE_KEY_LEN];
+    ngx_http_file_cache_index_record_t   records[NGX_HTTP_CACHE_INDEX_BATCH];
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache index checkpoint");
 
     ngx_shmtx_lock(&cache->shpool->mutex);
+    cache->sh->index_checkpoint = 0;
+    ngx_shmtx_unlock(&cache->shpool->mutex);
 
-    fcn = ngx_http_file_cache_lookup(cache, c->key);
+    /* the snapshot includes all changes queued so far */
 
-    if (fcn == NULL) {
+    (void) ngx_http_file_cache_index_flush(cache, 0);
 
-        fcn = ngx_slab_calloc_locked(cache->shpool,
-                                     sizeof(ngx_http_file_cache_node_t));
-        if (fcn == NULL) {
-            ngx_http_file_cache_set_watermark(cache);
+    name = ngx_alloc(cache->index.name.len + sizeof(".tmp"), ngx_cycle->log);
+    if (name == NULL) {
+        goto failed;
+    }
 
-            if (cache->fail_time != ngx_time()) {
-                cache->fail_time = ngx_time();
-                ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                           "could not allocate node%s", cache->shpool->log_ctx);
+    ngx_sprintf(name, "%V.tmp%Z", &cache->index.name);
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.name.data = name;
+    file.name.len = cache->index.name.len + sizeof(".tmp") - 1;
+    file.log = ngx_cycle->log;
+
+    file.fd = ngx_open_file(name, NGX_FILE_RDWR, NGX_FILE_TRUNCATE,
+                            NGX_FILE_DEFAULT_ACCESS);
+
+    if (file.fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_open_file_n " \"%s\" failed", name);
+        goto failed;
+    }
+
+    ngx_memzero(&h, sizeof(ngx_http_file_cache_index_header_t));
+
+    ngx_memcpy(h.magic, ngx_http_file_cache_index_magic,
+               sizeof(ngx_http_file_cache_index_magic));
+
+    h.version = NGX_HTTP_CACHE_INDEX_VERSION;
+    h.bsize = (uint32_t) cache->bsize;
+    h.shards = ngx_http_file_cache_shards_hash(cache);
+
+    for (n = 0; n < NGX_MAX_PATH_LEVEL; n++) {
+        h.level[n] = (uint32_t) cache->path->level[n];
+    }
+
+    if (ngx_write_file(&file, (u_char *) &h, sizeof(h), 0) == NGX_ERROR) {
+        goto failed;
+    }
+
+    /*
+     * the tree is walked in key order in small batches, so that
+     * the keys zone is not locked for long
+     */
+
+    total = 0;
+    node = NULL;
+
+    for ( ;; ) {
+        n = 0;
+
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        if (total == 0 && node == NULL) {
+            node = (cache->sh->rbtree.root == cache->sh->rbtree.sentinel)
+                   ? NULL : ngx_rbtree_min(cache->sh->rbtree.root,
+                                           cache->sh->rbtree.sentinel);
+
+        } else {
+            node = (ngx_rbtree_node_t *)
+                       ngx_http_file_cache_index_next(cache, key);
+        }
+
+        while (node && n < NGX_HTTP_CACHE_INDEX_BATCH) {
+            fcn = (ngx_http_file_cache_node_t *) node;
+
+            ngx_memcpy(key, &fcn->node.key, sizeof(ngx_rbtree_key_t));
+            ngx_memcpy(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
+                       NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+            if (fcn->exists && !fcn->deleting) {
+                ngx_memcpy(records[n].key, key, NGX_HTTP_CACHE_KEY_LEN);
+                records[n].fs_size = (uint64_t) fcn->fs_size;
+                records[n].op = NGX_HTTP_CACHE_INDEX_ADD;
+                records[n].shard = fcn->shard;
+                n++;
             }
 
-            ngx_shmtx_unlock(&cache->shpool->mutex);
-            return NGX_ERROR;
+            node = ngx_rbtree_next(&cache->sh->rbtree, node);
         }
 
-        cache->sh->count++;
+        ngx_shmtx_unlock(&cache->shpool->mutex);
 
-        ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
+        if (n && ngx_write_file(&file, (u_char *) records,
+                                n * sizeof(ngx_http_file_cache_index_record_t),
+                                file.offset)
+                 == NGX_ERROR)
+        {
+            goto failed;
+        }
 
-        ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
-                   NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+        total += n;
 
-        ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
+        if (node == NULL) {
+            break;
+        }
+    }
 
-        fcn->uses = 1;
-        fcn->exists = 1;
-        fcn->fs_size = c->fs_size;
+    h.snapshot = total;
 
-        cache->sh->size += c->fs_size;
+    if (ngx_write_file(&file, (u_char *) &h, sizeof(h), 0) == NGX_ERROR) {
+        goto failed;
+    }
 
-    } else {
-        ngx_queue_remove(&fcn->queue);
+    if (ngx_rename_file(name, cache->index.name.data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_rename_file_n " \"%s\" to \"%s\" failed",
+                      name, cache->index.name.data);
+        goto failed;
+    }
+
+    if (cache->index.fd != NGX_INVALID_FILE
+        && ngx_close_file(cache->index.fd) == NGX_FILE_ERROR)
+    {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed",
+                      cache->index.name.data);
     }
 
-    fcn->expire = ngx_time() + cache->inactive;
+    cache->index.fd = file.fd;
+    cache->index.log = ngx_cycle->log;
+    cache->index.offset = sizeof(h) + total
+                          * sizeof(ngx_http_file_cache_index_record_t);
+
+    cache->sh->index_journal = 0;
+
+    ngx_free(name);
+
+    ngx_log_error(NGX_LOG_INFO, ngx_cycle->log, 0,
+                  "http file cache index \"%V\": %ui entries",
+                  &cache->index.name, total);
+
+    return NGX_OK;
+
+failed:
+
+    if (name) {
+        if (file.fd != NGX_INVALID_FILE) {
+            if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+                ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                              ngx_close_file_n " \"%s\" failed", name);
+            }
+
+            (void) ngx_delete_file(name);
+        }
 
-    ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+        ngx_free(name);
+    }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    cache->sh->index_checkpoint = 1;
 
-    return NGX_OK;
+    return NGX_ERROR;
 }
 
 
-static ngx_int_t
-ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+static ngx_http_file_cache_node_t *
+ngx_http_file_cache_index_next(ngx_http_file_cache_t *cache, u_char *key)
 {
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
-                   "http file cache delete: \"%s\"", path->data);
+    ngx_int_t                    rc;
+    ngx_rbtree_key_t             node_key;
+    ngx_rbtree_node_t           *node, *sentinel, *next;
+    ngx_http_file_cache_node_t  *fcn;
 
-    if (ngx_delete_file(path->data) == NGX_FILE_ERROR) {
-        ngx_log_error(NGX_LOG_CRIT, ctx->log, ngx_errno,
-                      ngx_delete_file_n " \"%s\" failed", path->data);
-    }
+    /* the first node with a key greater than the given one */
 
-    return NGX_OK;
-}
+    ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
 
+    node = cache->sh->rbtree.root;
+    sentinel = cache->sh->rbtree.sentinel;
+    next = NULL;
 
-static void
-ngx_http_file_cache_set_watermark(ngx_http_file_cache_t *cache)
-{
-    cache->sh->watermark = cache->sh->count - cache->sh->count / 8;
+    while (node != sentinel) {
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache watermark: %ui", cache->sh->watermark);
+        if (node_key != node->key) {
+            rc = (node_key < node->key) ? -1 : 1;
+
+        } else {
+            fcn = (ngx_http_file_cache_node_t *) node;
+
+            rc = ngx_memcmp(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
+                            NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+        }
+
+        if (rc < 0) {
+            next = node;
+            node = node->left;
+
+        } else {
+            node = node->right;
+        }
+    }
+
+    return (ngx_http_file_cache_node_t *) next;
 }
 
 
@@ -2316,17 +6101,20 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
     char  *confp = conf;
 
-    off_t                   max_size, min_free;
-    u_char                 *last, *p;
-    time_t                  inactive;
-    ssize_t                 size;
-    ngx_str_t               s, name, *value;
-    ngx_int_t               loader_files, manager_files;
-    ngx_msec_t              loader_sleep, manager_sleep, loader_threshold,
-                            manager_threshold;
-    ngx_uint_t              i, n, use_temp_path;
-    ngx_array_t            *caches;
-    ngx_http_file_cache_t  *cache, **ce;
+    off_t                         max_size, min_free;
+    u_char                       *last, *p;
+    time_t                        inactive, fail_timeout, refresh_ahead;
+    ssize_t                       size, memory, memory_max_object, sparse;
+    ngx_str_t                     s, name, mname, *value;
+    ngx_int_t                     loader_files, manager_files, max_fails,
+                                  max_threads, updates;
+    ngx_msec_t                    loader_sleep, manager_sleep,
+                                  loader_threshold, manager_threshold;
+    ngx_uint_t                    i, n, use_temp_path;
+    ngx_path_t                   *path;
+    ngx_array_t                  *caches;
+    ngx_http_file_cache_t        *cache, **ce;
+    ngx_http_file_cache_shard_t  *shard;
 
     cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_file_cache_t));
     if (cache == NULL) {
@@ -2338,6 +6126,22 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    if (ngx_array_init(&cache->shards, cf->pool, 1,
+                       sizeof(ngx_http_file_cache_shard_t))
+        != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    shard = ngx_array_push(&cache->shards);
+    if (shard == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    shard->path = cache->path;
+
+    cache->index.fd = NGX_INVALID_FILE;
+
     use_temp_path = 1;
 
     inactive = 600;
@@ -2355,6 +6159,19 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     max_size = NGX_MAX_OFF_T_VALUE;
     min_free = 0;
 
+    memory = 0;
+    memory_max_object = 16384;
+
+    sparse = 0;
+
+    updates = 0;
+    refresh_ahead = 0;
+
+    max_fails = 1;
+    fail_timeout = 10;
+
+    max_threads = 2;
+
     value = cf->args->elts;
 
     cache->path->name = value[1];
@@ -2512,6 +6329,252 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "index=", 6) == 0) {
+
+            cache->index.name.len = value[i].len - 6;
+            cache->index.name.data = value[i].data + 6;
+
+            if (cache->index.name.len == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid index value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            if (ngx_conf_full_name(cf->cycle, &cache->index.name, 0)
+                != NGX_OK)
+            {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "shard=", 6) == 0) {
+
+            if (cache->shards.nelts == NGX_HTTP_CACHE_MAX_SHARDS) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "too many cache shards, "
+                                   "the maximum is %d",
+                                   NGX_HTTP_CACHE_MAX_SHARDS);
+                return NGX_CONF_ERROR;
+            }
+
+            path = ngx_pcalloc(cf->pool, sizeof(ngx_path_t));
+            if (path == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            path->name.len = value[i].len - 6;
+            path->name.data = value[i].data + 6;
+
+            if (path->name.len == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid shard value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            if (path->name.len > 1
+                && path->name.data[path->name.len - 1] == '/')
+            {
+                path->name.len--;
+            }
+
+            if (ngx_conf_full_name(cf->cycle, &path->name, 0) != NGX_OK) {
+                return NGX_CONF_ERROR;
+            }
+
+            shard = ngx_array_push(&cache->shards);
+            if (shard == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            shard->path = path;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "shard_max_fails=", 16) == 0) {
+
+            max_fails = ngx_atoi(value[i].data + 16, value[i].len - 16);
+            if (max_fails == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid shard_max_fails value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "shard_fail_timeout=", 19) == 0) {
+
+            s.len = value[i].len - 19;
+            s.data = value[i].data + 19;
+
+            fail_timeout = ngx_parse_time(&s, 1);
+            if (fail_timeout == (time_t) NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid shard_fail_timeout value \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "threads=", 8) == 0) {
+#if (NGX_THREADS)
+            s.len = value[i].len - 8;
+            s.data = value[i].data + 8;
+
+            cache->thread_pool = ngx_thread_pool_add(cf, &s);
+            if (cache->thread_pool == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+#else
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"threads\" parameter "
+                               "is unsupported on this platform");
+            return NGX_CONF_ERROR;
+#endif
+        }
+
+        if (ngx_strncmp(value[i].data, "max_threads=", 12) == 0) {
+
+            max_threads = ngx_atoi(value[i].data + 12, value[i].len - 12);
+            if (max_threads == NGX_ERROR || max_threads == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid max_threads value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "fsync=", 6) == 0) {
+
+            if (ngx_strcmp(&value[i].data[6], "on") == 0) {
+                cache->fsync = 1;
+
+            } else if (ngx_strcmp(&value[i].data[6], "off") == 0) {
+                cache->fsync = 0;
+
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid fsync value \"%V\", "
+                                   "it must be \"on\" or \"off\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "eviction=", 9) == 0) {
+
+            if (ngx_strcmp(&value[i].data[9], "lru") == 0) {
+                cache->eviction = NGX_HTTP_CACHE_EVICT_LRU;
+
+            } else if (ngx_strcmp(&value[i].data[9], "tinylfu") == 0) {
+                cache->eviction = NGX_HTTP_CACHE_EVICT_TINYLFU;
+
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid eviction value \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "memory=", 7) == 0) {
+
+            s.len = value[i].len - 7;
+            s.data = value[i].data + 7;
+
+            memory = ngx_parse_size(&s);
+
+            if (memory == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid memory value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            if (memory < (ssize_t) (8 * ngx_pagesize)) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "memory zone \"%V\" is too small",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "memory_max_object=", 18) == 0) {
+
+            s.len = value[i].len - 18;
+            s.data = value[i].data + 18;
+
+            memory_max_object = ngx_parse_size(&s);
+
+            if (memory_max_object == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid memory_max_object value \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "sparse=", 7) == 0) {
+
+            s.len = value[i].len - 7;
+            s.data = value[i].data + 7;
+
+            sparse = ngx_parse_size(&s);
+
+            if (sparse == NGX_ERROR
+                || sparse == 0
+                || (size_t) sparse > NGX_MAX_UINT32_VALUE)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid sparse value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "updates=", 8) == 0) {
+
+            updates = ngx_atoi(value[i].data + 8, value[i].len - 8);
+            if (updates == NGX_ERROR || updates == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid updates value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "refresh_ahead=", 14) == 0) {
+
+            s.len = value[i].len - 14;
+            s.data = value[i].data + 14;
+
+            refresh_ahead = ngx_parse_time(&s, 1);
+            if (refresh_ahead == (time_t) NGX_ERROR || refresh_ahead == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid refresh_ahead value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         if (ngx_strncmp(value[i].data, "loader_files=", 13) == 0) {
 
             loader_files = ngx_atoi(value[i].data + 13, value[i].len - 13);
@@ -2608,6 +6671,68 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    shard = cache->shards.elts;
+
+    for (i = 0; i < cache->shards.nelts; i++) {
+        path = shard[i].path;
+
+        for (n = 0; n < i; n++) {
+            if (shard[n].path->name.len == path->name.len
+                && ngx_strncmp(shard[n].path->name.data, path->name.data,
+                               path->name.len)
+                   == 0)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "duplicate cache shard \"%V\"",
+                                   &path->name);
+                return NGX_CONF_ERROR;
+            }
+        }
+
+        /* the cache loader removes unknown files from the cache directory */
+
+        if (cache->index.name.len > path->name.len
+            && cache->index.name.data[path->name.len] == '/'
+            && ngx_strncmp(cache->index.name.data, path->name.data,
+                           path->name.len)
+               == 0)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "cache index \"%V\" must not be inside "
+                               "the cache directory", &cache->index.name);
+            return NGX_CONF_ERROR;
+        }
+
+        shard[i].hash = ngx_crc32_short(path->name.data, path->name.len);
+
+#if (NGX_THREADS)
+        ngx_queue_init(&shard[i].ops);
+#endif
+
+        if (i == 0) {
+            continue;
+        }
+
+        /* shards are laid out like the cache directory, and have no manager */
+
+        ngx_memcpy(path->level, cache->path->level, sizeof(path->level));
+        path->len = cache->path->len;
+        path->data = cache;
+        path->conf_file = cf->conf_file->file.name.data;
+        path->line = cf->conf_file->line;
+
+        if (ngx_add_path(cf, &shard[i].path) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    cache->shard_max_fails = max_fails;
+    cache->shard_fail_timeout = fail_timeout;
+
+#if (NGX_THREADS)
+    cache->thread_max = max_threads;
+#endif
+
     cache->path->manager = ngx_http_file_cache_manager;
     cache->path->loader = ngx_http_file_cache_loader;
     cache->path->data = cache;
@@ -2639,8 +6764,35 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     cache->shm_zone->init = ngx_http_file_cache_init;
     cache->shm_zone->data = cache;
 
+    if (memory) {
+        mname.len = name.len + sizeof(":memory") - 1;
+
+        mname.data = ngx_pnalloc(cf->pool, mname.len);
+        if (mname.data == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_sprintf(mname.data, "%V:memory", &name);
+
+        cache->memory_zone = ngx_shared_memory_add(cf, &mname, memory,
+                                                   cmd->post);
+        if (cache->memory_zone == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        cache->memory_zone->init = ngx_http_file_cache_memory_init;
+        cache->memory_zone->data = cache;
+
+        cache->memory_max_object = memory_max_object;
+    }
+
     cache->use_temp_path = use_temp_path;
 
+    cache->sparse = sparse;
+
+    cache->updates = updates;
+    cache->refresh_ahead = refresh_ahead;
+
     cache->inactive = inactive;
     cache->max_size = max_size;
     cache->min_free = min_free;
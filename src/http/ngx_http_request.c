@@ -10,6 +10,28 @@
 #include <ngx_http.h>
 
 
+#define NGX_HTTP_HEADER_BUFFERS_SIZES   4
+#define NGX_HTTP_HEADER_BUFFERS_PERIOD  10000
+
+
+typedef struct {
+    size_t                     size;
+    u_char                    *free;
+    ngx_uint_t                 nfree;
+    ngx_uint_t                 nbusy;
+    ngx_uint_t                 peak;
+    ngx_uint_t                 max;
+    ngx_uint_t                 allocated;
+    ngx_uint_t                 reused;
+} ngx_http_header_buffers_t;
+
+
+typedef struct {
+    ngx_connection_t          *connection;
+    ngx_http_connection_t     *http_connection;
+} ngx_http_header_buffers_cleanup_t;
+
+
 static void ngx_http_wait_request_handler(ngx_event_t *ev);
 static ngx_http_request_t *ngx_http_alloc_request(ngx_connection_t *c);
 static void ngx_http_process_request_line(ngx_event_t *rev);
@@ -17,6 +39,17 @@ static void ngx_http_process_request_headers(ngx_event_t *rev);
 static ssize_t ngx_http_read_request_header(ngx_http_request_t *r);
 static ngx_int_t ngx_http_alloc_large_header_buffer(ngx_http_request_t *r,
     ngx_uint_t request_line);
+static ngx_http_header_buffers_t *ngx_http_header_buffers_lookup(size_t size);
+static u_char *ngx_http_alloc_header_buffer(size_t size, ngx_log_t *log);
+static void ngx_http_free_header_buffer(u_char *p, size_t size);
+static void ngx_http_free_connection_buffer(ngx_connection_t *c,
+    ngx_http_connection_t *hc);
+static void ngx_http_header_buffers_cleanup(void *data);
+static ngx_uint_t ngx_http_pipelined_request_ready(ngx_buf_t *b);
+static ngx_int_t ngx_http_send_pipelined_output(ngx_connection_t *c,
+    ngx_http_connection_t *hc);
+static void ngx_http_pipelined_output_handler(ngx_http_request_t *r);
+static void ngx_http_pipelined_close_handler(ngx_event_t *wev);
 
 static ngx_int_t ngx_http_process_header_line(ngx_http_request_t *r,
     ngx_table_elt_t *h, ngx_uint_t offset);
@@ -50,6 +83,7 @@ static void ngx_http_request_finalizer(ngx_http_request_t *r);
 static void ngx_http_set_keepalive(ngx_http_request_t *r);
 static void ngx_http_keepalive_handler(ngx_event_t *ev);
 static void ngx_http_set_lingering_close(ngx_http_request_t *r);
+static void ngx_http_lingering_flush_handler(ngx_event_t *wev);
 static void ngx_http_lingering_close_handler(ngx_event_t *ev);
 static ngx_int_t ngx_http_post_action(ngx_http_request_t *r);
 static void ngx_http_close_request(ngx_http_request_t *r, ngx_int_t error);
@@ -65,6 +99,11 @@ static void ngx_http_ssl_handshake_handler(ngx_connection_t *c);
 #endif
 
 
+static ngx_http_header_buffers_t
+    ngx_http_header_buffers[NGX_HTTP_HEADER_BUFFERS_SIZES];
+static ngx_msec_t  ngx_http_header_buffers_time;
+
+
 static char *ngx_http_client_errors[] = {
 
     /* NGX_HTTP_PARSE_INVALID_METHOD */
@@ -211,6 +250,7 @@ ngx_http_init_connection(ngx_connection_t *c)
     struct sockaddr_in     *sin;
     ngx_http_port_t        *port;
     ngx_http_in_addr_t     *addr;
+    ngx_pool_cleanup_t     *cln;
     ngx_http_log_ctx_t     *ctx;
     ngx_http_connection_t  *hc;
 #if (NGX_HAVE_INET6)
@@ -218,6 +258,8 @@ ngx_http_init_connection(ngx_connection_t *c)
     ngx_http_in6_addr_t    *addr6;
 #endif
 
+    ngx_http_header_buffers_cleanup_t  *hbc;
+
     hc = ngx_pcalloc(c->pool, sizeof(ngx_http_connection_t));
     if (hc == NULL) {
         ngx_http_close_connection(c);
@@ -226,6 +268,24 @@ ngx_http_init_connection(ngx_connection_t *c)
 
     c->data = hc;
 
+    if (c->buffer) {
+        /* the buffer is allocated from the connection pool by AcceptEx() */
+        hc->pool_buffer = 1;
+    }
+
+    cln = ngx_pool_cleanup_add(c->pool,
+                               sizeof(ngx_http_header_buffers_cleanup_t));
+    if (cln == NULL) {
+        ngx_http_close_connection(c);
+        return;
+    }
+
+    cln->handler = ngx_http_header_buffers_cleanup;
+
+    hbc = cln->data;
+    hbc->connection = c;
+    hbc->http_connection = hc;
+
     /* find the server configuration for the address:port */
 
     port = c->listening->servers;
@@ -405,17 +465,20 @@ ngx_http_wait_request_handler(ngx_event_t *rev)
     b = c->buffer;
 
     if (b == NULL) {
-        b = ngx_create_temp_buf(c->pool, size);
+        b = ngx_calloc_buf(c->pool);
         if (b == NULL) {
             ngx_http_close_connection(c);
             return;
         }
 
+        b->temporary = 1;
+
         c->buffer = b;
+    }
 
-    } else if (b->start == NULL) {
+    if (b->start == NULL) {
 
-        b->start = ngx_palloc(c->pool, size);
+        b->start = ngx_http_alloc_header_buffer(size, c->log);
         if (b->start == NULL) {
             ngx_http_close_connection(c);
             return;
@@ -444,9 +507,8 @@ ngx_http_wait_request_handler(ngx_event_t *rev)
          * We are trying to not hold c->buffer's memory for an idle connection.
          */
 
-        if (ngx_pfree(c->pool, b->start) == NGX_OK) {
-            b->start = NULL;
-        }
+        ngx_http_free_connection_buffer(c, hc);
+        b->start = NULL;
 
         return;
     }
@@ -604,7 +666,7 @@ ngx_http_alloc_request(ngx_connection_t *c)
     }
 
 #if (NGX_HTTP_SSL)
-    if (c->ssl) {
+    if (c->ssl && !c->ssl->sendfile) {
         r->main_filter_need_in_memory = 1;
     }
 #endif
@@ -1527,6 +1589,14 @@ ngx_http_read_request_header(ngx_http_request_t *r)
     }
 
     if (n == NGX_AGAIN) {
+
+        /* the client may wait for the batched responses */
+
+        if (ngx_http_flush_pipelined_output(r) == NGX_ERROR) {
+            ngx_http_close_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return NGX_ERROR;
+        }
+
         if (!rev->timer_set) {
             cscf = ngx_http_get_module_srv_conf(r, ngx_http_core_module);
             ngx_add_timer(rev, cscf->client_header_timeout);
@@ -1607,14 +1677,26 @@ ngx_http_alloc_large_header_buffer(ngx_http_request_t *r,
 
     } else if (hc->nbusy < cscf->large_client_header_buffers.num) {
 
-        b = ngx_create_temp_buf(r->connection->pool,
-                                cscf->large_client_header_buffers.size);
+        b = ngx_calloc_buf(r->connection->pool);
         if (b == NULL) {
             return NGX_ERROR;
         }
 
+        b->start = ngx_http_alloc_header_buffer(
+                                       cscf->large_client_header_buffers.size,
+                                       r->connection->log);
+        if (b->start == NULL) {
+            return NGX_ERROR;
+        }
+
+        b->pos = b->start;
+        b->last = b->start;
+        b->end = b->last + cscf->large_client_header_buffers.size;
+        b->temporary = 1;
+
         cl = ngx_alloc_chain_link(r->connection->pool);
         if (cl == NULL) {
+            ngx_http_free_header_buffer(b->start, b->end - b->start);
             return NGX_ERROR;
         }
 
@@ -1708,6 +1790,592 @@ ngx_http_alloc_large_header_buffer(ngx_http_request_t *r,
 }
 
 
+/*
+ * Client header buffers are kept in per-worker free lists, one list for
+ * each buffer size, instead of being allocated from the connection pool.
+ * An idle keepalive connection returns its buffers to the list, and the
+ * list is trimmed to the peak number of buffers that were simultaneously
+ * in use during the previous period.
+ */
+
+static ngx_http_header_buffers_t *
+ngx_http_header_buffers_lookup(size_t size)
+{
+    ngx_uint_t                  i;
+    ngx_http_header_buffers_t  *hb;
+
+    if (size < sizeof(void *)) {
+        return NULL;
+    }
+
+    for (i = 0; i < NGX_HTTP_HEADER_BUFFERS_SIZES; i++) {
+        hb = &ngx_http_header_buffers[i];
+
+        if (hb->size == size) {
+            return hb;
+        }
+
+        if (hb->size == 0) {
+            hb->size = size;
+            return hb;
+        }
+    }
+
+    /* too many different sizes, the buffer is not cached */
+
+    return NULL;
+}
+
+
+static u_char *
+ngx_http_alloc_header_buffer(size_t size, ngx_log_t *log)
+{
+    u_char                     *p;
+    ngx_http_header_buffers_t  *hb;
+
+    hb = ngx_http_header_buffers_lookup(size);
+
+    if (hb == NULL) {
+        return ngx_alloc(size, log);
+    }
+
+    if (hb->free) {
+        p = hb->free;
+        hb->free = *(u_char **) p;
+        hb->nfree--;
+        hb->reused++;
+
+    } else {
+        p = ngx_alloc(size, log);
+        if (p == NULL) {
+            return NULL;
+        }
+
+        hb->allocated++;
+    }
+
+    if (++hb->nbusy > hb->peak) {
+        hb->peak = hb->nbusy;
+    }
+
+    return p;
+}
+
+
+static void
+ngx_http_free_header_buffer(u_char *p, size_t size)
+{
+    u_char                     *next;
+    ngx_uint_t                  i;
+    ngx_http_header_buffers_t  *hb;
+
+    if (ngx_current_msec - ngx_http_header_buffers_time
+        >= NGX_HTTP_HEADER_BUFFERS_PERIOD)
+    {
+        ngx_http_header_buffers_time = ngx_current_msec;
+
+        for (i = 0; i < NGX_HTTP_HEADER_BUFFERS_SIZES; i++) {
+            hb = &ngx_http_header_buffers[i];
+
+            if (hb->size == 0) {
+                break;
+            }
+
+            ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                           "http header buffers %uz: busy:%ui free:%ui "
+                           "peak:%ui allocated:%ui reused:%ui",
+                           hb->size, hb->nbusy, hb->nfree, hb->peak,
+                           hb->allocated, hb->reused);
+
+            hb->max = hb->peak;
+            hb->peak = hb->nbusy;
+
+            while (hb->nfree > hb->max) {
+                next = hb->free;
+                hb->free = *(u_char **) next;
+                hb->nfree--;
+
+                ngx_free(next);
+            }
+        }
+    }
+
+    hb = ngx_http_header_buffers_lookup(size);
+
+    if (hb == NULL) {
+        ngx_free(p);
+        return;
+    }
+
+    hb->nbusy--;
+
+    if (hb->nfree >= ngx_max(hb->max, hb->peak)) {
+        ngx_free(p);
+        return;
+    }
+
+    *(u_char **) p = hb->free;
+    hb->free = p;
+    hb->nfree++;
+}
+
+
+static void
+ngx_http_free_connection_buffer(ngx_connection_t *c, ngx_http_connection_t *hc)
+{
+    ngx_buf_t  *b;
+
+    b = c->buffer;
+
+    if (hc->pool_buffer) {
+        hc->pool_buffer = 0;
+        ngx_pfree(c->pool, b->start);
+        return;
+    }
+
+    ngx_http_free_header_buffer(b->start, b->end - b->start);
+}
+
+
+static void
+ngx_http_header_buffers_cleanup(void *data)
+{
+    ngx_http_header_buffers_cleanup_t  *hbc = data;
+
+    ngx_buf_t              *b;
+    ngx_chain_t            *cl;
+    ngx_http_connection_t  *hc;
+
+    b = hbc->connection->buffer;
+
+    /*
+     * c->buffer->start is NULL after ngx_http_wait_request_handler(),
+     * and c->buffer->pos is NULL after ngx_http_set_keepalive()
+     * released the memory
+     */
+
+    hc = hbc->http_connection;
+
+    if (b && b->start && b->pos) {
+        ngx_http_free_connection_buffer(hbc->connection, hc);
+        b->start = NULL;
+    }
+
+    for (cl = hc->busy; cl; cl = cl->next) {
+        ngx_http_free_header_buffer(cl->buf->start,
+                                    cl->buf->end - cl->buf->start);
+    }
+
+    for (cl = hc->free; cl; cl = cl->next) {
+        ngx_http_free_header_buffer(cl->buf->start,
+                                    cl->buf->end - cl->buf->start);
+    }
+
+    hc->busy = NULL;
+    hc->nbusy = 0;
+    hc->free = NULL;
+
+    b = hc->pipeline;
+
+    if (b && b->start) {
+        ngx_http_free_header_buffer(b->start, b->end - b->start);
+        b->start = NULL;
+    }
+}
+
+
+void
+ngx_http_header_buffers_exit(ngx_cycle_t *cycle)
+{
+    u_char                     *next;
+    ngx_uint_t                  i;
+    ngx_http_header_buffers_t  *hb;
+
+    for (i = 0; i < NGX_HTTP_HEADER_BUFFERS_SIZES; i++) {
+        hb = &ngx_http_header_buffers[i];
+
+        if (hb->size == 0) {
+            break;
+        }
+
+        if (hb->allocated + hb->reused == 0) {
+            continue;
+        }
+
+        ngx_log_debug5(NGX_LOG_DEBUG_HTTP, cycle->log, 0,
+                       "http header buffers %uz: allocated:%ui "
+                       "reused:%ui (%ui%%) free:%ui",
+                       hb->size, hb->allocated, hb->reused,
+                       hb->reused * 100 / (hb->allocated + hb->reused),
+                       hb->nfree);
+
+        while (hb->free) {
+            next = hb->free;
+            hb->free = *(u_char **) next;
+
+            ngx_free(next);
+        }
+
+        ngx_memzero(hb, sizeof(ngx_http_header_buffers_t));
+    }
+}
+
+
+/*
+ * A complete response to a request followed by a pipelined one is copied
+ * to the connection's pipeline buffer instead of being sent, and the
+ * buffer is sent together with the response to the next request.
+ */
+
+ngx_int_t
+ngx_http_batch_pipelined_output(ngx_http_request_t *r, off_t size)
+{
+    ssize_t                    n;
+    ngx_buf_t                 *b, *buf;
+    ngx_chain_t               *cl, *ln;
+    ngx_connection_t          *c;
+    ngx_http_connection_t     *hc;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    c = r->connection;
+    hc = r->http_connection;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    if (clcf->pipeline_batch == 0
+        || r != r->main
+#if (NGX_HTTP_V2)
+        || r->stream
+#endif
+        || !r->keepalive
+        || r->discard_body
+        || r->headers_in.content_length_n > 0
+        || r->headers_in.chunked
+        || c->buffered
+        || ngx_exiting
+        || ngx_terminate
+        || !ngx_http_pipelined_request_ready(r->header_in))
+    {
+        return NGX_DECLINED;
+    }
+
+    b = hc->pipeline;
+
+    if (b && b->pos == b->last) {
+        b->pos = b->start;
+        b->last = b->start;
+        hc->npipelined = 0;
+    }
+
+    if (hc->npipelined >= clcf->pipeline_batch) {
+        return NGX_DECLINED;
+    }
+
+    for (cl = r->out; cl; cl = cl->next) {
+        buf = cl->buf;
+
+        if (buf == b) {
+            size -= ngx_buf_size(buf);
+            continue;
+        }
+
+        if (!ngx_buf_in_memory(buf) && buf->in_file && buf->file->directio) {
+            return NGX_DECLINED;
+        }
+    }
+
+    if (b == NULL) {
+        b = ngx_calloc_buf(c->pool);
+        if (b == NULL) {
+            return NGX_ERROR;
+        }
+
+        b->temporary = 1;
+
+        hc->pipeline = b;
+    }
+
+    if (b->start == NULL) {
+
+        if (size > (off_t) clcf->pipeline_buffer_size) {
+            return NGX_DECLINED;
+        }
+
+        b->start = ngx_http_alloc_header_buffer(clcf->pipeline_buffer_size,
+                                                c->log);
+        if (b->start == NULL) {
+            return NGX_ERROR;
+        }
+
+        b->pos = b->start;
+        b->last = b->start;
+        b->end = b->start + clcf->pipeline_buffer_size;
+
+        hc->npipelined = 0;
+    }
+
+    if (size > b->end - b->last) {
+        return NGX_DECLINED;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http pipeline batch: %O, %ui", size, hc->npipelined + 1);
+
+    for (cl = r->out; cl; /* void */) {
+        ln = cl;
+        cl = cl->next;
+
+        buf = ln->buf;
+
+        if (buf == b) {
+            ngx_free_chain(r->pool, ln);
+            continue;
+        }
+
+        if (ngx_buf_in_memory(buf)) {
+            b->last = ngx_cpymem(b->last, buf->pos, buf->last - buf->pos);
+            buf->pos = buf->last;
+
+        } else if (buf->in_file) {
+            n = ngx_read_file(buf->file, b->last,
+                              (size_t) (buf->file_last - buf->file_pos),
+                              buf->file_pos);
+
+            if (n != buf->file_last - buf->file_pos) {
+                if (n != NGX_ERROR) {
+                    ngx_log_error(NGX_LOG_CRIT, c->log, 0,
+                                  ngx_read_file_n " read only "
+                                  "%z of %O from \"%s\"",
+                                  n, buf->file_last - buf->file_pos,
+                                  buf->file->name.data);
+                }
+
+                c->error = 1;
+                return NGX_ERROR;
+            }
+
+            b->last += n;
+        }
+
+        if (buf->in_file) {
+            buf->file_pos = buf->file_last;
+        }
+
+        ngx_free_chain(r->pool, ln);
+    }
+
+    r->out = NULL;
+
+    c->sent += size;
+    hc->npipelined++;
+
+    return NGX_OK;
+}
+
+
+/*
+ * The response is batched only if the header of the next request
+ * has been received completely, so that the next request is processed
+ * without waiting for the client.
+ */
+
+static ngx_uint_t
+ngx_http_pipelined_request_ready(ngx_buf_t *b)
+{
+    u_char  *p;
+
+    p = b->pos;
+
+    /* empty lines before a request line are ignored by the parser */
+
+    while (p < b->last && (*p == CR || *p == LF)) {
+        p++;
+    }
+
+    for ( /* void */ ; p < b->last; p++) {
+
+        if (*p != LF) {
+            continue;
+        }
+
+        if (p + 1 < b->last && p[1] == LF) {
+            return 1;
+        }
+
+        if (p + 2 < b->last && p[1] == CR && p[2] == LF) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+ * The batched responses are flushed while the next request waits for
+ * the client.  If they cannot be sent at once, the write event is armed
+ * unless the request already has its own write handler, in which case
+ * the rest is sent along with the response.
+ */
+
+ngx_int_t
+ngx_http_flush_pipelined_output(ngx_http_request_t *r)
+{
+    ngx_int_t                  rc;
+    ngx_connection_t          *c;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    c = r->connection;
+
+    rc = ngx_http_send_pipelined_output(c, r->http_connection);
+
+    if (rc != NGX_AGAIN) {
+        ngx_http_stop_pipelined_output(r);
+        return rc;
+    }
+
+    if (r->write_event_handler != NULL
+        && r->write_event_handler != ngx_http_request_empty_handler
+        && r->write_event_handler != ngx_http_pipelined_output_handler)
+    {
+        return NGX_AGAIN;
+    }
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    r->write_event_handler = ngx_http_pipelined_output_handler;
+    c->write->handler = ngx_http_request_handler;
+
+    ngx_add_timer(c->write, clcf->send_timeout);
+
+    if (ngx_handle_write_event(c->write, clcf->send_lowat) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_AGAIN;
+}
+
+
+void
+ngx_http_stop_pipelined_output(ngx_http_request_t *r)
+{
+    ngx_event_t  *wev;
+
+    if (r->write_event_handler != ngx_http_pipelined_output_handler) {
+        return;
+    }
+
+    r->write_event_handler = ngx_http_request_empty_handler;
+
+    wev = r->connection->write;
+
+    if (wev->timer_set) {
+        ngx_del_timer(wev);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_send_pipelined_output(ngx_connection_t *c, ngx_http_connection_t *hc)
+{
+    off_t         sent;
+    ngx_buf_t    *b;
+    ngx_chain_t   out;
+
+    b = hc->pipeline;
+
+    if (b == NULL || b->pos == b->last) {
+        return NGX_OK;
+    }
+
+    if (c->error) {
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http pipeline flush: %z", b->last - b->pos);
+
+    out.buf = b;
+    out.next = NULL;
+
+    /* the batched responses are already accounted in c->sent */
+
+    sent = c->sent;
+
+    if (c->send_chain(c, &out, 0) == NGX_CHAIN_ERROR) {
+        c->error = 1;
+        c->sent = sent;
+        return NGX_ERROR;
+    }
+
+    c->sent = sent;
+
+    return (b->pos == b->last) ? NGX_OK : NGX_AGAIN;
+}
+
+
+static void
+ngx_http_pipelined_output_handler(ngx_http_request_t *r)
+{
+    ngx_event_t       *wev;
+    ngx_connection_t  *c;
+
+    c = r->connection;
+    wev = c->write;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http pipeline output handler");
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT,
+                      "client timed out");
+        c->timedout = 1;
+
+        ngx_http_finalize_request(r, NGX_HTTP_REQUEST_TIME_OUT);
+        return;
+    }
+
+    if (ngx_http_flush_pipelined_output(r) == NGX_ERROR) {
+        ngx_http_finalize_request(r, NGX_ERROR);
+    }
+}
+
+
+static void
+ngx_http_pipelined_close_handler(ngx_event_t *wev)
+{
+    ngx_connection_t          *c;
+    ngx_http_connection_t     *hc;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    c = wev->data;
+    hc = c->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http pipeline close handler");
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT,
+                      "client timed out");
+        ngx_http_close_connection(c);
+        return;
+    }
+
+    if (ngx_http_send_pipelined_output(c, hc) != NGX_AGAIN) {
+        ngx_http_close_connection(c);
+        return;
+    }
+
+    clcf = ngx_http_get_module_loc_conf(hc->conf_ctx, ngx_http_core_module);
+
+    ngx_add_timer(wev, clcf->send_timeout);
+
+    if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+        ngx_http_close_connection(c);
+    }
+}
+
+
 static ngx_int_t
 ngx_http_process_header_line(ngx_http_request_t *r, ngx_table_elt_t *h,
     ngx_uint_t offset)
@@ -2069,6 +2737,10 @@ ngx_http_process_request(ngx_http_request_t *r)
     c->write->handler = ngx_http_request_handler;
     r->read_event_handler = ngx_http_block_reading;
 
+    /* the rest of the batched responses is sent with the response */
+
+    ngx_http_stop_pipelined_output(r);
+
     ngx_http_handler(r);
 }
 
@@ -3018,6 +3690,17 @@ ngx_http_set_keepalive(ngx_http_request_t *r)
         return;
     }
 
+    if (r->header_in->pos == r->header_in->last
+        && ngx_http_send_pipelined_output(c, r->http_connection) == NGX_AGAIN)
+    {
+        /* the batched responses are sent before closing the connection */
+
+        ngx_http_close_request(r, 0);
+        return;
+    }
+
+    ngx_http_stop_pipelined_output(r);
+
     c->log->action = "closing request";
 
     hc = r->http_connection;
@@ -3113,26 +3796,20 @@ ngx_http_set_keepalive(ngx_http_request_t *r)
 
     /*
      * To keep a memory footprint as small as possible for an idle keepalive
-     * connection we try to free c->buffer's memory if it was allocated outside
-     * the c->pool.  The large header buffers are always allocated outside the
-     * c->pool and are freed too.
+     * connection we return c->buffer's memory and the large header buffers
+     * to the worker's header buffers lists.
      */
 
     b = c->buffer;
 
-    if (ngx_pfree(c->pool, b->start) == NGX_OK) {
+    ngx_http_free_connection_buffer(c, hc);
 
-        /*
-         * the special note for ngx_http_keepalive_handler() that
-         * c->buffer's memory was freed
-         */
-
-        b->pos = NULL;
+    /*
+     * the special note for ngx_http_keepalive_handler() that
+     * c->buffer's memory was freed
+     */
 
-    } else {
-        b->pos = b->start;
-        b->last = b->start;
-    }
+    b->pos = NULL;
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0, "hc free: %p",
                    hc->free);
@@ -3141,7 +3818,8 @@ ngx_http_set_keepalive(ngx_http_request_t *r)
         for (cl = hc->free; cl; /* void */) {
             ln = cl;
             cl = cl->next;
-            ngx_pfree(c->pool, ln->buf->start);
+            ngx_http_free_header_buffer(ln->buf->start,
+                                        ln->buf->end - ln->buf->start);
             ngx_free_chain(c->pool, ln);
         }
 
@@ -3155,7 +3833,8 @@ ngx_http_set_keepalive(ngx_http_request_t *r)
         for (cl = hc->busy; cl; /* void */) {
             ln = cl;
             cl = cl->next;
-            ngx_pfree(c->pool, ln->buf->start);
+            ngx_http_free_header_buffer(ln->buf->start,
+                                        ln->buf->end - ln->buf->start);
             ngx_free_chain(c->pool, ln);
         }
 
@@ -3163,6 +3842,17 @@ ngx_http_set_keepalive(ngx_http_request_t *r)
         hc->nbusy = 0;
     }
 
+    b = hc->pipeline;
+
+    if (b && b->start) {
+        ngx_http_free_header_buffer(b->start, b->end - b->start);
+
+        b->start = NULL;
+        b->pos = NULL;
+        b->last = NULL;
+        b->end = NULL;
+    }
+
 #if (NGX_HTTP_SSL)
     if (c->ssl) {
         ngx_ssl_free_buffer(c);
@@ -3263,7 +3953,7 @@ ngx_http_keepalive_handler(ngx_event_t *rev)
          * to keep the buffer size.
          */
 
-        b->pos = ngx_palloc(c->pool, size);
+        b->pos = ngx_http_alloc_header_buffer(size, c->log);
         if (b->pos == NULL) {
             ngx_http_close_connection(c);
             return;
@@ -3296,14 +3986,13 @@ ngx_http_keepalive_handler(ngx_event_t *rev)
          * c->buffer's memory for a keepalive connection.
          */
 
-        if (ngx_pfree(c->pool, b->start) == NGX_OK) {
+        ngx_http_free_connection_buffer(c, c->data);
 
-            /*
-             * the special note that c->buffer's memory was freed
-             */
+        /*
+         * the special note that c->buffer's memory was freed
+         */
 
-            b->pos = NULL;
-        }
+        b->pos = NULL;
 
         return;
     }
@@ -3378,6 +4067,22 @@ ngx_http_set_lingering_close(ngx_http_request_t *r)
         }
     }
 
+    ngx_http_stop_pipelined_output(r);
+
+    if (ngx_http_send_pipelined_output(c, r->http_connection) == NGX_AGAIN) {
+
+        /* the batched responses are sent before the write shutdown */
+
+        wev->handler = ngx_http_lingering_flush_handler;
+        ngx_add_timer(wev, clcf->send_timeout);
+
+        if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+            ngx_http_close_request(r, 0);
+        }
+
+        return;
+    }
+
     if (ngx_shutdown_socket(c->fd, NGX_WRITE_SHUTDOWN) == -1) {
         ngx_connection_error(c, ngx_socket_errno,
                              ngx_shutdown_socket_n " failed");
@@ -3391,6 +4096,55 @@ ngx_http_set_lingering_close(ngx_http_request_t *r)
 }
 
 
+static void
+ngx_http_lingering_flush_handler(ngx_event_t *wev)
+{
+    ngx_int_t                  rc;
+    ngx_connection_t          *c;
+    ngx_http_request_t        *r;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    c = wev->data;
+    r = c->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http lingering flush handler");
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT,
+                      "client timed out");
+        c->timedout = 1;
+
+        ngx_http_close_request(r, 0);
+        return;
+    }
+
+    rc = ngx_http_send_pipelined_output(c, r->http_connection);
+
+    if (rc == NGX_ERROR) {
+        ngx_http_close_request(r, 0);
+        return;
+    }
+
+    if (rc == NGX_OK) {
+        if (wev->timer_set) {
+            ngx_del_timer(wev);
+        }
+
+        ngx_http_set_lingering_close(r);
+        return;
+    }
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    ngx_add_timer(wev, clcf->send_timeout);
+
+    if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+        ngx_http_close_request(r, 0);
+    }
+}
+
+
 static void
 ngx_http_lingering_close_handler(ngx_event_t *rev)
 {
@@ -3543,7 +4297,10 @@ ngx_http_post_action(ngx_http_request_t *r)
 static void
 ngx_http_close_request(ngx_http_request_t *r, ngx_int_t rc)
 {
-    ngx_connection_t  *c;
+    ngx_event_t               *rev, *wev;
+    ngx_connection_t          *c;
+    ngx_http_connection_t     *hc;
+    ngx_http_core_loc_conf_t  *clcf;
 
     r = r->main;
     c = r->connection;
@@ -3568,6 +4325,46 @@ ngx_http_close_request(ngx_http_request_t *r, ngx_int_t rc)
     }
 #endif
 
+    hc = r->http_connection;
+
+    if (!c->timedout
+        && ngx_http_send_pipelined_output(c, hc) == NGX_AGAIN)
+    {
+        /* the batched responses are sent before closing the connection */
+
+        ngx_http_free_request(r, rc);
+
+        c->data = hc;
+
+        rev = c->read;
+        rev->handler = ngx_http_empty_handler;
+
+        if (rev->timer_set) {
+            ngx_del_timer(rev);
+        }
+
+        if (rev->active && (ngx_event_flags & NGX_USE_LEVEL_EVENT)) {
+            if (ngx_del_event(rev, NGX_READ_EVENT, 0) != NGX_OK) {
+                ngx_http_close_connection(c);
+                return;
+            }
+        }
+
+        clcf = ngx_http_get_module_loc_conf(hc->conf_ctx,
+                                            ngx_http_core_module);
+
+        wev = c->write;
+        wev->handler = ngx_http_pipelined_close_handler;
+
+        ngx_add_timer(wev, clcf->send_timeout);
+
+        if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+            ngx_http_close_connection(c);
+        }
+
+        return;
+    }
+
     ngx_http_free_request(r, rc);
     ngx_http_close_connection(c);
 }
@@ -322,8 +322,12 @@ typedef struct {
 
     ngx_chain_t                      *free;
 
+    ngx_buf_t                        *pipeline;
+    ngx_uint_t                        npipelined;
+
     unsigned                          ssl:1;
     unsigned                          proxy_protocol:1;
+    unsigned                          pool_buffer:1;
 } ngx_http_connection_t;
 
 
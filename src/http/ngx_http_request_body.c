@@ -73,6 +73,7 @@ ngx_http_read_client_request_body(ngx_http_request_t *r,
     r->request_body = rb;
 
     if (r->headers_in.content_length_n < 0 && !r->headers_in.chunked) {
+        ngx_http_stop_pipelined_output(r);
         r->request_body_no_buffering = 0;
         post_handler(r);
         return NGX_OK;
@@ -143,6 +144,7 @@ ngx_http_read_client_request_body(ngx_http_request_t *r,
 
     if (rb->rest == 0) {
         /* the whole request body was pre-read */
+        ngx_http_stop_pipelined_output(r);
         r->request_body_no_buffering = 0;
         post_handler(r);
         return NGX_OK;
@@ -197,6 +199,8 @@ done:
             r->reading_body = 1;
         }
 
+        ngx_http_stop_pipelined_output(r);
+
         r->read_event_handler = ngx_http_block_reading;
         post_handler(r);
     }
@@ -401,6 +405,10 @@ ngx_http_do_read_client_request_body(ngx_http_request_t *r)
                 }
             }
 
+            if (ngx_http_flush_pipelined_output(r) == NGX_ERROR) {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+
             clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
             ngx_add_timer(c->read, clcf->client_body_timeout);
 
@@ -416,6 +424,8 @@ ngx_http_do_read_client_request_body(ngx_http_request_t *r)
         ngx_del_timer(c->read);
     }
 
+    ngx_http_stop_pipelined_output(r);
+
     if (!r->request_body_no_buffering) {
         r->read_event_handler = ngx_http_block_reading;
         rb->post_handler(r);
@@ -826,6 +836,13 @@ ngx_http_test_expect(ngx_http_request_t *r)
         return NGX_OK;
     }
 
+    if (ngx_http_flush_pipelined_output(r) != NGX_OK) {
+
+        /* the responses to the previous requests are not sent yet */
+
+        return NGX_OK;
+    }
+
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "send 100 Continue");
 
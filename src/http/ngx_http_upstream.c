@@ -15,18 +15,26 @@ static ngx_int_t ngx_http_upstream_cache(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
 static ngx_int_t ngx_http_upstream_cache_get(ngx_http_request_t *r,
     ngx_http_upstream_t *u, ngx_http_file_cache_t **cache);
+static ngx_int_t ngx_http_upstream_cache_purge(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
 static ngx_int_t ngx_http_upstream_cache_send(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
 static ngx_int_t ngx_http_upstream_cache_background_update(
     ngx_http_request_t *r, ngx_http_upstream_t *u);
 static ngx_int_t ngx_http_upstream_cache_check_range(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
+static void ngx_http_upstream_cache_range(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static ngx_int_t ngx_http_upstream_cache_sparse(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
 static ngx_int_t ngx_http_upstream_cache_status(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
 static ngx_int_t ngx_http_upstream_cache_last_modified(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
 static ngx_int_t ngx_http_upstream_cache_etag(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_upstream_cache_tier(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
 #endif
 
 static void ngx_http_upstream_init_request(ngx_http_request_t *r);
@@ -77,6 +85,10 @@ static void
 static void
     ngx_http_upstream_process_non_buffered_request(ngx_http_request_t *r,
     ngx_uint_t do_write);
+#if (NGX_HAVE_SPLICE)
+static ngx_int_t ngx_http_upstream_init_splice(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+#endif
 #if (NGX_THREADS)
 static ngx_int_t ngx_http_upstream_thread_handler(ngx_thread_task_t *task,
     ngx_file_t *file);
@@ -95,6 +107,21 @@ static void ngx_http_upstream_dummy_handler(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
 static void ngx_http_upstream_next(ngx_http_request_t *r,
     ngx_http_upstream_t *u, ngx_uint_t ft_type);
+static void ngx_http_upstream_hedge(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_hedge_handler(ngx_event_t *ev);
+static void ngx_http_upstream_hedge_peer_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_upstream_hedge_resume(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static ngx_int_t ngx_http_upstream_hedge_test_peer(ngx_connection_t *c);
+static void ngx_http_upstream_hedge_cancel(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_close_peer_connection(ngx_connection_t *c);
+static ngx_msec_t ngx_http_upstream_hedge_delay(
+    ngx_http_upstream_hedge_conf_t *hc);
+static void ngx_http_upstream_hedge_sample(ngx_http_upstream_hedge_conf_t *hc,
+    ngx_msec_t ms);
+static ngx_uint_t ngx_http_upstream_hedge_bucket(ngx_msec_t ms);
 static void ngx_http_upstream_cleanup(void *data);
 static void ngx_http_upstream_finalize_request(ngx_http_request_t *r,
     ngx_http_upstream_t *u, ngx_int_t rc);
@@ -424,6 +451,10 @@ static ngx_http_variable_t  ngx_http_upstream_vars[] = {
       ngx_http_upstream_cache_etag, 0,
       NGX_HTTP_VAR_NOCACHEABLE|NGX_HTTP_VAR_NOHASH, 0 },
 
+    { ngx_string("upstream_cache_tier"), NULL,
+      ngx_http_upstream_cache_tier, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
 #endif
 
     { ngx_string("upstream_http_"), NULL, ngx_http_upstream_header_variable,
@@ -817,6 +848,18 @@ ngx_http_upstream_cache(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
     if (c == NULL) {
 
+        switch (ngx_http_test_predicates(r, u->conf->cache_purge)) {
+
+        case NGX_ERROR:
+            return NGX_ERROR;
+
+        case NGX_DECLINED:
+            return ngx_http_upstream_cache_purge(r, u);
+
+        default: /* NGX_OK */
+            break;
+        }
+
         if (!(r->method & u->conf->cache_methods)) {
             return NGX_DECLINED;
         }
@@ -879,6 +922,17 @@ ngx_http_upstream_cache(ngx_http_request_t *r, ngx_http_upstream_t *u)
         c->lock_timeout = u->conf->cache_lock_timeout;
         c->lock_age = u->conf->cache_lock_age;
 
+        c->ahead = (u->conf->cache_background_update && !r->background);
+
+        if (cache->sparse && u->cache_ranges) {
+            ngx_http_upstream_cache_range(r, c);
+
+            if (c->range) {
+                /* a lock holder would fetch the whole response */
+                c->lock = 0;
+            }
+        }
+
         u->cache_status = NGX_HTTP_CACHE_MISS;
     }
 
@@ -892,12 +946,21 @@ ngx_http_upstream_cache(ngx_http_request_t *r, ngx_http_upstream_t *u)
     case NGX_HTTP_CACHE_STALE:
 
         if (((u->conf->cache_use_stale & NGX_HTTP_UPSTREAM_FT_UPDATING)
-             || c->stale_updating) && !r->background
+             || c->stale_updating || c->refresh) && !r->background
             && u->conf->cache_background_update)
         {
-            if (ngx_http_upstream_cache_background_update(r, u) == NGX_OK) {
+            if (ngx_http_file_cache_schedule(r) != NGX_OK) {
+
+                /* too many updates, the cached response is sent as is */
+
+                u->cache_status = c->refresh ? NGX_HTTP_CACHE_HIT : rc;
+                rc = NGX_OK;
+
+            } else if (ngx_http_upstream_cache_background_update(r, u)
+                       == NGX_OK)
+            {
                 r->cache->background = 1;
-                u->cache_status = rc;
+                u->cache_status = c->refresh ? NGX_HTTP_CACHE_HIT : rc;
                 rc = NGX_OK;
 
             } else {
@@ -952,6 +1015,24 @@ ngx_http_upstream_cache(ngx_http_request_t *r, ngx_http_upstream_t *u)
             u->buffer.last = u->buffer.pos;
         }
 
+        if (c->range && !c->ranged && c->range_start != -1) {
+
+            /* a new sparse entry, the range is rounded to whole blocks */
+
+            cache = c->file_cache;
+
+            c->ranged = 1;
+            c->fill_start = c->range_start / cache->sparse * cache->sparse;
+
+            if (c->range_end == -1) {
+                c->fill_end = -1;
+
+            } else {
+                c->fill_end = (c->range_end + cache->sparse - 1)
+                              / cache->sparse * cache->sparse;
+            }
+        }
+
         break;
 
     case NGX_HTTP_CACHE_SCARCE:
@@ -977,7 +1058,9 @@ ngx_http_upstream_cache(ngx_http_request_t *r, ngx_http_upstream_t *u)
         return rc;
     }
 
-    if (ngx_http_upstream_cache_check_range(r, u) == NGX_DECLINED) {
+    if (!c->ranged
+        && ngx_http_upstream_cache_check_range(r, u) == NGX_DECLINED)
+    {
         u->cacheable = 0;
     }
 
@@ -1030,6 +1113,55 @@ ngx_http_upstream_cache_get(ngx_http_request_t *r, ngx_http_upstream_t *u,
 }
 
 
+static ngx_int_t
+ngx_http_upstream_cache_purge(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_int_t               rc;
+    ngx_str_t               tags;
+    ngx_http_file_cache_t  *cache;
+
+    rc = ngx_http_upstream_cache_get(r, u, &cache);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    if (ngx_http_file_cache_new(r) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    r->cache->file_cache = cache;
+
+    ngx_str_null(&tags);
+
+    if (u->conf->cache_purge_tags
+        && ngx_http_complex_value(r, u->conf->cache_purge_tags, &tags)
+           != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (tags.len == 0) {
+
+        /* without tags, the entry of the request's key is purged */
+
+        if (u->create_key(r) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        ngx_http_file_cache_create_key(r);
+    }
+
+    rc = ngx_http_file_cache_purge(r, &tags);
+
+    if (rc == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    return (rc == NGX_OK) ? NGX_HTTP_NO_CONTENT : NGX_HTTP_NOT_FOUND;
+}
+
+
 static ngx_int_t
 ngx_http_upstream_cache_send(ngx_http_request_t *r, ngx_http_upstream_t *u)
 {
@@ -1170,6 +1302,243 @@ ngx_http_upstream_cache_check_range(ngx_http_request_t *r,
     return NGX_OK;
 }
 
+
+static void
+ngx_http_upstream_cache_range(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    off_t             start, end;
+    u_char           *p, *last, *digits;
+    ngx_table_elt_t  *h;
+
+    /*
+     * only a single byte range can be filled in a sparse cache entry,
+     * other requests for an entry which is not complete get all of it
+     */
+
+    h = r->headers_in.range;
+
+    if (h == NULL
+        || r->headers_in.if_range
+        || r->method != NGX_HTTP_GET
+        || h->value.len < 7
+        || ngx_strncasecmp(h->value.data, (u_char *) "bytes=", 6) != 0)
+    {
+        return;
+    }
+
+    p = h->value.data + 6;
+    last = h->value.data + h->value.len;
+
+    while (p < last && *p == ' ') { p++; }
+
+    start = -1;
+    digits = p;
+
+    while (p < last && *p >= '0' && *p <= '9') { p++; }
+
+    if (p != digits) {
+        start = ngx_atoof(digits, p - digits);
+
+        if (start == NGX_ERROR) {
+            return;
+        }
+    }
+
+    while (p < last && *p == ' ') { p++; }
+
+    if (p == last || *p++ != '-') {
+        return;
+    }
+
+    while (p < last && *p == ' ') { p++; }
+
+    end = -1;
+    digits = p;
+
+    while (p < last && *p >= '0' && *p <= '9') { p++; }
+
+    if (p != digits) {
+        end = ngx_atoof(digits, p - digits);
+
+        if (end == NGX_ERROR || end == NGX_MAX_OFF_T_VALUE) {
+            return;
+        }
+    }
+
+    while (p < last && *p == ' ') { p++; }
+
+    if (p != last) {
+        return;
+    }
+
+    if (start == -1) {
+
+        /* the last bytes, the length is not known yet */
+
+        if (end <= 0) {
+            return;
+        }
+
+    } else if (end != -1) {
+
+        if (end < start) {
+            return;
+        }
+
+        end++;
+    }
+
+    c->range = 1;
+    c->range_start = start;
+    c->range_end = end;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_cache_sparse(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    off_t              start, end, length;
+    u_char            *p, *last;
+    ngx_http_cache_t  *c;
+
+    c = r->cache;
+
+    if (r->cached) {
+
+        /* the stored response of a sparse entry is for its first range */
+
+        if (u->headers_in.status_n != NGX_HTTP_PARTIAL_CONTENT
+            || r->headers_out.content_range == NULL)
+        {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                          "cache file \"%s\" contains unexpected header",
+                          c->file.name.data);
+            return NGX_ERROR;
+        }
+
+        r->headers_out.status = NGX_HTTP_OK;
+        r->headers_out.status_line.len = 0;
+        r->headers_out.content_length_n = c->sparse_length;
+        r->headers_out.content_range->hash = 0;
+        r->headers_out.content_range = NULL;
+
+        r->allow_ranges = 1;
+
+        return NGX_OK;
+    }
+
+    if (u->headers_in.status_n != NGX_HTTP_PARTIAL_CONTENT) {
+
+        /* the whole response, e.g., if the entry has changed */
+
+        return NGX_OK;
+    }
+
+    if (r->headers_out.content_range == NULL) {
+        goto invalid;
+    }
+
+    p = r->headers_out.content_range->value.data;
+    last = p + r->headers_out.content_range->value.len;
+
+    if (last - p < 6 || ngx_strncmp(p, "bytes ", 6) != 0) {
+        goto invalid;
+    }
+
+    p += 6;
+
+    start = 0;
+    end = 0;
+    length = 0;
+
+    for ( /* void */ ; p < last && *p >= '0' && *p <= '9'; p++) {
+        if (start >= NGX_MAX_OFF_T_VALUE / 10) {
+            goto invalid;
+        }
+
+        start = start * 10 + (*p - '0');
+    }
+
+    if (p == last || *p++ != '-') {
+        goto invalid;
+    }
+
+    for ( /* void */ ; p < last && *p >= '0' && *p <= '9'; p++) {
+        if (end >= NGX_MAX_OFF_T_VALUE / 10) {
+            goto invalid;
+        }
+
+        end = end * 10 + (*p - '0');
+    }
+
+    if (p == last || *p++ != '/') {
+        goto invalid;
+    }
+
+    for ( /* void */ ; p < last && *p >= '0' && *p <= '9'; p++) {
+        if (length >= NGX_MAX_OFF_T_VALUE / 10) {
+            goto invalid;
+        }
+
+        length = length * 10 + (*p - '0');
+    }
+
+    if (p != last || end < start || end >= length) {
+        goto invalid;
+    }
+
+    end++;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream cache fill: %O-%O/%O", start, end, length);
+
+    if (start != c->fill_start
+        || end != ((c->fill_end == -1) ? length
+                                       : ngx_min(c->fill_end, length))
+        || (c->sparse && length != c->sparse_length))
+    {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "upstream sent unexpected range \"%V\"",
+                      &r->headers_out.content_range->value);
+        return NGX_ERROR;
+    }
+
+    c->fill = 1;
+    c->fill_end = end;
+    c->sparse_length = length;
+
+    if (c->range_end == -1 || c->range_end > length) {
+        c->range_end = length;
+    }
+
+    /*
+     * the blocks of an entry around the range received are sent
+     * from the cache file
+     */
+
+    c->stitch = c->sparse
+                && (c->range_start < start || c->range_end > end);
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.status_line.len = 0;
+    r->headers_out.content_length_n = length;
+    r->headers_out.content_offset = ngx_min(c->range_start, start);
+    r->headers_out.content_range->hash = 0;
+    r->headers_out.content_range = NULL;
+
+    r->allow_ranges = 1;
+    r->single_range = 1;
+
+    return NGX_OK;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                  "upstream sent invalid range in partial response");
+
+    return NGX_ERROR;
+}
+
 #endif
 
 
@@ -1636,7 +2005,9 @@ ngx_http_upstream_connect(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
 #if (NGX_HTTP_SSL)
 
-    if (u->ssl && c->ssl == NULL) {
+    /* TLS of a multiplexed connection is handled by the connection itself */
+
+    if (u->ssl && c->ssl == NULL && !u->multiplexed) {
         ngx_http_upstream_ssl_init_connection(r, u, c);
         return;
     }
@@ -1768,6 +2139,11 @@ ngx_http_upstream_ssl_handshake(ngx_http_request_t *r, ngx_http_upstream_t *u,
             }
         }
 
+        if (c->ssl->sendfile) {
+            c->sendfile = r->connection->sendfile;
+            u->output.sendfile = c->sendfile;
+        }
+
         c->write->handler = ngx_http_upstream_handler;
         c->read->handler = ngx_http_upstream_handler;
 
@@ -2091,6 +2467,10 @@ ngx_http_upstream_send_request(ngx_http_request_t *r, ngx_http_upstream_t *u,
 
         ngx_add_timer(c->read, u->conf->read_timeout);
 
+        if (u->conf->hedge) {
+            ngx_http_upstream_hedge(r, u);
+        }
+
         if (c->read->ready) {
             ngx_http_upstream_process_header(r, u);
             return;
@@ -2237,7 +2617,7 @@ ngx_http_upstream_send_request_handler(ngx_http_request_t *r,
 
 #if (NGX_HTTP_SSL)
 
-    if (u->ssl && c->ssl == NULL) {
+    if (u->ssl && c->ssl == NULL && !u->multiplexed) {
         ngx_http_upstream_ssl_init_connection(r, u, c);
         return;
     }
@@ -2376,6 +2756,10 @@ ngx_http_upstream_process_header(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
         u->buffer.last += n;
 
+        if (u->hedge) {
+            ngx_http_upstream_hedge_cancel(r, u);
+        }
+
 #if 0
         u->valid_header_in = 0;
 
@@ -2416,6 +2800,10 @@ ngx_http_upstream_process_header(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
     u->state->header_time = ngx_current_msec - u->start_time;
 
+    if (u->conf->hedge && u->conf->hedge->percentile) {
+        ngx_http_upstream_hedge_sample(u->conf->hedge, u->state->header_time);
+    }
+
     if (u->headers_in.status_n >= NGX_HTTP_SPECIAL_RESPONSE) {
 
         if (ngx_http_upstream_test_next(r, u) == NGX_OK) {
@@ -2845,6 +3233,17 @@ ngx_http_upstream_process_headers(ngx_http_request_t *r, ngx_http_upstream_t *u)
 #endif
     }
 
+#if (NGX_HTTP_CACHE)
+
+    if (r->cache && (r->cache->ranged || (r->cached && r->cache->sparse))) {
+        if (ngx_http_upstream_cache_sparse(r, u) != NGX_OK) {
+            ngx_http_upstream_finalize_request(r, u, NGX_HTTP_BAD_GATEWAY);
+            return NGX_DONE;
+        }
+    }
+
+#endif
+
     u->length = -1;
 
     return NGX_OK;
@@ -2899,11 +3298,14 @@ ngx_http_upstream_process_trailers(ngx_http_request_t *r,
 static void
 ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
 {
-    ssize_t                    n;
-    ngx_int_t                  rc;
-    ngx_event_pipe_t          *p;
-    ngx_connection_t          *c;
-    ngx_http_core_loc_conf_t  *clcf;
+    ssize_t                        n;
+    ngx_int_t                      rc;
+    ngx_event_pipe_t              *p;
+    ngx_connection_t              *c;
+    ngx_http_core_loc_conf_t      *clcf;
+#if (NGX_HTTP_CACHE)
+    ngx_http_file_cache_shard_t   *shard;
+#endif
 
     rc = ngx_http_send_header(r);
 
@@ -2945,6 +3347,22 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
         u->pipe->downstream_error = 1;
     }
 
+#if (NGX_HTTP_CACHE)
+
+    if (r->cache && r->cache->stitch
+        && r->cache->range_start < r->cache->fill_start)
+    {
+        if (ngx_http_cache_send_range(r, r->cache->range_start,
+                                      r->cache->fill_start)
+            == NGX_ERROR)
+        {
+            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+            return;
+        }
+    }
+
+#endif
+
     if (r->request_body && r->request_body->temp_file
         && r == r->main && !r->preserve_body
         && !u->conf->preserve_output)
@@ -3023,7 +3441,10 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
 #if (NGX_HTTP_CACHE)
 
-    if (r->cache && r->cache->file.fd != NGX_INVALID_FILE) {
+    if (r->cache
+        && r->cache->file.fd != NGX_INVALID_FILE
+        && !r->cache->stitch)
+    {
         ngx_pool_run_cleanup_file(r->pool, r->cache->file.fd);
         r->cache->file.fd = NGX_INVALID_FILE;
     }
@@ -3062,12 +3483,33 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
         if (valid == 0) {
             valid = ngx_http_file_cache_valid(u->conf->cache_valid,
-                                              u->headers_in.status_n);
+                                              r->cache->fill
+                                              ? NGX_HTTP_OK
+                                              : u->headers_in.status_n);
             if (valid) {
                 r->cache->valid_sec = now + valid;
             }
         }
 
+        if (valid && r->cache->fill && !r->cache->sparse) {
+            size_t  len;
+
+            /* the block map is kept along with the response header */
+
+            len = u->buffer.pos - u->buffer.start
+                  + ngx_http_file_cache_map_len(r->cache->sparse_length,
+                                              r->cache->file_cache->sparse);
+
+            if (len > u->conf->buffer_size || len > 65535) {
+                ngx_log_error(NGX_LOG_WARN, c->log, 0,
+                              "%V_buffer_size %uz is not enough for "
+                              "block map of %O bytes response",
+                              &u->conf->module, u->conf->buffer_size,
+                              r->cache->sparse_length);
+                valid = 0;
+            }
+        }
+
         if (valid) {
             r->cache->date = now;
             r->cache->body_start = (u_short) (u->buffer.pos - u->buffer.start);
@@ -3089,6 +3531,15 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
                 ngx_str_null(&r->cache->etag);
             }
 
+            if (u->conf->cache_tags
+                && ngx_http_complex_value(r, u->conf->cache_tags,
+                                          &r->cache->tags)
+                   != NGX_OK)
+            {
+                ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+                return;
+            }
+
             if (ngx_http_file_cache_set_header(r, u->buffer.start) != NGX_OK) {
                 ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
                 return;
@@ -3145,7 +3596,8 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
 #if (NGX_HTTP_CACHE)
         if (r->cache && !r->cache->file_cache->use_temp_path) {
-            p->temp_file->path = r->cache->file_cache->path;
+            shard = r->cache->file_cache->shards.elts;
+            p->temp_file->path = shard[r->cache->shard].path;
             p->temp_file->file.name = r->cache->file.name;
         }
 #endif
@@ -3285,6 +3737,29 @@ ngx_http_upstream_upgrade(ngx_http_request_t *r, ngx_http_upstream_t *u)
         return;
     }
 
+#if (NGX_HAVE_SPLICE)
+
+    if (u->conf->splice
+        && c->recv == ngx_recv
+        && c->send == ngx_send
+        && u->peer.connection->recv == ngx_recv
+        && u->peer.connection->send == ngx_send)
+    {
+        u->splice_upstream = ngx_linux_splice_create(r->pool, c->log);
+        if (u->splice_upstream == NULL) {
+            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+            return;
+        }
+
+        u->splice_downstream = ngx_linux_splice_create(r->pool, c->log);
+        if (u->splice_downstream == NULL) {
+            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+            return;
+        }
+    }
+
+#endif
+
     if (u->peer.connection->read->ready
         || u->buffer.pos != u->buffer.last)
     {
@@ -3338,6 +3813,9 @@ ngx_http_upstream_process_upgraded(ngx_http_request_t *r,
     ngx_connection_t          *c, *downstream, *upstream, *dst, *src;
     ngx_http_upstream_t       *u;
     ngx_http_core_loc_conf_t  *clcf;
+#if (NGX_HAVE_SPLICE)
+    ngx_linux_splice_t        *sp;
+#endif
 
     c = r->connection;
     u = r->upstream;
@@ -3392,6 +3870,10 @@ ngx_http_upstream_process_upgraded(ngx_http_request_t *r,
         }
     }
 
+#if (NGX_HAVE_SPLICE)
+    sp = from_upstream ? u->splice_upstream : u->splice_downstream;
+#endif
+
     for ( ;; ) {
 
         if (do_write) {
@@ -3416,8 +3898,57 @@ ngx_http_upstream_process_upgraded(ngx_http_request_t *r,
                     }
                 }
             }
+
+#if (NGX_HAVE_SPLICE)
+
+            if (sp && sp->buffered && dst->write->ready) {
+
+                if (ngx_linux_splice_send(dst, sp) == NGX_ERROR) {
+                    ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+                    return;
+                }
+            }
+
+#endif
+        }
+
+#if (NGX_HAVE_SPLICE)
+
+        /*
+         * data already read into the buffer are sent first,
+         * after that they are moved through the pipe only
+         */
+
+        if (sp && b->pos == b->last) {
+
+            if (sp->buffered < sp->size && src->read->ready) {
+
+                n = ngx_linux_splice_recv(src, sp, sp->size);
+
+                if (n == NGX_AGAIN || n == 0) {
+                    break;
+                }
+
+                if (n > 0) {
+                    do_write = 1;
+
+                    if (from_upstream) {
+                        u->state->bytes_received += n;
+                    }
+
+                    continue;
+                }
+
+                if (n == NGX_ERROR) {
+                    src->read->eof = 1;
+                }
+            }
+
+            break;
         }
 
+#endif
+
         size = b->end - b->last;
 
         if (size && src->read->ready) {
@@ -3447,8 +3978,17 @@ ngx_http_upstream_process_upgraded(ngx_http_request_t *r,
         break;
     }
 
-    if ((upstream->read->eof && u->buffer.pos == u->buffer.last)
-        || (downstream->read->eof && u->from_client.pos == u->from_client.last)
+    if ((upstream->read->eof && u->buffer.pos == u->buffer.last
+#if (NGX_HAVE_SPLICE)
+         && (u->splice_upstream == NULL || u->splice_upstream->buffered == 0)
+#endif
+        )
+        || (downstream->read->eof && u->from_client.pos == u->from_client.last
+#if (NGX_HAVE_SPLICE)
+            && (u->splice_downstream == NULL
+                || u->splice_downstream->buffered == 0)
+#endif
+           )
         || (downstream->read->eof && upstream->read->eof))
     {
         ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
@@ -3607,6 +4147,26 @@ ngx_http_upstream_process_non_buffered_request(ngx_http_request_t *r,
                                         &u->out_bufs, u->output.tag);
             }
 
+#if (NGX_HAVE_SPLICE)
+
+            if (u->splice_upstream && u->splice_upstream->buffered) {
+
+                if (downstream->write->ready) {
+                    n = ngx_linux_splice_send(downstream, u->splice_upstream);
+
+                    if (n == NGX_ERROR) {
+                        ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+                        return;
+                    }
+                }
+
+                if (u->splice_upstream->buffered) {
+                    break;
+                }
+            }
+
+#endif
+
             if (u->busy_bufs == NULL) {
 
                 if (u->length == 0
@@ -3633,9 +4193,64 @@ ngx_http_upstream_process_non_buffered_request(ngx_http_request_t *r,
 
                 b->pos = b->start;
                 b->last = b->start;
+
+#if (NGX_HAVE_SPLICE)
+
+                if (u->splice
+                    && u->splice_upstream == NULL
+                    && !downstream->buffered)
+                {
+                    if (ngx_http_upstream_init_splice(r, u) != NGX_OK) {
+                        ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+                        return;
+                    }
+                }
+
+#endif
+            }
+        }
+
+#if (NGX_HAVE_SPLICE)
+
+        if (u->splice_upstream) {
+
+            size = u->splice_upstream->size - u->splice_upstream->buffered;
+
+            if (u->length != -1 && (off_t) size > u->length) {
+                size = (size_t) u->length;
+            }
+
+            if (size && upstream->read->ready) {
+
+                n = ngx_linux_splice_recv(upstream, u->splice_upstream, size);
+
+                if (n == NGX_AGAIN) {
+                    break;
+                }
+
+                if (n > 0) {
+                    u->state->bytes_received += n;
+                    u->state->response_length += n;
+
+                    if (u->length != -1) {
+                        u->length -= n;
+
+                        if (u->length == 0) {
+                            u->keepalive = !u->headers_in.connection_close;
+                        }
+                    }
+                }
+
+                do_write = 1;
+
+                continue;
             }
+
+            break;
         }
 
+#endif
+
         size = b->end - b->last;
 
         if (size && upstream->read->ready) {
@@ -3703,6 +4318,55 @@ ngx_http_upstream_process_non_buffered_request(ngx_http_request_t *r,
 }
 
 
+#if (NGX_HAVE_SPLICE)
+
+static ngx_int_t
+ngx_http_upstream_init_splice(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_connection_t  *c;
+
+    c = r->connection;
+
+    u->splice = 0;
+
+    /*
+     * the body is moved past the output filters, so it is only
+     * spliced when none of them is going to look at it
+     */
+
+    if (r != r->main
+        || r->postponed
+        || r->header_only
+        || r->chunked
+        || r->allow_ranges
+        || r->limit_rate
+        || r->filter_need_in_memory
+        || r->main_filter_need_in_memory
+        || r->filter_need_temporary
+#if (NGX_HTTP_V2)
+        || r->stream
+#endif
+        || c->send != ngx_send
+        || u->peer.connection->recv != ngx_recv)
+    {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "http upstream splice disabled");
+        return NGX_OK;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "http upstream splice");
+
+    u->splice_upstream = ngx_linux_splice_create(r->pool, c->log);
+    if (u->splice_upstream == NULL) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+#endif
+
+
 ngx_int_t
 ngx_http_upstream_non_buffered_filter_init(void *data)
 {
@@ -4015,6 +4679,8 @@ ngx_http_upstream_process_request(ngx_http_request_t *r,
 
         if (u->cacheable) {
 
+            ngx_http_file_cache_stream(r, p->temp_file);
+
             if (p->upstream_done) {
                 ngx_http_file_cache_update(r, p->temp_file);
 
@@ -4186,134 +4852,594 @@ ngx_http_upstream_next(ngx_http_request_t *r, ngx_http_upstream_t *u,
             state = NGX_PEER_FAILED;
         }
 
-        u->peer.free(&u->peer, u->peer.data, state);
-        u->peer.sockaddr = NULL;
+        u->peer.free(&u->peer, u->peer.data, state);
+        u->peer.sockaddr = NULL;
+    }
+
+    if (ft_type == NGX_HTTP_UPSTREAM_FT_TIMEOUT) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, NGX_ETIMEDOUT,
+                      "upstream timed out");
+    }
+
+    if (u->peer.cached && ft_type == NGX_HTTP_UPSTREAM_FT_ERROR) {
+        /* TODO: inform balancer instead */
+        u->peer.tries++;
+    }
+
+    switch (ft_type) {
+
+    case NGX_HTTP_UPSTREAM_FT_TIMEOUT:
+    case NGX_HTTP_UPSTREAM_FT_HTTP_504:
+        status = NGX_HTTP_GATEWAY_TIME_OUT;
+        break;
+
+    case NGX_HTTP_UPSTREAM_FT_HTTP_500:
+        status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        break;
+
+    case NGX_HTTP_UPSTREAM_FT_HTTP_503:
+        status = NGX_HTTP_SERVICE_UNAVAILABLE;
+        break;
+
+    case NGX_HTTP_UPSTREAM_FT_HTTP_403:
+        status = NGX_HTTP_FORBIDDEN;
+        break;
+
+    case NGX_HTTP_UPSTREAM_FT_HTTP_404:
+        status = NGX_HTTP_NOT_FOUND;
+        break;
+
+    case NGX_HTTP_UPSTREAM_FT_HTTP_429:
+        status = NGX_HTTP_TOO_MANY_REQUESTS;
+        break;
+
+    /*
+     * NGX_HTTP_UPSTREAM_FT_BUSY_LOCK and NGX_HTTP_UPSTREAM_FT_MAX_WAITING
+     * never reach here
+     */
+
+    default:
+        status = NGX_HTTP_BAD_GATEWAY;
+    }
+
+    if (r->connection->error) {
+        ngx_http_upstream_finalize_request(r, u,
+                                           NGX_HTTP_CLIENT_CLOSED_REQUEST);
+        return;
+    }
+
+    u->state->status = status;
+
+    if (u->hedge) {
+
+        if (u->hedge->connection) {
+
+            /* the hedged attempt failed, the original one is still going */
+
+            if (ngx_http_upstream_hedge_resume(r, u) != NGX_OK) {
+                ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
+            }
+
+            return;
+        }
+
+        if (u->hedge->event.timer_set) {
+            ngx_del_timer(&u->hedge->event);
+        }
+    }
+
+    timeout = u->conf->next_upstream_timeout;
+
+    if (u->request_sent
+        && (r->method & (NGX_HTTP_POST|NGX_HTTP_LOCK|NGX_HTTP_PATCH)))
+    {
+        ft_type |= NGX_HTTP_UPSTREAM_FT_NON_IDEMPOTENT;
+    }
+
+    if (u->peer.tries == 0
+        || ((u->conf->next_upstream & ft_type) != ft_type)
+        || (u->request_sent && r->request_body_no_buffering)
+        || (timeout && ngx_current_msec - u->peer.start_time >= timeout))
+    {
+#if (NGX_HTTP_CACHE)
+
+        if (u->cache_status == NGX_HTTP_CACHE_EXPIRED
+            && ((u->conf->cache_use_stale & ft_type) || r->cache->stale_error))
+        {
+            ngx_int_t  rc;
+
+            rc = u->reinit_request(r);
+
+            if (rc != NGX_OK) {
+                ngx_http_upstream_finalize_request(r, u, rc);
+                return;
+            }
+
+            u->cache_status = NGX_HTTP_CACHE_STALE;
+            rc = ngx_http_upstream_cache_send(r, u);
+
+            if (rc == NGX_DONE) {
+                return;
+            }
+
+            if (rc == NGX_HTTP_UPSTREAM_INVALID_HEADER) {
+                rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            ngx_http_upstream_finalize_request(r, u, rc);
+            return;
+        }
+#endif
+
+        ngx_http_upstream_finalize_request(r, u, status);
+        return;
+    }
+
+    if (u->peer.connection) {
+        ngx_http_upstream_close_peer_connection(u->peer.connection);
+        u->peer.connection = NULL;
+    }
+
+    ngx_http_upstream_connect(r, u);
+}
+
+
+static void
+ngx_http_upstream_hedge(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_msec_t                       delay, elapsed;
+    ngx_http_upstream_hedge_t       *h;
+    ngx_http_upstream_hedge_conf_t  *hc;
+
+    /*
+     * only a request which can be sent once more is hedged, and only once:
+     * the duplicate goes to another peer if the response header does not
+     * start to arrive in time
+     */
+
+    if (u->hedged
+        || u->multiplexed
+        || r->request_body_no_buffering
+        || (r->method & (NGX_HTTP_POST|NGX_HTTP_LOCK|NGX_HTTP_PATCH))
+        || u->peer.tries < 2)
+    {
+        return;
+    }
+
+    hc = u->conf->hedge;
+    h = u->hedge;
+
+    if (h == NULL) {
+        h = ngx_pcalloc(r->pool, sizeof(ngx_http_upstream_hedge_t));
+        if (h == NULL) {
+            return;
+        }
+
+        h->event.handler = ngx_http_upstream_hedge_handler;
+        h->event.data = r;
+        h->event.log = r->connection->log;
+
+        u->hedge = h;
+
+        /*
+         * each request earns a share of a hedge once, whatever the number
+         * of its attempts, up to a small burst
+         */
+
+        hc->tokens += hc->budget;
+
+        if (hc->tokens > 100 * NGX_HTTP_UPSTREAM_HEDGE_BURST) {
+            hc->tokens = 100 * NGX_HTTP_UPSTREAM_HEDGE_BURST;
+        }
+    }
+
+    delay = ngx_http_upstream_hedge_delay(hc);
+
+    if (delay == 0) {
+        return;
+    }
+
+    elapsed = ngx_current_msec - u->start_time;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream hedge delay:%M elapsed:%M",
+                   delay, elapsed);
+
+    ngx_add_timer(&h->event, delay > elapsed ? delay - elapsed : 1);
+}
+
+
+static void
+ngx_http_upstream_hedge_handler(ngx_event_t *ev)
+{
+    ngx_msec_t                       timeout;
+    ngx_connection_t                *c;
+    ngx_http_request_t              *r;
+    ngx_http_upstream_t             *u;
+    ngx_http_upstream_hedge_t       *h;
+    ngx_http_upstream_hedge_conf_t  *hc;
+
+    r = ev->data;
+    u = r->upstream;
+    h = u->hedge;
+    hc = u->conf->hedge;
+
+    ngx_http_set_log_request(r->connection->log, r);
+
+    c = u->peer.connection;
+    timeout = u->conf->next_upstream_timeout;
+
+    if (c == NULL
+        || u->peer.sockaddr == NULL
+        || u->peer.tries < 2
+        || (timeout && ngx_current_msec - u->peer.start_time >= timeout))
+    {
+        return;
+    }
+
+    if (hc->tokens < 100) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http upstream hedge budget exhausted");
+        return;
+    }
+
+    hc->tokens -= 100;
+
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                  "upstream is slow to respond, hedging request");
+
+    u->hedged = 1;
+
+    /*
+     * the original attempt is released to the balancer, so that another
+     * peer is chosen, but its connection is kept to race the new one
+     */
+
+    u->state->bytes_sent = c->sent;
+
+    /* the states array may be reallocated, so its index is kept */
+
+    h->state = u->state
+               - (ngx_http_upstream_state_t *) r->upstream_states->elts;
+    h->start_time = u->start_time;
+
+    u->peer.free(&u->peer, u->peer.data, 0);
+    u->peer.sockaddr = NULL;
+
+    if (u->peer.connection) {
+        h->connection = c;
+
+        c->read->handler = ngx_http_upstream_hedge_peer_handler;
+        c->write->handler = ngx_http_upstream_hedge_peer_handler;
+
+        u->peer.connection = NULL;
+    }
+
+    ngx_http_upstream_connect(r, u);
+
+    ngx_http_run_posted_requests(r->connection);
+}
+
+
+static void
+ngx_http_upstream_hedge_peer_handler(ngx_event_t *ev)
+{
+    ngx_connection_t           *c;
+    ngx_http_request_t         *r;
+    ngx_http_upstream_t        *u;
+    ngx_http_upstream_state_t  *state;
+
+    c = ev->data;
+    r = c->data;
+    u = r->upstream;
+
+    if (ev->write) {
+        return;
+    }
+
+    ngx_http_set_log_request(r->connection->log, r);
+
+    if (ev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, NGX_ETIMEDOUT,
+                      "hedged upstream timed out");
+
+        state = r->upstream_states->elts;
+        state[u->hedge->state].status = NGX_HTTP_GATEWAY_TIME_OUT;
+
+        ngx_http_upstream_hedge_cancel(r, u);
+        return;
+    }
+
+    switch (ngx_http_upstream_hedge_test_peer(c)) {
+
+    case NGX_AGAIN:
+
+        if (ngx_handle_read_event(ev, 0) == NGX_OK) {
+            return;
+        }
+
+        /* fall through */
+
+    case NGX_ERROR:
+
+        /* the original attempt failed, the new one goes on */
+
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, ngx_socket_errno,
+                      "hedged upstream prematurely closed connection");
+
+        state = r->upstream_states->elts;
+        state[u->hedge->state].status = NGX_HTTP_BAD_GATEWAY;
+
+        ngx_http_upstream_hedge_cancel(r, u);
+        return;
+    }
+
+    /* the original attempt starts to respond first */
+
+    if (ngx_http_upstream_hedge_resume(r, u) != NGX_OK) {
+        ngx_http_upstream_finalize_request(r, u,
+                                           NGX_HTTP_INTERNAL_SERVER_ERROR);
+
+    } else {
+        ngx_http_upstream_process_header(r, u);
+    }
+
+    ngx_http_run_posted_requests(r->connection);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_hedge_resume(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_connection_t           *c;
+    ngx_http_upstream_hedge_t  *h;
+
+    h = u->hedge;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream hedge resume original");
+
+    /* give up the attempt in progress */
+
+    if (u->peer.sockaddr) {
+
+        if (u->peer.connection) {
+            u->state->bytes_sent = u->peer.connection->sent;
+        }
+
+        u->peer.free(&u->peer, u->peer.data, 0);
+        u->peer.sockaddr = NULL;
+    }
+
+    if (u->state->response_time == (ngx_msec_t) -1) {
+        u->state->response_time = ngx_current_msec - u->start_time;
+    }
+
+    if (u->peer.connection) {
+        ngx_http_upstream_close_peer_connection(u->peer.connection);
+    }
+
+    /*
+     * the original peer was already released to the balancer,
+     * so it is not freed once more
+     */
+
+    c = h->connection;
+    h->connection = NULL;
+
+    u->peer.connection = c;
+    u->state = (ngx_http_upstream_state_t *) r->upstream_states->elts
+               + h->state;
+
+    u->peer.name = u->state->peer;
+    u->peer.cached = 0;
+
+    u->state->response_time = (ngx_msec_t) -1;
+    u->start_time = h->start_time;
+
+    u->request_sent = 1;
+    u->request_body_sent = 1;
+    u->request_body_blocked = 0;
+
+    u->writer.connection = c;
+
+    c->read->handler = ngx_http_upstream_handler;
+    c->write->handler = ngx_http_upstream_handler;
+
+    u->write_event_handler = ngx_http_upstream_dummy_handler;
+    u->read_event_handler = ngx_http_upstream_process_header;
+
+    return u->reinit_request(r);
+}
+
+
+/*
+ * A read event on the original connection may only report a connection
+ * close or, with SSL, a record without data, so the response bytes are
+ * peeked at before committing to the original attempt.
+ */
+
+static ngx_int_t
+ngx_http_upstream_hedge_test_peer(ngx_connection_t *c)
+{
+    int        n;
+    u_char     buf[1];
+    ngx_err_t  err;
+
+#if (NGX_HTTP_SSL)
+
+    if (c->ssl) {
+        ERR_clear_error();
+
+        n = SSL_peek(c->ssl->connection, buf, 1);
+
+        if (n > 0) {
+            return NGX_OK;
+        }
+
+        n = SSL_get_error(c->ssl->connection, n);
+
+        if (n == SSL_ERROR_WANT_READ || n == SSL_ERROR_WANT_WRITE) {
+            return NGX_AGAIN;
+        }
+
+        ngx_set_socket_errno(0);
+        ERR_clear_error();
+
+        return NGX_ERROR;
+    }
+
+#endif
+
+    n = recv(c->fd, (char *) buf, 1, MSG_PEEK);
+
+    if (n > 0) {
+        return NGX_OK;
+    }
+
+    if (n == -1) {
+        err = ngx_socket_errno;
+
+        if (err == NGX_EAGAIN) {
+            return NGX_AGAIN;
+        }
+
+    } else {
+        ngx_set_socket_errno(0);
     }
 
-    if (ft_type == NGX_HTTP_UPSTREAM_FT_TIMEOUT) {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, NGX_ETIMEDOUT,
-                      "upstream timed out");
+    return NGX_ERROR;
+}
+
+
+static void
+ngx_http_upstream_hedge_cancel(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_http_upstream_hedge_t  *h;
+    ngx_http_upstream_state_t  *state;
+
+    h = u->hedge;
+
+    if (h->event.timer_set) {
+        ngx_del_timer(&h->event);
     }
 
-    if (u->peer.cached && ft_type == NGX_HTTP_UPSTREAM_FT_ERROR) {
-        /* TODO: inform balancer instead */
-        u->peer.tries++;
+    if (h->connection == NULL) {
+        return;
     }
 
-    switch (ft_type) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream hedge cancel: %d", h->connection->fd);
 
-    case NGX_HTTP_UPSTREAM_FT_TIMEOUT:
-    case NGX_HTTP_UPSTREAM_FT_HTTP_504:
-        status = NGX_HTTP_GATEWAY_TIME_OUT;
-        break;
+    state = (ngx_http_upstream_state_t *) r->upstream_states->elts + h->state;
+    state->response_time = ngx_current_msec - h->start_time;
 
-    case NGX_HTTP_UPSTREAM_FT_HTTP_500:
-        status = NGX_HTTP_INTERNAL_SERVER_ERROR;
-        break;
+    ngx_http_upstream_close_peer_connection(h->connection);
+    h->connection = NULL;
+}
 
-    case NGX_HTTP_UPSTREAM_FT_HTTP_503:
-        status = NGX_HTTP_SERVICE_UNAVAILABLE;
-        break;
 
-    case NGX_HTTP_UPSTREAM_FT_HTTP_403:
-        status = NGX_HTTP_FORBIDDEN;
-        break;
+static void
+ngx_http_upstream_close_peer_connection(ngx_connection_t *c)
+{
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "close http upstream connection: %d", c->fd);
 
-    case NGX_HTTP_UPSTREAM_FT_HTTP_404:
-        status = NGX_HTTP_NOT_FOUND;
-        break;
+#if (NGX_HTTP_SSL)
 
-    case NGX_HTTP_UPSTREAM_FT_HTTP_429:
-        status = NGX_HTTP_TOO_MANY_REQUESTS;
-        break;
+    if (c->ssl) {
+        c->ssl->no_wait_shutdown = 1;
+        c->ssl->no_send_shutdown = 1;
 
-    /*
-     * NGX_HTTP_UPSTREAM_FT_BUSY_LOCK and NGX_HTTP_UPSTREAM_FT_MAX_WAITING
-     * never reach here
-     */
+        (void) ngx_ssl_shutdown(c);
+    }
+#endif
 
-    default:
-        status = NGX_HTTP_BAD_GATEWAY;
+    if (c->pool) {
+        ngx_destroy_pool(c->pool);
     }
 
-    if (r->connection->error) {
-        ngx_http_upstream_finalize_request(r, u,
-                                           NGX_HTTP_CLIENT_CLOSED_REQUEST);
-        return;
+    ngx_close_connection(c);
+}
+
+
+static ngx_msec_t
+ngx_http_upstream_hedge_delay(ngx_http_upstream_hedge_conf_t *hc)
+{
+    ngx_uint_t  i, n, need;
+
+    if (hc->percentile == 0) {
+        return hc->delay;
     }
 
-    u->state->status = status;
+    if (hc->samples < NGX_HTTP_UPSTREAM_HEDGE_MIN_SAMPLES) {
+        return 0;
+    }
 
-    timeout = u->conf->next_upstream_timeout;
+    need = (hc->samples * hc->percentile + 99) / 100;
 
-    if (u->request_sent
-        && (r->method & (NGX_HTTP_POST|NGX_HTTP_LOCK|NGX_HTTP_PATCH)))
-    {
-        ft_type |= NGX_HTTP_UPSTREAM_FT_NON_IDEMPOTENT;
+    for (i = 0, n = 0; i < NGX_HTTP_UPSTREAM_HEDGE_BUCKETS - 1; i++) {
+        n += hc->latency[i];
+
+        if (n >= need) {
+            break;
+        }
     }
 
-    if (u->peer.tries == 0
-        || ((u->conf->next_upstream & ft_type) != ft_type)
-        || (u->request_sent && r->request_body_no_buffering)
-        || (timeout && ngx_current_msec - u->peer.start_time >= timeout))
-    {
-#if (NGX_HTTP_CACHE)
+    /* the upper bound of the bucket */
 
-        if (u->cache_status == NGX_HTTP_CACHE_EXPIRED
-            && ((u->conf->cache_use_stale & ft_type) || r->cache->stale_error))
-        {
-            ngx_int_t  rc;
+    i++;
 
-            rc = u->reinit_request(r);
+    if (i < 4) {
+        return i;
+    }
 
-            if (rc != NGX_OK) {
-                ngx_http_upstream_finalize_request(r, u, rc);
-                return;
-            }
+    return (4 + (i & 3)) << (i / 4 - 1);
+}
 
-            u->cache_status = NGX_HTTP_CACHE_STALE;
-            rc = ngx_http_upstream_cache_send(r, u);
 
-            if (rc == NGX_DONE) {
-                return;
-            }
+static void
+ngx_http_upstream_hedge_sample(ngx_http_upstream_hedge_conf_t *hc,
+    ngx_msec_t ms)
+{
+    ngx_uint_t  i;
 
-            if (rc == NGX_HTTP_UPSTREAM_INVALID_HEADER) {
-                rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
-            }
+    /* older samples fade out */
 
-            ngx_http_upstream_finalize_request(r, u, rc);
-            return;
-        }
-#endif
+    if (hc->samples >= NGX_HTTP_UPSTREAM_HEDGE_WINDOW) {
+        hc->samples = 0;
 
-        ngx_http_upstream_finalize_request(r, u, status);
-        return;
+        for (i = 0; i < NGX_HTTP_UPSTREAM_HEDGE_BUCKETS; i++) {
+            hc->latency[i] /= 2;
+            hc->samples += hc->latency[i];
+        }
     }
 
-    if (u->peer.connection) {
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "close http upstream connection: %d",
-                       u->peer.connection->fd);
-#if (NGX_HTTP_SSL)
+    hc->latency[ngx_http_upstream_hedge_bucket(ms)]++;
+    hc->samples++;
+}
 
-        if (u->peer.connection->ssl) {
-            u->peer.connection->ssl->no_wait_shutdown = 1;
-            u->peer.connection->ssl->no_send_shutdown = 1;
 
-            (void) ngx_ssl_shutdown(u->peer.connection);
-        }
-#endif
+/*
+ * response header times are counted in buckets of roughly
+ * a fourth of a power of two: 0, 1, 2, 3, 4, 5, 6, 7, 8, 10, 12, 14, 16, ...
+ */
 
-        if (u->peer.connection->pool) {
-            ngx_destroy_pool(u->peer.connection->pool);
-        }
+static ngx_uint_t
+ngx_http_upstream_hedge_bucket(ngx_msec_t ms)
+{
+    ngx_uint_t  i, n;
 
-        ngx_close_connection(u->peer.connection);
-        u->peer.connection = NULL;
+    if (ms < 4) {
+        return ms;
     }
 
-    ngx_http_upstream_connect(r, u);
+    for (n = 2; ms >> (n + 1); n++) { /* void */ }
+
+    i = 4 * (n - 1) + ((ms >> (n - 2)) & 3);
+
+    return ngx_min(i, NGX_HTTP_UPSTREAM_HEDGE_BUCKETS - 1);
 }
 
 
@@ -4347,6 +5473,10 @@ ngx_http_upstream_finalize_request(ngx_http_request_t *r,
     *u->cleanup = NULL;
     u->cleanup = NULL;
 
+    if (u->hedge) {
+        ngx_http_upstream_hedge_cancel(r, u);
+    }
+
     if (u->resolved && u->resolved->ctx) {
         ngx_resolve_name_done(u->resolved->ctx);
         u->resolved->ctx = NULL;
@@ -4479,6 +5609,22 @@ ngx_http_upstream_finalize_request(ngx_http_request_t *r,
 
     if (rc == 0) {
 
+#if (NGX_HTTP_CACHE)
+
+        if (r->cache && r->cache->stitch
+            && r->cache->range_end > r->cache->fill_end)
+        {
+            if (ngx_http_cache_send_range(r, r->cache->fill_end,
+                                          r->cache->range_end)
+                == NGX_ERROR)
+            {
+                ngx_http_finalize_request(r, NGX_ERROR);
+                return;
+            }
+        }
+
+#endif
+
         if (ngx_http_upstream_process_trailers(r, u) != NGX_OK) {
             ngx_http_finalize_request(r, NGX_ERROR);
             return;
@@ -5723,6 +6869,32 @@ ngx_http_upstream_cache_etag(ngx_http_request_t *r,
     return NGX_OK;
 }
 
+
+static ngx_int_t
+ngx_http_upstream_cache_tier(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    if (r->upstream == NULL || r->cache == NULL || !r->cached) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+
+    if (r->cache->memory) {
+        v->len = sizeof("memory") - 1;
+        v->data = (u_char *) "memory";
+
+    } else {
+        v->len = sizeof("disk") - 1;
+        v->data = (u_char *) "disk";
+    }
+
+    return NGX_OK;
+}
+
 #endif
 
 
@@ -5955,6 +7127,13 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+#if (NGX_HTTP_UPSTREAM_ZONE)
+        if (ngx_strcmp(value[i].data, "resolve") == 0) {
+            us->resolve = 1;
+            continue;
+        }
+#endif
+
         goto invalid;
     }
 
@@ -5972,9 +7151,25 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    if (us->resolve && u.family == AF_UNIX) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"resolve\" cannot be used with unix sockets "
+                           "in upstream \"%V\"", &u.url);
+        return NGX_CONF_ERROR;
+    }
+
+    if (us->resolve && u.host.len && u.host.data[0] == '[') {
+
+        /* an IPv6 address, nothing to resolve */
+
+        us->resolve = 0;
+    }
+
     us->name = u.url;
     us->addrs = u.addrs;
     us->naddrs = u.naddrs;
+    us->host = u.host;
+    us->port = u.port;
     us->weight = weight;
     us->max_conns = max_conns;
     us->max_fails = max_fails;
@@ -6307,6 +7502,130 @@ ngx_http_upstream_param_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
 }
 
 
+char *
+ngx_http_upstream_hedge_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    char  *p = conf;
+
+    ngx_int_t                         n;
+    ngx_str_t                        *value;
+    ngx_uint_t                        i;
+    ngx_http_upstream_hedge_conf_t  **phc, *hc;
+
+    phc = (ngx_http_upstream_hedge_conf_t **) (p + cmd->offset);
+
+    if (*phc != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+
+        if (cf->args->nelts > 2) {
+            return "has invalid parameters with \"off\"";
+        }
+
+        *phc = NULL;
+        return NGX_CONF_OK;
+    }
+
+    hc = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_hedge_conf_t));
+    if (hc == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    i = 1;
+
+    if (value[1].data[0] == 'p') {
+
+        /* "p95", a percentile of recent response header times */
+
+        n = ngx_atoi(value[1].data + 1, value[1].len - 1);
+
+        if (n == NGX_ERROR || n == 0 || n > 99) {
+            goto invalid;
+        }
+
+        hc->percentile = n;
+
+    } else {
+        hc->delay = ngx_parse_time(&value[1], 0);
+
+        if (hc->delay == (ngx_msec_t) NGX_ERROR || hc->delay == 0) {
+            goto invalid;
+        }
+    }
+
+    hc->budget = 10;
+    hc->tokens = 100 * NGX_HTTP_UPSTREAM_HEDGE_BURST;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "budget=", 7) == 0
+            && value[i].data[value[i].len - 1] == '%')
+        {
+            n = ngx_atoi(value[i].data + 7, value[i].len - 8);
+
+            if (n == NGX_ERROR || n == 0 || n > 100) {
+                goto invalid;
+            }
+
+            hc->budget = n;
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    *phc = hc;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+/*
+ * The response header times and the hedge budget are kept per location:
+ * an inherited setting gets its own copy.
+ */
+
+ngx_int_t
+ngx_http_upstream_merge_hedge(ngx_conf_t *cf, ngx_http_upstream_conf_t *conf,
+    ngx_http_upstream_conf_t *prev)
+{
+    ngx_http_upstream_hedge_conf_t  *hc;
+
+    if (conf->hedge != NGX_CONF_UNSET_PTR) {
+        return NGX_OK;
+    }
+
+    if (prev->hedge == NGX_CONF_UNSET_PTR || prev->hedge == NULL) {
+        conf->hedge = NULL;
+        return NGX_OK;
+    }
+
+    hc = ngx_palloc(cf->pool, sizeof(ngx_http_upstream_hedge_conf_t));
+    if (hc == NULL) {
+        return NGX_ERROR;
+    }
+
+    *hc = *prev->hedge;
+
+    conf->hedge = hc;
+
+    return NGX_OK;
+}
+
+
 ngx_int_t
 ngx_http_upstream_hide_headers_hash(ngx_conf_t *cf,
     ngx_http_upstream_conf_t *conf, ngx_http_upstream_conf_t *prev,
@@ -6504,7 +7823,9 @@ ngx_http_upstream_init_main_conf(ngx_conf_t *cf, void *conf)
     hash.pool = cf->pool;
     hash.temp_pool = NULL;
 
-    if (ngx_hash_init(&hash, headers_in.elts, headers_in.nelts) != NGX_OK) {
+    if (ngx_hash_perfect_init(&hash, headers_in.elts, headers_in.nelts)
+        != NGX_OK)
+    {
         return NGX_CONF_ERROR;
     }
 
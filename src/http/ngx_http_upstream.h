@@ -103,6 +103,10 @@ typedef struct {
     ngx_uint_t                       down;
 
     unsigned                         backup:1;
+    unsigned                         resolve:1;
+
+    ngx_str_t                        host;
+    in_port_t                        port;
 
     NGX_COMPAT_BEGIN(6)
     NGX_COMPAT_END
@@ -133,6 +137,8 @@ struct ngx_http_upstream_srv_conf_s {
 
 #if (NGX_HTTP_UPSTREAM_ZONE)
     ngx_shm_zone_t                  *shm_zone;
+    ngx_resolver_t                  *resolver;
+    ngx_msec_t                       resolver_timeout;
 #endif
 };
 
@@ -146,6 +152,25 @@ typedef struct {
 } ngx_http_upstream_local_t;
 
 
+#define NGX_HTTP_UPSTREAM_HEDGE_BUCKETS      64
+#define NGX_HTTP_UPSTREAM_HEDGE_WINDOW       1024
+#define NGX_HTTP_UPSTREAM_HEDGE_MIN_SAMPLES  32
+#define NGX_HTTP_UPSTREAM_HEDGE_BURST        10
+
+
+typedef struct {
+    ngx_msec_t                       delay;
+    ngx_uint_t                       percentile;
+    ngx_uint_t                       budget;
+
+    /* per worker process */
+
+    ngx_uint_t                       tokens;
+    ngx_uint_t                       samples;
+    ngx_uint_t                       latency[NGX_HTTP_UPSTREAM_HEDGE_BUCKETS];
+} ngx_http_upstream_hedge_conf_t;
+
+
 typedef struct {
     ngx_http_upstream_srv_conf_t    *upstream;
 
@@ -174,6 +199,7 @@ typedef struct {
     ngx_uint_t                       next_upstream_tries;
     ngx_flag_t                       buffering;
     ngx_flag_t                       request_buffering;
+    ngx_flag_t                       splice;
     ngx_flag_t                       pass_request_headers;
     ngx_flag_t                       pass_request_body;
 
@@ -191,6 +217,8 @@ typedef struct {
     ngx_http_upstream_local_t       *local;
     ngx_flag_t                       socket_keepalive;
 
+    ngx_http_upstream_hedge_conf_t  *hedge;
+
 #if (NGX_HTTP_CACHE)
     ngx_shm_zone_t                  *cache_zone;
     ngx_http_complex_value_t        *cache_value;
@@ -213,6 +241,9 @@ typedef struct {
     ngx_array_t                     *cache_bypass;
     ngx_array_t                     *cache_purge;
     ngx_array_t                     *no_cache;
+
+    ngx_http_complex_value_t        *cache_tags;
+    ngx_http_complex_value_t        *cache_purge_tags;
 #endif
 
     ngx_array_t                     *store_lengths;
@@ -316,6 +347,14 @@ typedef void (*ngx_http_upstream_handler_pt)(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
 
 
+typedef struct {
+    ngx_event_t                      event;
+    ngx_connection_t                *connection;
+    ngx_uint_t                       state;
+    ngx_msec_t                       start_time;
+} ngx_http_upstream_hedge_t;
+
+
 struct ngx_http_upstream_s {
     ngx_http_upstream_handler_pt     read_event_handler;
     ngx_http_upstream_handler_pt     write_event_handler;
@@ -348,6 +387,11 @@ struct ngx_http_upstream_s {
     ngx_chain_t                     *busy_bufs;
     ngx_chain_t                     *free_bufs;
 
+#if (NGX_HAVE_SPLICE)
+    ngx_linux_splice_t              *splice_upstream;
+    ngx_linux_splice_t              *splice_downstream;
+#endif
+
     ngx_int_t                      (*input_filter_init)(void *data);
     ngx_int_t                      (*input_filter)(void *data, ssize_t bytes);
     void                            *input_filter_ctx;
@@ -370,6 +414,8 @@ struct ngx_http_upstream_s {
 
     ngx_http_upstream_state_t       *state;
 
+    ngx_http_upstream_hedge_t       *hedge;
+
     ngx_str_t                        method;
     ngx_str_t                        schema;
     ngx_str_t                        uri;
@@ -386,17 +432,22 @@ struct ngx_http_upstream_s {
     unsigned                         ssl:1;
 #if (NGX_HTTP_CACHE)
     unsigned                         cache_status:3;
+    unsigned                         cache_ranges:1;
 #endif
 
     unsigned                         buffering:1;
     unsigned                         keepalive:1;
     unsigned                         upgrade:1;
+    unsigned                         splice:1;
     unsigned                         error:1;
 
     unsigned                         request_sent:1;
     unsigned                         request_body_sent:1;
     unsigned                         request_body_blocked:1;
     unsigned                         header_sent:1;
+
+    unsigned                         hedged:1;
+    unsigned                         multiplexed:1;
 };
 
 
@@ -423,6 +474,10 @@ char *ngx_http_upstream_bind_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 char *ngx_http_upstream_param_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+char *ngx_http_upstream_hedge_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+ngx_int_t ngx_http_upstream_merge_hedge(ngx_conf_t *cf,
+    ngx_http_upstream_conf_t *conf, ngx_http_upstream_conf_t *prev);
 ngx_int_t ngx_http_upstream_hide_headers_hash(ngx_conf_t *cf,
     ngx_http_upstream_conf_t *conf, ngx_http_upstream_conf_t *prev,
     ngx_str_t *default_hide_headers, ngx_hash_init_t *hash);
@@ -262,12 +262,24 @@ ngx_http_upstream_init_round_robin_peer(ngx_http_request_t *r,
     rrp->current = NULL;
     rrp->config = 0;
 
+    ngx_http_upstream_rr_peers_rlock(rrp->peers);
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    if (rrp->peers->config) {
+        rrp->config = *rrp->peers->config;
+    }
+#endif
+
     n = rrp->peers->number;
 
     if (rrp->peers->next && rrp->peers->next->number > n) {
         n = rrp->peers->next->number;
     }
 
+    r->upstream->peer.tries = ngx_http_upstream_tries(rrp->peers);
+
+    ngx_http_upstream_rr_peers_unlock(rrp->peers);
+
     if (n <= 8 * sizeof(uintptr_t)) {
         rrp->tried = &rrp->data;
         rrp->data = 0;
@@ -283,7 +295,6 @@ ngx_http_upstream_init_round_robin_peer(ngx_http_request_t *r,
 
     r->upstream->peer.get = ngx_http_upstream_get_round_robin_peer;
     r->upstream->peer.free = ngx_http_upstream_free_round_robin_peer;
-    r->upstream->peer.tries = ngx_http_upstream_tries(rrp->peers);
 #if (NGX_HTTP_SSL)
     r->upstream->peer.set_session =
                                ngx_http_upstream_set_round_robin_peer_session;
@@ -432,10 +443,20 @@ ngx_http_upstream_get_round_robin_peer(ngx_peer_connection_t *pc, void *data)
     peers = rrp->peers;
     ngx_http_upstream_rr_peers_wlock(peers);
 
+    if (ngx_http_upstream_rr_peers_changed(rrp)) {
+
+        /* the peers were updated, and the tried peers are unknown */
+
+        ngx_http_upstream_rr_peers_unlock(peers);
+        pc->name = peers->name;
+
+        return NGX_BUSY;
+    }
+
     if (peers->single) {
         peer = peers->peer;
 
-        if (peer->down) {
+        if (peer->down || peer->unhealthy) {
             goto failed;
         }
 
@@ -533,7 +554,7 @@ ngx_http_upstream_get_peer(ngx_http_upstream_rr_peer_data_t *rrp)
             continue;
         }
 
-        if (peer->down) {
+        if (peer->down || peer->unhealthy) {
             continue;
         }
 
@@ -38,7 +38,11 @@ struct ngx_http_upstream_rr_peer_s {
     ngx_msec_t                      slow_start;
     ngx_msec_t                      start_time;
 
+    ngx_uint_t                      ewma;
+    ngx_msec_t                      ewma_time;
+
     ngx_uint_t                      down;
+    ngx_uint_t                      unhealthy;
 
 #if (NGX_HTTP_SSL || NGX_COMPAT)
     void                           *ssl_session;
@@ -47,6 +51,10 @@ struct ngx_http_upstream_rr_peer_s {
 
 #if (NGX_HTTP_UPSTREAM_ZONE)
     ngx_atomic_t                    lock;
+    ngx_uint_t                      refs;
+    ngx_msec_t                      hc_next;
+    ngx_uint_t                      hc_fails;
+    ngx_uint_t                      hc_passes;
 #endif
 
     ngx_http_upstream_rr_peer_t    *next;
@@ -65,6 +73,8 @@ struct ngx_http_upstream_rr_peers_s {
     ngx_slab_pool_t                *shpool;
     ngx_atomic_t                    rwlock;
     ngx_http_upstream_rr_peers_t   *zone_next;
+    ngx_uint_t                     *config;
+    ngx_http_upstream_rr_peer_t    *removed;
 #endif
 
     ngx_uint_t                      total_weight;
@@ -113,6 +123,9 @@ struct ngx_http_upstream_rr_peers_s {
         ngx_rwlock_unlock(&peer->lock);                                       \
     }
 
+#define ngx_http_upstream_rr_peers_changed(rrp)                               \
+    ((rrp)->peers->config && (rrp)->config != *(rrp)->peers->config)
+
 #else
 
 #define ngx_http_upstream_rr_peers_rlock(peers)
@@ -120,6 +133,7 @@ struct ngx_http_upstream_rr_peers_s {
 #define ngx_http_upstream_rr_peers_unlock(peers)
 #define ngx_http_upstream_rr_peer_lock(peers, peer)
 #define ngx_http_upstream_rr_peer_unlock(peers, peer)
+#define ngx_http_upstream_rr_peers_changed(rrp)  0
 
 #endif
 
@@ -47,7 +47,9 @@ ngx_module_t  ngx_http_write_filter_module = {
 ngx_int_t
 ngx_http_write_filter(ngx_http_request_t *r, ngx_chain_t *in)
 {
-    off_t                      size, sent, nsent, limit;
+    off_t                      size, sent, nsent, limit, batched;
+    ngx_int_t                  rc;
+    ngx_buf_t                 *pipeline;
     ngx_uint_t                 last, flush, sync;
     ngx_msec_t                 delay;
     ngx_chain_t               *cl, *ln, **ll, *chain;
@@ -60,6 +62,24 @@ ngx_http_write_filter(ngx_http_request_t *r, ngx_chain_t *in)
         return NGX_ERROR;
     }
 
+    pipeline = r->http_connection ? r->http_connection->pipeline : NULL;
+
+    if (pipeline && pipeline->pos != pipeline->last
+        && r == r->main && r->out == NULL)
+    {
+        /* send the responses batched by the previous pipelined requests */
+
+        cl = ngx_alloc_chain_link(r->pool);
+        if (cl == NULL) {
+            return NGX_ERROR;
+        }
+
+        cl->buf = pipeline;
+        cl->next = NULL;
+
+        r->out = cl;
+    }
+
     size = 0;
     flush = 0;
     sync = 0;
@@ -210,13 +230,22 @@ ngx_http_write_filter(ngx_http_request_t *r, ngx_chain_t *in)
 
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
+    batched = 0;
+
+    if (pipeline && r->out && r->out->buf == pipeline) {
+        batched = pipeline->last - pipeline->pos;
+    }
+
     /*
      * avoid the output if there are no last buf, no flush point,
      * there are the incoming bufs and the size of all bufs
-     * is smaller than "postpone_output" directive
+     * except the batched responses is smaller than "postpone_output"
+     * directive
      */
 
-    if (!last && !flush && in && size < (off_t) clcf->postpone_output) {
+    if (!last && !flush && in
+        && size - batched < (off_t) clcf->postpone_output)
+    {
         return NGX_OK;
     }
 
@@ -286,6 +315,14 @@ ngx_http_write_filter(ngx_http_request_t *r, ngx_chain_t *in)
         limit = clcf->sendfile_max_chunk;
     }
 
+    if (last && !r->limit_rate && !c->write->delayed) {
+        rc = ngx_http_batch_pipelined_output(r, size);
+
+        if (rc != NGX_DECLINED) {
+            return rc;
+        }
+    }
+
     sent = c->sent;
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
@@ -301,6 +338,14 @@ ngx_http_write_filter(ngx_http_request_t *r, ngx_chain_t *in)
         return NGX_ERROR;
     }
 
+    if (batched) {
+
+        /* the batched responses were accounted when they were batched */
+
+        batched -= pipeline->last - pipeline->pos;
+        c->sent -= batched;
+    }
+
     if (r->limit_rate) {
 
         nsent = c->sent;
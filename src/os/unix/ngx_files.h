@@ -110,6 +110,10 @@ typedef struct {
 #define ngx_close_file_n         "close()"
 
 
+#define ngx_fsync_file           fsync
+#define ngx_fsync_file_n         "fsync()"
+
+
 #define ngx_delete_file(name)    unlink((const char *) name)
 #define ngx_delete_file_n        "unlink()"
 
@@ -0,0 +1,195 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+
+#define NGX_LINUX_SPLICE_SIZE  65536
+
+
+static void ngx_linux_splice_cleanup(void *data);
+
+
+ngx_linux_splice_t *
+ngx_linux_splice_create(ngx_pool_t *pool, ngx_log_t *log)
+{
+    ngx_linux_splice_t  *sp;
+    ngx_pool_cleanup_t  *cln;
+#ifdef F_GETPIPE_SZ
+    int                  size;
+#endif
+
+    cln = ngx_pool_cleanup_add(pool, sizeof(ngx_linux_splice_t));
+    if (cln == NULL) {
+        return NULL;
+    }
+
+    sp = cln->data;
+
+    if (pipe2(sp->fd, O_NONBLOCK|O_CLOEXEC) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno, "pipe2() failed");
+        return NULL;
+    }
+
+    sp->size = NGX_LINUX_SPLICE_SIZE;
+    sp->buffered = 0;
+    sp->log = log;
+
+#ifdef F_GETPIPE_SZ
+    size = fcntl(sp->fd[1], F_GETPIPE_SZ);
+
+    if (size > 0) {
+        sp->size = size;
+    }
+#endif
+
+    cln->handler = ngx_linux_splice_cleanup;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_CORE, log, 0, "splice pipe: %d:%d %uz",
+                   sp->fd[0], sp->fd[1], sp->size);
+
+    return sp;
+}
+
+
+static void
+ngx_linux_splice_cleanup(void *data)
+{
+    ngx_linux_splice_t  *sp = data;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, sp->log, 0, "splice pipe close: %d:%d",
+                   sp->fd[0], sp->fd[1]);
+
+    if (close(sp->fd[0]) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, sp->log, ngx_errno, "close() pipe failed");
+    }
+
+    if (close(sp->fd[1]) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, sp->log, ngx_errno, "close() pipe failed");
+    }
+}
+
+
+ssize_t
+ngx_linux_splice_recv(ngx_connection_t *c, ngx_linux_splice_t *sp,
+    size_t size)
+{
+    ssize_t       n;
+    ngx_err_t     err;
+    ngx_event_t  *rev;
+
+    rev = c->read;
+
+    if (size > sp->size - sp->buffered) {
+        size = sp->size - sp->buffered;
+    }
+
+    for ( ;; ) {
+        n = splice(c->fd, NULL, sp->fd[1], NULL, size,
+                   SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "splice recv: fd:%d %z of %uz", c->fd, n, size);
+
+        if (n > 0) {
+            sp->buffered += n;
+            return n;
+        }
+
+        if (n == 0) {
+            rev->ready = 0;
+            rev->eof = 1;
+            return 0;
+        }
+
+        err = ngx_socket_errno;
+
+        if (err == NGX_EINTR) {
+            continue;
+        }
+
+        if (err == NGX_EAGAIN) {
+
+            /*
+             * a pipe may run out of slots well before it is full, and
+             * splice() reports this as EAGAIN too, so the socket is only
+             * known to be drained when the pipe was empty
+             */
+
+            if (sp->buffered == 0) {
+                rev->ready = 0;
+            }
+
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, err,
+                           "splice() not ready");
+            return NGX_AGAIN;
+        }
+
+        rev->ready = 0;
+        rev->error = 1;
+
+        return ngx_connection_error(c, err, "splice() failed");
+    }
+}
+
+
+ssize_t
+ngx_linux_splice_send(ngx_connection_t *c, ngx_linux_splice_t *sp)
+{
+    ssize_t       n;
+    ngx_err_t     err;
+    ngx_event_t  *wev;
+
+    wev = c->write;
+
+    for ( ;; ) {
+        n = splice(sp->fd[0], NULL, c->fd, NULL, sp->buffered,
+                   SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "splice send: fd:%d %z of %uz", c->fd, n,
+                       sp->buffered);
+
+        if (n > 0) {
+            if ((size_t) n < sp->buffered) {
+                wev->ready = 0;
+            }
+
+            sp->buffered -= n;
+            c->sent += n;
+
+            return n;
+        }
+
+        err = ngx_socket_errno;
+
+        if (n == 0) {
+            ngx_log_error(NGX_LOG_ALERT, c->log, err, "splice() returned zero");
+            wev->ready = 0;
+            return n;
+        }
+
+        if (err == NGX_EINTR) {
+            continue;
+        }
+
+        if (err == NGX_EAGAIN) {
+            wev->ready = 0;
+
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, err,
+                           "splice() not ready");
+            return NGX_AGAIN;
+        }
+
+        wev->error = 1;
+        (void) ngx_connection_error(c, err, "splice() failed");
+
+        return NGX_ERROR;
+    }
+}
@@ -1108,6 +1108,24 @@ ngx_channel_handler(ngx_event_t *ev)
 
             ngx_processes[ch.slot].channel[0] = -1;
             break;
+
+        case NGX_CMD_PASS_CONNECTION:
+
+            ngx_log_debug3(NGX_LOG_DEBUG_CORE, ev->log, 0,
+                           "get connection pid:%P fd:%d tag:%ui",
+                           ch.pid, ch.fd, ch.tag);
+
+            if (ngx_channel_pass_connection) {
+                ngx_channel_pass_connection(&ch);
+                break;
+            }
+
+            if (close(ch.fd) == -1) {
+                ngx_log_error(NGX_LOG_ALERT, ev->log, ngx_errno,
+                              "close() passed connection failed");
+            }
+
+            break;
         }
     }
 }
@@ -33,6 +33,7 @@ typedef struct {
     ngx_flag_t                       proxy_protocol;
     ngx_stream_upstream_local_t     *local;
     ngx_flag_t                       socket_keepalive;
+    ngx_flag_t                       splice;
 
 #if (NGX_STREAM_SSL)
     ngx_flag_t                       ssl_enable;
@@ -49,6 +50,7 @@ typedef struct {
     ngx_str_t                        ssl_certificate;
     ngx_str_t                        ssl_certificate_key;
     ngx_array_t                     *ssl_passwords;
+    ngx_flag_t                       ssl_ktls;
 
     ngx_ssl_t                       *ssl;
 #endif
@@ -147,6 +149,13 @@ static ngx_command_t  ngx_stream_proxy_commands[] = {
       offsetof(ngx_stream_proxy_srv_conf_t, socket_keepalive),
       NULL },
 
+    { ngx_string("proxy_splice"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_proxy_srv_conf_t, splice),
+      NULL },
+
     { ngx_string("proxy_connect_timeout"),
       NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_msec_slot,
@@ -331,6 +340,13 @@ static ngx_command_t  ngx_stream_proxy_commands[] = {
       0,
       NULL },
 
+    { ngx_string("proxy_ssl_ktls"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_proxy_srv_conf_t, ssl_ktls),
+      NULL },
+
 #endif
 
       ngx_null_command
@@ -1509,6 +1525,9 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
     ngx_log_handler_pt            handler;
     ngx_stream_upstream_t        *u;
     ngx_stream_proxy_srv_conf_t  *pscf;
+#if (NGX_HAVE_SPLICE)
+    ngx_linux_splice_t          **splice;
+#endif
 
     u = s->upstream;
 
@@ -1541,6 +1560,9 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
         packets = &u->responses;
         out = &u->downstream_out;
         busy = &u->downstream_busy;
+#if (NGX_HAVE_SPLICE)
+        splice = &u->upstream_splice;
+#endif
         recv_action = "proxying and reading from upstream";
         send_action = "proxying and sending to client";
 
@@ -1553,10 +1575,41 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
         packets = &u->requests;
         out = &u->upstream_out;
         busy = &u->upstream_busy;
+#if (NGX_HAVE_SPLICE)
+        splice = &u->downstream_splice;
+#endif
         recv_action = "proxying and reading from client";
         send_action = "proxying and sending to upstream";
     }
 
+#if (NGX_HAVE_SPLICE)
+
+    /*
+     * once everything read so far is sent, plain tcp connections
+     * without rate limits are proxied through a pipe
+     */
+
+    if (*splice == NULL
+        && pscf->splice
+        && dst
+        && c->type == SOCK_STREAM
+        && limit_rate == 0
+        && src->recv == ngx_recv
+        && dst->send == ngx_send
+        && *out == NULL
+        && *busy == NULL
+        && !dst->buffered
+        && b->last == b->pos)
+    {
+        *splice = ngx_linux_splice_create(c->pool, c->log);
+        if (*splice == NULL) {
+            ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+            return;
+        }
+    }
+
+#endif
+
     for ( ;; ) {
 
         if (do_write && dst) {
@@ -1579,8 +1632,60 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
                     b->last = b->start;
                 }
             }
+
+#if (NGX_HAVE_SPLICE)
+
+            if (*splice && (*splice)->buffered && dst->write->ready) {
+                c->log->action = send_action;
+
+                if (ngx_linux_splice_send(dst, *splice) == NGX_ERROR) {
+                    ngx_stream_proxy_finalize(s, NGX_STREAM_OK);
+                    return;
+                }
+            }
+
+#endif
         }
 
+#if (NGX_HAVE_SPLICE)
+
+        if (*splice) {
+
+            if ((*splice)->buffered < (*splice)->size
+                && src->read->ready && !src->read->error)
+            {
+                c->log->action = recv_action;
+
+                n = ngx_linux_splice_recv(src, *splice, (*splice)->size);
+
+                if (n == NGX_AGAIN) {
+                    break;
+                }
+
+                if (n == NGX_ERROR) {
+                    src->read->eof = 1;
+                    n = 0;
+                }
+
+                if (from_upstream) {
+                    if (u->state->first_byte_time == (ngx_msec_t) -1) {
+                        u->state->first_byte_time = ngx_current_msec
+                                                    - u->start_time;
+                    }
+                }
+
+                (*packets)++;
+                *received += n;
+                do_write = 1;
+
+                continue;
+            }
+
+            break;
+        }
+
+#endif
+
         size = b->end - b->last;
 
         if (size && src->read->ready && !src->read->delayed
@@ -1755,6 +1860,17 @@ ngx_stream_proxy_test_finalize(ngx_stream_session_t *s,
         return NGX_DECLINED;
     }
 
+#if (NGX_HAVE_SPLICE)
+
+    if ((!c->read->eof && u->upstream_splice && u->upstream_splice->buffered)
+        || (!pc->read->eof && u->downstream_splice
+            && u->downstream_splice->buffered))
+    {
+        return NGX_DECLINED;
+    }
+
+#endif
+
     handler = c->log->handler;
     c->log->handler = NULL;
 
@@ -1977,6 +2093,7 @@ ngx_stream_proxy_create_srv_conf(ngx_conf_t *cf)
     conf->proxy_protocol = NGX_CONF_UNSET;
     conf->local = NGX_CONF_UNSET_PTR;
     conf->socket_keepalive = NGX_CONF_UNSET;
+    conf->splice = NGX_CONF_UNSET;
 
 #if (NGX_STREAM_SSL)
     conf->ssl_enable = NGX_CONF_UNSET;
@@ -1985,6 +2102,7 @@ ngx_stream_proxy_create_srv_conf(ngx_conf_t *cf)
     conf->ssl_verify = NGX_CONF_UNSET;
     conf->ssl_verify_depth = NGX_CONF_UNSET_UINT;
     conf->ssl_passwords = NGX_CONF_UNSET_PTR;
+    conf->ssl_ktls = NGX_CONF_UNSET;
 #endif
 
     return conf;
@@ -1997,6 +2115,10 @@ ngx_stream_proxy_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_stream_proxy_srv_conf_t *prev = parent;
     ngx_stream_proxy_srv_conf_t *conf = child;
 
+    ngx_uint_t                    i;
+    ngx_stream_listen_t          *ls;
+    ngx_stream_core_main_conf_t  *cmcf;
+
     ngx_conf_merge_msec_value(conf->connect_timeout,
                               prev->connect_timeout, 60000);
 
@@ -2035,6 +2157,8 @@ ngx_stream_proxy_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_value(conf->socket_keepalive,
                               prev->socket_keepalive, 0);
 
+    ngx_conf_merge_value(conf->splice, prev->splice, 0);
+
 #if (NGX_STREAM_SSL)
 
     ngx_conf_merge_value(conf->ssl_enable, prev->ssl_enable, 0);
@@ -2071,6 +2195,7 @@ ngx_stream_proxy_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
                               prev->ssl_certificate_key, "");
 
     ngx_conf_merge_ptr_value(conf->ssl_passwords, prev->ssl_passwords, NULL);
+    ngx_conf_merge_value(conf->ssl_ktls, prev->ssl_ktls, 0);
 
     if (conf->ssl_enable && ngx_stream_proxy_set_ssl(cf, conf) != NGX_OK) {
         return NGX_CONF_ERROR;
@@ -2078,6 +2203,22 @@ ngx_stream_proxy_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
 
 #endif
 
+    if (conf->upstream) {
+
+        /* mark the upstreams proxied to from UDP servers */
+
+        cmcf = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_core_module);
+
+        ls = cmcf->listen.elts;
+
+        for (i = 0; i < cmcf->listen.nelts; i++) {
+            if (ls[i].ctx == cf->ctx && ls[i].type == SOCK_DGRAM) {
+                conf->upstream->udp = 1;
+                break;
+            }
+        }
+    }
+
     return NGX_CONF_OK;
 }
 
@@ -2150,6 +2291,10 @@ ngx_stream_proxy_set_ssl(ngx_conf_t *cf, ngx_stream_proxy_srv_conf_t *pscf)
         }
     }
 
+    if (ngx_ssl_ktls(cf, pscf->ssl, pscf->ssl_ktls) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
     if (ngx_ssl_client_session_cache(cf, pscf->ssl, pscf->ssl_session_reuse)
         != NGX_OK)
     {
@@ -196,6 +196,13 @@ static ngx_command_t  ngx_stream_ssl_commands[] = {
       offsetof(ngx_stream_ssl_conf_t, crl),
       NULL },
 
+    { ngx_string("ssl_ktls"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_ssl_conf_t, ktls),
+      NULL },
+
       ngx_null_command
 };
 
@@ -248,6 +255,13 @@ static ngx_stream_variable_t  ngx_stream_ssl_vars[] = {
     { ngx_string("ssl_session_reused"), NULL, ngx_stream_ssl_variable,
       (uintptr_t) ngx_ssl_get_session_reused, NGX_STREAM_VAR_CHANGEABLE, 0 },
 
+    { ngx_string("ssl_ktls"), NULL, ngx_stream_ssl_variable,
+      (uintptr_t) ngx_ssl_get_ktls, NGX_STREAM_VAR_CHANGEABLE, 0 },
+
+    { ngx_string("ssl_ktls_sent"), NULL, ngx_stream_ssl_variable,
+      (uintptr_t) ngx_ssl_get_ktls_sent,
+      NGX_STREAM_VAR_CHANGEABLE|NGX_STREAM_VAR_NOCACHEABLE, 0 },
+
     { ngx_string("ssl_server_name"), NULL, ngx_stream_ssl_variable,
       (uintptr_t) ngx_ssl_get_server_name, NGX_STREAM_VAR_CHANGEABLE, 0 },
 
@@ -602,6 +616,7 @@ ngx_stream_ssl_create_conf(ngx_conf_t *cf)
     scf->session_timeout = NGX_CONF_UNSET;
     scf->session_tickets = NGX_CONF_UNSET;
     scf->session_ticket_keys = NGX_CONF_UNSET_PTR;
+    scf->ktls = NGX_CONF_UNSET;
 
     return scf;
 }
@@ -811,6 +826,12 @@ ngx_stream_ssl_merge_conf(ngx_conf_t *cf, void *parent, void *child)
         return NGX_CONF_ERROR;
     }
 
+    ngx_conf_merge_value(conf->ktls, prev->ktls, 0);
+
+    if (ngx_ssl_ktls(cf, &conf->ssl, conf->ktls) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
     return NGX_CONF_OK;
 }
 
@@ -52,6 +52,8 @@ typedef struct {
     ngx_flag_t       session_tickets;
     ngx_array_t     *session_ticket_keys;
 
+    ngx_flag_t       ktls;
+
     u_char          *file;
     ngx_uint_t       line;
 } ngx_stream_ssl_conf_t;
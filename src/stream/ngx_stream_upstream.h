@@ -80,6 +80,7 @@ struct ngx_stream_upstream_srv_conf_s {
     ngx_uint_t                         line;
     in_port_t                          port;
     ngx_uint_t                         no_port;  /* unsigned no_port:1 */
+    ngx_uint_t                         udp;      /* unsigned udp:1 */
 
 #if (NGX_STREAM_UPSTREAM_ZONE)
     ngx_shm_zone_t                    *shm_zone;
@@ -126,6 +127,11 @@ typedef struct {
     ngx_chain_t                       *downstream_out;
     ngx_chain_t                       *downstream_busy;
 
+#if (NGX_HAVE_SPLICE)
+    ngx_linux_splice_t                *upstream_splice;
+    ngx_linux_splice_t                *downstream_splice;
+#endif
+
     off_t                              received;
     time_t                             start_sec;
     ngx_uint_t                         requests;
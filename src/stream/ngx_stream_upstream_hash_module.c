@@ -232,7 +232,7 @@ ngx_stream_upstream_get_hash_peer(ngx_peer_connection_t *pc, void *data)
         ngx_log_debug2(NGX_LOG_DEBUG_STREAM, pc->log, 0,
                        "get hash peer, value:%uD, peer:%ui", hp->hash, p);
 
-        if (peer->down) {
+        if (peer->down || peer->unhealthy) {
             ngx_stream_upstream_rr_peer_unlock(hp->rrp.peers, peer);
             goto next;
         }
@@ -546,7 +546,7 @@ ngx_stream_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
                 continue;
             }
 
-            if (peer->down) {
+            if (peer->down || peer->unhealthy) {
                 continue;
             }
 
@@ -139,7 +139,7 @@ ngx_stream_upstream_get_least_conn_peer(ngx_peer_connection_t *pc, void *data)
             continue;
         }
 
-        if (peer->down) {
+        if (peer->down || peer->unhealthy) {
             continue;
         }
 
@@ -194,7 +194,7 @@ ngx_stream_upstream_get_least_conn_peer(ngx_peer_connection_t *pc, void *data)
                 continue;
             }
 
-            if (peer->down) {
+            if (peer->down || peer->unhealthy) {
                 continue;
             }
 
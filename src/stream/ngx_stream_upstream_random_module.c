@@ -245,7 +245,7 @@ ngx_stream_upstream_get_random_peer(ngx_peer_connection_t *pc, void *data)
 
         ngx_stream_upstream_rr_peer_lock(peers, peer);
 
-        if (peer->down) {
+        if (peer->down || peer->unhealthy) {
             ngx_stream_upstream_rr_peer_unlock(peers, peer);
             goto next;
         }
@@ -347,7 +347,7 @@ ngx_stream_upstream_get_random2_peer(ngx_peer_connection_t *pc, void *data)
             goto next;
         }
 
-        if (peer->down) {
+        if (peer->down || peer->unhealthy) {
             goto next;
         }
 
@@ -444,7 +444,7 @@ ngx_stream_upstream_get_round_robin_peer(ngx_peer_connection_t *pc, void *data)
     if (peers->single) {
         peer = peers->peer;
 
-        if (peer->down) {
+        if (peer->down || peer->unhealthy) {
             goto failed;
         }
 
@@ -542,7 +542,7 @@ ngx_stream_upstream_get_peer(ngx_stream_upstream_rr_peer_data_t *rrp)
             continue;
         }
 
-        if (peer->down) {
+        if (peer->down || peer->unhealthy) {
             continue;
         }
 
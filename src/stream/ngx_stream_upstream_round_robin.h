@@ -39,12 +39,16 @@ struct ngx_stream_upstream_rr_peer_s {
     ngx_msec_t                       start_time;
 
     ngx_uint_t                       down;
+    ngx_uint_t                       unhealthy;
 
     void                            *ssl_session;
     int                              ssl_session_len;
 
 #if (NGX_STREAM_UPSTREAM_ZONE)
     ngx_atomic_t                     lock;
+    ngx_msec_t                       hc_next;
+    ngx_uint_t                       hc_fails;
+    ngx_uint_t                       hc_passes;
 #endif
 
     ngx_stream_upstream_rr_peer_t   *next;